@@ -19,16 +19,27 @@
 #include <cxxopts.hpp>
 
 // STL:
+#include <algorithm>
+#include <cmath>
 #include <cstdlib>
+#include <iomanip>
 #include <iostream>
+#include <sstream>
+#include <stdexcept>
 
 // readybase:
 #include <AbstractRD.hpp>
+#include <FormulaOpenCLImageRD.hpp>
+#include <GrayScottKernels.hpp>
+#include <MeshRD.hpp>
+#include <NativeKernel.hpp>
+#include <OpenCL_KernelCache.hpp>
 #include <OpenCL_utils.hpp>
 #include <OpenCLImageRD.hpp>
 #include <Properties.hpp>
 #include <scene_items.hpp>
 #include <SystemFactory.hpp>
+#include <utils.hpp>
 
 using namespace std;
 
@@ -56,6 +67,75 @@ void printSeparator()
     cout << "================================\n";
 }
 
+// -------------------------------------------------------------------------------------------------------------
+/*
+        Reads a parameter sweep like "F=0.02:0.06:5; K=0.06,0.062" into a list of names and the values of each member.
+        Each parameter is given a range start:stop:count (evenly spaced, including both ends) or a list of values,
+        and the members are every combination of them, with the first parameter changing slowest.
+*/
+void parseSweep(const std::string& spec, vector<string>& names, vector<vector<float>>& members)
+{
+    names.clear();
+    members.assign(1, vector<float>());
+    istringstream entries(spec);
+    string entry;
+    while (getline(entries, entry, ';'))
+    {
+        const size_t first = entry.find_first_not_of(" \t");
+        if (first == string::npos)
+            continue;
+        const size_t equals = entry.find('=');
+        if (equals == string::npos)
+            throw runtime_error("expected name=values in sweep: " + entry);
+        string name = entry.substr(first, equals - first);
+        name.erase(name.find_last_not_of(" \t") + 1);
+        const string values_string = entry.substr(equals + 1);
+
+        vector<float> values;
+        float start, stop;
+        int count;
+        char colon1, colon2;
+        istringstream range(values_string);
+        if (values_string.find(':') != string::npos)
+        {
+            if (!(range >> start >> colon1 >> stop >> colon2 >> count) || colon1 != ':' || colon2 != ':' || count < 1)
+                throw runtime_error("expected start:stop:count in sweep: " + entry);
+            for (int i = 0; i < count; i++)
+                values.push_back(count > 1 ? start + (stop - start) * i / (count - 1) : start);
+        }
+        else
+        {
+            istringstream list(values_string);
+            string value;
+            while (getline(list, value, ','))
+            {
+                istringstream value_stream(value);
+                float v;
+                if (!(value_stream >> v))
+                    throw runtime_error("expected a list of numbers in sweep: " + entry);
+                values.push_back(v);
+            }
+        }
+        if (values.empty())
+            throw runtime_error("no values in sweep: " + entry);
+
+        // every combination of the values so far with the new ones
+        names.push_back(name);
+        vector<vector<float>> combinations;
+        for (const vector<float>& member : members)
+        {
+            for (float v : values)
+            {
+                combinations.push_back(member);
+                combinations.back().push_back(v);
+            }
+        }
+        members.swap(combinations);
+    }
+    if (names.empty())
+        throw runtime_error("empty sweep");
+}
+
 int main(int argc,char *argv[])
 {
     vtkObject::GlobalWarningDisplayOff();
@@ -87,6 +167,16 @@ int main(int argc,char *argv[])
     int opencl_platform = 0;
     int opencl_device = 0;
     bool verbose = false;
+    bool no_kernel_cache = false;
+    bool no_native_kernels = false;
+    std::string neighbor_storage = "auto";
+    std::string cell_order = "original";
+    bool until_steady = false;
+    double steady_tolerance = 0.0;
+    int max_steps = 100000;
+    int steady_check_interval = 100;
+    std::string steady_norm = "max";
+    std::string sweep;
 
     cxxopts::Options options("rdy", "Command-line version of Ready");
     try
@@ -109,6 +199,15 @@ int main(int argc,char *argv[])
             ("l,opencl-platform", "OpenCL platform number (Currently will crash if incorrect!)", cxxopts::value<int>(opencl_platform))
             ("g,opencl-device", "OpenCL device number (Currently will crash if incorrect!)", cxxopts::value<int>(opencl_device))
             ("v,verbose", "Verbose output.", cxxopts::value<bool>(verbose)->default_value("false"))
+            ("no-kernel-cache", "Always build OpenCL and native kernels from source, instead of reusing stored binaries", cxxopts::value<bool>(no_kernel_cache)->default_value("false"))
+            ("no-native-kernels", "Evaluate formula rules without compiling them to native code when running on the CPU", cxxopts::value<bool>(no_native_kernels)->default_value("false"))
+            ("neighbor-storage", "How mesh neighbors are stored: auto, compressed or padded (padded can be faster on GPUs)", cxxopts::value<string>(neighbor_storage)->default_value("auto"))
+            ("cell-order", "How mesh cells are numbered: original, hilbert or rcm (reverse Cuthill-McKee); files are saved in the original order", cxxopts::value<string>(cell_order)->default_value("original"))
+            ("until-steady", "Instead of running for -n steps, run until the change made by a step is at most this tolerance", cxxopts::value<double>(steady_tolerance))
+            ("max-steps", "With --until-steady, the most steps to run before giving up", cxxopts::value<int>(max_steps)->default_value("100000"))
+            ("steady-check-interval", "With --until-steady, how many steps to run between measuring the change", cxxopts::value<int>(steady_check_interval)->default_value("100"))
+            ("steady-norm", "With --until-steady, how to measure the change made by a step: max or rms (root-mean-square)", cxxopts::value<string>(steady_norm)->default_value("max"))
+            ("sweep", "Run an ensemble of copies of a formula pattern in one kernel, one for each combination of parameter values, e.g. \"F=0.02:0.06:5; K=0.06,0.062\" (start:stop:count or a list). Each copy is summarized, and saved to the -o name with its number added", cxxopts::value<string>(sweep))
             ;
     }
     catch (const cxxopts::OptionSpecException& e)
@@ -130,6 +229,7 @@ int main(int argc,char *argv[])
             cout << options.help() << endl;
             return EXIT_SUCCESS;
         }
+        until_steady = args.count("until-steady") > 0;
         if (args.count("vti-in") == 0)
         {
             cout << "Missing required argument: vti-in" << endl;
@@ -156,6 +256,56 @@ int main(int argc,char *argv[])
         return EXIT_FAILURE;
     }
 
+    if (verbose)
+    {
+        cout << "Inbuilt CPU kernels use: " << GetGrayScottKernelInstructionSet() << "\n";
+    }
+
+    OpenCL_KernelCache::SetEnabled(!no_kernel_cache); // (also used for native kernels)
+    NativeKernel::SetEnabled(!no_native_kernels);
+    if (neighbor_storage == "compressed")
+    {
+        MeshRD::SetNeighborStorage(MeshRD::NeighborStorage::Compressed);
+    }
+    else if (neighbor_storage == "padded")
+    {
+        MeshRD::SetNeighborStorage(MeshRD::NeighborStorage::Padded);
+    }
+    else if (neighbor_storage != "auto")
+    {
+        cout << "Unknown neighbor storage: " << neighbor_storage << " (expected auto, compressed or padded)" << endl;
+        return EXIT_FAILURE;
+    }
+    if (cell_order == "hilbert")
+    {
+        MeshRD::SetCellOrder(MeshRD::CellOrder::Hilbert);
+    }
+    else if (cell_order == "rcm")
+    {
+        MeshRD::SetCellOrder(MeshRD::CellOrder::ReverseCuthillMcKee);
+    }
+    else if (cell_order != "original")
+    {
+        cout << "Unknown cell order: " << cell_order << " (expected original, hilbert or rcm)" << endl;
+        return EXIT_FAILURE;
+    }
+
+    AbstractRD::ChangeNorm change_norm = AbstractRD::ChangeNorm::Max;
+    if (steady_norm == "rms")
+    {
+        change_norm = AbstractRD::ChangeNorm::RootMeanSquare;
+    }
+    else if (steady_norm != "max")
+    {
+        cout << "Unknown steady norm: " << steady_norm << " (expected max or rms)" << endl;
+        return EXIT_FAILURE;
+    }
+    if (until_steady && (max_steps < 1 || steady_check_interval < 1))
+    {
+        cout << "--max-steps and --steady-check-interval must be at least 1" << endl;
+        return EXIT_FAILURE;
+    }
+
     const bool is_opencl_available = OpenCL_utils::IsOpenCLAvailable();
     if( is_opencl_available )
     {
@@ -163,9 +313,13 @@ int main(int argc,char *argv[])
         {
             cout << "OpenCL found.\n";
         }
+        if (verbose && !no_kernel_cache)
+        {
+            cout << "Using OpenCL kernel cache: " << OpenCL_KernelCache::GetFolder() << "\n";
+        }
     } else {
         // Still print (despite not verbose) since it's a warning:
-        cout << "Warning: OpenCL not found! (This may not bode well for what's about to happen..).\n";
+        cout << "Warning: OpenCL not found! Formula rules will run on the CPU, and kernel rules will fail.\n";
     }
 
     Properties render_settings("render_settings");
@@ -357,12 +511,123 @@ int main(int argc,char *argv[])
         if( warn_to_update )
             cout << "This pattern was created with a newer version of Ready. You should update your copy.\n";
 
-        if ( numiter > 0 )
+        FormulaOpenCLImageRD* ensemble = nullptr;
+        vector<string> sweep_names;
+        vector<vector<float>> sweep_members;
+        if ( !sweep.empty() )
+        {
+            ensemble = dynamic_cast<FormulaOpenCLImageRD*>( system.get() );
+            if ( !ensemble )
+            {
+                cout << "A sweep needs a formula pattern on an image, running with OpenCL.\n";
+                return EXIT_FAILURE;
+            }
+            parseSweep( sweep, sweep_names, sweep_members );
+            ensemble->SetEnsemble( sweep_names, sweep_members );
+            cout << "Running an ensemble of " << sweep_members.size() << " members at once.\n";
+        }
+
+        if ( until_steady )
+        {
+            cout << "Run the simulation until the change per step is at most " << steady_tolerance
+                 << " (checking every " << steady_check_interval << " steps, for at most " << max_steps << " steps)...\n";
+            int steps_run = 0;
+            double change = 0.0;
+            bool is_steady = false;
+            while ( steps_run < max_steps )
+            {
+                const int n_steps = min( steady_check_interval, max_steps - steps_run );
+                change = system->UpdateAndGetChange( n_steps, change_norm );
+                steps_run += n_steps;
+                if (verbose)
+                {
+                    cout << "Step " << steps_run << ": change per step = " << change << "\n";
+                }
+                if ( change <= steady_tolerance )
+                {
+                    is_steady = true;
+                    break;
+                }
+                if ( !isfinite( change ) )
+                {
+                    break; // the system has blown up, so it will never settle
+                }
+            }
+            if ( is_steady )
+            {
+                cout << "Settled into a steady state at step " << steps_run << " (change per step = " << change << ")\n";
+            } else if ( !isfinite( change ) ) {
+                cout << "Stopped at step " << steps_run << ": some values are no longer finite\n";
+            } else {
+                cout << "Not steady after " << steps_run << " steps (change per step = " << change << ")\n";
+            }
+            numiter = steps_run; // (so that the result is saved below)
+        }
+        else if ( numiter > 0 )
         {
             cout << "Run the simulation for " << numiter << " steps...\n";
             system->Update( numiter );
+        }
 
-            if ( !vti_out.empty() )
+        if ( numiter > 0 )
+        {
+            system->SyncToHost(); // wait for the device to finish, so that any errors are reported here
+
+            if ( ensemble )
+            {
+                // summarize each member, and save it to the output name with its number added
+                const int num_members = ensemble->GetEnsembleSize();
+                const int num_digits = static_cast<int>( to_string( num_members - 1 ).size() );
+                const size_t last_separator = vti_out.find_last_of( "/\\" );
+                const size_t extension_start = vti_out.find_last_of( '.' );
+                const bool has_extension = extension_start != string::npos
+                    && ( last_separator == string::npos || extension_start > last_separator );
+                cout << "\n";
+                cout << "Ensemble summary:\n";
+                printSeparator();
+                for ( int im = 0; im < num_members; im++ )
+                {
+                    ensemble->ShowEnsembleMember( im );
+                    cout << "member=" << im;
+                    for ( size_t j = 0; j < sweep_names.size(); j++ )
+                    {
+                        cout << " " << sweep_names[j] << "=" << sweep_members[im][j];
+                    }
+                    for ( int ic = 0; ic < system->GetNumberOfChemicals(); ic++ )
+                    {
+                        const vector<float> rd_data = system->GetData( ic );
+                        double total = 0.0;
+                        for ( float value : rd_data )
+                        {
+                            total += value;
+                        }
+                        cout << " " << GetChemicalName( ic ) << "(min,mean,max)=("
+                             << *min_element( rd_data.begin(), rd_data.end() ) << ","
+                             << total / max<size_t>( 1, rd_data.size() ) << ","
+                             << *max_element( rd_data.begin(), rd_data.end() ) << ")";
+                    }
+                    cout << "\n";
+                    if ( !vti_out.empty() )
+                    {
+                        ostringstream member_filename;
+                        member_filename << ( has_extension ? vti_out.substr( 0, extension_start ) : vti_out )
+                                        << "_" << setw( num_digits ) << setfill( '0' ) << im
+                                        << ( has_extension ? vti_out.substr( extension_start ) : string() );
+                        try {
+                            system->SaveFile( member_filename.str().c_str(), render_settings, false );
+                        } catch(const exception& e) {
+                            cout << "Something went wrong when saving file to: " << member_filename.str() << "\n";
+                            cout << e.what() << "\n";
+                        }
+                    }
+                }
+                printSeparator();
+                if ( !vti_out.empty() )
+                {
+                    cout << "Saved each member with its number added to " << vti_out << "\n";
+                }
+            }
+            else if ( !vti_out.empty() )
             {
                 // save something out
                 cout << "Saving file as " << vti_out << " ...\n";
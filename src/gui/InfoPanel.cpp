@@ -62,6 +62,10 @@ const wxString InfoPanel::neighborhood_range_label = _("Neighborhood range");
 const wxString InfoPanel::neighborhood_weight_label = _("Neighborhood weight");
 const wxString InfoPanel::accuracy_label = _("Accuracy");
 const wxString InfoPanel::accuracy_labels[3] = { _("low"), _("medium"), _("high") };
+const wxString InfoPanel::integrator_label = _("Integrator");
+const wxString InfoPanel::integrator_labels[4] = { _("euler"), _("rk2"), _("rk4"), _("rk45") };
+const wxString InfoPanel::tolerance_label = _("Tolerance");
+const wxString InfoPanel::implicit_diffusion_label = _("Implicit diffusion");
 
 // -----------------------------------------------------------------------------
 
@@ -196,6 +200,22 @@ void InfoPanel::UpdatePanel(const AbstractRD& system)
         contents += AppendRow(accuracy_label, accuracy_label, accuracy_labels[static_cast<int>(system.GetAccuracy())], true);
     }
 
+    if (system.HasEditableIntegratorOption())
+    {
+        contents += AppendRow(integrator_label, integrator_label, integrator_labels[static_cast<int>(system.GetIntegrator())], true);
+        if (system.GetIntegrator() == AbstractRD::Integrator::RK45)
+        {
+            contents += AppendRow(tolerance_label, tolerance_label, FormatFloat(system.GetIntegratorTolerance()), true);
+        }
+    }
+
+    if (system.HasEditableImplicitDiffusionOption())
+    {
+        const string implicit_diffusion = system.GetImplicitDiffusion();
+        contents += AppendRow(implicit_diffusion_label, implicit_diffusion_label,
+            implicit_diffusion.empty() ? _("none") : wxString(implicit_diffusion.c_str(), wxConvUTF8), true);
+    }
+
     contents += AppendRow(block_size_label, block_size_label, wxString::Format(wxT("%d x %d x %d"),
                                         system.GetBlockSizeX(),system.GetBlockSizeY(),system.GetBlockSizeZ()),
                                         system.HasEditableBlockSize());
@@ -637,6 +657,75 @@ void InfoPanel::ChangeAccuracy()
 
 // -----------------------------------------------------------------------------
 
+void InfoPanel::ChangeIntegrator()
+{
+    const AbstractRD::Integrator old_val = frame->GetCurrentRDSystem().GetIntegrator();
+
+    wxArrayString choices;
+    for (const wxString& label : integrator_labels)
+    {
+        choices.Add(label);
+    }
+    wxSingleChoiceDialog dlg(this, _("Integrator:"), _("Select integrator:"),
+        choices);
+    dlg.SetSelection(static_cast<int>(old_val));
+    if (dlg.ShowModal() != wxID_OK) return;
+    const AbstractRD::Integrator new_val = static_cast<AbstractRD::Integrator>(dlg.GetSelection());
+    frame->GetCurrentRDSystem().SetIntegrator(new_val);
+    UpdatePanel(frame->GetCurrentRDSystem());
+}
+
+// -----------------------------------------------------------------------------
+
+void InfoPanel::ChangeTolerance()
+{
+    AbstractRD& sys = frame->GetCurrentRDSystem();
+    float newval;
+
+    // position dialog box to left of linkrect
+    wxPoint pos = ClientToScreen( wxPoint(html->linkrect.x, html->linkrect.y) );
+    int dlgwd = 300;
+    pos.x -= dlgwd + 20;
+
+    if ( GetFloat(_("Change tolerance"), _("Enter the largest error allowed in each step:"),
+                  sys.GetIntegratorTolerance(), &newval, pos, wxSize(dlgwd,wxDefaultCoord)) )
+    {
+        if (newval <= 0.0f)
+        {
+            Warning(_("The tolerance must be greater than zero."));
+            return;
+        }
+        sys.SetIntegratorTolerance(newval);
+        UpdatePanel(sys);
+    }
+}
+
+// -----------------------------------------------------------------------------
+
+void InfoPanel::ChangeImplicitDiffusion()
+{
+    AbstractRD& sys = frame->GetCurrentRDSystem();
+    wxString oldtext(sys.GetImplicitDiffusion().c_str(), wxConvUTF8);
+    wxString newtext;
+
+    // position dialog box to left of linkrect
+    wxPoint pos = ClientToScreen( wxPoint(html->linkrect.x, html->linkrect.y) );
+    int dlgwd = 300;
+    pos.x -= dlgwd + 20;
+
+    if ( GetString(_("Change implicit diffusion"),
+                   _("Enter the diffusion coefficient of each chemical, as parameter names or numbers (e.g. D_a D_b).\n"
+                     "The formula should then leave out the diffusion of those chemicals:"),
+                   oldtext, newtext, pos, wxSize(dlgwd,wxDefaultCoord)) )
+    {
+        newtext.Trim(true).Trim(false);
+        if (newtext == _("none")) newtext.Clear();
+        sys.SetImplicitDiffusion(string(newtext.mb_str()));
+        UpdatePanel(sys);
+    }
+}
+// -----------------------------------------------------------------------------
+
 void InfoPanel::ChangeBlockSize()
 {
     const AbstractRD& sys = frame->GetCurrentRDSystem();
@@ -730,6 +819,15 @@ void InfoPanel::ChangeInfo(const wxString& label)
     } else if ( label == accuracy_label ) {
         ChangeAccuracy();
 
+    } else if ( label == integrator_label ) {
+        ChangeIntegrator();
+
+    } else if ( label == tolerance_label ) {
+        ChangeTolerance();
+
+    } else if ( label == implicit_diffusion_label ) {
+        ChangeImplicitDiffusion();
+
     } else if ( label == block_size_label ) {
         ChangeBlockSize();
 
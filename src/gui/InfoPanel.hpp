@@ -92,6 +92,10 @@ class InfoPanel : public wxPanel
         static const wxString neighborhood_weight_label;
         static const wxString accuracy_label;
         static const wxString accuracy_labels[3];
+        static const wxString integrator_label;
+        static const wxString integrator_labels[4];
+        static const wxString tolerance_label;
+        static const wxString implicit_diffusion_label;
 
 private:
         
@@ -110,6 +114,9 @@ private:
         void ChangeDimensions();
         void ChangeBlockSize();
         void ChangeAccuracy();
+        void ChangeIntegrator();
+        void ChangeTolerance();
+        void ChangeImplicitDiffusion();
         void ChangeUseLocalMemory();
         void ChangeWrapOption();
         void ChangeDataType();
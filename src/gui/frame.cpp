@@ -1061,6 +1061,7 @@ void MyFrame::OnStep(wxCommandEvent& event)
         if (event.GetId() == ID::Step1)
         {
             this->system->Update(1);
+            this->system->SyncToHost();
             this->pVTKWindow->GetRenderWindow()->GetRenderers()->GetFirstRenderer()->ResetCameraClippingRange();
         }
         else if (event.GetId() == ID::StepN)
@@ -1232,6 +1233,17 @@ void MyFrame::OnIdle(wxIdleEvent& event)
         try
         {
             this->system->Update(temp_steps);
+            const bool will_render = steps_since_last_render + temp_steps >= timesteps_per_render;
+            if (will_render) {
+                // queue the transfer of the results right behind the computation
+                this->system->BeginSyncToHost();
+            }
+            // wait for the device to finish, so that we time the computation itself and never queue up more
+            // work than the time limit below allows (else the render would block until the backlog was done)
+            this->system->WaitForUpdate();
+            if (will_render) {
+                this->system->SyncToHost(); // (the transfer has finished by now, so this doesn't wait)
+            }
             this->pVTKWindow->GetRenderWindow()->GetRenderers()->GetFirstRenderer()->ResetCameraClippingRange();
         }
         catch(const exception& e)
@@ -1349,6 +1361,7 @@ void MyFrame::OnGenerateInitialPattern(wxCommandEvent& event)
     try
     {
         this->system->GenerateInitialPattern();
+        this->system->SyncToHost(); // (the pattern may have been made on the OpenCL device)
     }
     catch(const exception& e)
     {
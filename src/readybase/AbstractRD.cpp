@@ -17,10 +17,14 @@
 
 // local:
 #include "AbstractRD.hpp"
+#include "Integrators.hpp"
 #include "overlays.hpp"
 
 // STL:
 #include <algorithm>
+#include <cmath>
+#include <limits>
+#include <stdexcept>
 
 // SSE:
 #include <xmmintrin.h>
@@ -39,6 +43,8 @@ AbstractRD::AbstractRD(int data_type)
     , x_spacing_proportion(0.05)
     , y_spacing_proportion(0.1)
     , accuracy(Accuracy::Medium)
+    , integrator(Integrator::Euler)
+    , integrator_tolerance(1e-3f)
 {
     this->InternalSetDataType(data_type);
 
@@ -290,6 +296,70 @@ vtkSmartPointer<vtkXMLDataElement> AbstractRD::GetAsXML(bool generate_initial_pa
 
 // ---------------------------------------------------------------------
 
+vtkSmartPointer<vtkXMLDataElement> AbstractRD::ReadFormulaElement(vtkXMLDataElement* rd, int block_size[3])
+{
+    vtkSmartPointer<vtkXMLDataElement> rule = rd->FindNestedElementWithName("rule");
+    if(!rule) throw runtime_error("rule node not found in file");
+
+    // formula:
+    vtkSmartPointer<vtkXMLDataElement> xml_formula = rule->FindNestedElementWithName("formula");
+    if(!xml_formula) throw runtime_error("formula node not found in file");
+    read_optional_attribute(xml_formula, "block_size_x", block_size[0]);
+    read_optional_attribute(xml_formula, "block_size_y", block_size[1]);
+    read_optional_attribute(xml_formula, "block_size_z", block_size[2]);
+
+    // number_of_chemicals:
+    read_required_attribute(xml_formula,"number_of_chemicals",this->n_chemicals);
+
+    // accuracy
+    string accuracy_string;
+    read_optional_attribute(xml_formula, "accuracy", accuracy_string);
+    if (accuracy_string.size() > 0)
+    {
+        const char* accuracy_labels[3] = { "low", "medium", "high" };
+        auto it = find(accuracy_labels, accuracy_labels + 3, accuracy_string);
+        if (it == accuracy_labels + 3)
+        {
+            throw std::runtime_error("unknown accuracy attribute: " + accuracy_string);
+        }
+        this->SetAccuracy(static_cast<AbstractRD::Accuracy>(it - accuracy_labels));
+    }
+
+    // integrator
+    AbstractRD::Integrator integrator;
+    ReadIntegratorAttributes(xml_formula, integrator, this->integrator_tolerance);
+    this->SetIntegrator(integrator);
+
+    return xml_formula;
+}
+
+// ---------------------------------------------------------------------
+
+vtkSmartPointer<vtkXMLDataElement> AbstractRD::AddFormulaElement(vtkXMLDataElement* rd, const int block_size[3]) const
+{
+    vtkSmartPointer<vtkXMLDataElement> rule = rd->FindNestedElementWithName("rule");
+    if(!rule) throw runtime_error("rule node not found");
+
+    // formula
+    vtkSmartPointer<vtkXMLDataElement> formula = vtkSmartPointer<vtkXMLDataElement>::New();
+    formula->SetName("formula");
+    formula->SetIntAttribute("number_of_chemicals",this->GetNumberOfChemicals());
+    formula->SetIntAttribute("block_size_x", block_size[0]);
+    formula->SetIntAttribute("block_size_y", block_size[1]);
+    formula->SetIntAttribute("block_size_z", block_size[2]);
+    const char* accuracy_labels[3] = { "low", "medium", "high" };
+    formula->SetAttribute("accuracy", accuracy_labels[static_cast<int>(this->accuracy)]);
+    WriteIntegratorAttributes(formula, this->integrator, this->integrator_tolerance);
+    string f = this->GetFormula();
+    f = ReplaceAllSubstrings(f, "\n", "\n        "); // indent the lines
+    formula->SetCharacterData(f.c_str(), (int)f.length());
+    rule->AddNestedElement(formula);
+
+    return formula;
+}
+
+// ---------------------------------------------------------------------
+
 void AbstractRD::CreateDefaultInitialPatternGenerator(size_t num_chemicals)
 {
     this->initial_pattern_generator.CreateDefaultInitialPatternGenerator(num_chemicals);
@@ -373,6 +443,54 @@ void AbstractRD::StorePaintAction(int iChemical,int iCell,float old_val)
 
 // ---------------------------------------------------------------------
 
+double AbstractRD::UpdateAndGetChange(int n_steps, ChangeNorm norm)
+{
+    if (n_steps < 1)
+        throw runtime_error("AbstractRD::UpdateAndGetChange : n_steps must be at least 1");
+    this->Update(n_steps - 1);
+    this->SaveChangeReference();
+    this->Update(1);
+    double max_change, sum_squares;
+    this->GetChangeFromReference(max_change, sum_squares);
+    if (norm == ChangeNorm::Max)
+        return max_change;
+    const double num_values = double(this->GetNumberOfChemicals()) * this->GetNumberOfCells();
+    return num_values > 0 ? sqrt(sum_squares / num_values) : 0.0;
+}
+
+// ---------------------------------------------------------------------
+
+void AbstractRD::SaveChangeReference()
+{
+    this->change_reference.resize(this->GetNumberOfChemicals());
+    for (int iChem = 0; iChem < this->GetNumberOfChemicals(); iChem++)
+        this->change_reference[iChem] = this->GetData(iChem);
+}
+
+// ---------------------------------------------------------------------
+
+void AbstractRD::GetChangeFromReference(double& max_change, double& sum_squares)
+{
+    max_change = 0.0;
+    sum_squares = 0.0;
+    for (int iChem = 0; iChem < this->GetNumberOfChemicals() && iChem < (int)this->change_reference.size(); iChem++)
+    {
+        const vector<float> values = this->GetData(iChem);
+        const vector<float>& reference = this->change_reference[iChem];
+        for (size_t i = 0; i < values.size() && i < reference.size(); i++)
+        {
+            double change = fabs(double(values[i]) - double(reference[i]));
+            if (change != change)
+                change = numeric_limits<double>::infinity(); // (NaN, so the system has blown up)
+            max_change = max(max_change, change);
+            sum_squares += change * change;
+        }
+    }
+    this->change_reference.clear();
+}
+
+// ---------------------------------------------------------------------
+
 std::string AbstractRD::GetNeighborhoodType() const
 {
     return this->canonical_neighborhood_type_identifiers.find(this->neighborhood_type)->second;
@@ -50,6 +50,14 @@ class AbstractRD
 
         /// Called to progress the simulation by N steps.
         virtual void Update(int n_steps) =0;
+        /// Some implementations (e.g. OpenCL ones) keep the data elsewhere while running; this brings the local copy up to date.
+        /** Functions that read or modify the data call this themselves, but renderers should call it before each render. */
+        virtual void SyncToHost() const {}
+        /// Starts bringing the local copy up to date without waiting for it, so that other work can overlap the transfer.
+        /** SyncToHost still has to be called before the data is used. */
+        virtual void BeginSyncToHost() const {}
+        /// Some implementations (e.g. OpenCL ones) return from Update before the work is done; this waits for it to finish.
+        virtual void WaitForUpdate() const {}
 
         /// Some implementations (e.g. inbuilt ones) cannot have their number_of_chemicals edited.
         virtual bool HasEditableNumberOfChemicals() const { return true; }
@@ -59,6 +67,13 @@ class AbstractRD
         /// How many timesteps have we advanced since being initialized?
         int GetTimestepsTaken() const { return this->timesteps_taken; }
 
+        /// How the change made by a step is measured, to tell when the system has settled into a steady state.
+        enum class ChangeNorm { Max, RootMeanSquare };
+        /// Advances n_steps steps (at least 1) and returns the size of the change that the last of them made.
+        /** ChangeNorm::Max gives the largest change of any value, ChangeNorm::RootMeanSquare the L2 norm of the changes
+         *  divided by the square root of the number of values. A change that isn't finite gives infinity. */
+        double UpdateAndGetChange(int n_steps, ChangeNorm norm);
+
         /// The formula is a piece of code (currently either an OpenCL snippet or a full OpenCL kernel) that drives the system.
         std::string GetFormula() const { return this->formula; }
         /// Throws std::runtime_error with information if the formula doesn't work.
@@ -141,6 +156,22 @@ class AbstractRD
         Accuracy GetAccuracy() const { return this->accuracy; }
         virtual void SetAccuracy(Accuracy acc) { this->accuracy = acc; }
 
+        /// Some implementations (e.g. formula ones) can use other ways of stepping forward in time than forward-Euler.
+        virtual bool HasEditableIntegratorOption() const { return false; }
+        enum class Integrator { Euler, RK2, RK4, RK45 }; ///< see Integrators.hpp
+        Integrator GetIntegrator() const { return this->integrator; }
+        virtual void SetIntegrator(Integrator integrator) { this->integrator = integrator; }
+        /// For adaptive integrators (RK45), the largest error allowed in each step, relative to 1 + the size of the value.
+        float GetIntegratorTolerance() const { return this->integrator_tolerance; }
+        void SetIntegratorTolerance(float tolerance) { this->integrator_tolerance = tolerance; }
+
+        /// Some implementations (e.g. FormulaImageRD) can solve the diffusion of some chemicals implicitly, which allows much larger timesteps.
+        virtual bool HasEditableImplicitDiffusionOption() const { return false; }
+        /// The diffusion coefficient of each chemical in turn, as parameter names or numbers, e.g. "D_a D_b". Empty if not used.
+        /** The formula should then leave out the diffusion of those chemicals, which is applied after each step. */
+        std::string GetImplicitDiffusion() const { return this->implicit_diffusion; }
+        void SetImplicitDiffusion(const std::string& s) { this->implicit_diffusion = s; }
+
         /// Retrieve the current 3D object as a vtkPolyData.
         virtual void GetAsMesh(vtkPolyData *out,const Properties& render_settings) const =0;
 
@@ -237,16 +268,34 @@ class AbstractRD
 
         Accuracy accuracy;
 
+        Integrator integrator;
+        float integrator_tolerance;
+
+        std::string implicit_diffusion;
+
+        std::vector<std::vector<float>> change_reference; ///< see SaveChangeReference
+
     protected: // functions
 
         /// Advance the RD system by n timesteps.
         virtual void InternalUpdate(int n_steps)=0;
 
+        /// Keeps a copy of the current values, for GetChangeFromReference.
+        /** Implementations that keep their data elsewhere (e.g. OpenCL ones) can keep the copy there too. */
+        virtual void SaveChangeReference();
+        /// Finds the largest change of any value since SaveChangeReference, and the sum of the squares of the changes.
+        virtual void GetChangeFromReference(double& max_change, double& sum_squares);
+
         virtual void AddPhasePlot(vtkRenderer* pRenderer, float scaling, float low, float high, float posX, float posY, float posZ,
             int iChemX, int iChemY, int iChemZ) =0;
         virtual void FlipPaintAction(PaintAction& cca) =0; ///< Undo/redo this paint action.
         void StorePaintAction(int iChemical,int iCell,float old_val); ///< Implementations call this when performing undo-able paint actions.
 
+        /// Reads the attributes of the rule's formula element that the image formula implementations share, and returns the element.
+        vtkSmartPointer<vtkXMLDataElement> ReadFormulaElement(vtkXMLDataElement* rd, int block_size[3]);
+        /// Adds a formula element holding the formula to the rule, with the attributes that ReadFormulaElement reads, and returns it.
+        vtkSmartPointer<vtkXMLDataElement> AddFormulaElement(vtkXMLDataElement* rd, const int block_size[3]) const;
+
     private: // functions
 
         void InternalSetDataType(int type);
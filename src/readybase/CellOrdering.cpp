@@ -0,0 +1,165 @@
+/*  Copyright 2011-2021 The Ready Bunch
+
+    This file is part of Ready.
+
+    Ready is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Ready is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Ready. If not, see <http://www.gnu.org/licenses/>.         */
+
+// local:
+#include "CellOrdering.hpp"
+
+// STL:
+#include <algorithm>
+#include <cstdint>
+#include <limits>
+#include <numeric>
+
+using namespace std;
+
+// ---------------------------------------------------------------------
+
+namespace
+{
+    const int HILBERT_BITS = 21; // per axis, so that the index fits in 63 bits
+
+    /// Returns the distance along the Hilbert curve of a point with integer coordinates of HILBERT_BITS bits.
+    /** From J. Skilling, "Programming the Hilbert curve", AIP Conference Proceedings 707 (2004). */
+    uint64_t HilbertIndex(uint32_t X[3])
+    {
+        const uint32_t M = 1u << (HILBERT_BITS - 1);
+        // inverse undo
+        for(uint32_t Q = M; Q > 1; Q >>= 1)
+        {
+            const uint32_t P = Q - 1;
+            for(int i=0;i<3;i++)
+            {
+                if(X[i] & Q)
+                    X[0] ^= P; // invert
+                else
+                {
+                    const uint32_t t = (X[0] ^ X[i]) & P; // exchange
+                    X[0] ^= t;
+                    X[i] ^= t;
+                }
+            }
+        }
+        // Gray encode
+        for(int i=1;i<3;i++)
+            X[i] ^= X[i-1];
+        uint32_t t = 0;
+        for(uint32_t Q = M; Q > 1; Q >>= 1)
+            if(X[2] & Q)
+                t ^= Q - 1;
+        for(int i=0;i<3;i++)
+            X[i] ^= t;
+        // the result is transposed across the three coordinates, so interleave their bits
+        uint64_t index = 0;
+        for(int b=HILBERT_BITS-1;b>=0;b--)
+            for(int i=0;i<3;i++)
+                index = (index << 1) | ((X[i] >> b) & 1u);
+        return index;
+    }
+}
+
+// ---------------------------------------------------------------------
+
+vector<int> GetHilbertOrder(const vector<float>& points)
+{
+    const int N = static_cast<int>(points.size() / 3);
+
+    // scale the points to fill the grid of the curve, keeping their proportions
+    float lower[3], upper[3];
+    for(int i=0;i<3;i++)
+    {
+        lower[i] = numeric_limits<float>::max();
+        upper[i] = -numeric_limits<float>::max();
+    }
+    for(int iPt=0;iPt<N;iPt++)
+    {
+        for(int i=0;i<3;i++)
+        {
+            lower[i] = min(lower[i], points[iPt*3+i]);
+            upper[i] = max(upper[i], points[iPt*3+i]);
+        }
+    }
+    const double extent = max(upper[0]-lower[0], max(upper[1]-lower[1], upper[2]-lower[2]));
+    const double max_coordinate = (1u << HILBERT_BITS) - 1;
+    const double scale = extent > 0.0 ? max_coordinate / extent : 0.0;
+
+    vector<uint64_t> keys(N);
+    for(int iPt=0;iPt<N;iPt++)
+    {
+        uint32_t X[3];
+        for(int i=0;i<3;i++)
+            X[i] = static_cast<uint32_t>(min(max_coordinate, max(0.0, (points[iPt*3+i] - lower[i]) * scale)));
+        keys[iPt] = HilbertIndex(X);
+    }
+
+    vector<int> order(N);
+    iota(order.begin(), order.end(), 0);
+    stable_sort(order.begin(), order.end(), [&](int a, int b) { return keys[a] < keys[b]; });
+    return order;
+}
+
+// ---------------------------------------------------------------------
+
+vector<int> GetReverseCuthillMcKeeOrder(const vector<int>& offsets,const vector<int>& indices)
+{
+    const int N = static_cast<int>(offsets.size()) - 1;
+    if(N <= 0)
+        return vector<int>();
+
+    vector<int> degree(N, 0);
+    for(int i=0;i<N;i++)
+        for(int k=offsets[i];k<offsets[i+1];k++)
+            if(indices[k] != i)
+                degree[i]++;
+
+    // each connected part of the graph is started from one of its nodes with the fewest neighbors
+    vector<int> starts(N);
+    iota(starts.begin(), starts.end(), 0);
+    stable_sort(starts.begin(), starts.end(), [&](int a, int b) { return degree[a] < degree[b]; });
+
+    vector<int> order;
+    order.reserve(N);
+    vector<bool> visited(N, false);
+    vector<int> unvisited_neighbors;
+    for(const int start : starts)
+    {
+        if(visited[start])
+            continue;
+        visited[start] = true;
+        order.push_back(start);
+        // breadth-first, adding the neighbors of each node in order of increasing degree
+        for(size_t head = order.size() - 1; head < order.size(); head++)
+        {
+            const int i = order[head];
+            unvisited_neighbors.clear();
+            for(int k=offsets[i];k<offsets[i+1];k++)
+            {
+                const int j = indices[k];
+                if(!visited[j])
+                {
+                    visited[j] = true;
+                    unvisited_neighbors.push_back(j);
+                }
+            }
+            stable_sort(unvisited_neighbors.begin(), unvisited_neighbors.end(), [&](int a, int b) { return degree[a] < degree[b]; });
+            order.insert(order.end(), unvisited_neighbors.begin(), unvisited_neighbors.end());
+        }
+    }
+    reverse(order.begin(), order.end());
+    return order;
+}
+
+// ---------------------------------------------------------------------
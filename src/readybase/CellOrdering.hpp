@@ -0,0 +1,35 @@
+/*  Copyright 2011-2021 The Ready Bunch
+
+    This file is part of Ready.
+
+    Ready is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Ready is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Ready. If not, see <http://www.gnu.org/licenses/>.         */
+
+#ifndef __CELLORDERING__
+#define __CELLORDERING__
+
+// STL:
+#include <vector>
+
+// Ways of renumbering the cells of a mesh so that cells that are near each other are also near each other in memory,
+// which makes gathering the values of the neighbors faster. Each returns the new order as a list of the old indices:
+// the cell at position i should be the one that was at order[i].
+
+/// Orders the points along a 3D Hilbert curve. The points are given as x,y,z for each one.
+std::vector<int> GetHilbertOrder(const std::vector<float>& points);
+
+/// Orders the nodes of a graph by the reverse Cuthill-McKee method, which keeps the neighbors of each node close by.
+/** The neighbors of node i are indices[offsets[i]] up to indices[offsets[i+1]-1]. Links to itself are ignored. */
+std::vector<int> GetReverseCuthillMcKeeOrder(const std::vector<int>& offsets,const std::vector<int>& indices);
+
+#endif
@@ -0,0 +1,222 @@
+/*  Copyright 2011-2021 The Ready Bunch
+
+    This file is part of Ready.
+
+    Ready is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Ready is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Ready. If not, see <http://www.gnu.org/licenses/>.         */
+
+// local:
+#include "FFT.hpp"
+#include "ThreadPool.hpp"
+
+// STL:
+#include <algorithm>
+#include <cmath>
+#include <stdexcept>
+
+using namespace std;
+
+// ---------------------------------------------------------------------
+
+namespace
+{
+    const double PI = 3.14159265358979323846;
+
+    bool IsPowerOfTwo(int n)
+    {
+        return n > 0 && (n & (n-1)) == 0;
+    }
+
+    void Conjugate(complex<double>* data,int n)
+    {
+        for(int i=0;i<n;i++)
+            data[i] = conj(data[i]);
+    }
+}
+
+// ---------------------------------------------------------------------
+
+FFT1D::FFT1D(int n)
+    : n(n)
+    , is_power_of_two(IsPowerOfTwo(n))
+{
+    if(n<1)
+        throw runtime_error("FFT1D::FFT1D : length must be at least 1");
+
+    if(this->is_power_of_two)
+    {
+        this->twiddles.resize(n/2);
+        for(int k=0;k<n/2;k++)
+            this->twiddles[k] = polar(1.0, -2.0 * PI * k / n);
+        this->bit_reversed.resize(n);
+        int num_bits = 0;
+        while((1<<num_bits) < n)
+            num_bits++;
+        for(int i=0;i<n;i++)
+        {
+            int r = 0;
+            for(int b=0;b<num_bits;b++)
+                if(i & (1<<b))
+                    r |= 1 << (num_bits-1-b);
+            this->bit_reversed[i] = r;
+        }
+    }
+    else
+    {
+        int m = 1;
+        while(m < 2*n-1)
+            m *= 2;
+        this->padded_fft = make_unique<FFT1D>(m);
+        // k^2 is taken modulo 2n before converting to an angle, to keep the angles accurate for large k
+        this->chirp.resize(n);
+        for(int k=0;k<n;k++)
+            this->chirp[k] = polar(1.0, -PI * double((long long)k * k % (2LL * n)) / n);
+        this->chirp_transform.assign(m, 0.0);
+        this->chirp_transform[0] = conj(this->chirp[0]);
+        for(int k=1;k<n;k++)
+        {
+            this->chirp_transform[k] = conj(this->chirp[k]);
+            this->chirp_transform[m-k] = conj(this->chirp[k]);
+        }
+        this->padded_fft->TransformPowerOfTwo(this->chirp_transform.data());
+    }
+}
+
+// ---------------------------------------------------------------------
+
+FFT1D::~FFT1D()
+{
+}
+
+// ---------------------------------------------------------------------
+
+void FFT1D::TransformPowerOfTwo(complex<double>* data) const
+{
+    const int n = this->n;
+    for(int i=0;i<n;i++)
+    {
+        const int j = this->bit_reversed[i];
+        if(i < j)
+            swap(data[i], data[j]);
+    }
+    for(int len=2;len<=n;len*=2)
+    {
+        const int half = len/2;
+        const int step = n/len;
+        for(int i=0;i<n;i+=len)
+        {
+            for(int j=0;j<half;j++)
+            {
+                const complex<double> u = data[i+j];
+                const complex<double> v = data[i+j+half] * this->twiddles[j*step];
+                data[i+j] = u + v;
+                data[i+j+half] = u - v;
+            }
+        }
+    }
+}
+
+// ---------------------------------------------------------------------
+
+void FFT1D::Transform(complex<double>* data,bool inverse,vector<complex<double>>& scratch) const
+{
+    if(this->n == 1)
+        return;
+    // the inverse transform is the conjugate of the forward transform of the conjugate
+    if(inverse)
+        Conjugate(data, this->n);
+
+    if(this->is_power_of_two)
+        this->TransformPowerOfTwo(data);
+    else
+    {
+        // Bluestein's method: the transform is a convolution with the chirp, which we do with power-of-two transforms
+        const int m = this->padded_fft->GetLength();
+        scratch.assign(m, 0.0);
+        for(int j=0;j<this->n;j++)
+            scratch[j] = data[j] * this->chirp[j];
+        this->padded_fft->TransformPowerOfTwo(scratch.data());
+        for(int k=0;k<m;k++)
+            scratch[k] = conj(scratch[k] * this->chirp_transform[k]);
+        this->padded_fft->TransformPowerOfTwo(scratch.data());
+        const double scale = 1.0 / m;
+        for(int k=0;k<this->n;k++)
+            data[k] = this->chirp[k] * conj(scratch[k]) * scale;
+    }
+
+    if(inverse)
+        Conjugate(data, this->n);
+}
+
+// ---------------------------------------------------------------------
+
+FFT3D::FFT3D(int X,int Y,int Z)
+    : X(X), Y(Y), Z(Z)
+    , fft_x(X), fft_y(Y), fft_z(Z)
+{
+}
+
+// ---------------------------------------------------------------------
+
+void FFT3D::Transform(complex<double>* data,bool inverse) const
+{
+    ThreadPool& thread_pool = ThreadPool::GetInstance();
+    const int TARGET_VALUES_PER_TASK = 16384;
+
+    // along x the lines are contiguous, so we transform them in place, a few lines per task
+    if(this->X > 1)
+    {
+        const int num_lines = this->Y * this->Z;
+        const int lines_per_task = max(1, TARGET_VALUES_PER_TASK / this->X);
+        const int num_tasks = (num_lines + lines_per_task - 1) / lines_per_task;
+        thread_pool.ParallelFor(num_tasks, [&](int iTask)
+        {
+            vector<complex<double>> scratch;
+            const int line_end = min(num_lines, (iTask+1) * lines_per_task);
+            for(int iLine=iTask*lines_per_task;iLine<line_end;iLine++)
+                this->fft_x.Transform(data + size_t(iLine) * this->X, inverse, scratch);
+        });
+    }
+
+    // along y and z the lines are strided, so we copy a block of neighboring lines into a buffer, which keeps the
+    // memory reads and writes contiguous, transform them there and copy them back
+    const int BLOCK_WIDTH = 16;
+    auto TransformStridedLines = [&](const FFT1D& fft,size_t stride,int num_inner,int num_outer)
+    {
+        // line (inner,outer) starts at inner + outer*stride*length and has a stride of 'stride'
+        const int L = fft.GetLength();
+        const int num_blocks = (num_inner + BLOCK_WIDTH - 1) / BLOCK_WIDTH;
+        thread_pool.ParallelFor(num_blocks * num_outer, [&](int iTask)
+        {
+            const int inner_start = (iTask % num_blocks) * BLOCK_WIDTH;
+            const int width = min(BLOCK_WIDTH, num_inner - inner_start);
+            complex<double>* first = data + inner_start + size_t(iTask / num_blocks) * stride * L;
+            vector<complex<double>> block(size_t(width) * L);
+            vector<complex<double>> scratch;
+            for(int j=0;j<L;j++)
+                for(int b=0;b<width;b++)
+                    block[size_t(b)*L + j] = first[j*stride + b];
+            for(int b=0;b<width;b++)
+                fft.Transform(block.data() + size_t(b)*L, inverse, scratch);
+            for(int j=0;j<L;j++)
+                for(int b=0;b<width;b++)
+                    first[j*stride + b] = block[size_t(b)*L + j];
+        });
+    };
+    if(this->Y > 1)
+        TransformStridedLines(this->fft_y, this->X, this->X, this->Z);
+    if(this->Z > 1)
+        TransformStridedLines(this->fft_z, size_t(this->X) * this->Y, this->X * this->Y, 1);
+}
+
+// ---------------------------------------------------------------------
@@ -0,0 +1,79 @@
+/*  Copyright 2011-2021 The Ready Bunch
+
+    This file is part of Ready.
+
+    Ready is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Ready is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Ready. If not, see <http://www.gnu.org/licenses/>.         */
+
+#ifndef __FFT__
+#define __FFT__
+
+// STL:
+#include <complex>
+#include <memory>
+#include <vector>
+
+/// A fast Fourier transform of complex data of one fixed length.
+/** Lengths that are powers of two use the radix-2 method. Other lengths are turned into a convolution of power-of-two
+ *  length by Bluestein's method, so they take a few times longer but any length works. */
+class FFT1D
+{
+    public:
+
+        explicit FFT1D(int n);
+        ~FFT1D();
+
+        int GetLength() const { return this->n; }
+
+        /// Replaces data[0..n-1] with its discrete Fourier transform, sum_j data[j] * exp(-2 pi i j k / n).
+        /** The inverse transform uses exp(+2 pi i j k / n) and is not divided by n. The scratch space is resized as
+         *  needed, so that each thread can keep its own. */
+        void Transform(std::complex<double>* data,bool inverse,std::vector<std::complex<double>>& scratch) const;
+
+    private:
+
+        void TransformPowerOfTwo(std::complex<double>* data) const;
+
+    private:
+
+        int n;
+        bool is_power_of_two;
+
+        // for the radix-2 transform
+        std::vector<std::complex<double>> twiddles; ///< exp(-2 pi i k / n) for k in [0,n/2)
+        std::vector<int> bit_reversed;
+
+        // for Bluestein's method
+        std::vector<std::complex<double>> chirp;           ///< exp(-pi i k^2 / n) for k in [0,n)
+        std::vector<std::complex<double>> chirp_transform; ///< the transform of the conjugate chirp, padded to length m
+        std::unique_ptr<FFT1D> padded_fft;                 ///< of length m, a power of two of at least 2n-1
+};
+
+/// A fast Fourier transform of a 3D array of complex values, stored with x varying fastest.
+/** The 1D transforms along each axis are shared out among the threads of the ThreadPool. Axes of length 1 are skipped. */
+class FFT3D
+{
+    public:
+
+        FFT3D(int X,int Y,int Z);
+
+        /// Transforms the data in place. The inverse transform is not divided by X*Y*Z.
+        void Transform(std::complex<double>* data,bool inverse) const;
+
+    private:
+
+        int X,Y,Z;
+        FFT1D fft_x,fft_y,fft_z;
+};
+
+#endif
@@ -0,0 +1,1309 @@
+/*  Copyright 2011-2021 The Ready Bunch
+
+    This file is part of Ready.
+
+    Ready is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Ready is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Ready. If not, see <http://www.gnu.org/licenses/>.         */
+
+// local:
+#include "FormulaEvaluator.hpp"
+
+// STL:
+#include <algorithm>
+#include <cctype>
+#include <cmath>
+#include <cstring>
+#include <locale>
+#include <map>
+#include <set>
+#include <sstream>
+#include <stdexcept>
+
+using namespace std;
+
+// -------------------------------------------------------------------------
+
+namespace
+{
+    enum Op
+    {
+        // moving values around:
+        OP_COPY, OP_MASKED_COPY, OP_LOAD_INDEXED, OP_STORE_INDEXED,
+        // control flow (c is the instruction to jump to):
+        OP_JUMP, OP_JUMP_IF_NONE,
+        // operators:
+        OP_NEG, OP_NOT, OP_ADD, OP_SUB, OP_MUL, OP_DIV, OP_MOD, OP_TRUNC,
+        OP_LT, OP_LE, OP_GT, OP_GE, OP_EQ, OP_NE, OP_AND, OP_OR, OP_AND_NOT, OP_SELECT,
+        // functions of one value:
+        OP_SIN, OP_COS, OP_TAN, OP_ASIN, OP_ACOS, OP_ATAN, OP_SINH, OP_COSH, OP_TANH, OP_ASINH, OP_ACOSH, OP_ATANH,
+        OP_EXP, OP_EXP2, OP_EXP10, OP_EXPM1, OP_LOG, OP_LOG2, OP_LOG10, OP_LOG1P, OP_SQRT, OP_RSQRT, OP_CBRT,
+        OP_FABS, OP_FLOOR, OP_CEIL, OP_ROUND, OP_RINT, OP_SIGN, OP_DEGREES, OP_RADIANS,
+        // functions of two values:
+        OP_POW, OP_ATAN2, OP_MIN, OP_MAX, OP_STEP, OP_HYPOT, OP_COPYSIGN,
+        // functions of three values:
+        OP_CLAMP, OP_MIX, OP_SMOOTHSTEP, OP_FMA
+    };
+
+    struct FunctionInfo
+    {
+        int op;
+        int num_arguments;
+        bool returns_int;
+    };
+
+    const map<string, FunctionInfo>& GetFunctions()
+    {
+        static const map<string, FunctionInfo> functions = {
+            { "sin", { OP_SIN, 1, false } }, { "cos", { OP_COS, 1, false } }, { "tan", { OP_TAN, 1, false } },
+            { "asin", { OP_ASIN, 1, false } }, { "acos", { OP_ACOS, 1, false } }, { "atan", { OP_ATAN, 1, false } },
+            { "sinh", { OP_SINH, 1, false } }, { "cosh", { OP_COSH, 1, false } }, { "tanh", { OP_TANH, 1, false } },
+            { "asinh", { OP_ASINH, 1, false } }, { "acosh", { OP_ACOSH, 1, false } }, { "atanh", { OP_ATANH, 1, false } },
+            { "exp", { OP_EXP, 1, false } }, { "exp2", { OP_EXP2, 1, false } }, { "exp10", { OP_EXP10, 1, false } },
+            { "expm1", { OP_EXPM1, 1, false } }, { "log", { OP_LOG, 1, false } }, { "log2", { OP_LOG2, 1, false } },
+            { "log10", { OP_LOG10, 1, false } }, { "log1p", { OP_LOG1P, 1, false } }, { "sqrt", { OP_SQRT, 1, false } },
+            { "rsqrt", { OP_RSQRT, 1, false } }, { "cbrt", { OP_CBRT, 1, false } }, { "fabs", { OP_FABS, 1, false } },
+            { "floor", { OP_FLOOR, 1, false } }, { "ceil", { OP_CEIL, 1, false } }, { "round", { OP_ROUND, 1, false } },
+            { "rint", { OP_RINT, 1, false } }, { "trunc", { OP_TRUNC, 1, false } }, { "sign", { OP_SIGN, 1, false } },
+            { "degrees", { OP_DEGREES, 1, false } }, { "radians", { OP_RADIANS, 1, false } },
+            { "pow", { OP_POW, 2, false } }, { "powr", { OP_POW, 2, false } }, { "pown", { OP_POW, 2, false } },
+            { "atan2", { OP_ATAN2, 2, false } }, { "fmod", { OP_MOD, 2, false } }, { "hypot", { OP_HYPOT, 2, false } },
+            { "min", { OP_MIN, 2, false } }, { "max", { OP_MAX, 2, false } },
+            { "fmin", { OP_MIN, 2, false } }, { "fmax", { OP_MAX, 2, false } },
+            { "step", { OP_STEP, 2, false } }, { "copysign", { OP_COPYSIGN, 2, false } }, { "divide", { OP_DIV, 2, false } },
+            { "isless", { OP_LT, 2, true } }, { "islessequal", { OP_LE, 2, true } },
+            { "isgreater", { OP_GT, 2, true } }, { "isgreaterequal", { OP_GE, 2, true } },
+            { "isequal", { OP_EQ, 2, true } }, { "isnotequal", { OP_NE, 2, true } },
+            { "clamp", { OP_CLAMP, 3, false } }, { "mix", { OP_MIX, 3, false } }, { "smoothstep", { OP_SMOOTHSTEP, 3, false } },
+            { "fma", { OP_FMA, 3, false } }, { "mad", { OP_FMA, 3, false } },
+            { "select", { OP_SELECT, 3, false } }, // (argument order is handled specially)
+            { "abs", { OP_FABS, 1, false } },
+        };
+        return functions;
+    }
+
+    // ---------------------------------------------------------------------
+
+    struct Token
+    {
+        enum Type { IDENTIFIER, NUMBER, PUNCTUATOR, END } type;
+        string text;
+        double value;
+        bool is_int;
+        int line; // line in the formula, or 0 for the generated code around it
+    };
+
+    void Tokenize(const string& source, bool is_formula, vector<Token>& tokens)
+    {
+        // longest first, so that e.g. "<=" is found before "<"
+        const char* punctuators[] = { "<<=", ">>=", "++", "--", "+=", "-=", "*=", "/=", "%=", "&&", "||", "==", "!=",
+            "<=", ">=", "<<", ">>", "->", "+", "-", "*", "/", "%", "<", ">", "=", "!", "?", ":", ";", ",", "(", ")",
+            "[", "]", "{", "}", ".", "&", "|", "^", "~", "#" };
+        int line = 1;
+        size_t i = 0;
+        while (i < source.size())
+        {
+            const char ch = source[i];
+            if (ch == '\n')
+            {
+                line++;
+                i++;
+            }
+            else if (isspace(static_cast<unsigned char>(ch)))
+            {
+                i++;
+            }
+            else if (source.compare(i, 2, "//") == 0)
+            {
+                while (i < source.size() && source[i] != '\n') i++;
+            }
+            else if (source.compare(i, 2, "/*") == 0)
+            {
+                const size_t end = source.find("*/", i + 2);
+                const size_t stop = (end == string::npos) ? source.size() : end + 2;
+                line += static_cast<int>(count(source.begin() + i, source.begin() + stop, '\n'));
+                i = stop;
+            }
+            else if (isalpha(static_cast<unsigned char>(ch)) || ch == '_')
+            {
+                const size_t start = i;
+                while (i < source.size() && (isalnum(static_cast<unsigned char>(source[i])) || source[i] == '_')) i++;
+                tokens.push_back({ Token::IDENTIFIER, source.substr(start, i - start), 0.0, false, is_formula ? line : 0 });
+            }
+            else if (isdigit(static_cast<unsigned char>(ch)) || (ch == '.' && i + 1 < source.size() && isdigit(static_cast<unsigned char>(source[i + 1]))))
+            {
+                const size_t start = i;
+                bool is_int = true;
+                double value;
+                if (source.compare(i, 2, "0x") == 0 || source.compare(i, 2, "0X") == 0)
+                {
+                    i += 2;
+                    while (i < source.size() && isxdigit(static_cast<unsigned char>(source[i]))) i++;
+                    value = static_cast<double>(stoll(source.substr(start, i - start), nullptr, 16));
+                }
+                else
+                {
+                    while (i < source.size())
+                    {
+                        const char c = source[i];
+                        if (isdigit(static_cast<unsigned char>(c))) i++;
+                        else if (c == '.') { is_int = false; i++; }
+                        else if ((c == 'e' || c == 'E') && i + 1 < source.size()
+                            && (isdigit(static_cast<unsigned char>(source[i + 1])) || source[i + 1] == '+' || source[i + 1] == '-'))
+                        {
+                            is_int = false;
+                            i += 2;
+                        }
+                        else break;
+                    }
+                    istringstream iss(source.substr(start, i - start));
+                    iss.imbue(locale::classic()); // the decimal point is always '.'
+                    iss >> value;
+                }
+                // suffixes, e.g. "1.0f", "2u"
+                while (i < source.size() && strchr("fFhHlLuU", source[i]))
+                {
+                    if (source[i] == 'f' || source[i] == 'F' || source[i] == 'h' || source[i] == 'H') is_int = false;
+                    i++;
+                }
+                tokens.push_back({ Token::NUMBER, source.substr(start, i - start), value, is_int, is_formula ? line : 0 });
+            }
+            else
+            {
+                bool found = false;
+                for (const char* p : punctuators)
+                {
+                    const size_t len = strlen(p);
+                    if (source.compare(i, len, p) == 0)
+                    {
+                        tokens.push_back({ Token::PUNCTUATOR, p, 0.0, false, is_formula ? line : 0 });
+                        i += len;
+                        found = true;
+                        break;
+                    }
+                }
+                if (!found)
+                {
+                    ostringstream oss;
+                    oss << "Formula error on line " << line << ": unexpected character '" << ch << "'";
+                    throw runtime_error(oss.str());
+                }
+            }
+        }
+    }
+
+    // ---------------------------------------------------------------------
+
+    /// Translates the tokens into instructions, as they are parsed.
+    class Compiler
+    {
+        public:
+
+            Compiler(FormulaProgram& program, const vector<Token>& tokens)
+                : program(program), tokens(tokens), pos(0), end_token{ Token::END, "", 0.0, false, 0 }, current_mask(-1) {}
+
+            void CompileAll();
+
+        private:
+
+            struct Operand
+            {
+                int slot;
+                bool is_int;
+                bool is_temp;     ///< can be reused once it has been consumed
+                bool is_uniform;  ///< has the same value for every cell, so can be computed once per workspace
+                bool is_constant;
+                double constant_value;
+            };
+
+            struct Variable
+            {
+                int slot;
+                int array_size; ///< 0 if not an array
+                bool is_int;
+                bool is_const;
+                bool is_uniform;
+                int index;      ///< in program.variables, or -1
+            };
+
+            struct LValue
+            {
+                Variable variable;
+                string name;
+                int slot;           ///< if not dynamic_index
+                bool dynamic_index;
+                Operand index;      ///< if dynamic_index
+            };
+
+        private:
+
+            // tokens
+            const Token& Peek(size_t k = 0) const;
+            const Token& Next();
+            bool IsPunctuator(const Token& t, const char* p) const { return t.type == Token::PUNCTUATOR && t.text == p; }
+            bool Accept(const char* p);
+            void Expect(const char* p);
+            string ExpectIdentifier();
+            [[noreturn]] void Error(const string& message) const;
+            bool IsTypeStart(size_t k = 0) const;
+            bool ParseType(bool& is_const);
+
+            // slots
+            int NewSlots(int n = 1);
+            int AllocateTemp(bool is_uniform);
+            void Release(const Operand& operand, bool consumed_by_setup);
+            Operand Constant(double value, bool is_int);
+
+            // code
+            void EmitMain(int op, int dst, int a = -1, int b = -1, int c = -1, int mask = -1);
+            Operand EmitOp(int op, const vector<Operand>& args, bool result_is_int);
+            void AssignToSlot(int slot, Operand value, bool is_int);
+            void Assign(const LValue& lvalue, Operand value);
+            Operand Read(const LValue& lvalue);
+            Variable* Lookup(const string& name);
+
+            // statements
+            void ParseStatement();
+            void ParseBlock();
+            void ParseDeclaration();
+            void ParseSimpleStatement();
+            void ParseIf();
+            void ParseFor();
+            void ParseWhile();
+            void ParseLoopBody(int outer_mask, int loop_mask, bool has_increment, size_t increment_start);
+            LValue ParseLValue();
+
+            // expressions
+            Operand ParseExpression();
+            Operand ParseLogicalOr();
+            Operand ParseLogicalAnd();
+            Operand ParseEquality();
+            Operand ParseRelational();
+            Operand ParseAdditive();
+            Operand ParseMultiplicative();
+            Operand ParseUnary();
+            Operand ParsePrimary();
+            Operand ParseFunctionCall(const string& name);
+
+        private:
+
+            FormulaProgram& program;
+            const vector<Token>& tokens;
+            size_t pos;
+            Token end_token;
+
+            vector<map<string, Variable>> scopes;
+            vector<int> free_temps, free_setup_temps;
+            map<pair<double, bool>, int> constant_slots;
+            int current_mask; ///< slot that says which cells the code applies to, or -1 for all of them
+    };
+
+    // ---------------------------------------------------------------------
+
+    const Token& Compiler::Peek(size_t k) const
+    {
+        if (this->pos + k < this->tokens.size())
+            return this->tokens[this->pos + k];
+        return this->end_token;
+    }
+
+    const Token& Compiler::Next()
+    {
+        const Token& t = this->Peek();
+        if (this->pos < this->tokens.size())
+            this->pos++;
+        return t;
+    }
+
+    bool Compiler::Accept(const char* p)
+    {
+        if (!this->IsPunctuator(this->Peek(), p))
+            return false;
+        this->pos++;
+        return true;
+    }
+
+    void Compiler::Expect(const char* p)
+    {
+        if (!this->Accept(p))
+            this->Error(string("expected '") + p + "'");
+    }
+
+    string Compiler::ExpectIdentifier()
+    {
+        if (this->Peek().type != Token::IDENTIFIER)
+            this->Error("expected a name");
+        return this->Next().text;
+    }
+
+    void Compiler::Error(const string& message) const
+    {
+        const Token& t = this->Peek();
+        ostringstream oss;
+        if (t.type == Token::END)
+            oss << "Formula error at the end of the formula: " << message;
+        else if (t.line > 0)
+            oss << "Formula error on line " << t.line << " near '" << t.text << "': " << message;
+        else
+            oss << "Formula error in the code generated around the formula, near '" << t.text << "': " << message;
+        throw runtime_error(oss.str());
+    }
+
+    bool Compiler::IsTypeStart(size_t k) const
+    {
+        static const set<string> qualifiers = { "const", "__const", "private", "__private", "unsigned", "signed" };
+        static const set<string> base_types = { "float", "double", "half", "int", "uint", "long", "ulong", "short",
+            "ushort", "char", "uchar", "bool" };
+        const Token& t = this->Peek(k);
+        if (t.type != Token::IDENTIFIER)
+            return false;
+        if (qualifiers.count(t.text))
+            return true;
+        // allow the vector types too, e.g. "float4", since we hold one value per cell
+        const size_t digits = t.text.find_first_of("0123456789");
+        const string base = t.text.substr(0, digits);
+        if (!base_types.count(base))
+            return false;
+        if (digits == string::npos)
+            return true;
+        const string width = t.text.substr(digits);
+        return width == "2" || width == "3" || width == "4" || width == "8" || width == "16";
+    }
+
+    bool Compiler::ParseType(bool& is_const)
+    {
+        is_const = false;
+        bool is_int = false;
+        bool found_type = false;
+        while (this->IsTypeStart())
+        {
+            const string& s = this->Next().text;
+            if (s == "const" || s == "__const")
+                is_const = true;
+            else if (s == "unsigned" || s == "signed")
+                is_int = true;
+            else if (s == "private" || s == "__private")
+                continue;
+            else
+            {
+                if (found_type)
+                    this->Error("unexpected type");
+                found_type = true;
+                is_int = !(s.compare(0, 5, "float") == 0 || s.compare(0, 6, "double") == 0 || s.compare(0, 4, "half") == 0);
+            }
+        }
+        if (this->Accept("const"))
+            is_const = true;
+        return is_int;
+    }
+
+    // ---------------------------------------------------------------------
+
+    int Compiler::NewSlots(int n)
+    {
+        const int slot = this->program.num_slots;
+        this->program.num_slots += n;
+        return slot;
+    }
+
+    int Compiler::AllocateTemp(bool is_uniform)
+    {
+        // the setup code runs before the main code, so the two mustn't share temporary slots
+        vector<int>& free_list = is_uniform ? this->free_setup_temps : this->free_temps;
+        if (free_list.empty())
+            return this->NewSlots();
+        const int slot = free_list.back();
+        free_list.pop_back();
+        return slot;
+    }
+
+    void Compiler::Release(const Operand& operand, bool consumed_by_setup)
+    {
+        if (!operand.is_temp)
+            return;
+        if (!operand.is_uniform)
+            this->free_temps.push_back(operand.slot);
+        else if (consumed_by_setup)
+            this->free_setup_temps.push_back(operand.slot);
+        // (a uniform value used by the main code must stay where it is, since the setup code only runs once)
+    }
+
+    Compiler::Operand Compiler::Constant(double value, bool is_int)
+    {
+        const pair<double, bool> key(value, is_int);
+        auto it = this->constant_slots.find(key);
+        int slot;
+        if (it != this->constant_slots.end())
+        {
+            slot = it->second;
+        }
+        else
+        {
+            slot = this->NewSlots();
+            this->constant_slots[key] = slot;
+            this->program.constants.push_back({ slot, value });
+        }
+        return { slot, is_int, false, true, true, value };
+    }
+
+    // ---------------------------------------------------------------------
+
+    void Compiler::EmitMain(int op, int dst, int a, int b, int c, int mask)
+    {
+        this->program.code.push_back({ op, dst, a, b, c, mask });
+    }
+
+    Compiler::Operand Compiler::EmitOp(int op, const vector<Operand>& args, bool result_is_int)
+    {
+        bool is_uniform = true;
+        for (const Operand& arg : args)
+            is_uniform = is_uniform && arg.is_uniform;
+        // every operation works cell-by-cell, so the result can go in the same place as one of the arguments
+        for (const Operand& arg : args)
+            this->Release(arg, is_uniform);
+        const int dst = this->AllocateTemp(is_uniform);
+        const FormulaProgram::Instruction instruction = { op, dst,
+            args.size() > 0 ? args[0].slot : -1,
+            args.size() > 1 ? args[1].slot : -1,
+            args.size() > 2 ? args[2].slot : -1, -1 };
+        if (is_uniform)
+            this->program.setup_code.push_back(instruction);
+        else
+            this->program.code.push_back(instruction);
+        return { dst, result_is_int, true, is_uniform, false, 0.0 };
+    }
+
+    void Compiler::AssignToSlot(int slot, Operand value, bool is_int)
+    {
+        if (is_int && !value.is_int)
+            value = this->EmitOp(OP_TRUNC, { value }, true);
+        if (this->current_mask >= 0)
+        {
+            this->EmitMain(OP_MASKED_COPY, slot, value.slot, this->current_mask);
+            this->Release(value, false);
+        }
+        else if (value.is_temp && !value.is_uniform && !this->program.code.empty() && this->program.code.back().dst == value.slot)
+        {
+            // the value was computed by the last instruction, so it can write to the variable directly
+            this->program.code.back().dst = slot;
+            this->Release(value, false);
+        }
+        else
+        {
+            this->EmitMain(OP_COPY, slot, value.slot);
+            this->Release(value, false);
+        }
+    }
+
+    void Compiler::Assign(const LValue& lvalue, Operand value)
+    {
+        if (lvalue.variable.is_const)
+            this->Error("cannot assign to '" + lvalue.name + "'");
+        if (!lvalue.dynamic_index)
+        {
+            this->AssignToSlot(lvalue.slot, value, lvalue.variable.is_int);
+            return;
+        }
+        if (lvalue.variable.is_int && !value.is_int)
+            value = this->EmitOp(OP_TRUNC, { value }, true);
+        this->EmitMain(OP_STORE_INDEXED, lvalue.variable.slot, value.slot, lvalue.index.slot, lvalue.variable.array_size,
+            this->current_mask);
+        this->Release(value, false);
+        this->Release(lvalue.index, false);
+    }
+
+    Compiler::Operand Compiler::Read(const LValue& lvalue)
+    {
+        if (!lvalue.dynamic_index)
+            return { lvalue.slot, lvalue.variable.is_int, false, lvalue.variable.is_uniform, false, 0.0 };
+        // (the index is not released, since the caller will need it again)
+        const int dst = this->AllocateTemp(false);
+        this->EmitMain(OP_LOAD_INDEXED, dst, lvalue.variable.slot, lvalue.index.slot, lvalue.variable.array_size);
+        return { dst, lvalue.variable.is_int, true, false, false, 0.0 };
+    }
+
+    Compiler::Variable* Compiler::Lookup(const string& name)
+    {
+        for (auto it = this->scopes.rbegin(); it != this->scopes.rend(); it++)
+        {
+            auto found = it->find(name);
+            if (found != it->end())
+            {
+                if (found->second.index >= 0)
+                    this->program.variable_used[found->second.index] = true;
+                return &found->second;
+            }
+        }
+        return nullptr;
+    }
+
+    // ---------------------------------------------------------------------
+
+    void Compiler::CompileAll()
+    {
+        // the variables and uniforms supplied by the caller are in the outermost scope, as in the OpenCL kernel
+        this->scopes.resize(1);
+        for (size_t i = 0; i < this->program.variables.size(); i++)
+        {
+            const FormulaProgram::Name& v = this->program.variables[i];
+            if (this->scopes[0].count(v.name))
+                throw runtime_error("Formula error: '" + v.name + "' is declared twice");
+            const int slot = this->NewSlots();
+            this->program.variable_slots.push_back(slot);
+            this->scopes[0][v.name] = { slot, 0, v.is_int, v.is_const, false, static_cast<int>(i) };
+        }
+        for (const FormulaProgram::Name& u : this->program.uniforms)
+        {
+            if (this->scopes[0].count(u.name))
+                throw runtime_error("Formula error: '" + u.name + "' is declared twice");
+            const int slot = this->NewSlots();
+            this->program.uniform_slots.push_back(slot);
+            this->scopes[0][u.name] = { slot, 0, u.is_int, true, true, -1 };
+        }
+        while (this->Peek().type != Token::END)
+            this->ParseStatement();
+    }
+
+    // ---------------------------------------------------------------------
+
+    void Compiler::ParseStatement()
+    {
+        const Token& t = this->Peek();
+        if (this->Accept(";"))
+            return;
+        if (this->IsPunctuator(t, "{"))
+        {
+            this->ParseBlock();
+            return;
+        }
+        if (this->IsPunctuator(t, "#"))
+            this->Error("preprocessor directives are not supported by the CPU implementation");
+        if (t.type == Token::IDENTIFIER)
+        {
+            if (t.text == "if") { this->ParseIf(); return; }
+            if (t.text == "for") { this->ParseFor(); return; }
+            if (t.text == "while") { this->ParseWhile(); return; }
+            if (t.text == "else")
+                this->Error("'else' without 'if'");
+            if (t.text == "do" || t.text == "break" || t.text == "continue" || t.text == "return" || t.text == "switch"
+                || t.text == "case" || t.text == "default" || t.text == "goto")
+                this->Error("'" + t.text + "' is not supported by the CPU implementation");
+            if (this->IsTypeStart())
+            {
+                this->ParseDeclaration();
+                return;
+            }
+        }
+        this->ParseSimpleStatement();
+        this->Expect(";");
+    }
+
+    void Compiler::ParseBlock()
+    {
+        this->Expect("{");
+        this->scopes.emplace_back();
+        while (!this->Accept("}"))
+        {
+            if (this->Peek().type == Token::END)
+                this->Error("missing '}'");
+            this->ParseStatement();
+        }
+        this->scopes.pop_back();
+    }
+
+    void Compiler::ParseDeclaration()
+    {
+        bool is_const;
+        const bool is_int = this->ParseType(is_const);
+        do
+        {
+            const string name = this->ExpectIdentifier();
+            if (this->scopes.back().count(name))
+                this->Error("'" + name + "' is already declared");
+            int array_size = 0;
+            if (this->Accept("["))
+            {
+                const Token& n = this->Next();
+                if (n.type != Token::NUMBER || !n.is_int || n.value < 1)
+                    this->Error("the size of an array must be a positive whole number");
+                array_size = static_cast<int>(n.value);
+                this->Expect("]");
+            }
+            const Variable variable = { this->NewSlots(max(1, array_size)), array_size, is_int, is_const, false, -1 };
+            const Operand zero = this->Constant(0.0, is_int);
+            if (this->Accept("="))
+            {
+                if (array_size > 0)
+                {
+                    this->Expect("{");
+                    int i = 0;
+                    if (!this->Accept("}"))
+                    {
+                        do
+                        {
+                            if (i >= array_size)
+                                this->Error("too many values for '" + name + "'");
+                            this->AssignToSlot(variable.slot + i++, this->ParseExpression(), is_int);
+                        } while (this->Accept(","));
+                        this->Expect("}");
+                    }
+                    for (; i < array_size; i++)
+                        this->AssignToSlot(variable.slot + i, zero, is_int);
+                }
+                else
+                {
+                    this->AssignToSlot(variable.slot, this->ParseExpression(), is_int);
+                }
+            }
+            else
+            {
+                // OpenCL leaves these undefined, but we may as well be predictable
+                for (int i = 0; i < max(1, array_size); i++)
+                    this->AssignToSlot(variable.slot + i, zero, is_int);
+            }
+            this->scopes.back()[name] = variable;
+        } while (this->Accept(","));
+        this->Expect(";");
+    }
+
+    Compiler::LValue Compiler::ParseLValue()
+    {
+        LValue lvalue;
+        lvalue.name = this->ExpectIdentifier();
+        Variable* variable = this->Lookup(lvalue.name);
+        if (!variable)
+        {
+            this->pos--;
+            this->Error("unknown name '" + lvalue.name + "'");
+        }
+        lvalue.variable = *variable;
+        lvalue.slot = variable->slot;
+        lvalue.dynamic_index = false;
+        if (this->Accept("["))
+        {
+            if (variable->array_size == 0)
+                this->Error("'" + lvalue.name + "' is not an array");
+            const Operand index = this->ParseExpression();
+            this->Expect("]");
+            if (index.is_constant)
+            {
+                if (index.constant_value < 0 || index.constant_value >= variable->array_size)
+                    this->Error("index out of range for '" + lvalue.name + "'");
+                lvalue.slot = variable->slot + static_cast<int>(index.constant_value);
+            }
+            else
+            {
+                lvalue.dynamic_index = true;
+                lvalue.index = index;
+            }
+        }
+        else if (variable->array_size > 0)
+        {
+            this->Error("arrays can only be used one element at a time");
+        }
+        if (this->IsPunctuator(this->Peek(), "."))
+            this->Error("vector components are not supported by the CPU implementation");
+        return lvalue;
+    }
+
+    void Compiler::ParseSimpleStatement()
+    {
+        if (this->IsPunctuator(this->Peek(), "++") || this->IsPunctuator(this->Peek(), "--"))
+        {
+            const int op = (this->Next().text == "++") ? OP_ADD : OP_SUB;
+            const LValue lvalue = this->ParseLValue();
+            this->Assign(lvalue, this->EmitOp(op, { this->Read(lvalue), this->Constant(1.0, true) }, lvalue.variable.is_int));
+            return;
+        }
+        if (this->Peek().type != Token::IDENTIFIER || this->IsPunctuator(this->Peek(1), "("))
+        {
+            // an expression on its own, e.g. a function call, has no effect
+            this->Release(this->ParseExpression(), false);
+            return;
+        }
+        const LValue lvalue = this->ParseLValue();
+        if (this->Accept("="))
+        {
+            this->Assign(lvalue, this->ParseExpression());
+            return;
+        }
+        const char* compound[] = { "+=", "-=", "*=", "/=", "%=", "++", "--" };
+        const int ops[] = { OP_ADD, OP_SUB, OP_MUL, OP_DIV, OP_MOD, OP_ADD, OP_SUB };
+        for (int i = 0; i < 7; i++)
+        {
+            if (this->Accept(compound[i]))
+            {
+                const Operand current = this->Read(lvalue);
+                const Operand rhs = (i >= 5) ? this->Constant(1.0, true) : this->ParseExpression();
+                const bool is_int = current.is_int && rhs.is_int;
+                Operand result = this->EmitOp(ops[i], { current, rhs }, is_int);
+                if (ops[i] == OP_DIV && is_int)
+                    result = this->EmitOp(OP_TRUNC, { result }, true);
+                this->Assign(lvalue, result);
+                return;
+            }
+        }
+        this->Error("expected an assignment");
+    }
+
+    void Compiler::ParseIf()
+    {
+        this->Next();
+        this->Expect("(");
+        const Operand condition = this->ParseExpression();
+        this->Expect(")");
+        const int outer_mask = this->current_mask;
+        const int then_mask = this->NewSlots();
+        if (outer_mask < 0)
+            this->EmitMain(OP_NE, then_mask, condition.slot, this->Constant(0.0, false).slot);
+        else
+            this->EmitMain(OP_AND, then_mask, outer_mask, condition.slot);
+        this->Release(condition, false);
+        // skip the code if it doesn't apply to any of the cells
+        size_t skip = this->program.code.size();
+        this->EmitMain(OP_JUMP_IF_NONE, -1, then_mask, -1, -1);
+        this->current_mask = then_mask;
+        this->scopes.emplace_back();
+        this->ParseStatement();
+        this->scopes.pop_back();
+        this->program.code[skip].c = static_cast<int>(this->program.code.size());
+        if (this->Peek().type == Token::IDENTIFIER && this->Peek().text == "else")
+        {
+            this->Next();
+            const int else_mask = this->NewSlots();
+            if (outer_mask < 0)
+                this->EmitMain(OP_NOT, else_mask, then_mask);
+            else
+                this->EmitMain(OP_AND_NOT, else_mask, outer_mask, then_mask);
+            skip = this->program.code.size();
+            this->EmitMain(OP_JUMP_IF_NONE, -1, else_mask, -1, -1);
+            this->current_mask = else_mask;
+            this->scopes.emplace_back();
+            this->ParseStatement();
+            this->scopes.pop_back();
+            this->program.code[skip].c = static_cast<int>(this->program.code.size());
+        }
+        this->current_mask = outer_mask;
+    }
+
+    void Compiler::ParseFor()
+    {
+        this->Next();
+        this->Expect("(");
+        this->scopes.emplace_back();
+        if (this->IsTypeStart())
+        {
+            this->ParseDeclaration();
+        }
+        else if (!this->Accept(";"))
+        {
+            this->ParseSimpleStatement();
+            this->Expect(";");
+        }
+        const int outer_mask = this->current_mask;
+        const int loop_mask = this->NewSlots();
+        this->EmitMain(OP_COPY, loop_mask, outer_mask < 0 ? this->Constant(1.0, true).slot : outer_mask);
+        const size_t loop_start = this->program.code.size();
+        if (!this->IsPunctuator(this->Peek(), ";"))
+        {
+            // cells drop out of the loop when their condition becomes false
+            const Operand condition = this->ParseExpression();
+            this->EmitMain(OP_AND, loop_mask, loop_mask, condition.slot);
+            this->Release(condition, false);
+        }
+        this->Expect(";");
+        // the increment comes after the body in the code, so skip over it for now
+        const size_t increment_start = this->pos;
+        for (int depth = 0; !(depth == 0 && this->IsPunctuator(this->Peek(), ")")); this->Next())
+        {
+            if (this->Peek().type == Token::END) this->Error("missing ')'");
+            if (this->IsPunctuator(this->Peek(), "(")) depth++;
+            if (this->IsPunctuator(this->Peek(), ")")) depth--;
+        }
+        this->Next();
+        this->ParseLoopBody(outer_mask, loop_mask, true, increment_start);
+        this->EmitMain(OP_JUMP, -1, -1, -1, static_cast<int>(loop_start));
+        this->scopes.pop_back();
+    }
+
+    void Compiler::ParseWhile()
+    {
+        this->Next();
+        this->Expect("(");
+        const int outer_mask = this->current_mask;
+        const int loop_mask = this->NewSlots();
+        this->EmitMain(OP_COPY, loop_mask, outer_mask < 0 ? this->Constant(1.0, true).slot : outer_mask);
+        const size_t loop_start = this->program.code.size();
+        const Operand condition = this->ParseExpression();
+        this->EmitMain(OP_AND, loop_mask, loop_mask, condition.slot);
+        this->Release(condition, false);
+        this->Expect(")");
+        this->ParseLoopBody(outer_mask, loop_mask, false, 0);
+        this->EmitMain(OP_JUMP, -1, -1, -1, static_cast<int>(loop_start));
+    }
+
+    void Compiler::ParseLoopBody(int outer_mask, int loop_mask, bool has_increment, size_t increment_start)
+    {
+        const size_t exit = this->program.code.size();
+        this->EmitMain(OP_JUMP_IF_NONE, -1, loop_mask, -1, -1);
+        this->current_mask = loop_mask;
+        this->scopes.emplace_back();
+        this->ParseStatement();
+        this->scopes.pop_back();
+        if (has_increment)
+        {
+            const size_t after_body = this->pos;
+            this->pos = increment_start;
+            if (!this->IsPunctuator(this->Peek(), ")"))
+                this->ParseSimpleStatement();
+            this->Expect(")");
+            this->pos = after_body;
+        }
+        this->current_mask = outer_mask;
+        // (the caller adds the jump back to the start, and the exit lands after it)
+        this->program.code[exit].c = static_cast<int>(this->program.code.size() + 1);
+    }
+
+    // ---------------------------------------------------------------------
+
+    Compiler::Operand Compiler::ParseExpression()
+    {
+        const Operand condition = this->ParseLogicalOr();
+        if (!this->Accept("?"))
+            return condition;
+        // (both sides are computed, as on a GPU)
+        const Operand if_true = this->ParseExpression();
+        this->Expect(":");
+        const Operand if_false = this->ParseExpression();
+        return this->EmitOp(OP_SELECT, { condition, if_true, if_false }, if_true.is_int && if_false.is_int);
+    }
+
+    Compiler::Operand Compiler::ParseLogicalOr()
+    {
+        Operand left = this->ParseLogicalAnd();
+        while (this->Accept("||"))
+            left = this->EmitOp(OP_OR, { left, this->ParseLogicalAnd() }, true);
+        return left;
+    }
+
+    Compiler::Operand Compiler::ParseLogicalAnd()
+    {
+        Operand left = this->ParseEquality();
+        while (this->Accept("&&"))
+            left = this->EmitOp(OP_AND, { left, this->ParseEquality() }, true);
+        return left;
+    }
+
+    Compiler::Operand Compiler::ParseEquality()
+    {
+        Operand left = this->ParseRelational();
+        while (true)
+        {
+            if (this->Accept("==")) left = this->EmitOp(OP_EQ, { left, this->ParseRelational() }, true);
+            else if (this->Accept("!=")) left = this->EmitOp(OP_NE, { left, this->ParseRelational() }, true);
+            else return left;
+        }
+    }
+
+    Compiler::Operand Compiler::ParseRelational()
+    {
+        Operand left = this->ParseAdditive();
+        while (true)
+        {
+            if (this->Accept("<")) left = this->EmitOp(OP_LT, { left, this->ParseAdditive() }, true);
+            else if (this->Accept("<=")) left = this->EmitOp(OP_LE, { left, this->ParseAdditive() }, true);
+            else if (this->Accept(">")) left = this->EmitOp(OP_GT, { left, this->ParseAdditive() }, true);
+            else if (this->Accept(">=")) left = this->EmitOp(OP_GE, { left, this->ParseAdditive() }, true);
+            else return left;
+        }
+    }
+
+    Compiler::Operand Compiler::ParseAdditive()
+    {
+        Operand left = this->ParseMultiplicative();
+        while (true)
+        {
+            int op;
+            if (this->Accept("+")) op = OP_ADD;
+            else if (this->Accept("-")) op = OP_SUB;
+            else return left;
+            const Operand right = this->ParseMultiplicative();
+            left = this->EmitOp(op, { left, right }, left.is_int && right.is_int);
+        }
+    }
+
+    Compiler::Operand Compiler::ParseMultiplicative()
+    {
+        Operand left = this->ParseUnary();
+        while (true)
+        {
+            int op;
+            if (this->Accept("*")) op = OP_MUL;
+            else if (this->Accept("/")) op = OP_DIV;
+            else if (this->Accept("%")) op = OP_MOD;
+            else return left;
+            const Operand right = this->ParseUnary();
+            const bool is_int = left.is_int && right.is_int;
+            left = this->EmitOp(op, { left, right }, is_int);
+            if (op == OP_DIV && is_int)
+                left = this->EmitOp(OP_TRUNC, { left }, true); // integer division
+        }
+    }
+
+    Compiler::Operand Compiler::ParseUnary()
+    {
+        if (this->Accept("-"))
+        {
+            const Operand operand = this->ParseUnary();
+            if (operand.is_constant)
+                return this->Constant(-operand.constant_value, operand.is_int);
+            return this->EmitOp(OP_NEG, { operand }, operand.is_int);
+        }
+        if (this->Accept("+"))
+            return this->ParseUnary();
+        if (this->Accept("!"))
+            return this->EmitOp(OP_NOT, { this->ParseUnary() }, true);
+        const Token& t = this->Peek();
+        if (this->IsPunctuator(t, "++") || this->IsPunctuator(t, "--"))
+            this->Error("'" + t.text + "' can only be used on its own, e.g. 'i++;'");
+        if (this->IsPunctuator(t, "~") || this->IsPunctuator(t, "&") || this->IsPunctuator(t, "*"))
+            this->Error("'" + t.text + "' is not supported by the CPU implementation");
+        if (this->IsPunctuator(t, "(") && this->IsTypeStart(1))
+        {
+            // a cast, e.g. "(float4)x" or "(int)(x*2)"
+            this->Next();
+            bool is_const;
+            const bool is_int = this->ParseType(is_const);
+            this->Expect(")");
+            Operand operand;
+            if (this->Accept("("))
+            {
+                operand = this->ParseExpression();
+                if (this->IsPunctuator(this->Peek(), ","))
+                    this->Error("vector literals are not supported by the CPU implementation");
+                this->Expect(")");
+            }
+            else
+            {
+                operand = this->ParseUnary();
+            }
+            if (is_int && !operand.is_int)
+                return this->EmitOp(OP_TRUNC, { operand }, true);
+            operand.is_int = is_int;
+            return operand;
+        }
+        const Operand operand = this->ParsePrimary();
+        if (this->IsPunctuator(this->Peek(), "."))
+            this->Error("vector components are not supported by the CPU implementation");
+        if (this->IsPunctuator(this->Peek(), "++") || this->IsPunctuator(this->Peek(), "--"))
+            this->Error("'" + this->Peek().text + "' can only be used on its own, e.g. 'i++;'");
+        return operand;
+    }
+
+    Compiler::Operand Compiler::ParsePrimary()
+    {
+        const Token& t = this->Peek();
+        if (t.type == Token::NUMBER)
+        {
+            this->Next();
+            return this->Constant(t.value, t.is_int);
+        }
+        if (this->Accept("("))
+        {
+            const Operand operand = this->ParseExpression();
+            if (this->IsPunctuator(this->Peek(), ","))
+                this->Error("the comma operator is not supported by the CPU implementation");
+            this->Expect(")");
+            return operand;
+        }
+        if (t.type != Token::IDENTIFIER)
+            this->Error("expected a value");
+        if (this->IsPunctuator(this->Peek(1), "("))
+            return this->ParseFunctionCall(this->Next().text);
+        const LValue lvalue = this->ParseLValue();
+        const Operand value = this->Read(lvalue);
+        if (lvalue.dynamic_index)
+            this->Release(lvalue.index, false);
+        return value;
+    }
+
+    Compiler::Operand Compiler::ParseFunctionCall(const string& name)
+    {
+        const map<string, FunctionInfo>& functions = GetFunctions();
+        string base_name = name;
+        // the fast versions, e.g. "native_exp", are computed in the same way as the others
+        for (const string prefix : { "native_", "half_" })
+        {
+            if (name.compare(0, prefix.size(), prefix) == 0 && functions.count(name.substr(prefix.size())))
+                base_name = name.substr(prefix.size());
+        }
+        auto it = functions.find(base_name);
+        if (it == functions.end())
+        {
+            this->pos--;
+            this->Error("unknown function '" + name + "'");
+        }
+        const FunctionInfo& info = it->second;
+        this->Expect("(");
+        vector<Operand> args;
+        if (!this->Accept(")"))
+        {
+            do
+            {
+                args.push_back(this->ParseExpression());
+            } while (this->Accept(","));
+            this->Expect(")");
+        }
+        if (static_cast<int>(args.size()) != info.num_arguments)
+        {
+            ostringstream oss;
+            oss << "'" << name << "' needs " << info.num_arguments << " argument" << (info.num_arguments > 1 ? "s" : "");
+            this->Error(oss.str());
+        }
+        if (base_name == "select")
+            swap(args[0], args[2]); // select(a,b,c) is c ? b : a
+        bool is_int = info.returns_int;
+        if (base_name == "min" || base_name == "max" || base_name == "clamp" || base_name == "abs" || base_name == "select")
+        {
+            is_int = true;
+            for (size_t i = (base_name == "select" ? 1 : 0); i < args.size(); i++)
+                is_int = is_int && args[i].is_int;
+        }
+        return this->EmitOp(info.op, args, is_int);
+    }
+
+    // ---------------------------------------------------------------------
+
+    template<typename T, typename F>
+    inline void Apply1(T* r, const T* a, int n, F f)
+    {
+        for (int i = 0; i < n; i++) r[i] = f(a[i]);
+    }
+
+    template<typename T, typename F>
+    inline void Apply2(T* r, const T* a, const T* b, int n, F f)
+    {
+        for (int i = 0; i < n; i++) r[i] = f(a[i], b[i]);
+    }
+
+    template<typename T, typename F>
+    inline void Apply3(T* r, const T* a, const T* b, const T* c, int n, F f)
+    {
+        for (int i = 0; i < n; i++) r[i] = f(a[i], b[i], c[i]);
+    }
+
+    /// Runs the instructions on the first n cells of each slot.
+    template<typename T>
+    void Execute(const vector<FormulaProgram::Instruction>& code, T* values, int n)
+    {
+        const size_t B = FormulaEvaluator<T>::BATCH_SIZE;
+        size_t pc = 0;
+        while (pc < code.size())
+        {
+            const FormulaProgram::Instruction& ins = code[pc++];
+            switch (ins.op)
+            {
+                case OP_JUMP:
+                    pc = ins.c;
+                    continue;
+                case OP_JUMP_IF_NONE:
+                {
+                    const T* m = values + ins.a * B;
+                    bool any = false;
+                    for (int i = 0; i < n; i++)
+                        any = any || (m[i] != T(0));
+                    if (!any)
+                        pc = ins.c;
+                    continue;
+                }
+                case OP_LOAD_INDEXED:
+                {
+                    T* r = values + ins.dst * B;
+                    const T* index = values + ins.b * B;
+                    for (int i = 0; i < n; i++)
+                    {
+                        const int k = min(ins.c - 1, max(0, static_cast<int>(index[i])));
+                        r[i] = values[(ins.a + k) * B + i];
+                    }
+                    continue;
+                }
+                case OP_STORE_INDEXED:
+                {
+                    const T* src = values + ins.a * B;
+                    const T* index = values + ins.b * B;
+                    const T* m = (ins.mask >= 0) ? values + ins.mask * B : nullptr;
+                    for (int i = 0; i < n; i++)
+                    {
+                        if (m && m[i] == T(0)) continue;
+                        const int k = min(ins.c - 1, max(0, static_cast<int>(index[i])));
+                        values[(ins.dst + k) * B + i] = src[i];
+                    }
+                    continue;
+                }
+                default:
+                    break;
+            }
+            T* r = values + ins.dst * B;
+            const T* a = (ins.a >= 0) ? values + ins.a * B : nullptr;
+            const T* b = (ins.b >= 0) ? values + ins.b * B : nullptr;
+            const T* c = (ins.c >= 0) ? values + ins.c * B : nullptr;
+            switch (ins.op)
+            {
+                case OP_COPY: copy(a, a + n, r); break;
+                case OP_MASKED_COPY: for (int i = 0; i < n; i++) r[i] = (b[i] != T(0)) ? a[i] : r[i]; break;
+                case OP_NEG: Apply1(r, a, n, [](T x) { return -x; }); break;
+                case OP_NOT: Apply1(r, a, n, [](T x) { return T(x == T(0)); }); break;
+                case OP_ADD: Apply2(r, a, b, n, [](T x, T y) { return x + y; }); break;
+                case OP_SUB: Apply2(r, a, b, n, [](T x, T y) { return x - y; }); break;
+                case OP_MUL: Apply2(r, a, b, n, [](T x, T y) { return x * y; }); break;
+                case OP_DIV: Apply2(r, a, b, n, [](T x, T y) { return x / y; }); break;
+                case OP_MOD: Apply2(r, a, b, n, [](T x, T y) { return fmod(x, y); }); break;
+                case OP_TRUNC: Apply1(r, a, n, [](T x) { return trunc(x); }); break;
+                case OP_LT: Apply2(r, a, b, n, [](T x, T y) { return T(x < y); }); break;
+                case OP_LE: Apply2(r, a, b, n, [](T x, T y) { return T(x <= y); }); break;
+                case OP_GT: Apply2(r, a, b, n, [](T x, T y) { return T(x > y); }); break;
+                case OP_GE: Apply2(r, a, b, n, [](T x, T y) { return T(x >= y); }); break;
+                case OP_EQ: Apply2(r, a, b, n, [](T x, T y) { return T(x == y); }); break;
+                case OP_NE: Apply2(r, a, b, n, [](T x, T y) { return T(x != y); }); break;
+                case OP_AND: Apply2(r, a, b, n, [](T x, T y) { return T(x != T(0) && y != T(0)); }); break;
+                case OP_OR: Apply2(r, a, b, n, [](T x, T y) { return T(x != T(0) || y != T(0)); }); break;
+                case OP_AND_NOT: Apply2(r, a, b, n, [](T x, T y) { return T(x != T(0) && y == T(0)); }); break;
+                case OP_SELECT: Apply3(r, a, b, c, n, [](T x, T y, T z) { return x != T(0) ? y : z; }); break;
+                case OP_SIN: Apply1(r, a, n, [](T x) { return sin(x); }); break;
+                case OP_COS: Apply1(r, a, n, [](T x) { return cos(x); }); break;
+                case OP_TAN: Apply1(r, a, n, [](T x) { return tan(x); }); break;
+                case OP_ASIN: Apply1(r, a, n, [](T x) { return asin(x); }); break;
+                case OP_ACOS: Apply1(r, a, n, [](T x) { return acos(x); }); break;
+                case OP_ATAN: Apply1(r, a, n, [](T x) { return atan(x); }); break;
+                case OP_SINH: Apply1(r, a, n, [](T x) { return sinh(x); }); break;
+                case OP_COSH: Apply1(r, a, n, [](T x) { return cosh(x); }); break;
+                case OP_TANH: Apply1(r, a, n, [](T x) { return tanh(x); }); break;
+                case OP_ASINH: Apply1(r, a, n, [](T x) { return asinh(x); }); break;
+                case OP_ACOSH: Apply1(r, a, n, [](T x) { return acosh(x); }); break;
+                case OP_ATANH: Apply1(r, a, n, [](T x) { return atanh(x); }); break;
+                case OP_EXP: Apply1(r, a, n, [](T x) { return exp(x); }); break;
+                case OP_EXP2: Apply1(r, a, n, [](T x) { return exp2(x); }); break;
+                case OP_EXP10: Apply1(r, a, n, [](T x) { return pow(T(10), x); }); break;
+                case OP_EXPM1: Apply1(r, a, n, [](T x) { return expm1(x); }); break;
+                case OP_LOG: Apply1(r, a, n, [](T x) { return log(x); }); break;
+                case OP_LOG2: Apply1(r, a, n, [](T x) { return log2(x); }); break;
+                case OP_LOG10: Apply1(r, a, n, [](T x) { return log10(x); }); break;
+                case OP_LOG1P: Apply1(r, a, n, [](T x) { return log1p(x); }); break;
+                case OP_SQRT: Apply1(r, a, n, [](T x) { return sqrt(x); }); break;
+                case OP_RSQRT: Apply1(r, a, n, [](T x) { return T(1) / sqrt(x); }); break;
+                case OP_CBRT: Apply1(r, a, n, [](T x) { return cbrt(x); }); break;
+                case OP_FABS: Apply1(r, a, n, [](T x) { return fabs(x); }); break;
+                case OP_FLOOR: Apply1(r, a, n, [](T x) { return floor(x); }); break;
+                case OP_CEIL: Apply1(r, a, n, [](T x) { return ceil(x); }); break;
+                case OP_ROUND: Apply1(r, a, n, [](T x) { return round(x); }); break;
+                case OP_RINT: Apply1(r, a, n, [](T x) { return nearbyint(x); }); break;
+                case OP_SIGN: Apply1(r, a, n, [](T x) { return x > T(0) ? T(1) : (x < T(0) ? T(-1) : T(0)); }); break;
+                case OP_DEGREES: Apply1(r, a, n, [](T x) { return x * T(57.29577951308232); }); break;
+                case OP_RADIANS: Apply1(r, a, n, [](T x) { return x * T(0.017453292519943295); }); break;
+                case OP_POW: Apply2(r, a, b, n, [](T x, T y) { return pow(x, y); }); break;
+                case OP_ATAN2: Apply2(r, a, b, n, [](T x, T y) { return atan2(x, y); }); break;
+                case OP_MIN: Apply2(r, a, b, n, [](T x, T y) { return y < x ? y : x; }); break;
+                case OP_MAX: Apply2(r, a, b, n, [](T x, T y) { return x < y ? y : x; }); break;
+                case OP_STEP: Apply2(r, a, b, n, [](T edge, T x) { return x < edge ? T(0) : T(1); }); break;
+                case OP_HYPOT: Apply2(r, a, b, n, [](T x, T y) { return hypot(x, y); }); break;
+                case OP_COPYSIGN: Apply2(r, a, b, n, [](T x, T y) { return copysign(x, y); }); break;
+                case OP_CLAMP: Apply3(r, a, b, c, n, [](T x, T lo, T hi) { const T y = x < lo ? lo : x; return hi < y ? hi : y; }); break;
+                case OP_MIX: Apply3(r, a, b, c, n, [](T x, T y, T t) { return x + (y - x) * t; }); break;
+                case OP_SMOOTHSTEP: Apply3(r, a, b, c, n, [](T e0, T e1, T x) {
+                    T t = (x - e0) / (e1 - e0);
+                    t = t < T(0) ? T(0) : (T(1) < t ? T(1) : t);
+                    return t * t * (T(3) - T(2) * t); }); break;
+                case OP_FMA: Apply3(r, a, b, c, n, [](T x, T y, T z) { return x * y + z; }); break;
+                default:
+                    throw runtime_error("FormulaEvaluator::Run : unknown operation");
+            }
+        }
+    }
+}
+
+// -------------------------------------------------------------------------
+
+void FormulaProgram::Compile(const string& prologue, const string& formula, const string& epilogue)
+{
+    vector<Token> tokens;
+    Tokenize(prologue, false, tokens);
+    Tokenize(formula, true, tokens);
+    Tokenize(epilogue, false, tokens);
+
+    this->variable_slots.clear();
+    this->uniform_slots.clear();
+    this->variable_used.assign(this->variables.size(), false);
+    this->constants.clear();
+    this->setup_code.clear();
+    this->code.clear();
+    this->num_slots = 0;
+
+    Compiler compiler(*this, tokens);
+    compiler.CompileAll();
+}
+
+// -------------------------------------------------------------------------
+
+template<typename T>
+int FormulaEvaluator<T>::AddVariable(const string& name, bool is_const, bool is_int)
+{
+    this->program.variables.push_back({ name, is_const, is_int });
+    return static_cast<int>(this->program.variables.size()) - 1;
+}
+
+// -------------------------------------------------------------------------
+
+template<typename T>
+int FormulaEvaluator<T>::AddUniform(const string& name, bool is_int)
+{
+    this->program.uniforms.push_back({ name, true, is_int });
+    return static_cast<int>(this->program.uniforms.size()) - 1;
+}
+
+// -------------------------------------------------------------------------
+
+template<typename T>
+void FormulaEvaluator<T>::Compile(const string& prologue, const string& formula, const string& epilogue)
+{
+    this->program.Compile(prologue, formula, epilogue);
+}
+
+// -------------------------------------------------------------------------
+
+template<typename T>
+void FormulaEvaluator<T>::PrepareWorkspace(Workspace& workspace, const vector<T>& uniform_values) const
+{
+    if (uniform_values.size() != this->program.uniforms.size())
+        throw runtime_error("FormulaEvaluator::PrepareWorkspace : wrong number of uniform values");
+    workspace.values.assign(size_t(this->program.num_slots) * BATCH_SIZE, T(0));
+    T* values = workspace.values.data();
+    for (size_t i = 0; i < uniform_values.size(); i++)
+        fill_n(values + size_t(this->program.uniform_slots[i]) * BATCH_SIZE, BATCH_SIZE, uniform_values[i]);
+    for (const pair<int, double>& constant : this->program.constants)
+        fill_n(values + size_t(constant.first) * BATCH_SIZE, BATCH_SIZE, static_cast<T>(constant.second));
+    Execute(this->program.setup_code, values, BATCH_SIZE);
+}
+
+// -------------------------------------------------------------------------
+
+template<typename T>
+void FormulaEvaluator<T>::Run(Workspace& workspace, int n) const
+{
+    Execute(this->program.code, workspace.values.data(), n);
+}
+
+// -------------------------------------------------------------------------
+
+template class FormulaEvaluator<float>;
+template class FormulaEvaluator<double>;
+
+// -------------------------------------------------------------------------
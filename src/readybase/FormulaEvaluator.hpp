@@ -0,0 +1,109 @@
+/*  Copyright 2011-2021 The Ready Bunch
+
+    This file is part of Ready.
+
+    Ready is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Ready is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Ready. If not, see <http://www.gnu.org/licenses/>.         */
+
+#ifndef __FORMULAEVALUATOR__
+#define __FORMULAEVALUATOR__
+
+// STL:
+#include <string>
+#include <vector>
+
+/// A formula compiled into a list of operations, each of which works on a whole batch of cells.
+/** The operations are shared by the float and double versions of FormulaEvaluator. */
+struct FormulaProgram
+{
+    struct Instruction
+    {
+        int op;
+        int dst,a,b,c;
+        int mask; ///< only for stores into arrays, -1 if none
+    };
+
+    struct Name
+    {
+        std::string name;
+        bool is_const;
+        bool is_int;
+    };
+
+    FormulaProgram() : num_slots(0) {}
+
+    std::vector<Name> variables;       ///< have a different value for each cell
+    std::vector<Name> uniforms;        ///< have the same value for every cell, e.g. the parameters
+    std::vector<int> variable_slots;
+    std::vector<int> uniform_slots;
+    std::vector<bool> variable_used;
+
+    std::vector<std::pair<int,double>> constants; ///< the literals in the formula, and where they are stored
+    std::vector<Instruction> setup_code;          ///< operations that only depend on the uniforms and the constants
+    std::vector<Instruction> code;                ///< operations that are run for every batch
+    int num_slots;
+
+    /// Throws std::runtime_error if the formula has an error or uses something that is not supported.
+    void Compile(const std::string& prologue,const std::string& formula,const std::string& epilogue);
+};
+
+/// Runs an OpenCL formula snippet (as used by FormulaOpenCLImageRD) on the CPU, a batch of cells at a time.
+/** Each operation loops over the whole batch, so the loops are simple enough for the compiler to vectorize.
+ *  Conditionals and loops are handled with a mask for each branch, as on a GPU. Supported: declarations (float, float4,
+ *  double, int, etc. all hold one value per cell), fixed-size arrays, assignment, compound assignment, ++ and --,
+ *  if/else, for and while loops, the arithmetic, comparison and logical operators, the ternary operator, casts and the
+ *  common OpenCL math functions. Not supported: vector literals, swizzles, pointers, break, continue and return. */
+template<typename T>
+class FormulaEvaluator
+{
+    public:
+
+        static const int BATCH_SIZE = 128; ///< the largest number of cells that Run() can work on at once
+
+        /// Declares a value that can be different for each cell, e.g. "a" or "a_nw". Returns its index.
+        int AddVariable(const std::string& name,bool is_const,bool is_int=false);
+        /// Declares a value that is the same for every cell, e.g. a parameter. Returns its index.
+        int AddUniform(const std::string& name,bool is_int=false);
+
+        /// Compiles the formula, with some lines of code to run before and after it.
+        /** Throws std::runtime_error if the formula has an error or uses something that is not supported. */
+        void Compile(const std::string& prologue,const std::string& formula,const std::string& epilogue);
+
+        /// Returns whether the formula reads or writes the variable, so that the caller can skip any inputs it doesn't need.
+        bool IsVariableUsed(int i) const { return this->program.variable_used[i]; }
+
+        /// Storage for the values of one batch of cells. Use one per thread.
+        class Workspace
+        {
+            friend class FormulaEvaluator<T>;
+            std::vector<T> values;
+        };
+
+        /// Sets up a workspace with the values of the uniforms, in the order they were added.
+        void PrepareWorkspace(Workspace& workspace,const std::vector<T>& uniform_values) const;
+
+        /// Where the caller writes the values of a variable for each cell before calling Run(), and reads them after.
+        T* GetVariable(Workspace& workspace,int i) const
+        {
+            return workspace.values.data() + size_t(this->program.variable_slots[i]) * BATCH_SIZE;
+        }
+
+        /// Runs the formula on the first n cells in the workspace (n <= BATCH_SIZE).
+        void Run(Workspace& workspace,int n) const;
+
+    private:
+
+        FormulaProgram program;
+};
+
+#endif
@@ -0,0 +1,708 @@
+/*  Copyright 2011-2021 The Ready Bunch
+
+    This file is part of Ready.
+
+    Ready is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Ready is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Ready. If not, see <http://www.gnu.org/licenses/>.         */
+
+// local:
+#include "FormulaImageRD.hpp"
+#include "Integrators.hpp"
+#include "stencils.hpp"
+#include "ThreadPool.hpp"
+#include "utils.hpp"
+
+// STL:
+#include <algorithm>
+#include <cmath>
+#include <limits>
+#include <sstream>
+#include <stdexcept>
+
+// VTK:
+#include <vtkImageData.h>
+#include <vtkXMLDataElement.h>
+
+using namespace std;
+
+// -------------------------------------------------------------------------
+
+FormulaImageRD::FormulaImageRD(int data_type)
+    : ImageRD(data_type)
+    , needs_dx_uniform(false)
+    , native_function(nullptr)
+    , compiled_dimensionality(0)
+    , compiled_num_chemicals(0)
+    , compiled_data_type(0)
+    , block_size{4, 1, 1}
+{
+    // these settings are used in File > New Pattern
+    this->SetRuleName("Gray-Scott");
+    this->AddParameter("timestep",1.0f);
+    this->AddParameter("D_a",0.082f);
+    this->AddParameter("D_b",0.041f);
+    this->AddParameter("K",0.06f);
+    this->AddParameter("F",0.035f);
+    this->SetFormula("\
+delta_a = D_a * laplacian_a - a*b*b + F*(1.0"+this->data_type_suffix+"-a);\n\
+delta_b = D_b * laplacian_b + a*b*b - (F+K)*b;");
+}
+
+// -------------------------------------------------------------------------
+
+void FormulaImageRD::InitializeFromXML(vtkXMLDataElement *rd,bool &warn_to_update)
+{
+    ImageRD::InitializeFromXML(rd,warn_to_update);
+
+    vtkSmartPointer<vtkXMLDataElement> xml_formula = this->ReadFormulaElement(rd, this->block_size);
+
+    // implicit diffusion
+    read_optional_attribute(xml_formula, "implicit_diffusion", this->implicit_diffusion);
+
+    string formula = trim_multiline_string(xml_formula->GetCharacterData());
+    this->SetFormula(formula); // (won't throw yet)
+}
+
+// -------------------------------------------------------------------------
+
+vtkSmartPointer<vtkXMLDataElement> FormulaImageRD::GetAsXML(bool generate_initial_pattern_when_loading) const
+{
+    vtkSmartPointer<vtkXMLDataElement> rd = ImageRD::GetAsXML(generate_initial_pattern_when_loading);
+
+    vtkSmartPointer<vtkXMLDataElement> formula = this->AddFormulaElement(rd, this->block_size);
+    if (!this->implicit_diffusion.empty())
+        formula->SetAttribute("implicit_diffusion", this->implicit_diffusion.c_str());
+
+    return rd;
+}
+
+// -------------------------------------------------------------------------
+
+void FormulaImageRD::TestFormula(std::string program_string)
+{
+    // compile into a spare evaluator, so that the current one is left alone
+    const vector<FormulaInput> old_inputs = this->inputs;
+    const vector<int> old_chemical_variables = this->chemical_variables;
+    const bool old_needs_dx_uniform = this->needs_dx_uniform;
+    try
+    {
+        if (this->data_type == VTK_DOUBLE)
+        {
+            FormulaEvaluator<double> evaluator;
+            this->CompileFormula(program_string, evaluator);
+        }
+        else
+        {
+            FormulaEvaluator<float> evaluator;
+            this->CompileFormula(program_string, evaluator);
+        }
+    }
+    catch (...)
+    {
+        this->inputs = old_inputs;
+        this->chemical_variables = old_chemical_variables;
+        this->needs_dx_uniform = old_needs_dx_uniform;
+        throw;
+    }
+    this->inputs = old_inputs;
+    this->chemical_variables = old_chemical_variables;
+    this->needs_dx_uniform = old_needs_dx_uniform;
+}
+
+// -------------------------------------------------------------------------
+
+template<typename T>
+void FormulaImageRD::CompileFormula(const string& formula, FormulaEvaluator<T>& evaluator)
+{
+    // we work on one cell at a time, so the stencils don't need to account for blocks
+    const int cell_block_size[3] = { 1, 1, 1 };
+    const int dimensionality = this->images.empty() ? 3 : this->GetArenaDimensionality();
+    const InputsNeeded inputs_needed = DetectInputsNeeded(formula, this->GetNumberOfChemicals(), dimensionality,
+        cell_block_size, this->GetAccuracy());
+
+    this->inputs.clear();
+    this->chemical_variables.clear();
+
+    // the chemicals themselves, which the formula is allowed to change
+    for (int iChem = 0; iChem < this->GetNumberOfChemicals(); iChem++)
+    {
+        const int variable = evaluator.AddVariable(GetChemicalName(iChem), false);
+        this->chemical_variables.push_back(variable);
+        this->inputs.push_back({ FormulaInput::Type::Cell, variable, iChem, { 0, 0, 0 } });
+    }
+    // the neighbors that the formula or the stencils read, e.g. "a_nw"
+    for (const InputPoint& input_point : inputs_needed.cells_needed)
+    {
+        const Point& p = input_point.point;
+        if (p.x == 0 && p.y == 0 && p.z == 0)
+            continue;
+        const int iChem = static_cast<int>(find(inputs_needed.chemicals_needed.begin(), inputs_needed.chemicals_needed.end(),
+            input_point.chem) - inputs_needed.chemicals_needed.begin());
+        this->inputs.push_back({ FormulaInput::Type::Cell, evaluator.AddVariable(input_point.GetName(), true), iChem,
+            { p.x, p.y, p.z } });
+    }
+    // the other keywords, which are only filled in if the formula uses them
+    this->inputs.push_back({ FormulaInput::Type::XPos, evaluator.AddVariable("x_pos", true), -1, { 0, 0, 0 } });
+    this->inputs.push_back({ FormulaInput::Type::YPos, evaluator.AddVariable("y_pos", true), -1, { 0, 0, 0 } });
+    this->inputs.push_back({ FormulaInput::Type::ZPos, evaluator.AddVariable("z_pos", true), -1, { 0, 0, 0 } });
+    this->inputs.push_back({ FormulaInput::Type::IndexX, evaluator.AddVariable("index_x", true, true), -1, { 0, 0, 0 } });
+    this->inputs.push_back({ FormulaInput::Type::IndexY, evaluator.AddVariable("index_y", true, true), -1, { 0, 0, 0 } });
+    this->inputs.push_back({ FormulaInput::Type::IndexZ, evaluator.AddVariable("index_z", true, true), -1, { 0, 0, 0 } });
+    this->inputs.push_back({ FormulaInput::Type::IndexHere, evaluator.AddVariable("index_here", true, true), -1, { 0, 0, 0 } });
+
+    // the values that are the same for every cell, in the order that RunFormula supplies them
+    for (const Parameter& parameter : this->parameters)
+        evaluator.AddUniform(parameter.name);
+    evaluator.AddUniform("X", true);
+    evaluator.AddUniform("Y", true);
+    evaluator.AddUniform("Z", true);
+    // add a dx parameter for grid spacing if one is not already supplied, as FormulaOpenCLImageRD does
+    this->needs_dx_uniform = !inputs_needed.stencils_needed.empty() && !this->IsParameter("dx");
+    if (this->needs_dx_uniform)
+        evaluator.AddUniform("dx");
+
+    // the stencils and other keywords are computed before the formula, as in the OpenCL kernel
+    ostringstream prologue;
+    for (const AppliedStencil& applied_stencil : inputs_needed.stencils_needed)
+        prologue << "const float " << applied_stencil.GetCode() << ";\n";
+    for (const auto& pair : inputs_needed.gradient_mag_squared)
+    {
+        const string& chem = pair.first;
+        prologue << "const float gradient_mag_squared_" << chem << " = pow(x_gradient_" << chem << ", 2.0f)";
+        if (pair.second > 1)
+            prologue << " + pow(y_gradient_" << chem << ", 2.0f)";
+        if (pair.second > 2)
+            prologue << " + pow(z_gradient_" << chem << ", 2.0f)";
+        prologue << ";\n";
+    }
+    for (const string& chem : inputs_needed.deltas_needed)
+        prologue << "float delta_" << chem << " = 0.0f;\n";
+
+    // the forward-Euler update step, or just the rates if the integrator combines them itself
+    ostringstream epilogue;
+    for (const string& chem : inputs_needed.chemicals_needed)
+    {
+        if (this->IsComputingRates())
+            epilogue << chem << " = delta_" << chem << ";\n";
+        else
+            epilogue << chem << " = " << chem << " + timestep * delta_" << chem << ";\n";
+    }
+
+    evaluator.Compile(prologue.str(), formula, epilogue.str());
+}
+
+// -------------------------------------------------------------------------
+
+string FormulaImageRD::AssembleNativeSource(const string& formula) const
+{
+    const int cell_block_size[3] = { 1, 1, 1 };
+    const InputsNeeded inputs_needed = DetectInputsNeeded(formula, this->GetNumberOfChemicals(), this->GetArenaDimensionality(),
+        cell_block_size, this->GetAccuracy());
+    const string real_type = (this->data_type == VTK_DOUBLE) ? "double" : "float";
+
+    const string amended_formula = NativeKernel::AdaptFormula(formula, this->data_type == VTK_DOUBLE);
+
+    ostringstream source;
+    source << "typedef " << real_type << " real;\n" << NativeKernel::GetFormulaPrelude() << "\n";
+    source << "extern \"C\" void formula_kernel(const real* const* in, real* const* out, const real* parameters,"
+        " int X, int Y, int Z, int x_start, int x_end, int y_start, int y_end, int z_start, int z_end)\n{\n";
+    for (size_t iParam = 0; iParam < this->parameters.size(); iParam++)
+        source << "    const real " << this->parameters[iParam].name << " = parameters[" << iParam << "];\n";
+    if (!inputs_needed.stencils_needed.empty() && !this->IsParameter("dx"))
+        source << "    const real dx = 1.0; // grid spacing\n";
+    source << "    for (int index_z = z_start; index_z < z_end; index_z++)\n    {\n";
+    source << "    for (int index_y = y_start; index_y < y_end; index_y++)\n    {\n";
+    source << "    for (int index_x = x_start; index_x < x_end; index_x++)\n    {\n";
+    const string indent = "        ";
+    source << indent << "const int index_here = X * (Y * index_z + index_y) + index_x;\n";
+
+    // the cells that the formula reads
+    const string wrap_function = this->wrap ? "ready_wrap" : "ready_clamp_index";
+    for (size_t iChem = 0; iChem < inputs_needed.chemicals_needed.size(); iChem++)
+        source << indent << "real " << inputs_needed.chemicals_needed[iChem] << " = in[" << iChem << "][index_here];\n";
+    for (const InputPoint& input_point : inputs_needed.cells_needed)
+    {
+        const Point& p = input_point.point;
+        if (p.x == 0 && p.y == 0 && p.z == 0)
+            continue;
+        const int iChem = static_cast<int>(find(inputs_needed.chemicals_needed.begin(), inputs_needed.chemicals_needed.end(),
+            input_point.chem) - inputs_needed.chemicals_needed.begin());
+        auto coord = [&](const char* index, const char* size, int offset)
+        {
+            ostringstream oss;
+            if (offset == 0)
+                oss << index;
+            else
+                oss << wrap_function << "(" << index << " + (" << offset << "), " << size << ")";
+            return oss.str();
+        };
+        source << indent << "const real " << input_point.GetName() << " = in[" << iChem << "][X * (Y * "
+            << coord("index_z", "Z", p.z) << " + " << coord("index_y", "Y", p.y) << ") + " << coord("index_x", "X", p.x) << "];\n";
+    }
+    if (inputs_needed.using_x_pos)
+        source << indent << "const real x_pos = index_x / (real)X;\n";
+    if (inputs_needed.using_y_pos)
+        source << indent << "const real y_pos = index_y / (real)Y;\n";
+    if (inputs_needed.using_z_pos)
+        source << indent << "const real z_pos = index_z / (real)Z;\n";
+
+    // the stencils and other keywords, as in the OpenCL kernel
+    for (const AppliedStencil& applied_stencil : inputs_needed.stencils_needed)
+        source << indent << "const real " << applied_stencil.GetCode() << ";\n";
+    for (const auto& pair : inputs_needed.gradient_mag_squared)
+    {
+        const string& chem = pair.first;
+        source << indent << "const real gradient_mag_squared_" << chem << " = pow(x_gradient_" << chem << ", real(2))";
+        if (pair.second > 1)
+            source << " + pow(y_gradient_" << chem << ", real(2))";
+        if (pair.second > 2)
+            source << " + pow(z_gradient_" << chem << ", real(2))";
+        source << ";\n";
+    }
+    for (const string& chem : inputs_needed.deltas_needed)
+        source << indent << "real delta_" << chem << " = 0;\n";
+
+    // the formula
+    source << "\n" << indent << ReplaceAllSubstrings(amended_formula, "\n", "\n" + indent) << "\n\n";
+
+    // the forward-Euler update step, or just the rates if the integrator combines them itself
+    for (size_t iChem = 0; iChem < inputs_needed.chemicals_needed.size(); iChem++)
+    {
+        const string& chem = inputs_needed.chemicals_needed[iChem];
+        if (this->IsComputingRates())
+            source << indent << "out[" << iChem << "][index_here] = delta_" << chem << ";\n";
+        else
+            source << indent << "out[" << iChem << "][index_here] = " << chem << " + timestep * delta_" << chem << ";\n";
+    }
+    source << "    }\n    }\n    }\n}\n";
+    return source.str();
+}
+
+// -------------------------------------------------------------------------
+
+bool FormulaImageRD::IsComputingRates() const
+{
+    return GetButcherTableau(this->integrator).GetNumberOfStages() > 1;
+}
+
+// -------------------------------------------------------------------------
+
+void FormulaImageRD::AllocateBuffersIfNeeded()
+{
+    const int nc = this->GetNumberOfChemicals();
+    int dims[3];
+    this->images.front()->GetDimensions(dims);
+    auto allocate = [&](vector<vtkSmartPointer<vtkImageData>>& buffers, size_t n)
+    {
+        bool ok = buffers.size() == n;
+        for (size_t i = 0; ok && i < n; i++)
+        {
+            const int* buffer_dims = buffers[i]->GetDimensions();
+            ok = buffer_dims[0] == dims[0] && buffer_dims[1] == dims[1] && buffer_dims[2] == dims[2]
+                && buffers[i]->GetScalarType() == this->data_type;
+        }
+        if (ok)
+            return;
+        buffers.resize(n);
+        for (size_t i = 0; i < n; i++)
+            buffers[i] = AllocateVTKImage(dims[0], dims[1], dims[2], this->data_type);
+    };
+    allocate(this->buffer_images, nc);
+    // the multi-stage integrators need the rates of each stage, and the inputs to the next stage
+    const int num_stages = GetButcherTableau(this->integrator).GetNumberOfStages();
+    allocate(this->rate_images, num_stages > 1 ? num_stages * nc : 0);
+    allocate(this->stage_images, num_stages > 2 ? 2 * nc : (num_stages > 1 ? nc : 0));
+}
+
+// -------------------------------------------------------------------------
+
+void FormulaImageRD::InternalUpdate(int n_steps)
+{
+    this->AllocateBuffersIfNeeded();
+
+    const int dimensionality = this->GetArenaDimensionality();
+    if (this->need_reload_formula || dimensionality != this->compiled_dimensionality
+        || this->GetNumberOfChemicals() != this->compiled_num_chemicals || this->data_type != this->compiled_data_type)
+    {
+        this->float_evaluator.reset();
+        this->double_evaluator.reset();
+        this->native_kernel.reset();
+        this->native_function = nullptr;
+        if (this->data_type == VTK_DOUBLE)
+        {
+            unique_ptr<FormulaEvaluator<double>> evaluator = make_unique<FormulaEvaluator<double>>();
+            this->CompileFormula(this->formula, *evaluator);
+            this->double_evaluator = move(evaluator);
+        }
+        else
+        {
+            unique_ptr<FormulaEvaluator<float>> evaluator = make_unique<FormulaEvaluator<float>>();
+            this->CompileFormula(this->formula, *evaluator);
+            this->float_evaluator = move(evaluator);
+        }
+        // the evaluator has checked the formula, so we can try to compile it to native code, which is faster
+        if (NativeKernel::IsEnabled())
+        {
+            try
+            {
+                this->native_kernel = make_unique<NativeKernel>(this->AssembleNativeSource(this->formula),
+                    "FormulaImageRD::InternalUpdate");
+                this->native_function = this->native_kernel->GetFunction("formula_kernel");
+            }
+            catch (const exception&)
+            {
+                // no compiler available, so we fall back on the evaluator
+                this->native_kernel.reset();
+                this->native_function = nullptr;
+            }
+        }
+        this->need_reload_formula = false;
+        this->compiled_dimensionality = dimensionality;
+        this->compiled_num_chemicals = this->GetNumberOfChemicals();
+        this->compiled_data_type = this->data_type;
+    }
+
+    if (this->data_type == VTK_DOUBLE)
+        this->RunFormula(*this->double_evaluator, n_steps);
+    else
+        this->RunFormula(*this->float_evaluator, n_steps);
+}
+
+// -------------------------------------------------------------------------
+
+template<typename T>
+void FormulaImageRD::RunFormula(const FormulaEvaluator<T>& evaluator, int n_steps)
+{
+    const int X = this->GetX();
+    const int Y = this->GetY();
+    const int Z = this->GetZ();
+    const int NC = this->GetNumberOfChemicals();
+    const int B = FormulaEvaluator<T>::BATCH_SIZE;
+    const bool wrap = this->wrap;
+
+    vector<T> uniform_values;
+    for (const Parameter& parameter : this->parameters)
+        uniform_values.push_back(static_cast<T>(parameter.value));
+    uniform_values.push_back(static_cast<T>(X));
+    uniform_values.push_back(static_cast<T>(Y));
+    uniform_values.push_back(static_cast<T>(Z));
+    if (this->needs_dx_uniform)
+        uniform_values.push_back(T(1));
+
+    // skip the inputs that the formula doesn't use
+    vector<FormulaInput> used_inputs;
+    for (const FormulaInput& input : this->inputs)
+        if (evaluator.IsVariableUsed(input.variable))
+            used_inputs.push_back(input);
+
+    auto wrap_or_clamp = [wrap](int i, int n) { return wrap ? ((i % n) + n) % n : min(n - 1, max(0, i)); };
+
+    // divide the grid into tiles and share them out among the threads
+    // (the tiles are whole rows, unless there are fewer rows than threads, e.g. for a 1D grid, when we split the rows too)
+    ThreadPool& thread_pool = ThreadPool::GetInstance();
+    const int num_threads = thread_pool.GetNumberOfThreads();
+    const int TARGET_CELLS_PER_TILE = 16384;
+    const int tile_X = Y * Z < num_threads ? max(1, min((X + num_threads - 1) / num_threads, TARGET_CELLS_PER_TILE)) : X;
+    const int tile_Z = min(Z, 8);
+    const int tile_Y = max(1, min(Y, TARGET_CELLS_PER_TILE / max(1, tile_X * tile_Z)));
+    const int num_tiles_X = (X + tile_X - 1) / tile_X;
+    const int num_tiles_Y = (Y + tile_Y - 1) / tile_Y;
+    const int num_tiles_Z = (Z + tile_Z - 1) / tile_Z;
+
+    typedef void (*NativeFunction)(const T* const* in, T* const* out, const T* parameters, int X, int Y, int Z,
+        int x_start, int x_end, int y_start, int y_end, int z_start, int z_end);
+    const NativeFunction native_function = reinterpret_cast<NativeFunction>(this->native_function);
+
+    // each thread prepares an evaluator workspace the first time it needs one, and uses it for the rest of the update
+    struct ThreadWorkspace
+    {
+        typename FormulaEvaluator<T>::Workspace workspace;
+        vector<T*> input_values;    // the workspace's variable for each used input
+        vector<T*> chemical_values; // the workspace's variable for each chemical
+    };
+    vector<unique_ptr<ThreadWorkspace>> thread_workspaces(native_function ? 0 : thread_pool.GetNumberOfThreads());
+    auto get_thread_workspace = [&]() -> ThreadWorkspace&
+    {
+        unique_ptr<ThreadWorkspace>& thread_workspace = thread_workspaces[ThreadPool::GetThreadIndex()];
+        if (!thread_workspace)
+        {
+            thread_workspace = make_unique<ThreadWorkspace>();
+            evaluator.PrepareWorkspace(thread_workspace->workspace, uniform_values);
+            for (const FormulaInput& input : used_inputs)
+                thread_workspace->input_values.push_back(evaluator.GetVariable(thread_workspace->workspace, input.variable));
+            for (int iChem = 0; iChem < NC; iChem++)
+                thread_workspace->chemical_values.push_back(evaluator.GetVariable(thread_workspace->workspace, this->chemical_variables[iChem]));
+        }
+        return *thread_workspace;
+    };
+
+    // runs the formula once over the whole grid
+    auto run_pass = [&](const vector<const T*>& old_data, const vector<T*>& new_data)
+    {
+        thread_pool.ParallelFor(num_tiles_X * num_tiles_Y * num_tiles_Z, [&](int iTile)
+        {
+            const int x_start = (iTile % num_tiles_X) * tile_X;
+            const int y_start = (iTile / num_tiles_X % num_tiles_Y) * tile_Y;
+            const int z_start = (iTile / num_tiles_X / num_tiles_Y) * tile_Z;
+            const int x_end = min(X, x_start + tile_X);
+            const int y_end = min(Y, y_start + tile_Y);
+            const int z_end = min(Z, z_start + tile_Z);
+            if (native_function)
+            {
+                native_function(old_data.data(), new_data.data(), uniform_values.data(), X, Y, Z,
+                    x_start, x_end, y_start, y_end, z_start, z_end);
+                return;
+            }
+
+            ThreadWorkspace& thread_workspace = get_thread_workspace();
+            typename FormulaEvaluator<T>::Workspace& workspace = thread_workspace.workspace;
+            const vector<T*>& input_values = thread_workspace.input_values;
+            const vector<T*>& chemical_values = thread_workspace.chemical_values;
+            vector<const T*> input_rows(used_inputs.size());
+            for (int z = z_start; z < z_end; z++)
+            {
+                for (int y = y_start; y < y_end; y++)
+                {
+                    const size_t row = size_t(X) * (y + size_t(Y) * z);
+                    // find the neighboring rows once, rather than for every cell
+                    for (size_t i = 0; i < used_inputs.size(); i++)
+                    {
+                        const FormulaInput& input = used_inputs[i];
+                        if (input.type == FormulaInput::Type::Cell)
+                        {
+                            const int yy = wrap_or_clamp(y + input.offset[1], Y);
+                            const int zz = wrap_or_clamp(z + input.offset[2], Z);
+                            input_rows[i] = old_data[input.iChemical] + size_t(X) * (yy + size_t(Y) * zz);
+                        }
+                    }
+                    for (int x_block = x_start; x_block < x_end; x_block += B)
+                    {
+                        const int n = min(B, x_end - x_block);
+                        for (size_t i = 0; i < used_inputs.size(); i++)
+                        {
+                            const FormulaInput& input = used_inputs[i];
+                            T* values = input_values[i];
+                            switch (input.type)
+                            {
+                                case FormulaInput::Type::Cell:
+                                {
+                                    const int x_from = x_block + input.offset[0];
+                                    if (x_from >= 0 && x_from + n <= X)
+                                    {
+                                        copy_n(input_rows[i] + x_from, n, values);
+                                    }
+                                    else
+                                    {
+                                        for (int j = 0; j < n; j++)
+                                            values[j] = input_rows[i][wrap_or_clamp(x_from + j, X)];
+                                    }
+                                    break;
+                                }
+                                case FormulaInput::Type::XPos:
+                                    for (int j = 0; j < n; j++)
+                                        values[j] = T(x_block + j) / T(X);
+                                    break;
+                                case FormulaInput::Type::YPos: fill_n(values, n, T(y) / T(Y)); break;
+                                case FormulaInput::Type::ZPos: fill_n(values, n, T(z) / T(Z)); break;
+                                case FormulaInput::Type::IndexX:
+                                    for (int j = 0; j < n; j++)
+                                        values[j] = T(x_block + j);
+                                    break;
+                                case FormulaInput::Type::IndexY: fill_n(values, n, T(y)); break;
+                                case FormulaInput::Type::IndexZ: fill_n(values, n, T(z)); break;
+                                case FormulaInput::Type::IndexHere:
+                                    for (int j = 0; j < n; j++)
+                                        values[j] = T(row + x_block + j);
+                                    break;
+                            }
+                        }
+                        evaluator.Run(workspace, n);
+                        for (int iChem = 0; iChem < NC; iChem++)
+                            copy_n(chemical_values[iChem], n, new_data[iChem] + row + x_block);
+                    }
+                }
+            }
+        });
+    };
+
+    // the diffusion of some chemicals can be solved implicitly after each step, instead of by the formula
+    const vector<double> diffusion_coefficients = this->GetImplicitDiffusionCoefficients();
+    const bool has_implicit_diffusion = any_of(diffusion_coefficients.begin(), diffusion_coefficients.end(),
+        [](double coefficient) { return coefficient != 0.0; });
+    auto diffuse_implicitly = [&](const vector<vtkSmartPointer<vtkImageData>>& chemical_images, double timestep)
+    {
+        for (int iChem = 0; iChem < NC; iChem++)
+            if (diffusion_coefficients[iChem] != 0.0)
+                this->DiffuseImplicitly(chemical_images[iChem], diffusion_coefficients[iChem], timestep);
+    };
+
+    if (!this->IsComputingRates())
+    {
+        const double timestep = has_implicit_diffusion ? this->GetParameterValueByName("timestep") : 0.0;
+        vector<const T*> old_data(NC);
+        vector<T*> new_data(NC);
+        for (int iStep = 0; iStep < n_steps; iStep++)
+        {
+            for (int iChem = 0; iChem < NC; iChem++)
+            {
+                vtkImageData* from = (iStep % 2) ? this->buffer_images[iChem] : this->images[iChem];
+                vtkImageData* to = (iStep % 2) ? this->images[iChem] : this->buffer_images[iChem];
+                old_data[iChem] = static_cast<const T*>(from->GetScalarPointer());
+                new_data[iChem] = static_cast<T*>(to->GetScalarPointer());
+            }
+            run_pass(old_data, new_data);
+            if (has_implicit_diffusion)
+                diffuse_implicitly(iStep % 2 ? this->images : this->buffer_images, timestep);
+        }
+        if (n_steps % 2)
+        {
+            // output ended up in the buffer images, so make them current
+            for (int iChem = 0; iChem < NC; iChem++)
+                SwapImageData(this->images[iChem], this->buffer_images[iChem]);
+        }
+        return;
+    }
+
+    // for a multi-stage integrator the formula gives the rates at each stage, which we combine here
+    const ButcherTableau& tableau = GetButcherTableau(this->integrator);
+    const int S = tableau.GetNumberOfStages();
+    const int num_stage_sets = static_cast<int>(this->stage_images.size()) / NC;
+    const size_t N = size_t(X) * Y * Z;
+    const int iTimestep = GetTimestepParameterIndex(*this);
+    auto get_data = [](vtkImageData* image) { return static_cast<T*>(image->GetScalarPointer()); };
+    vector<vector<T*>> rates(S, vector<T*>(NC));
+    for (int s = 0; s < S; s++)
+        for (int iChem = 0; iChem < NC; iChem++)
+            rates[s][iChem] = get_data(this->rate_images[s * NC + iChem]);
+    // the non-zero weights for combining the rates after each stage, and for the error
+    vector<vector<pair<int, double>>> stage_weights(S);
+    for (int s = 0; s < S; s++)
+    {
+        const vector<double>& weights = (s == S - 1) ? tableau.b : tableau.a[s + 1];
+        for (int j = 0; j <= s; j++)
+            if (weights[j] != 0.0)
+                stage_weights[s].push_back({ j, weights[j] });
+    }
+    vector<pair<int, double>> error_weights;
+    for (int j = 0; j < static_cast<int>(tableau.error_b.size()); j++)
+        if (tableau.error_b[j] != 0.0)
+            error_weights.push_back({ j, tableau.error_b[j] });
+    const int num_chunks = static_cast<int>((N + TARGET_CELLS_PER_TILE - 1) / TARGET_CELLS_PER_TILE);
+    vector<double> chunk_errors(num_chunks);
+
+    vector<const T*> stage_in(NC);
+    vector<T*> stage_out(NC);
+    double step_timestep = 0.0; // the size of the step that was taken last
+    auto take_step = [&](double timestep)
+    {
+        step_timestep = timestep;
+        uniform_values[iTimestep] = static_cast<T>(timestep);
+        // each workspace holds its own copy of the uniforms, and of what the setup code works out from them, so refresh them
+        // (the workspaces stay the same size, so the pointers into them stay valid)
+        for (unique_ptr<ThreadWorkspace>& thread_workspace : thread_workspaces)
+            if (thread_workspace)
+                evaluator.PrepareWorkspace(thread_workspace->workspace, uniform_values);
+        for (int s = 0; s < S; s++)
+        {
+            const bool last_stage = (s == S - 1);
+            for (int iChem = 0; iChem < NC; iChem++)
+            {
+                stage_in[iChem] = get_data(s == 0 ? this->images[iChem]
+                                                  : this->stage_images[((s - 1) % num_stage_sets) * NC + iChem]);
+                stage_out[iChem] = get_data(last_stage ? this->buffer_images[iChem]
+                                                       : this->stage_images[(s % num_stage_sets) * NC + iChem]);
+            }
+            run_pass(stage_in, rates[s]);
+            // the input for the next stage, or the new values, from the values at the start of the step
+            thread_pool.ParallelFor(num_chunks, [&](int iChunk)
+            {
+                const size_t start = size_t(iChunk) * TARGET_CELLS_PER_TILE;
+                const size_t end = min(N, start + TARGET_CELLS_PER_TILE);
+                double chunk_error = 0.0;
+                for (int iChem = 0; iChem < NC; iChem++)
+                {
+                    const T* base = get_data(this->images[iChem]);
+                    T* out = stage_out[iChem];
+                    for (size_t i = start; i < end; i++)
+                    {
+                        double sum = 0.0;
+                        for (const pair<int, double>& weight : stage_weights[s])
+                            sum += weight.second * rates[weight.first][iChem][i];
+                        out[i] = static_cast<T>(base[i] + timestep * sum);
+                    }
+                    if (last_stage && tableau.IsAdaptive())
+                    {
+                        for (size_t i = start; i < end; i++)
+                        {
+                            double error = 0.0;
+                            for (const pair<int, double>& weight : error_weights)
+                                error += weight.second * rates[weight.first][iChem][i];
+                            const double scaled_error = fabs(timestep * error) / (1.0 + fabs(double(out[i])));
+                            if (scaled_error != scaled_error)
+                                chunk_error = numeric_limits<double>::infinity(); // NaN, so the step is rejected
+                            else
+                                chunk_error = max(chunk_error, scaled_error);
+                        }
+                    }
+                }
+                chunk_errors[iChunk] = chunk_error;
+            });
+        }
+        return *max_element(chunk_errors.begin(), chunk_errors.end());
+    };
+    auto accept = [&]()
+    {
+        for (int iChem = 0; iChem < NC; iChem++)
+            SwapImageData(this->images[iChem], this->buffer_images[iChem]);
+        if (has_implicit_diffusion)
+            diffuse_implicitly(this->images, step_timestep);
+    };
+    const double next_timestep = RunIntegratorSteps(tableau, n_steps, this->parameters[iTimestep].value,
+        this->integrator_tolerance, take_step, accept);
+    if (tableau.IsAdaptive())
+        this->SetParameterValue(iTimestep, static_cast<float>(next_timestep));
+}
+
+// -------------------------------------------------------------------------
+
+void FormulaImageRD::SetParameterName(int iParam,const string& s)
+{
+    AbstractRD::SetParameterName(iParam,s);
+    this->need_reload_formula = true;
+}
+
+// -------------------------------------------------------------------------
+
+void FormulaImageRD::AddParameter(const std::string& name,float val)
+{
+    AbstractRD::AddParameter(name,val);
+    this->need_reload_formula = true;
+}
+
+// -------------------------------------------------------------------------
+
+void FormulaImageRD::DeleteParameter(int iParam)
+{
+    AbstractRD::DeleteParameter(iParam);
+    this->need_reload_formula = true;
+}
+
+// -------------------------------------------------------------------------
+
+void FormulaImageRD::DeleteAllParameters()
+{
+    AbstractRD::DeleteAllParameters();
+    this->need_reload_formula = true;
+}
+
+// -------------------------------------------------------------------------
@@ -0,0 +1,115 @@
+/*  Copyright 2011-2021 The Ready Bunch
+
+    This file is part of Ready.
+
+    Ready is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Ready is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Ready. If not, see <http://www.gnu.org/licenses/>.         */
+
+#ifndef __FORMULAIMAGERD__
+#define __FORMULAIMAGERD__
+
+// local:
+#include "ImageRD.hpp"
+#include "FormulaEvaluator.hpp"
+#include "NativeKernel.hpp"
+
+// STL:
+#include <memory>
+
+/// An RD system that runs a formula snippet on the CPU, for when OpenCL is not available.
+/** Loads and saves the same files as FormulaOpenCLImageRD. The formula is compiled by FormulaEvaluator, using the same
+ *  stencils as the OpenCL version, and the rows of the image are shared out among the threads of the ThreadPool. Where
+ *  NativeKernel is available the formula is also compiled to native code, which is used instead when it succeeds.
+ *  Optionally the diffusion of some chemicals is left out of the formula and solved implicitly after each step. */
+class FormulaImageRD : public ImageRD
+{
+    public:
+
+        FormulaImageRD(int data_type);
+
+        void InitializeFromXML(vtkXMLDataElement* rd,bool& warn_to_update) override;
+        vtkSmartPointer<vtkXMLDataElement> GetAsXML(bool generate_initial_pattern_when_loading) const override;
+
+        std::string GetRuleType() const override { return "formula"; }
+
+        bool HasEditableFormula() const override { return true; }
+        void TestFormula(std::string program_string) override;
+
+        bool HasEditableAccuracyOption() const override { return true; }
+        void SetAccuracy(Accuracy acc) override { this->accuracy = acc; this->need_reload_formula = true; }
+
+        bool HasEditableIntegratorOption() const override { return true; }
+        void SetIntegrator(Integrator integrator) override { this->integrator = integrator; this->need_reload_formula = true; }
+
+        bool HasEditableImplicitDiffusionOption() const override { return true; }
+
+        // we override the parameter access functions because changing the parameters requires recompiling the formula
+        // (changing a parameter value does not, since the values are passed in on each update)
+        void AddParameter(const std::string& name,float val) override;
+        void DeleteParameter(int iParam) override;
+        void DeleteAllParameters() override;
+        void SetParameterName(int iParam,const std::string& s) override;
+
+        bool HasEditableWrapOption() const override { return true; }
+        bool HasEditableDataType() const override { return true; }
+
+    protected:
+
+        void InternalUpdate(int n_steps) override;
+
+    private:
+
+        /// A value that the formula reads for each cell, e.g. "a_nw" or "x_pos".
+        struct FormulaInput
+        {
+            enum class Type { Cell, XPos, YPos, ZPos, IndexX, IndexY, IndexZ, IndexHere } type;
+            int variable;   ///< index in the evaluator
+            int iChemical;  ///< for Type::Cell
+            int offset[3];  ///< for Type::Cell, the position of the neighbor relative to the cell
+        };
+
+        template<typename T>
+        void CompileFormula(const std::string& formula,FormulaEvaluator<T>& evaluator);
+
+        /// Takes n_steps forward-Euler steps, or if the integrator has more than one stage, n_steps of its steps.
+        template<typename T>
+        void RunFormula(const FormulaEvaluator<T>& evaluator,int n_steps);
+
+        /// For multi-stage integrators the formula is compiled to output the rates of change instead of the new values.
+        bool IsComputingRates() const;
+
+        void AllocateBuffersIfNeeded();
+
+        /// Returns C++ source for the formula, with the same inputs as the OpenCL kernel, for NativeKernel to compile.
+        std::string AssembleNativeSource(const std::string& formula) const;
+
+    private:
+
+        std::vector<vtkSmartPointer<vtkImageData>> buffer_images; ///< one for each chemical
+        std::vector<vtkSmartPointer<vtkImageData>> rate_images;   ///< for multi-stage integrators, k[s] for each stage and chemical
+        std::vector<vtkSmartPointer<vtkImageData>> stage_images;  ///< for multi-stage integrators, two sets of stage inputs
+
+        // the compiled formula, for whichever data type we are using
+        std::unique_ptr<FormulaEvaluator<float>> float_evaluator;
+        std::unique_ptr<FormulaEvaluator<double>> double_evaluator;
+        std::vector<FormulaInput> inputs;
+        std::vector<int> chemical_variables;
+        bool needs_dx_uniform;
+        std::unique_ptr<NativeKernel> native_kernel;
+        void* native_function; ///< the formula compiled to native code, or nullptr if we are using the evaluator
+        int compiled_dimensionality,compiled_num_chemicals,compiled_data_type;
+
+        int block_size[3]; ///< not used on the CPU, but kept so that saving doesn't change the file
+};
+
+#endif
@@ -0,0 +1,599 @@
+/*  Copyright 2011-2021 The Ready Bunch
+
+    This file is part of Ready.
+
+    Ready is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Ready is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Ready. If not, see <http://www.gnu.org/licenses/>.         */
+
+// local:
+#include "FormulaMeshRD.hpp"
+#include "Integrators.hpp"
+#include "ThreadPool.hpp"
+#include "utils.hpp"
+
+// STL:
+#include <algorithm>
+#include <cmath>
+#include <limits>
+#include <sstream>
+#include <stdexcept>
+
+// VTK:
+#include <vtkCellData.h>
+#include <vtkDataArray.h>
+#include <vtkUnstructuredGrid.h>
+#include <vtkXMLDataElement.h>
+
+using namespace std;
+
+// -------------------------------------------------------------------------
+
+namespace
+{
+    vtkDataArray* GetChemicalArray(vtkUnstructuredGrid* mesh, const string& name, int data_type)
+    {
+        vtkDataArray* array = mesh->GetCellData()->GetArray(name.c_str());
+        if (!array || array->GetDataType() != data_type)
+            throw runtime_error("FormulaMeshRD::InternalUpdate : missing or mistyped array: " + name);
+        return array;
+    }
+
+    // Puts the array into the mesh in place of the chemical's array, and hands back the one that it replaced.
+    void SwapChemicalArray(vtkUnstructuredGrid* mesh, vtkSmartPointer<vtkDataArray>& array, const string& name)
+    {
+        vtkSmartPointer<vtkDataArray> mesh_array = mesh->GetCellData()->GetArray(name.c_str());
+        array->SetName(name.c_str());
+        // (AddArray replaces the array with the same name, keeping its position)
+        mesh->GetCellData()->AddArray(array);
+        array = mesh_array;
+    }
+}
+
+// -------------------------------------------------------------------------
+
+FormulaMeshRD::FormulaMeshRD(int data_type)
+    : MeshRD(data_type)
+    , index_variable(-1)
+    , native_function(nullptr)
+    , compiled_num_chemicals(0)
+    , compiled_data_type(0)
+{
+    // these settings are used in File > New Pattern
+    this->SetRuleName("Gray-Scott");
+    this->AddParameter("timestep",1.0f);
+    this->AddParameter("D_a",0.082f);
+    this->AddParameter("D_b",0.041f);
+    this->AddParameter("K",0.06f);
+    this->AddParameter("F",0.035f);
+    this->SetFormula("\
+delta_a = D_a * laplacian_a - a*b*b + F*(1.0" + this->data_type_suffix + "-a);\n\
+delta_b = D_b * laplacian_b + a*b*b - (F+K)*b;");
+}
+
+// -------------------------------------------------------------------------
+
+void FormulaMeshRD::InitializeFromXML(vtkXMLDataElement *rd, bool &warn_to_update)
+{
+    MeshRD::InitializeFromXML(rd,warn_to_update);
+
+    vtkSmartPointer<vtkXMLDataElement> rule = rd->FindNestedElementWithName("rule");
+    if(!rule) throw runtime_error("rule node not found in file");
+
+    // formula:
+    vtkSmartPointer<vtkXMLDataElement> xml_formula = rule->FindNestedElementWithName("formula");
+    if(!xml_formula) throw runtime_error("formula node not found in file");
+
+    // number_of_chemicals:
+    read_required_attribute(xml_formula,"number_of_chemicals",this->n_chemicals);
+
+    // integrator:
+    Integrator integrator;
+    ReadIntegratorAttributes(xml_formula, integrator, this->integrator_tolerance);
+    this->SetIntegrator(integrator);
+
+    string formula = trim_multiline_string(xml_formula->GetCharacterData());
+    this->SetFormula(formula); // (won't throw yet)
+}
+
+// -------------------------------------------------------------------------
+
+vtkSmartPointer<vtkXMLDataElement> FormulaMeshRD::GetAsXML(bool generate_initial_pattern_when_loading) const
+{
+    vtkSmartPointer<vtkXMLDataElement> rd = MeshRD::GetAsXML(generate_initial_pattern_when_loading);
+
+    vtkSmartPointer<vtkXMLDataElement> rule = rd->FindNestedElementWithName("rule");
+    if(!rule) throw runtime_error("rule node not found");
+
+    // formula
+    vtkSmartPointer<vtkXMLDataElement> formula = vtkSmartPointer<vtkXMLDataElement>::New();
+    formula->SetName("formula");
+    formula->SetIntAttribute("number_of_chemicals",this->GetNumberOfChemicals());
+    WriteIntegratorAttributes(formula, this->integrator, this->integrator_tolerance);
+    string f = this->GetFormula();
+    f = ReplaceAllSubstrings(f, "\n", "\n        "); // indent the lines
+    formula->SetCharacterData(f.c_str(), (int)f.length());
+    rule->AddNestedElement(formula);
+
+    return rd;
+}
+
+// -------------------------------------------------------------------------
+
+void FormulaMeshRD::TestFormula(std::string program_string)
+{
+    // compile into a spare evaluator, so that the current one is left alone
+    const vector<int> old_chemical_variables = this->chemical_variables;
+    const vector<int> old_laplacian_variables = this->laplacian_variables;
+    const int old_index_variable = this->index_variable;
+    try
+    {
+        if (this->data_type == VTK_DOUBLE)
+        {
+            FormulaEvaluator<double> evaluator;
+            this->CompileFormula(program_string, evaluator);
+        }
+        else
+        {
+            FormulaEvaluator<float> evaluator;
+            this->CompileFormula(program_string, evaluator);
+        }
+    }
+    catch (...)
+    {
+        this->chemical_variables = old_chemical_variables;
+        this->laplacian_variables = old_laplacian_variables;
+        this->index_variable = old_index_variable;
+        throw;
+    }
+    this->chemical_variables = old_chemical_variables;
+    this->laplacian_variables = old_laplacian_variables;
+    this->index_variable = old_index_variable;
+}
+
+// -------------------------------------------------------------------------
+
+template<typename T>
+void FormulaMeshRD::CompileFormula(const string& formula, FormulaEvaluator<T>& evaluator)
+{
+    const int NC = this->GetNumberOfChemicals();
+    this->chemical_variables.clear();
+    this->laplacian_variables.clear();
+
+    // the chemicals themselves, which the formula is allowed to change
+    for (int iChem = 0; iChem < NC; iChem++)
+        this->chemical_variables.push_back(evaluator.AddVariable(GetChemicalName(iChem), false));
+    // the Laplacians, which RunFormula works out from the neighbor lists, as the OpenCL kernel does
+    for (int iChem = 0; iChem < NC; iChem++)
+        this->laplacian_variables.push_back(evaluator.AddVariable("laplacian_" + GetChemicalName(iChem), true));
+    this->index_variable = evaluator.AddVariable("index_x", true, true);
+
+    // the values that are the same for every cell, in the order that RunFormula supplies them
+    for (const Parameter& parameter : this->parameters)
+        evaluator.AddUniform(parameter.name);
+
+    ostringstream prologue;
+    for (int iChem = 0; iChem < NC; iChem++)
+        prologue << "float delta_" << GetChemicalName(iChem) << " = 0.0f;\n";
+
+    // the forward-Euler update step, or just the rates if the integrator combines them itself
+    ostringstream epilogue;
+    for (int iChem = 0; iChem < NC; iChem++)
+    {
+        const string chem = GetChemicalName(iChem);
+        if (this->IsComputingRates())
+            epilogue << chem << " = delta_" << chem << ";\n";
+        else
+            epilogue << chem << " = " << chem << " + timestep * delta_" << chem << ";\n";
+    }
+
+    evaluator.Compile(prologue.str(), formula, epilogue.str());
+}
+
+// -------------------------------------------------------------------------
+
+string FormulaMeshRD::AssembleNativeSource(const string& formula) const
+{
+    const int NC = this->GetNumberOfChemicals();
+    const string real_type = (this->data_type == VTK_DOUBLE) ? "double" : "float";
+
+    const string amended_formula = NativeKernel::AdaptFormula(formula, this->data_type == VTK_DOUBLE);
+
+    ostringstream source;
+    source << "typedef " << real_type << " real;\n" << NativeKernel::GetFormulaPrelude() << "\n";
+    // if neighbor_offsets is null then each cell has max_neighbors entries (see MeshRD::NeighborStorage)
+    source << "extern \"C\" void formula_kernel(const real* const* in, real* const* out, const real* parameters,"
+        " const int* neighbor_indices, const float* neighbor_weights, const int* neighbor_offsets, int max_neighbors,"
+        " int first_cell, int last_cell)\n{\n";
+    for (size_t iParam = 0; iParam < this->parameters.size(); iParam++)
+        source << "    const real " << this->parameters[iParam].name << " = parameters[" << iParam << "];\n";
+    source << "    for (int index_x = first_cell; index_x < last_cell; index_x++)\n    {\n";
+    const string indent = "        ";
+    for (int iChem = 0; iChem < NC; iChem++)
+        source << indent << "real " << GetChemicalName(iChem) << " = in[" << iChem << "][index_x];\n";
+
+    // the Laplacians, as in the OpenCL kernel
+    for (int iChem = 0; iChem < NC; iChem++)
+        source << indent << "real laplacian_" << GetChemicalName(iChem) << " = -" << GetChemicalName(iChem) << ";\n";
+    source << indent << "const int first_neighbor = neighbor_offsets ? neighbor_offsets[index_x] : index_x * max_neighbors;\n";
+    source << indent << "const int last_neighbor = neighbor_offsets ? neighbor_offsets[index_x + 1] : first_neighbor + max_neighbors;\n";
+    source << indent << "for (int k = first_neighbor; k < last_neighbor; k++)\n" << indent << "{\n";
+    for (int iChem = 0; iChem < NC; iChem++)
+        source << indent << "    laplacian_" << GetChemicalName(iChem) << " += in[" << iChem
+            << "][neighbor_indices[k]] * neighbor_weights[k];\n";
+    source << indent << "}\n";
+    for (int iChem = 0; iChem < NC; iChem++)
+        source << indent << "laplacian_" << GetChemicalName(iChem) << " *= real(4);\n";
+    for (int iChem = 0; iChem < NC; iChem++)
+        source << indent << "real delta_" << GetChemicalName(iChem) << " = 0;\n";
+
+    // the formula
+    source << "\n" << indent << ReplaceAllSubstrings(amended_formula, "\n", "\n" + indent) << "\n\n";
+
+    // the forward-Euler update step, or just the rates if the integrator combines them itself
+    for (int iChem = 0; iChem < NC; iChem++)
+    {
+        const string chem = GetChemicalName(iChem);
+        if (this->IsComputingRates())
+            source << indent << "out[" << iChem << "][index_x] = delta_" << chem << ";\n";
+        else
+            source << indent << "out[" << iChem << "][index_x] = " << chem << " + timestep * delta_" << chem << ";\n";
+    }
+    source << "    }\n}\n";
+    return source.str();
+}
+
+// -------------------------------------------------------------------------
+
+bool FormulaMeshRD::IsComputingRates() const
+{
+    return GetButcherTableau(this->integrator).GetNumberOfStages() > 1;
+}
+
+// -------------------------------------------------------------------------
+
+void FormulaMeshRD::AllocateBuffersIfNeeded()
+{
+    const int nc = this->GetNumberOfChemicals();
+    const vtkIdType N = this->mesh->GetNumberOfCells();
+    auto allocate = [&](vector<vtkSmartPointer<vtkDataArray>>& buffers, size_t n)
+    {
+        bool ok = buffers.size() == n;
+        for (size_t i = 0; ok && i < n; i++)
+            ok = buffers[i]->GetNumberOfTuples() == N && buffers[i]->GetDataType() == this->data_type;
+        if (ok)
+            return;
+        buffers.resize(n);
+        for (size_t i = 0; i < n; i++)
+        {
+            buffers[i] = vtkSmartPointer<vtkDataArray>::Take(vtkDataArray::CreateDataArray(this->data_type));
+            buffers[i]->SetNumberOfComponents(1);
+            buffers[i]->SetNumberOfTuples(N);
+        }
+    };
+    allocate(this->buffer_arrays, nc);
+    // the multi-stage integrators need the rates of each stage, and the inputs to the next stage
+    const int num_stages = GetButcherTableau(this->integrator).GetNumberOfStages();
+    allocate(this->rate_arrays, num_stages > 1 ? num_stages * nc : 0);
+    allocate(this->stage_arrays, num_stages > 2 ? 2 * nc : (num_stages > 1 ? nc : 0));
+}
+
+// -------------------------------------------------------------------------
+
+void FormulaMeshRD::InternalUpdate(int n_steps)
+{
+    if (this->mesh->GetNumberOfCells() == 0)
+        return;
+    this->AllocateBuffersIfNeeded();
+
+    if (this->need_reload_formula || this->GetNumberOfChemicals() != this->compiled_num_chemicals
+        || this->data_type != this->compiled_data_type)
+    {
+        this->float_evaluator.reset();
+        this->double_evaluator.reset();
+        this->native_kernel.reset();
+        this->native_function = nullptr;
+        if (this->data_type == VTK_DOUBLE)
+        {
+            unique_ptr<FormulaEvaluator<double>> evaluator = make_unique<FormulaEvaluator<double>>();
+            this->CompileFormula(this->formula, *evaluator);
+            this->double_evaluator = move(evaluator);
+        }
+        else
+        {
+            unique_ptr<FormulaEvaluator<float>> evaluator = make_unique<FormulaEvaluator<float>>();
+            this->CompileFormula(this->formula, *evaluator);
+            this->float_evaluator = move(evaluator);
+        }
+        // the evaluator has checked the formula, so we can try to compile it to native code, which is faster
+        if (NativeKernel::IsEnabled())
+        {
+            try
+            {
+                this->native_kernel = make_unique<NativeKernel>(this->AssembleNativeSource(this->formula),
+                    "FormulaMeshRD::InternalUpdate");
+                this->native_function = this->native_kernel->GetFunction("formula_kernel");
+            }
+            catch (const exception&)
+            {
+                // no compiler available, so we fall back on the evaluator
+                this->native_kernel.reset();
+                this->native_function = nullptr;
+            }
+        }
+        this->need_reload_formula = false;
+        this->compiled_num_chemicals = this->GetNumberOfChemicals();
+        this->compiled_data_type = this->data_type;
+    }
+
+    if (this->data_type == VTK_DOUBLE)
+        this->RunFormula(*this->double_evaluator, n_steps);
+    else
+        this->RunFormula(*this->float_evaluator, n_steps);
+}
+
+// -------------------------------------------------------------------------
+
+template<typename T>
+void FormulaMeshRD::RunFormula(const FormulaEvaluator<T>& evaluator, int n_steps)
+{
+    const size_t N = this->mesh->GetNumberOfCells();
+    const int NC = this->GetNumberOfChemicals();
+    const int B = FormulaEvaluator<T>::BATCH_SIZE;
+
+    vector<T> uniform_values;
+    for (const Parameter& parameter : this->parameters)
+        uniform_values.push_back(static_cast<T>(parameter.value));
+
+    // the neighbor lists, in whichever storage MeshRD chose
+    const int* neighbor_indices = this->cell_neighbor_indices.data();
+    const float* neighbor_weights = this->cell_neighbor_weights.data();
+    const int* neighbor_offsets = this->padded_neighbors ? nullptr : this->cell_neighbor_offsets.data();
+    const int max_neighbors = this->max_neighbors;
+
+    // share the cells out among the threads, in chunks small enough to stay in cache
+    ThreadPool& thread_pool = ThreadPool::GetInstance();
+    const size_t CELLS_PER_CHUNK = 16384;
+    const int num_chunks = static_cast<int>((N + CELLS_PER_CHUNK - 1) / CELLS_PER_CHUNK);
+
+    typedef void (*NativeFunction)(const T* const* in, T* const* out, const T* parameters, const int* neighbor_indices,
+        const float* neighbor_weights, const int* neighbor_offsets, int max_neighbors, int first_cell, int last_cell);
+    const NativeFunction native_function = reinterpret_cast<NativeFunction>(this->native_function);
+
+    // each thread prepares an evaluator workspace the first time it needs one, and uses it for the rest of the update
+    struct ThreadWorkspace
+    {
+        typename FormulaEvaluator<T>::Workspace workspace;
+        vector<T*> chemical_values;  // the workspace's variable for each chemical
+        vector<T*> laplacian_values; // the workspace's variable for each Laplacian, or nullptr if the formula doesn't use it
+        T* index_values;             // or nullptr if the formula doesn't use index_x
+    };
+    vector<unique_ptr<ThreadWorkspace>> thread_workspaces(native_function ? 0 : thread_pool.GetNumberOfThreads());
+    auto get_thread_workspace = [&]() -> ThreadWorkspace&
+    {
+        unique_ptr<ThreadWorkspace>& thread_workspace = thread_workspaces[ThreadPool::GetThreadIndex()];
+        if (!thread_workspace)
+        {
+            thread_workspace = make_unique<ThreadWorkspace>();
+            typename FormulaEvaluator<T>::Workspace& workspace = thread_workspace->workspace;
+            evaluator.PrepareWorkspace(workspace, uniform_values);
+            for (int iChem = 0; iChem < NC; iChem++)
+            {
+                thread_workspace->chemical_values.push_back(evaluator.GetVariable(workspace, this->chemical_variables[iChem]));
+                const int laplacian_variable = this->laplacian_variables[iChem];
+                thread_workspace->laplacian_values.push_back(evaluator.IsVariableUsed(laplacian_variable)
+                    ? evaluator.GetVariable(workspace, laplacian_variable) : nullptr);
+            }
+            thread_workspace->index_values = evaluator.IsVariableUsed(this->index_variable)
+                ? evaluator.GetVariable(workspace, this->index_variable) : nullptr;
+        }
+        return *thread_workspace;
+    };
+
+    // runs the formula once over the whole mesh
+    auto run_pass = [&](const vector<const T*>& old_data, const vector<T*>& new_data)
+    {
+        thread_pool.ParallelFor(num_chunks, [&](int iChunk)
+        {
+            const size_t first_cell = iChunk * CELLS_PER_CHUNK;
+            const size_t last_cell = min(N, first_cell + CELLS_PER_CHUNK);
+            if (native_function)
+            {
+                native_function(old_data.data(), new_data.data(), uniform_values.data(), neighbor_indices,
+                    neighbor_weights, neighbor_offsets, max_neighbors, static_cast<int>(first_cell), static_cast<int>(last_cell));
+                return;
+            }
+
+            ThreadWorkspace& thread_workspace = get_thread_workspace();
+            for (size_t first_in_batch = first_cell; first_in_batch < last_cell; first_in_batch += B)
+            {
+                const int n = static_cast<int>(min<size_t>(B, last_cell - first_in_batch));
+                for (int iChem = 0; iChem < NC; iChem++)
+                {
+                    const T* in = old_data[iChem];
+                    copy_n(in + first_in_batch, n, thread_workspace.chemical_values[iChem]);
+                    T* laplacians = thread_workspace.laplacian_values[iChem];
+                    if (!laplacians)
+                        continue;
+                    for (int j = 0; j < n; j++)
+                    {
+                        const size_t cell = first_in_batch + j;
+                        const size_t first_neighbor = neighbor_offsets ? neighbor_offsets[cell] : cell * max_neighbors;
+                        const size_t last_neighbor = neighbor_offsets ? neighbor_offsets[cell + 1] : first_neighbor + max_neighbors;
+                        T laplacian = -in[cell];
+                        for (size_t k = first_neighbor; k < last_neighbor; k++)
+                            laplacian += in[neighbor_indices[k]] * neighbor_weights[k];
+                        laplacians[j] = laplacian * T(4);
+                    }
+                }
+                if (thread_workspace.index_values)
+                    for (int j = 0; j < n; j++)
+                        thread_workspace.index_values[j] = T(first_in_batch + j);
+                evaluator.Run(thread_workspace.workspace, n);
+                for (int iChem = 0; iChem < NC; iChem++)
+                    copy_n(thread_workspace.chemical_values[iChem], n, new_data[iChem] + first_in_batch);
+            }
+        });
+    };
+
+    auto get_data = [](vtkDataArray* array) { return static_cast<T*>(array->GetVoidPointer(0)); };
+    auto get_chemical_data = [&](int iChem)
+    {
+        return get_data(GetChemicalArray(this->mesh, GetChemicalName(iChem), this->data_type));
+    };
+    auto swap_with_buffers = [&]()
+    {
+        for (int iChem = 0; iChem < NC; iChem++)
+            SwapChemicalArray(this->mesh, this->buffer_arrays[iChem], GetChemicalName(iChem));
+    };
+
+    if (!this->IsComputingRates())
+    {
+        vector<T*> mesh_data(NC), buffer_data(NC);
+        for (int iChem = 0; iChem < NC; iChem++)
+        {
+            mesh_data[iChem] = get_chemical_data(iChem);
+            buffer_data[iChem] = get_data(this->buffer_arrays[iChem]);
+        }
+        vector<const T*> old_data(NC);
+        for (int iStep = 0; iStep < n_steps; iStep++)
+        {
+            for (int iChem = 0; iChem < NC; iChem++)
+                old_data[iChem] = (iStep % 2) ? buffer_data[iChem] : mesh_data[iChem];
+            run_pass(old_data, (iStep % 2) ? mesh_data : buffer_data);
+        }
+        if (n_steps % 2)
+            swap_with_buffers(); // output ended up in the buffers, so make them current
+        return;
+    }
+
+    // for a multi-stage integrator the formula gives the rates at each stage, which we combine here
+    const ButcherTableau& tableau = GetButcherTableau(this->integrator);
+    const int S = tableau.GetNumberOfStages();
+    const int num_stage_sets = static_cast<int>(this->stage_arrays.size()) / NC;
+    const int iTimestep = GetTimestepParameterIndex(*this);
+    vector<vector<T*>> rates(S, vector<T*>(NC));
+    for (int s = 0; s < S; s++)
+        for (int iChem = 0; iChem < NC; iChem++)
+            rates[s][iChem] = get_data(this->rate_arrays[s * NC + iChem]);
+    // the non-zero weights for combining the rates after each stage, and for the error
+    vector<vector<pair<int, double>>> stage_weights(S);
+    for (int s = 0; s < S; s++)
+    {
+        const vector<double>& weights = (s == S - 1) ? tableau.b : tableau.a[s + 1];
+        for (int j = 0; j <= s; j++)
+            if (weights[j] != 0.0)
+                stage_weights[s].push_back({ j, weights[j] });
+    }
+    vector<pair<int, double>> error_weights;
+    for (int j = 0; j < static_cast<int>(tableau.error_b.size()); j++)
+        if (tableau.error_b[j] != 0.0)
+            error_weights.push_back({ j, tableau.error_b[j] });
+    vector<double> chunk_errors(num_chunks);
+
+    vector<const T*> base(NC), stage_in(NC);
+    vector<T*> stage_out(NC);
+    auto take_step = [&](double timestep)
+    {
+        uniform_values[iTimestep] = static_cast<T>(timestep);
+        // each workspace holds its own copy of the uniforms, and of what the setup code works out from them, so refresh them
+        // (the workspaces stay the same size, so the pointers into them stay valid)
+        for (unique_ptr<ThreadWorkspace>& thread_workspace : thread_workspaces)
+            if (thread_workspace)
+                evaluator.PrepareWorkspace(thread_workspace->workspace, uniform_values);
+        for (int iChem = 0; iChem < NC; iChem++)
+            base[iChem] = get_chemical_data(iChem);
+        for (int s = 0; s < S; s++)
+        {
+            const bool last_stage = (s == S - 1);
+            for (int iChem = 0; iChem < NC; iChem++)
+            {
+                stage_in[iChem] = (s == 0) ? base[iChem] : get_data(this->stage_arrays[((s - 1) % num_stage_sets) * NC + iChem]);
+                stage_out[iChem] = get_data(last_stage ? this->buffer_arrays[iChem]
+                                                       : this->stage_arrays[(s % num_stage_sets) * NC + iChem]);
+            }
+            run_pass(stage_in, rates[s]);
+            // the input for the next stage, or the new values, from the values at the start of the step
+            thread_pool.ParallelFor(num_chunks, [&](int iChunk)
+            {
+                const size_t start = iChunk * CELLS_PER_CHUNK;
+                const size_t end = min(N, start + CELLS_PER_CHUNK);
+                double chunk_error = 0.0;
+                for (int iChem = 0; iChem < NC; iChem++)
+                {
+                    T* out = stage_out[iChem];
+                    for (size_t i = start; i < end; i++)
+                    {
+                        double sum = 0.0;
+                        for (const pair<int, double>& weight : stage_weights[s])
+                            sum += weight.second * rates[weight.first][iChem][i];
+                        out[i] = static_cast<T>(base[iChem][i] + timestep * sum);
+                    }
+                    if (last_stage && tableau.IsAdaptive())
+                    {
+                        for (size_t i = start; i < end; i++)
+                        {
+                            double error = 0.0;
+                            for (const pair<int, double>& weight : error_weights)
+                                error += weight.second * rates[weight.first][iChem][i];
+                            const double scaled_error = fabs(timestep * error) / (1.0 + fabs(double(out[i])));
+                            if (scaled_error != scaled_error)
+                                chunk_error = numeric_limits<double>::infinity(); // NaN, so the step is rejected
+                            else
+                                chunk_error = max(chunk_error, scaled_error);
+                        }
+                    }
+                }
+                chunk_errors[iChunk] = chunk_error;
+            });
+        }
+        return *max_element(chunk_errors.begin(), chunk_errors.end());
+    };
+    const double next_timestep = RunIntegratorSteps(tableau, n_steps, this->parameters[iTimestep].value,
+        this->integrator_tolerance, take_step, swap_with_buffers);
+    if (tableau.IsAdaptive())
+        this->SetParameterValue(iTimestep, static_cast<float>(next_timestep));
+}
+
+// -------------------------------------------------------------------------
+
+void FormulaMeshRD::SetParameterName(int iParam,const string& s)
+{
+    AbstractRD::SetParameterName(iParam,s);
+    this->need_reload_formula = true;
+}
+
+// -------------------------------------------------------------------------
+
+void FormulaMeshRD::AddParameter(const std::string& name,float val)
+{
+    AbstractRD::AddParameter(name,val);
+    this->need_reload_formula = true;
+}
+
+// -------------------------------------------------------------------------
+
+void FormulaMeshRD::DeleteParameter(int iParam)
+{
+    AbstractRD::DeleteParameter(iParam);
+    this->need_reload_formula = true;
+}
+
+// -------------------------------------------------------------------------
+
+void FormulaMeshRD::DeleteAllParameters()
+{
+    AbstractRD::DeleteAllParameters();
+    this->need_reload_formula = true;
+}
+
+// -------------------------------------------------------------------------
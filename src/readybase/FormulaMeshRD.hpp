@@ -0,0 +1,100 @@
+/*  Copyright 2011-2021 The Ready Bunch
+
+    This file is part of Ready.
+
+    Ready is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Ready is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Ready. If not, see <http://www.gnu.org/licenses/>.         */
+
+#ifndef __FORMULAMESHRD__
+#define __FORMULAMESHRD__
+
+// local:
+#include "MeshRD.hpp"
+#include "FormulaEvaluator.hpp"
+#include "NativeKernel.hpp"
+
+// STL:
+#include <memory>
+
+// VTK:
+class vtkDataArray;
+
+/// A mesh RD system that runs a formula snippet on the CPU, for when OpenCL is not available.
+/** Loads and saves the same files as FormulaOpenCLMeshRD. The formula is compiled by FormulaEvaluator, with the
+ *  Laplacians worked out beforehand from the neighbor lists, and the cells are shared out among the threads of the
+ *  ThreadPool. Where NativeKernel is available the formula is also compiled to native code, which is used instead when
+ *  it succeeds. */
+class FormulaMeshRD : public MeshRD
+{
+    public:
+
+        FormulaMeshRD(int data_type);
+
+        void InitializeFromXML(vtkXMLDataElement* rd,bool& warn_to_update) override;
+        vtkSmartPointer<vtkXMLDataElement> GetAsXML(bool generate_initial_pattern_when_loading) const override;
+
+        std::string GetRuleType() const override { return "formula"; }
+
+        void TestFormula(std::string program_string) override;
+
+        bool HasEditableIntegratorOption() const override { return true; }
+        void SetIntegrator(Integrator integrator) override { this->integrator = integrator; this->need_reload_formula = true; }
+
+        // we override the parameter access functions because changing the parameters requires recompiling the formula
+        // (changing a parameter value does not, since the values are passed in on each update)
+        void AddParameter(const std::string& name,float val) override;
+        void DeleteParameter(int iParam) override;
+        void DeleteAllParameters() override;
+        void SetParameterName(int iParam,const std::string& s) override;
+
+        bool HasEditableDataType() const override { return true; }
+
+    protected:
+
+        void InternalUpdate(int n_steps) override;
+
+    private:
+
+        template<typename T>
+        void CompileFormula(const std::string& formula,FormulaEvaluator<T>& evaluator);
+
+        /// Takes n_steps forward-Euler steps, or if the integrator has more than one stage, n_steps of its steps.
+        template<typename T>
+        void RunFormula(const FormulaEvaluator<T>& evaluator,int n_steps);
+
+        /// For multi-stage integrators the formula is compiled to output the rates of change instead of the new values.
+        bool IsComputingRates() const;
+
+        void AllocateBuffersIfNeeded();
+
+        /// Returns C++ source for the formula, with the same inputs as the OpenCL kernel, for NativeKernel to compile.
+        std::string AssembleNativeSource(const std::string& formula) const;
+
+    private:
+
+        std::vector<vtkSmartPointer<vtkDataArray>> buffer_arrays; ///< one for each chemical
+        std::vector<vtkSmartPointer<vtkDataArray>> rate_arrays;   ///< for multi-stage integrators, k[s] for each stage and chemical
+        std::vector<vtkSmartPointer<vtkDataArray>> stage_arrays;  ///< for multi-stage integrators, two sets of stage inputs
+
+        // the compiled formula, for whichever data type we are using
+        std::unique_ptr<FormulaEvaluator<float>> float_evaluator;
+        std::unique_ptr<FormulaEvaluator<double>> double_evaluator;
+        std::vector<int> chemical_variables;
+        std::vector<int> laplacian_variables;
+        int index_variable;
+        std::unique_ptr<NativeKernel> native_kernel;
+        void* native_function; ///< the formula compiled to native code, or nullptr if we are using the evaluator
+        int compiled_num_chemicals,compiled_data_type;
+};
+
+#endif
@@ -17,17 +17,20 @@
 
 // local:
 #include "FormulaOpenCLImageRD.hpp"
+#include "Integrators.hpp"
 #include "stencils.hpp"
 #include "utils.hpp"
 
 // STL:
 #include <algorithm>
 #include <cmath>
+#include <iomanip>
 #include <set>
 #include <sstream>
 #include <string>
 
 // VTK:
+#include <vtkMath.h>
 #include <vtkXMLUtilities.h>
 
 using namespace std;
@@ -52,123 +55,11 @@ delta_b = D_b * laplacian_b + a*b*b - (F+K)*b;");
 
 // -------------------------------------------------------------------------
 
-struct InputsNeeded {
-    vector<string> chemicals_needed;
-    vector<AppliedStencil> stencils_needed;
-    set<InputPoint> cells_needed;
-    map<string, int> gradient_mag_squared;
-    bool using_x_pos;
-    bool using_y_pos;
-    bool using_z_pos;
-    vector<string> deltas_needed;
-    vector<string> local_memory_needed;
-    int stencil_radii[3];
-};
-
-// -------------------------------------------------------------------------
-
-InputsNeeded DetectInputsNeeded(const string& formula, int num_chemicals, int dimensionality, const int block_size[3],
-                                const AbstractRD::Accuracy& accuracy)
-{
-    InputsNeeded inputs_needed;
-
-    const vector<string> formula_tokens = tokenize_for_keywords(formula);
-    const vector<Stencil> known_stencils = GetKnownStencils(dimensionality, accuracy);
-    for (int i = 0; i < num_chemicals; i++)
-    {
-        const string chem = GetChemicalName(i);
-        inputs_needed.chemicals_needed.push_back(chem);
-        // assume we will need the central cell
-        inputs_needed.cells_needed.insert({ { { 0, 0, 0 } }, chem });
-        // assume we need delta_<chem> for the forward Euler step
-        inputs_needed.deltas_needed.push_back(chem);
-        // assume we need local memory for every chemical
-        inputs_needed.local_memory_needed.push_back(chem);
-        // search for keywords that make use of stencils
-        set<string> dependent_stencils;
-        if (UsingKeyword(formula_tokens, "gradient_mag_squared_" + chem))
-        {
-            inputs_needed.gradient_mag_squared[chem] = dimensionality;
-            switch (dimensionality)
-            {
-            default:
-            case 3:
-                dependent_stencils.insert("z_gradient_" + chem);
-            case 2:
-                dependent_stencils.insert("y_gradient_" + chem);
-            case 1:
-                dependent_stencils.insert("x_gradient_" + chem); // (N.B. no breaks)
-            }
-        }
-        // search for keywords that are stencils
-        for (const Stencil& stencil : known_stencils)
-        {
-            const string keyword = stencil.label + "_" + chem;
-            if (UsingKeyword(formula_tokens, keyword) || dependent_stencils.find(keyword) != dependent_stencils.end())
-            {
-                const AppliedStencil applied_stencil{ stencil, chem };
-                inputs_needed.stencils_needed.push_back(applied_stencil);
-                // add the cell inputs needed for this stencil
-                const set<InputPoint> input_points = applied_stencil.GetInputPoints();
-                inputs_needed.cells_needed.insert(input_points.begin(), input_points.end());
-            }
-        }
-        // search for direct access to neighbors, e.g. "a_nw"
-        const int MAX_RADIUS = 10; // surely if the user wants something this big they should use a kernel?
-        for (int x = -MAX_RADIUS; x <= MAX_RADIUS; x++)
-        {
-            for (int y = -MAX_RADIUS; y <= MAX_RADIUS; y++)
-            {
-                for (int z = -MAX_RADIUS; z <= MAX_RADIUS; z++)
-                {
-                    const InputPoint input_point{ { {x, y, z} }, chem };
-                    if (UsingKeyword(formula_tokens, input_point.GetName()))
-                    {
-                        inputs_needed.cells_needed.insert(input_point);
-                    }
-                }
-            }
-        }
-    }
-    if (block_size[0] == 4)
-    {
-        // non-block-aligned inputs need other inputs: the two blocks that supply them
-        vector<InputPoint> blocks_needed;
-        for (const InputPoint& input_point : inputs_needed.cells_needed)
-        {
-            if (input_point.point.x % 4 != 0)
-            {
-                const pair<InputPoint, InputPoint> blocks = input_point.GetAlignedBlocks_Block411();
-                blocks_needed.push_back(blocks.first);
-                blocks_needed.push_back(blocks.second);
-            }
-        }
-        inputs_needed.cells_needed.insert(blocks_needed.begin(), blocks_needed.end());
-    }
-    // detect if using x_pos, y_pos or z_pos
-    inputs_needed.using_x_pos = UsingKeyword(formula_tokens, "x_pos");
-    inputs_needed.using_y_pos = UsingKeyword(formula_tokens, "y_pos");
-    inputs_needed.using_z_pos = UsingKeyword(formula_tokens, "z_pos");
-    // compute the overall stencil radius in each direction
-    inputs_needed.stencil_radii[0] = 0;
-    inputs_needed.stencil_radii[1] = 0;
-    inputs_needed.stencil_radii[2] = 0;
-    for (const InputPoint& input_point : inputs_needed.cells_needed)
-    {
-        inputs_needed.stencil_radii[0] = max(inputs_needed.stencil_radii[0], abs(input_point.point.x) / block_size[0]);
-        inputs_needed.stencil_radii[1] = max(inputs_needed.stencil_radii[1], abs(input_point.point.y) / block_size[1]);
-        inputs_needed.stencil_radii[2] = max(inputs_needed.stencil_radii[2], abs(input_point.point.z) / block_size[2]);
-    }
-
-    return inputs_needed;
-}
-
-// -------------------------------------------------------------------------
-
 struct KernelOptions {
     KernelOptions(bool wrap, const string& indent, int data_type, const string& data_type_string,
                   const string& data_type_suffix, const int block_size[3],
-                  bool use_local_memory, const size_t local_work_size[3])
+                  bool use_local_memory, const size_t local_work_size[3], bool parameters_as_arguments,
+                  const ButcherTableau* tableau)
         : wrap(wrap)
         , indent(indent)
         , data_type(data_type)
@@ -177,6 +68,8 @@ struct KernelOptions {
         , block_size{ block_size[0], block_size[1], block_size[2] }
         , use_local_memory(use_local_memory)
         , local_work_size{ local_work_size[0], local_work_size[1], local_work_size[2] }
+        , parameters_as_arguments(parameters_as_arguments)
+        , tableau(tableau)
     {}
     bool wrap;
     string indent;
@@ -186,11 +79,32 @@ struct KernelOptions {
     const int block_size[3];
     bool use_local_memory;
     const size_t local_work_size[3];
+    bool parameters_as_arguments;
+    const ButcherTableau* tableau; ///< for multi-stage integrators (whose arguments come after the parameters), else nullptr
+    // for running an ensemble (see FormulaOpenCLImageRD::SetEnsemble):
+    int ensemble_size = 1;
+    int member_z = 1; ///< the size in z of each member, in blocks
+    vector<string> ensemble_parameter_names;
+    vector<vector<float>> ensemble_values;
 };
 
 // -------------------------------------------------------------------------
 
-void WriteHeader(ostringstream& kernel_source, const InputsNeeded& inputs_needed, const KernelOptions& options)
+/// Returns the index of the parameter in the ensemble's parameters, or -1 if it has the same value in every member.
+int GetEnsembleParameterIndex(const string& name, const KernelOptions& options)
+{
+    if (options.ensemble_size < 2)
+    {
+        return -1;
+    }
+    auto it = find(options.ensemble_parameter_names.begin(), options.ensemble_parameter_names.end(), name);
+    return it == options.ensemble_parameter_names.end() ? -1 : static_cast<int>(it - options.ensemble_parameter_names.begin());
+}
+
+// -------------------------------------------------------------------------
+
+void WriteHeader(ostringstream& kernel_source, const vector<AbstractRD::Parameter>& parameters,
+                 const InputsNeeded& inputs_needed, const KernelOptions& options)
 {
     if (options.data_type == VTK_DOUBLE)
     {
@@ -214,6 +128,27 @@ void WriteHeader(ostringstream& kernel_source, const InputsNeeded& inputs_needed
         kernel_source << "#define YR " << inputs_needed.stencil_radii[1] << "\n";
         kernel_source << "#define ZR " << inputs_needed.stencil_radii[2] << "\n\n";
     }
+    if (options.ensemble_size > 1)
+    {
+        // the parameters that differ between the members of the ensemble are looked up in these tables
+        const string scalar_type_string = (options.data_type == VTK_DOUBLE) ? "double" : "float";
+        kernel_source << "// the values of each member of the ensemble:\n";
+        for (const AbstractRD::Parameter& parameter : parameters)
+        {
+            const int j = GetEnsembleParameterIndex(parameter.name, options);
+            if (j < 0)
+            {
+                continue;
+            }
+            kernel_source << "constant " << scalar_type_string << " rd_ensemble_" << parameter.name << "[" << options.ensemble_size << "] = { ";
+            for (int im = 0; im < options.ensemble_size; im++)
+            {
+                kernel_source << GetKernelLiteral(options.ensemble_values[im][j], options.data_type_suffix);
+                kernel_source << (im < options.ensemble_size - 1 ? ", " : " };\n");
+            }
+        }
+        kernel_source << "\n";
+    }
     // output the function declaration
     kernel_source << "kernel void rd_compute(";
     for (const string& chem : inputs_needed.chemicals_needed)
@@ -229,6 +164,20 @@ void WriteHeader(ostringstream& kernel_source, const InputsNeeded& inputs_needed
             kernel_source << ",";
         }
     }
+    if (options.parameters_as_arguments)
+    {
+        // the parameters are scalars, even when the chemicals are in float4 blocks
+        const string scalar_type_string = (options.data_type == VTK_DOUBLE) ? "double" : "float";
+        for (const AbstractRD::Parameter& parameter : parameters)
+        {
+            kernel_source << ",const " << scalar_type_string << " parameter_" << parameter.name;
+        }
+        if (options.tableau)
+        {
+            WriteIntegratorKernelArguments(kernel_source, *options.tableau, inputs_needed.chemicals_needed,
+                options.data_type_string);
+        }
+    }
     kernel_source << ")\n{\n";
 }
 
@@ -240,8 +189,19 @@ void WriteParameters(ostringstream& kernel_source, const vector<AbstractRD::Para
     kernel_source << options.indent << "// parameters:\n";
     for (const AbstractRD::Parameter& parameter : parameters)
     {
-        kernel_source << options.indent << "const " << options.data_type_string << " " << parameter.name
-            << " = " << setprecision(8) << parameter.value << options.data_type_suffix << ";\n";
+        kernel_source << options.indent << "const " << options.data_type_string << " " << parameter.name << " = ";
+        if (GetEnsembleParameterIndex(parameter.name, options) >= 0)
+        {
+            kernel_source << "rd_ensemble_" << parameter.name << "[rd_member];\n";
+        }
+        else if (options.parameters_as_arguments)
+        {
+            kernel_source << "parameter_" << parameter.name << ";\n";
+        }
+        else
+        {
+            kernel_source << GetKernelLiteral(parameter.value, options.data_type_suffix) << ";\n";
+        }
     }
     // add a dx parameter for grid spacing if one is not already supplied
     const bool has_dx_parameter = find_if(parameters.begin(), parameters.end(),
@@ -256,12 +216,62 @@ void WriteParameters(ostringstream& kernel_source, const vector<AbstractRD::Para
 
 // -------------------------------------------------------------------------
 
+void WriteEnsembleMember(ostringstream& kernel_source, const InputsNeeded& inputs_needed, const KernelOptions& options)
+{
+    // the members are stacked along z, so each one starts further into the buffers
+    kernel_source << options.indent << "// member of the ensemble:\n";
+    kernel_source << options.indent << "const int rd_member = get_global_id(2) / " << options.member_z << ";\n";
+    kernel_source << options.indent << "const int rd_member_offset = get_global_size(0) * get_global_size(1) * "
+        << options.member_z << " * rd_member;\n";
+    vector<string> buffers;
+    for (const string& chem : inputs_needed.chemicals_needed)
+    {
+        buffers.push_back(chem + "_in");
+        buffers.push_back(chem + "_out");
+    }
+    if (options.tableau)
+    {
+        for (const string& chem : inputs_needed.chemicals_needed)
+        {
+            buffers.push_back(chem + "_base");
+        }
+        for (int s = 0; s < options.tableau->GetNumberOfStages(); s++)
+        {
+            if (options.tableau->IsRateStored(s))
+            {
+                for (const string& chem : inputs_needed.chemicals_needed)
+                {
+                    buffers.push_back(chem + "_k" + to_string(s));
+                }
+            }
+        }
+        if (options.tableau->IsAdaptive())
+        {
+            buffers.push_back("rd_error");
+        }
+    }
+    for (const string& buffer : buffers)
+    {
+        kernel_source << options.indent << buffer << " += rd_member_offset;\n";
+    }
+    kernel_source << "\n";
+}
+
+// -------------------------------------------------------------------------
+
 void WriteIndices(ostringstream& kernel_source, const InputsNeeded& inputs_needed, const KernelOptions& options)
 {
     kernel_source << options.indent << "// indices:\n";
     kernel_source << options.indent << "const int index_x = get_global_id(0);\n";
     kernel_source << options.indent << "const int index_y = get_global_id(1);\n";
-    kernel_source << options.indent << "const int index_z = get_global_id(2);\n";
+    if (options.ensemble_size > 1)
+    {
+        kernel_source << options.indent << "const int index_z = get_global_id(2) - rd_member * " << options.member_z << ";\n";
+    }
+    else
+    {
+        kernel_source << options.indent << "const int index_z = get_global_id(2);\n";
+    }
     if (options.use_local_memory)
     {
         kernel_source << options.indent << "const int local_x = get_local_id(0);\n";
@@ -270,7 +280,14 @@ void WriteIndices(ostringstream& kernel_source, const InputsNeeded& inputs_neede
     }
     kernel_source << options.indent << "const int X = get_global_size(0);\n";
     kernel_source << options.indent << "const int Y = get_global_size(1);\n";
-    kernel_source << options.indent << "const int Z = get_global_size(2);\n";
+    if (options.ensemble_size > 1)
+    {
+        kernel_source << options.indent << "const int Z = " << options.member_z << ";\n";
+    }
+    else
+    {
+        kernel_source << options.indent << "const int Z = get_global_size(2);\n";
+    }
     kernel_source << options.indent << "const int index_here = X*(Y*index_z + index_y) + index_x;\n";
     for (const string& chem : inputs_needed.chemicals_needed)
     {
@@ -517,7 +534,12 @@ string AssembleKernelSource(const InputsNeeded& inputs_needed,
     ostringstream kernel_source;
     kernel_source << fixed << setprecision(6);
     // add the #defines and the kernel definition header
-    WriteHeader(kernel_source, inputs_needed, options);
+    WriteHeader(kernel_source, parameters, inputs_needed, options);
+    // find which member of the ensemble we are in, since the parameters can depend on it
+    if (options.ensemble_size > 1)
+    {
+        WriteEnsembleMember(kernel_source, inputs_needed, options);
+    }
     // add the parameters
     WriteParameters(kernel_source, parameters, inputs_needed, options);
     // add the bit that retrieves the global indices etc.
@@ -541,12 +563,20 @@ string AssembleKernelSource(const InputsNeeded& inputs_needed,
         kernel_source << options.indent << s << "\n";
     }
     kernel_source << "\n";
-    // add the forward-Euler step
-    // TODO: only add this when delta_<chem> appears in the formula
-    kernel_source << options.indent << "// forward-Euler update step:\n";
-    for (const string& chem : inputs_needed.chemicals_needed)
+    if (options.tableau)
+    {
+        WriteIntegratorKernelStages(kernel_source, *options.tableau, inputs_needed.chemicals_needed, "index_here",
+            options.indent, options.data_type_string, options.data_type_suffix);
+    }
+    else
     {
-        kernel_source << options.indent << chem << "_out[index_here] = " << chem << " + timestep * delta_" << chem << ";\n";
+        // add the forward-Euler step
+        // TODO: only add this when delta_<chem> appears in the formula
+        kernel_source << options.indent << "// forward-Euler update step:\n";
+        for (const string& chem : inputs_needed.chemicals_needed)
+        {
+            kernel_source << options.indent << chem << "_out[index_here] = " << chem << " + timestep * delta_" << chem << ";\n";
+        }
     }
     // TODO: timestep only needed if it appears in the formula or if we are doing forward-Euler for at least one chemical
     // finish up
@@ -558,6 +588,20 @@ string AssembleKernelSource(const InputsNeeded& inputs_needed,
 // -------------------------------------------------------------------------
 
 string FormulaOpenCLImageRD::AssembleKernelSourceFromFormula(const string& formula) const
+{
+    return this->AssembleFormulaKernelSource(formula, false);
+}
+
+// -------------------------------------------------------------------------
+
+string FormulaOpenCLImageRD::AssembleKernelSourceForRunning(const string& formula) const
+{
+    return this->AssembleFormulaKernelSource(formula, true);
+}
+
+// -------------------------------------------------------------------------
+
+string FormulaOpenCLImageRD::AssembleFormulaKernelSource(const string& formula, bool parameters_as_arguments) const
 {
     string full_data_type_string = this->data_type_string;
     if (this->block_size[0] == 4 && this->block_size[1] == 1 && this->block_size[2] == 1)
@@ -576,8 +620,24 @@ string FormulaOpenCLImageRD::AssembleKernelSourceFromFormula(const string& formu
         this->GetArenaDimensionality(), this->block_size, this->GetAccuracy());
 
     const string indent = "    ";
-    const KernelOptions options(this->wrap, indent, this->data_type, full_data_type_string, this->data_type_suffix, this->block_size,
-        this->use_local_memory, this->local_work_size);
+    // multi-stage integrators are only used by the kernel for running, since their arguments come after the parameters
+    const ButcherTableau& tableau = GetButcherTableau(this->integrator);
+    const bool multi_stage = parameters_as_arguments && tableau.GetNumberOfStages() > 1;
+    KernelOptions options(this->wrap, indent, this->data_type, full_data_type_string, this->data_type_suffix, this->block_size,
+        this->use_local_memory, this->local_work_size, parameters_as_arguments, multi_stage ? &tableau : nullptr);
+    if (parameters_as_arguments && this->ensemble_size > 1)
+    {
+        // only the kernel for running works on the whole ensemble
+        if (multi_stage && find(this->ensemble_parameter_names.begin(), this->ensemble_parameter_names.end(), "timestep")
+            != this->ensemble_parameter_names.end())
+        {
+            throw runtime_error("FormulaOpenCLImageRD::AssembleFormulaKernelSource : the timestep can only differ between the members of an ensemble with the euler integrator");
+        }
+        options.ensemble_size = this->ensemble_size;
+        options.member_z = max(1, vtkMath::Round(this->GetZ()) / this->block_size[2]);
+        options.ensemble_parameter_names = this->ensemble_parameter_names;
+        options.ensemble_values = this->ensemble_values;
+    }
 
     string amended_formula = formula;
     if (this->data_type == VTK_DOUBLE)
@@ -606,32 +666,7 @@ void FormulaOpenCLImageRD::InitializeFromXML(vtkXMLDataElement *rd, bool &warn_t
 {
     OpenCLImageRD::InitializeFromXML(rd,warn_to_update);
 
-    vtkSmartPointer<vtkXMLDataElement> rule = rd->FindNestedElementWithName("rule");
-    if(!rule) throw runtime_error("rule node not found in file");
-
-    // formula:
-    vtkSmartPointer<vtkXMLDataElement> xml_formula = rule->FindNestedElementWithName("formula");
-    if(!xml_formula) throw runtime_error("formula node not found in file");
-    read_optional_attribute(xml_formula, "block_size_x", this->block_size[0]);
-    read_optional_attribute(xml_formula, "block_size_y", this->block_size[1]);
-    read_optional_attribute(xml_formula, "block_size_z", this->block_size[2]);
-
-    // number_of_chemicals:
-    read_required_attribute(xml_formula,"number_of_chemicals",this->n_chemicals);
-
-    // accuracy
-    string accuracy_string;
-    read_optional_attribute(xml_formula, "accuracy", accuracy_string);
-    if (accuracy_string.size() > 0)
-    {
-        const char* accuracy_labels[3] = { "low", "medium", "high" };
-        auto it = find(accuracy_labels, accuracy_labels + 3, accuracy_string);
-        if (it == accuracy_labels + 3)
-        {
-            throw std::runtime_error("unknown accuracy attribute: " + accuracy_string);
-        }
-        this->SetAccuracy(static_cast<AbstractRD::Accuracy>(it - accuracy_labels));
-    }
+    vtkSmartPointer<vtkXMLDataElement> xml_formula = this->ReadFormulaElement(rd, this->block_size);
 
     string formula = trim_multiline_string(xml_formula->GetCharacterData());
     //this->TestFormula(formula); // will throw on error
@@ -644,36 +679,13 @@ vtkSmartPointer<vtkXMLDataElement> FormulaOpenCLImageRD::GetAsXML(bool generate_
 {
     vtkSmartPointer<vtkXMLDataElement> rd = OpenCLImageRD::GetAsXML(generate_initial_pattern_when_loading);
 
-    vtkSmartPointer<vtkXMLDataElement> rule = rd->FindNestedElementWithName("rule");
-    if(!rule) throw runtime_error("rule node not found");
-
-    // formula
-    vtkSmartPointer<vtkXMLDataElement> formula = vtkSmartPointer<vtkXMLDataElement>::New();
-    formula->SetName("formula");
-    formula->SetIntAttribute("number_of_chemicals",this->GetNumberOfChemicals());
-    formula->SetIntAttribute("block_size_x", this->block_size[0]);
-    formula->SetIntAttribute("block_size_y", this->block_size[1]);
-    formula->SetIntAttribute("block_size_z", this->block_size[2]);
-    const char* accuracy_labels[3] = { "low", "medium", "high" };
-    formula->SetAttribute("accuracy", accuracy_labels[static_cast<int>(this->accuracy)]);
-    string f = this->GetFormula();
-    f = ReplaceAllSubstrings(f, "\n", "\n        "); // indent the lines
-    formula->SetCharacterData(f.c_str(), (int)f.length());
-    rule->AddNestedElement(formula);
+    this->AddFormulaElement(rd, this->block_size);
 
     return rd;
 }
 
 // -------------------------------------------------------------------------
 
-void FormulaOpenCLImageRD::SetParameterValue(int iParam,float val)
-{
-    AbstractRD::SetParameterValue(iParam,val);
-    this->need_reload_formula = true;
-}
-
-// -------------------------------------------------------------------------
-
 void FormulaOpenCLImageRD::SetParameterName(int iParam,const string& s)
 {
     AbstractRD::SetParameterName(iParam,s);
@@ -713,3 +725,82 @@ void FormulaOpenCLImageRD::SetWrap(bool w)
 }
 
 // -------------------------------------------------------------------------
+
+void FormulaOpenCLImageRD::SetEnsemble(const vector<string>& parameter_names, const vector<vector<float>>& values)
+{
+    for (const string& name : parameter_names)
+    {
+        if (!this->IsParameter(name))
+        {
+            throw runtime_error("FormulaOpenCLImageRD::SetEnsemble : unknown parameter: " + name);
+        }
+    }
+    for (const vector<float>& member_values : values)
+    {
+        if (member_values.size() != parameter_names.size())
+        {
+            throw runtime_error("FormulaOpenCLImageRD::SetEnsemble : each member needs a value for each parameter");
+        }
+    }
+
+    this->SyncToHost(); // every member starts from the pattern shown now
+    if (values.empty() || parameter_names.empty())
+    {
+        this->ensemble_parameter_names.clear();
+        this->ensemble_values.clear();
+        this->ensemble_size = 1;
+    }
+    else
+    {
+        this->ensemble_parameter_names = parameter_names;
+        this->ensemble_values = values;
+        this->ensemble_size = static_cast<int>(values.size());
+    }
+    this->ensemble_member_shown = 0;
+    this->ShowEnsembleParameterValues();
+
+    // the buffers hold every member, so they change size
+    this->need_reload_formula = true;
+    this->ReloadContextIfNeeded();
+    this->ReloadKernelIfNeeded();
+    this->CreateOpenCLBuffers();
+}
+
+// -------------------------------------------------------------------------
+
+void FormulaOpenCLImageRD::ShowEnsembleMember(int i)
+{
+    if (i < 0 || i >= this->ensemble_size)
+    {
+        throw runtime_error("FormulaOpenCLImageRD::ShowEnsembleMember : no such member");
+    }
+    if (i == this->ensemble_member_shown)
+    {
+        return;
+    }
+    this->ensemble_member_shown = i;
+    if (!this->need_write_to_opencl_buffers)
+    {
+        // the device has the latest values, so read this member's when they are next needed
+        this->need_read_from_opencl_buffers = true;
+    }
+    this->ShowEnsembleParameterValues();
+}
+
+// -------------------------------------------------------------------------
+
+void FormulaOpenCLImageRD::ShowEnsembleParameterValues()
+{
+    for (size_t j = 0; j < this->ensemble_parameter_names.size(); j++)
+    {
+        for (int iParam = 0; iParam < this->GetNumberOfParameters(); iParam++)
+        {
+            if (this->GetParameterName(iParam) == this->ensemble_parameter_names[j])
+            {
+                this->SetParameterValue(iParam, this->ensemble_values[this->ensemble_member_shown][j]);
+            }
+        }
+    }
+}
+
+// -------------------------------------------------------------------------
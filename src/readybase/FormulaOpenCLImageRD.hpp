@@ -21,7 +21,7 @@
 /// An RD system that uses an OpenCL formula snippet.
 /** An N-dimensional (1D,2D,3D) OpenCL RD implementations with n chemicals
  *  specified as a short formula involving delta_a, laplacian_a, etc.
- *  implemented with Euler integration, a basic finite difference stencil
+ *  implemented with Euler integration (or a Runge-Kutta method, see Integrators.hpp), a basic finite difference stencil
  *  and float4 blocks for speed */
 class FormulaOpenCLImageRD : public OpenCLImageRD
 {
@@ -45,20 +45,48 @@ class FormulaOpenCLImageRD : public OpenCLImageRD
         bool HasEditableAccuracyOption() const override { return true; }
         void SetAccuracy(Accuracy acc) override { this->accuracy = acc; this->need_reload_formula = true; }
 
+        bool HasEditableIntegratorOption() const override { return true; }
+        void SetIntegrator(Integrator integrator) override { this->integrator = integrator; this->need_reload_formula = true; }
+
         std::string AssembleKernelSourceFromFormula(const std::string& formula) const override;
 
         // we override the parameter access functions because changing the parameters requires rewriting the kernel
+        // (changing a parameter value does not, since the values are passed as kernel arguments)
         void AddParameter(const std::string& name,float val) override;
         void DeleteParameter(int iParam) override;
         void DeleteAllParameters() override;
         void SetParameterName(int iParam,const std::string& s) override;
-        void SetParameterValue(int iParam,float val) override;
 
         bool HasEditableWrapOption() const override { return true; }
         void SetWrap(bool w) override;
         bool HasEditableDataType() const override { return true; }
 
+        /// Runs several copies of the system at once, each member of the ensemble with its own values of some parameters.
+        /** The members are stacked along z in the OpenCL buffers and advanced together by a single kernel, so that
+         *  small grids can make use of the whole device. values[i][j] is the value of parameter_names[j] for member i.
+         *  Every member starts from the current pattern. Other parameters are shared, and changing the value of a
+         *  swept parameter has no effect. With no values there is just one system again. */
+        void SetEnsemble(const std::vector<std::string>& parameter_names, const std::vector<std::vector<float>>& values);
+        int GetEnsembleSize() const { return this->ensemble_size; }
+        /// Chooses which member of the ensemble the images (and the values of the swept parameters) show, e.g. for saving.
+        void ShowEnsembleMember(int i);
+        int GetEnsembleMemberShown() const { return this->ensemble_member_shown; }
+
+    protected:
+
+        std::string AssembleKernelSourceForRunning(const std::string& formula) const override;
+        bool HasParameterKernelArguments() const override { return true; }
+
     private:
 
+        /// If parameters_as_arguments is false then the parameter values are written into the kernel source.
+        std::string AssembleFormulaKernelSource(const std::string& formula, bool parameters_as_arguments) const;
+
+        /// Sets the values of the swept parameters to those of the member shown, so that a saved file runs the same way on its own.
+        void ShowEnsembleParameterValues();
+
         int block_size[3];
+
+        std::vector<std::string> ensemble_parameter_names;
+        std::vector<std::vector<float>> ensemble_values; ///< for each member, the value of each of ensemble_parameter_names
 };
@@ -17,6 +17,7 @@
 
 // local:
 #include "FormulaOpenCLMeshRD.hpp"
+#include "Integrators.hpp"
 #include "utils.hpp"
 
 // STL:
@@ -48,6 +49,21 @@ delta_b = D_b * laplacian_b + a*b*b - (F+K)*b;");
 // -------------------------------------------------------------------------
 
 std::string FormulaOpenCLMeshRD::AssembleKernelSourceFromFormula(const std::string& f) const
+{
+    return this->AssembleFormulaKernelSource(f, false, false);
+}
+
+// -------------------------------------------------------------------------
+
+std::string FormulaOpenCLMeshRD::AssembleKernelSourceForRunning(const std::string& f) const
+{
+    return this->AssembleFormulaKernelSource(f, true, !this->padded_neighbors);
+}
+
+// -------------------------------------------------------------------------
+
+std::string FormulaOpenCLMeshRD::AssembleFormulaKernelSource(const std::string& f, bool parameters_as_arguments,
+                                                              bool compressed_neighbors) const
 {
     const string indent = "    ";
     const int NC = this->GetNumberOfChemicals();
@@ -71,7 +87,21 @@ std::string FormulaOpenCLMeshRD::AssembleKernelSourceFromFormula(const std::stri
         kernel_source << "global " << this->data_type_string << " *" << GetChemicalName(i) << "_in,";
     for(int i=0;i<NC;i++)
         kernel_source << "global " << this->data_type_string << " *" << GetChemicalName(i) << "_out,";
-    kernel_source << "global int* neighbor_indices,global float* neighbor_weights,const int max_neighbors)\n";
+    kernel_source << "global int* neighbor_indices,global float* neighbor_weights,";
+    kernel_source << (compressed_neighbors ? "global int* neighbor_offsets" : "const int max_neighbors");
+    // multi-stage integrators are only used by the kernel for running, since their arguments come after the parameters
+    const ButcherTableau& tableau = GetButcherTableau(parameters_as_arguments ? this->integrator : Integrator::Euler);
+    vector<string> chemicals;
+    for(int i=0;i<NC;i++)
+        chemicals.push_back(GetChemicalName(i));
+    if( parameters_as_arguments )
+    {
+        for (const Parameter& parameter : this->parameters)
+            kernel_source << ",const " << this->data_type_string << " parameter_" << parameter.name;
+        if( tableau.GetNumberOfStages() > 1 )
+            WriteIntegratorKernelArguments(kernel_source, tableau, chemicals, this->data_type_string);
+    }
+    kernel_source << ")\n";
     // output the body
     kernel_source << "{\n";
     kernel_source << indent << "const int index_x = get_global_id(0);\n";
@@ -82,11 +112,16 @@ std::string FormulaOpenCLMeshRD::AssembleKernelSourceFromFormula(const std::stri
     kernel_source << indent << "// compute the Laplacians\n";
     for(int i=0;i<NC;i++)
         kernel_source << indent << this->data_type_string << " laplacian_" << GetChemicalName(i) << " = -" << GetChemicalName(i) << ";\n";
-    kernel_source << indent << "int _offset = index_x * max_neighbors;\n";
-    kernel_source << indent << "for(int _i=0;_i<max_neighbors;_i++)\n" << indent << "{\n";
+    if(compressed_neighbors)
+        kernel_source << indent << "for(int _k=neighbor_offsets[index_x];_k<neighbor_offsets[index_x+1];_k++)\n" << indent << "{\n";
+    else
+    {
+        kernel_source << indent << "int _offset = index_x * max_neighbors;\n";
+        kernel_source << indent << "for(int _k=_offset;_k<_offset+max_neighbors;_k++)\n" << indent << "{\n";
+    }
     for(int i=0;i<NC;i++)
         kernel_source << indent << indent << "laplacian_" << GetChemicalName(i) << " += " << GetChemicalName(i)
-                      << "_in[neighbor_indices[_offset+_i]] * neighbor_weights[_offset+_i];\n";
+                      << "_in[neighbor_indices[_k]] * neighbor_weights[_k];\n";
     kernel_source << indent << "}\n";
     for(int i=0;i<NC;i++)
         kernel_source << indent << "laplacian_" << GetChemicalName(i) << " *= 4.0" << this->data_type_suffix << ";\n"; // TODO: not sure about 3D meshes
@@ -95,17 +130,27 @@ std::string FormulaOpenCLMeshRD::AssembleKernelSourceFromFormula(const std::stri
     kernel_source << indent << "// parameters:\n";
     for (const Parameter& parameter : this->parameters)
     {
-        kernel_source << indent << this->data_type_string << " " << parameter.name << " = " << parameter.value << this->data_type_suffix << ";\n";
+        kernel_source << indent << this->data_type_string << " " << parameter.name << " = ";
+        if( parameters_as_arguments )
+            kernel_source << "parameter_" << parameter.name << ";\n";
+        else
+            kernel_source << parameter.value << this->data_type_suffix << ";\n";
     }
     // the update step
     for(int i=0;i<NC;i++)
         kernel_source << indent << this->data_type_string << " delta_" << GetChemicalName(i) << " = 0.0" << this->data_type_suffix << ";\n";
     kernel_source << "\n" << indent << "// the formula:\n";
     kernel_source << f << "\n";
-    // the forward-Euler step
-    kernel_source << indent << "// forward-Euler update step:\n";
-    for(int i=0;i<NC;i++)
-        kernel_source << indent << GetChemicalName(i) << "_out[index_x] = " << GetChemicalName(i) << " + timestep * delta_" << GetChemicalName(i) << ";\n";
+    if( tableau.GetNumberOfStages() > 1 )
+        WriteIntegratorKernelStages(kernel_source, tableau, chemicals, "index_x", indent, this->data_type_string,
+                                    this->data_type_suffix);
+    else
+    {
+        // the forward-Euler step
+        kernel_source << indent << "// forward-Euler update step:\n";
+        for(int i=0;i<NC;i++)
+            kernel_source << indent << GetChemicalName(i) << "_out[index_x] = " << GetChemicalName(i) << " + timestep * delta_" << GetChemicalName(i) << ";\n";
+    }
     // finish up
     kernel_source << "}\n";
 
@@ -128,8 +173,15 @@ void FormulaOpenCLMeshRD::InitializeFromXML(vtkXMLDataElement *rd, bool &warn_to
     // number_of_chemicals:
     read_required_attribute(xml_formula,"number_of_chemicals",this->n_chemicals);
 
+    // integrator:
+    Integrator integrator;
+    ReadIntegratorAttributes(xml_formula, integrator, this->integrator_tolerance);
+    this->SetIntegrator(integrator);
+
     string formula = trim_multiline_string(xml_formula->GetCharacterData());
-    this->TestFormula(formula); // will throw on error
+    // (not test-compiled here: the running kernel depends on the mesh, which isn't loaded yet;
+    //  any error is reported when the kernel is first built)
+    //this->TestFormula(formula); // will throw on error
     this->SetFormula(formula); // (won't throw yet)
 }
 
@@ -146,6 +198,7 @@ vtkSmartPointer<vtkXMLDataElement> FormulaOpenCLMeshRD::GetAsXML(bool generate_i
     vtkSmartPointer<vtkXMLDataElement> formula = vtkSmartPointer<vtkXMLDataElement>::New();
     formula->SetName("formula");
     formula->SetIntAttribute("number_of_chemicals",this->GetNumberOfChemicals());
+    WriteIntegratorAttributes(formula, this->integrator, this->integrator_tolerance);
     string f = this->GetFormula();
     f = ReplaceAllSubstrings(f, "\n", "\n        "); // indent the lines
     formula->SetCharacterData(f.c_str(), (int)f.length());
@@ -156,14 +209,6 @@ vtkSmartPointer<vtkXMLDataElement> FormulaOpenCLMeshRD::GetAsXML(bool generate_i
 
 // -------------------------------------------------------------------------
 
-void FormulaOpenCLMeshRD::SetParameterValue(int iParam,float val)
-{
-    AbstractRD::SetParameterValue(iParam,val);
-    this->need_reload_formula = true;
-}
-
-// -------------------------------------------------------------------------
-
 void FormulaOpenCLMeshRD::SetParameterName(int iParam,const string& s)
 {
     AbstractRD::SetParameterName(iParam,s);
@@ -33,11 +33,28 @@ class FormulaOpenCLMeshRD : public OpenCLMeshRD
         std::string AssembleKernelSourceFromFormula(const std::string& formula) const override;
 
         // we override the parameter access functions because changing the parameters requires rewriting the kernel
+        // (changing a parameter value does not, since the values are passed as kernel arguments)
         void AddParameter(const std::string& name,float val) override;
         void DeleteParameter(int iParam) override;
         void DeleteAllParameters() override;
         void SetParameterName(int iParam,const std::string& s) override;
-        void SetParameterValue(int iParam,float val) override;
 
         bool HasEditableDataType() const override { return true; }
+
+        bool HasEditableIntegratorOption() const override { return true; }
+        void SetIntegrator(Integrator integrator) override { this->integrator = integrator; this->need_reload_formula = true; }
+
+    protected:
+
+        std::string AssembleKernelSourceForRunning(const std::string& formula) const override;
+        bool HasParameterKernelArguments() const override { return true; }
+
+    private:
+
+        /// If parameters_as_arguments is false then the parameter values are written into the kernel source.
+        /** If compressed_neighbors is true then the kernel takes neighbor_offsets instead of max_neighbors (see
+         *  MeshRD::NeighborStorage). The kernel that the user sees always uses the padded storage, so that it can be
+         *  run as a full kernel. */
+        std::string AssembleFormulaKernelSource(const std::string& formula, bool parameters_as_arguments,
+                                                bool compressed_neighbors) const;
 };
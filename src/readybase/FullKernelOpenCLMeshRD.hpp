@@ -34,4 +34,9 @@ class FullKernelOpenCLMeshRD : public OpenCLMeshRD
         std::string AssembleKernelSourceFromFormula(const std::string& formula) const override;
 
         bool HasEditableDataType() const override { return false; }
+
+    protected:
+
+        /// the user's kernel takes max_neighbors, so it needs the padded storage
+        bool NeedsPaddedNeighbors() const override { return true; }
 };
@@ -17,6 +17,8 @@
 
 // local:
 #include "GrayScottImageRD.hpp"
+#include "GrayScottKernels.hpp"
+#include "ThreadPool.hpp"
 #include "utils.hpp"
 
 // STL:
@@ -62,19 +64,89 @@ void GrayScottImageRD::DeleteBuffers()
     this->buffer_images.clear();
 }
 
+namespace
+{
+    // Updates the cells x_start to x_end-1 of one row of cells (constant y and z).
+    void UpdateRow(const float* old_a,const float* old_b,float* new_a,float* new_b,
+                   int X,int Y,int Z,int x_start,int x_end,int y,int z,bool wrap,const GrayScottParameters& p)
+    {
+        // find the neighboring rows once, rather than for every cell
+        int y_prev,y_next,z_prev,z_next;
+        if(wrap)
+        {
+            y_prev = (y-1+Y)%Y;
+            y_next = (y+1)%Y;
+            z_prev = (z-1+Z)%Z;
+            z_next = (z+1)%Z;
+        }
+        else
+        {
+            y_prev = max(0,y-1);
+            y_next = min(Y-1,y+1);
+            z_prev = max(0,z-1);
+            z_next = min(Z-1,z+1);
+        }
+        const size_t row = size_t(X) * (y + size_t(Y) * z);
+        const size_t row_y_prev = size_t(X) * (y_prev + size_t(Y) * z);
+        const size_t row_y_next = size_t(X) * (y_next + size_t(Y) * z);
+        const size_t row_z_prev = size_t(X) * (y + size_t(Y) * z_prev);
+        const size_t row_z_next = size_t(X) * (y + size_t(Y) * z_next);
+
+        // fast path for the interior of the row, where x-1 and x+1 need no wrapping or clamping
+        const int interior_start = max(1,x_start);
+        const int interior_end = min(X-1,x_end);
+        if(interior_start < interior_end)
+            GrayScottImageRow(old_a,old_b,new_a,new_b,row,row_y_prev,row_y_next,row_z_prev,row_z_next,interior_start,interior_end,p);
+
+        // the cells at each end of the row (just one cell if X is 1)
+        const int ends[2] = { 0, X-1 };
+        for(int iEnd=0;iEnd<min(X,2);iEnd++)
+        {
+            const int x = ends[iEnd];
+            if(x < x_start || x >= x_end)
+                continue;
+            int x_prev,x_next;
+            if(wrap)
+            {
+                x_prev = (x-1+X)%X;
+                x_next = (x+1)%X;
+            }
+            else
+            {
+                x_prev = max(0,x-1);
+                x_next = min(X-1,x+1);
+            }
+            GrayScottImageCell(old_a,old_b,new_a,new_b,row+x,row+x_prev,row+x_next,row_y_prev+x,row_y_next+x,row_z_prev+x,row_z_next+x,p);
+        }
+    }
+}
+
+// ---------------------------------------------------------------------
+
 void GrayScottImageRD::InternalUpdate(int n_steps)
 {
     const int X = this->GetX();
     const int Y = this->GetY();
     const int Z = this->GetZ();
 
-    float timestep = this->GetParameterValueByName("timestep");
-    float D_a = this->GetParameterValueByName("D_a");
-    float D_b = this->GetParameterValueByName("D_b");
-    float k = this->GetParameterValueByName("k");
-    float F = this->GetParameterValueByName("F");
-
-    int x_prev,x_next,y_prev,y_next,z_prev,z_next;
+    GrayScottParameters p;
+    p.timestep = this->GetParameterValueByName("timestep");
+    p.D_a = this->GetParameterValueByName("D_a");
+    p.D_b = this->GetParameterValueByName("D_b");
+    p.k = this->GetParameterValueByName("k");
+    p.F = this->GetParameterValueByName("F");
+
+    // divide the grid into tiles, small enough to stay in cache, and share them out among the threads
+    // (the tiles are whole rows, unless there are fewer rows than threads, e.g. for a 1D grid, when we split the rows too)
+    ThreadPool& thread_pool = ThreadPool::GetInstance();
+    const int num_threads = thread_pool.GetNumberOfThreads();
+    const int TARGET_CELLS_PER_TILE = 16384;
+    const int tile_X = Y*Z < num_threads ? max(1,min((X + num_threads - 1) / num_threads,TARGET_CELLS_PER_TILE)) : X;
+    const int tile_Z = min(Z,8);
+    const int tile_Y = max(1,min(Y,TARGET_CELLS_PER_TILE / max(1,tile_X*tile_Z)));
+    const int num_tiles_X = (X + tile_X - 1) / tile_X;
+    const int num_tiles_Y = (Y + tile_Y - 1) / tile_Y;
+    const int num_tiles_Z = (Z + tile_Z - 1) / tile_Z;
 
     // take approximately n_steps
     for(int iStep=0;iStep<n_steps;iStep++)
@@ -93,82 +165,23 @@ void GrayScottImageRD::InternalUpdate(int n_steps)
                     new_b = static_cast<float*>(this->images[1]->GetScalarPointer());
                     break;
         }
-        for(int z=0;z<Z;z++)
+        thread_pool.ParallelFor(num_tiles_X * num_tiles_Y * num_tiles_Z, [&](int iTile)
         {
-            if(this->wrap)
-            {
-                z_prev = (z-1+Z)%Z;
-                z_next = (z+1)%Z;
-            }
-            else
-            {
-                z_prev = max(0,z-1);
-                z_next = min(Z-1,z+1);
-            }
-            for(int y=0;y<Y;y++)
-            {
-                if(this->wrap)
-                {
-                    y_prev = (y-1+Y)%Y;
-                    y_next = (y+1)%Y;
-                }
-                else
-                {
-                    y_prev = max(0,y-1);
-                    y_next = min(Y-1,y+1);
-                }
-                for(int x=0;x<X;x++)
-                {
-                    if(this->wrap)
-                    {
-                        x_prev = (x-1+X)%X;
-                        x_next = (x+1)%X;
-                    }
-                    else
-                    {
-                        x_prev = max(0,x-1);
-                        x_next = min(X-1,x+1);
-                    }
-
-                    float aval = *vtk_at(old_a,x,y,z,X,Y);
-                    float bval = *vtk_at(old_b,x,y,z,X,Y);
-
-                    // compute the Laplacians of a and b
-                    // 7-point stencil:
-                    float dda = *vtk_at(old_a,x,y_prev,z,X,Y) +
-                                *vtk_at(old_a,x,y_next,z,X,Y) +
-                                *vtk_at(old_a,x_prev,y,z,X,Y) +
-                                *vtk_at(old_a,x_next,y,z,X,Y) +
-                                *vtk_at(old_a,x,y,z_prev,X,Y) +
-                                *vtk_at(old_a,x,y,z_next,X,Y) - 6*aval;
-                    float ddb = *vtk_at(old_b,x,y_prev,z,X,Y) +
-                                *vtk_at(old_b,x,y_next,z,X,Y) +
-                                *vtk_at(old_b,x_prev,y,z,X,Y) +
-                                *vtk_at(old_b,x_next,y,z,X,Y) +
-                                *vtk_at(old_b,x,y,z_prev,X,Y) +
-                                *vtk_at(old_b,x,y,z_next,X,Y) - 6*bval;
-
-                    // compute the new rate of change of a and b
-                    float da = D_a * dda - aval*bval*bval + F*(1-aval);
-                    float db = D_b * ddb + aval*bval*bval - (F+k)*bval;
-
-                    #if !defined( USE_SSE )
-                        // avoid denormals manually
-                        da += 1e-10f;
-                        db += 1e-10f;
-                    #endif
-
-                    // apply the change
-                    *vtk_at(new_a,x,y,z,X,Y) = aval + timestep * da;
-                    *vtk_at(new_b,x,y,z,X,Y) = bval + timestep * db;
-                }
-            }
-        }
+            const int x_start = (iTile % num_tiles_X) * tile_X;
+            const int y_start = (iTile / num_tiles_X % num_tiles_Y) * tile_Y;
+            const int z_start = (iTile / num_tiles_X / num_tiles_Y) * tile_Z;
+            const int x_end = min(X,x_start+tile_X);
+            const int y_end = min(Y,y_start+tile_Y);
+            const int z_end = min(Z,z_start+tile_Z);
+            for(int z=z_start;z<z_end;z++)
+                for(int y=y_start;y<y_end;y++)
+                    UpdateRow(old_a,old_b,new_a,new_b,X,Y,Z,x_start,x_end,y,z,this->wrap,p);
+        });
     }
     if(n_steps%2)
     {
-        // output ended up in the buffer images
-        this->images[0]->DeepCopy(this->buffer_images[0]);
-        this->images[1]->DeepCopy(this->buffer_images[1]);
+        // output ended up in the buffer images, so make them current
+        SwapImageData(this->images[0],this->buffer_images[0]);
+        SwapImageData(this->images[1],this->buffer_images[1]);
     }
 }
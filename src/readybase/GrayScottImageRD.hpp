@@ -16,23 +16,7 @@
     along with Ready. If not, see <http://www.gnu.org/licenses/>.         */
 
 // local:
-#include "ImageRD.hpp"
-
-/// Base class for all the inbuilt implementations.
-// (TODO: put in separate files when we have more than one derived class)
-class InbuiltImageRD : public ImageRD
-{
-    public:
-        InbuiltImageRD(int data_type) : ImageRD(data_type) {}
-
-        std::string GetRuleType() const override { return "inbuilt"; }
-
-        bool HasEditableFormula() const override { return false; }
-        bool HasEditableNumberOfChemicals() const override { return false; }
-
-        bool HasEditableWrapOption() const override { return true; }
-        bool HasEditableDataType() const override { return false; }
-};
+#include "InbuiltImageRD.hpp"
 
 /// An inbuilt implementation: n-dimensional Gray-Scott.
 class GrayScottImageRD : public InbuiltImageRD
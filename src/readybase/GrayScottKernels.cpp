@@ -0,0 +1,492 @@
+/*  Copyright 2011-2021 The Ready Bunch
+
+    This file is part of Ready.
+
+    Ready is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Ready is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Ready. If not, see <http://www.gnu.org/licenses/>.         */
+
+// local:
+#include "GrayScottKernels.hpp"
+
+#if (defined(__i386__) || defined(__x86_64__) || defined(__amd64__) || defined(_M_X64) || defined(_M_IX86))
+    #define READY_X86_KERNELS
+    // SSE, AVX:
+    #include <immintrin.h>
+    #if defined(_MSC_VER)
+        #include <intrin.h>
+    #endif
+#endif
+
+// With GCC and clang we compile each vector version for its own instruction set, so that the rest of the code
+// doesn't need any special flags. (MSVC allows the intrinsics anywhere.)
+#if defined(__GNUC__)
+    #define READY_TARGET(isa) __attribute__((target(isa)))
+#else
+    #define READY_TARGET(isa)
+#endif
+
+using namespace std;
+
+// ---------------------------------------------------------------------
+
+namespace
+{
+    // The reaction step, shared by the image and mesh versions.
+    inline void Reaction(float aval,float bval,float dda,float ddb,const GrayScottParameters& p,float& new_a,float& new_b)
+    {
+        // compute the new rate of change of a and b
+        float da = p.D_a * dda - aval*bval*bval + p.F*(1-aval);
+        float db = p.D_b * ddb + aval*bval*bval - (p.F+p.k)*bval;
+
+        #if !defined( USE_SSE )
+            // avoid denormals manually
+            da += 1e-10f;
+            db += 1e-10f;
+        #endif
+
+        // apply the change
+        new_a = aval + p.timestep * da;
+        new_b = bval + p.timestep * db;
+    }
+
+    // ---------------------------------------------------------------------
+
+    inline void MeshCell(const float* old_a,const float* old_b,float* new_a,float* new_b,
+                         const int* neighbor_indices,const float* neighbor_weights,int max_neighbors,
+                         size_t iCell,const GrayScottParameters& p)
+    {
+        // compute the laplacian
+        const float aval = old_a[iCell];
+        const float bval = old_b[iCell];
+        float dda = 0.0f;
+        float ddb = 0.0f;
+        for(int iNeighbor=0;iNeighbor<max_neighbors;iNeighbor++)
+        {
+            const size_t k = iCell*max_neighbors + iNeighbor;
+            const int neighbor_index = neighbor_indices[k];
+            const float diffusion_coefficient = neighbor_weights[k];
+            dda += old_a[neighbor_index] * diffusion_coefficient;
+            ddb += old_b[neighbor_index] * diffusion_coefficient;
+        }
+        dda -= aval;
+        ddb -= bval;
+        dda *= 4.0f; // scale the Laplacian to be more similar to the 2D square grid version, so the same parameters work
+        ddb *= 4.0f;
+        Reaction(aval,bval,dda,ddb,p,new_a[iCell],new_b[iCell]);
+    }
+
+    // ---------------------------------------------------------------------
+
+    void ImageRowScalar(const float* old_a,const float* old_b,float* new_a,float* new_b,
+                        size_t row,size_t row_y_prev,size_t row_y_next,size_t row_z_prev,size_t row_z_next,
+                        size_t x_start,size_t x_end,const GrayScottParameters& p)
+    {
+        for(size_t x=x_start;x<x_end;x++)
+            GrayScottImageCell(old_a,old_b,new_a,new_b,row+x,row+x-1,row+x+1,row_y_prev+x,row_y_next+x,row_z_prev+x,row_z_next+x,p);
+    }
+
+    // ---------------------------------------------------------------------
+
+    void MeshCellsScalar(const float* old_a,const float* old_b,float* new_a,float* new_b,
+                         const int* neighbor_indices,const float* neighbor_weights,int max_neighbors,
+                         size_t first_cell,size_t last_cell,const GrayScottParameters& p)
+    {
+        for(size_t iCell=first_cell;iCell<last_cell;iCell++)
+            MeshCell(old_a,old_b,new_a,new_b,neighbor_indices,neighbor_weights,max_neighbors,iCell,p);
+    }
+
+#if defined(READY_X86_KERNELS)
+
+    // ---------------------------------------------------------------------
+    // SSE2: 4 cells at a time
+
+    READY_TARGET("sse2")
+    inline void ReactionSSE2(__m128 aval,__m128 bval,__m128 dda,__m128 ddb,const GrayScottParameters& p,float* new_a,float* new_b)
+    {
+        const __m128 abb = _mm_mul_ps(_mm_mul_ps(aval,bval),bval);
+        __m128 da = _mm_add_ps(_mm_sub_ps(_mm_mul_ps(_mm_set1_ps(p.D_a),dda),abb),
+                               _mm_mul_ps(_mm_set1_ps(p.F),_mm_sub_ps(_mm_set1_ps(1.0f),aval)));
+        __m128 db = _mm_sub_ps(_mm_add_ps(_mm_mul_ps(_mm_set1_ps(p.D_b),ddb),abb),
+                               _mm_mul_ps(_mm_set1_ps(p.F+p.k),bval));
+        #if !defined( USE_SSE )
+            da = _mm_add_ps(da,_mm_set1_ps(1e-10f));
+            db = _mm_add_ps(db,_mm_set1_ps(1e-10f));
+        #endif
+        _mm_storeu_ps(new_a,_mm_add_ps(aval,_mm_mul_ps(_mm_set1_ps(p.timestep),da)));
+        _mm_storeu_ps(new_b,_mm_add_ps(bval,_mm_mul_ps(_mm_set1_ps(p.timestep),db)));
+    }
+
+    READY_TARGET("sse2")
+    inline __m128 LaplacianSSE2(const float* c,const float* y_prev,const float* y_next,const float* z_prev,const float* z_next,__m128 val)
+    {
+        // 7-point stencil, summed in the same order as GrayScottImageCell
+        __m128 sum = _mm_add_ps(_mm_loadu_ps(y_prev),_mm_loadu_ps(y_next));
+        sum = _mm_add_ps(sum,_mm_loadu_ps(c-1));
+        sum = _mm_add_ps(sum,_mm_loadu_ps(c+1));
+        sum = _mm_add_ps(sum,_mm_loadu_ps(z_prev));
+        sum = _mm_add_ps(sum,_mm_loadu_ps(z_next));
+        return _mm_sub_ps(sum,_mm_mul_ps(_mm_set1_ps(6.0f),val));
+    }
+
+    READY_TARGET("sse2")
+    void ImageRowSSE2(const float* old_a,const float* old_b,float* new_a,float* new_b,
+                      size_t row,size_t row_y_prev,size_t row_y_next,size_t row_z_prev,size_t row_z_next,
+                      size_t x_start,size_t x_end,const GrayScottParameters& p)
+    {
+        size_t x = x_start;
+        for(;x+4<=x_end;x+=4)
+        {
+            const __m128 aval = _mm_loadu_ps(old_a+row+x);
+            const __m128 bval = _mm_loadu_ps(old_b+row+x);
+            const __m128 dda = LaplacianSSE2(old_a+row+x,old_a+row_y_prev+x,old_a+row_y_next+x,old_a+row_z_prev+x,old_a+row_z_next+x,aval);
+            const __m128 ddb = LaplacianSSE2(old_b+row+x,old_b+row_y_prev+x,old_b+row_y_next+x,old_b+row_z_prev+x,old_b+row_z_next+x,bval);
+            ReactionSSE2(aval,bval,dda,ddb,p,new_a+row+x,new_b+row+x);
+        }
+        ImageRowScalar(old_a,old_b,new_a,new_b,row,row_y_prev,row_y_next,row_z_prev,row_z_next,x,x_end,p);
+    }
+
+    READY_TARGET("sse2")
+    void MeshCellsSSE2(const float* old_a,const float* old_b,float* new_a,float* new_b,
+                       const int* neighbor_indices,const float* neighbor_weights,int max_neighbors,
+                       size_t first_cell,size_t last_cell,const GrayScottParameters& p)
+    {
+        const size_t M = max_neighbors;
+        size_t iCell = first_cell;
+        for(;iCell+4<=last_cell;iCell+=4)
+        {
+            const __m128 aval = _mm_loadu_ps(old_a+iCell);
+            const __m128 bval = _mm_loadu_ps(old_b+iCell);
+            __m128 dda = _mm_setzero_ps();
+            __m128 ddb = _mm_setzero_ps();
+            const int* indices = neighbor_indices + iCell*M;
+            const float* weights = neighbor_weights + iCell*M;
+            for(size_t iNeighbor=0;iNeighbor<M;iNeighbor++)
+            {
+                // SSE2 has no gather so we load each lane separately
+                const int i0 = indices[iNeighbor], i1 = indices[M+iNeighbor], i2 = indices[2*M+iNeighbor], i3 = indices[3*M+iNeighbor];
+                const __m128 w = _mm_setr_ps(weights[iNeighbor],weights[M+iNeighbor],weights[2*M+iNeighbor],weights[3*M+iNeighbor]);
+                dda = _mm_add_ps(dda,_mm_mul_ps(_mm_setr_ps(old_a[i0],old_a[i1],old_a[i2],old_a[i3]),w));
+                ddb = _mm_add_ps(ddb,_mm_mul_ps(_mm_setr_ps(old_b[i0],old_b[i1],old_b[i2],old_b[i3]),w));
+            }
+            dda = _mm_mul_ps(_mm_sub_ps(dda,aval),_mm_set1_ps(4.0f));
+            ddb = _mm_mul_ps(_mm_sub_ps(ddb,bval),_mm_set1_ps(4.0f));
+            ReactionSSE2(aval,bval,dda,ddb,p,new_a+iCell,new_b+iCell);
+        }
+        MeshCellsScalar(old_a,old_b,new_a,new_b,neighbor_indices,neighbor_weights,max_neighbors,iCell,last_cell,p);
+    }
+
+    // ---------------------------------------------------------------------
+    // AVX2: 8 cells at a time (we deliberately don't enable FMA, since fusing would change the rounding)
+
+    READY_TARGET("avx2")
+    inline void ReactionAVX2(__m256 aval,__m256 bval,__m256 dda,__m256 ddb,const GrayScottParameters& p,float* new_a,float* new_b)
+    {
+        const __m256 abb = _mm256_mul_ps(_mm256_mul_ps(aval,bval),bval);
+        __m256 da = _mm256_add_ps(_mm256_sub_ps(_mm256_mul_ps(_mm256_set1_ps(p.D_a),dda),abb),
+                                  _mm256_mul_ps(_mm256_set1_ps(p.F),_mm256_sub_ps(_mm256_set1_ps(1.0f),aval)));
+        __m256 db = _mm256_sub_ps(_mm256_add_ps(_mm256_mul_ps(_mm256_set1_ps(p.D_b),ddb),abb),
+                                  _mm256_mul_ps(_mm256_set1_ps(p.F+p.k),bval));
+        #if !defined( USE_SSE )
+            da = _mm256_add_ps(da,_mm256_set1_ps(1e-10f));
+            db = _mm256_add_ps(db,_mm256_set1_ps(1e-10f));
+        #endif
+        _mm256_storeu_ps(new_a,_mm256_add_ps(aval,_mm256_mul_ps(_mm256_set1_ps(p.timestep),da)));
+        _mm256_storeu_ps(new_b,_mm256_add_ps(bval,_mm256_mul_ps(_mm256_set1_ps(p.timestep),db)));
+    }
+
+    READY_TARGET("avx2")
+    inline __m256 LaplacianAVX2(const float* c,const float* y_prev,const float* y_next,const float* z_prev,const float* z_next,__m256 val)
+    {
+        __m256 sum = _mm256_add_ps(_mm256_loadu_ps(y_prev),_mm256_loadu_ps(y_next));
+        sum = _mm256_add_ps(sum,_mm256_loadu_ps(c-1));
+        sum = _mm256_add_ps(sum,_mm256_loadu_ps(c+1));
+        sum = _mm256_add_ps(sum,_mm256_loadu_ps(z_prev));
+        sum = _mm256_add_ps(sum,_mm256_loadu_ps(z_next));
+        return _mm256_sub_ps(sum,_mm256_mul_ps(_mm256_set1_ps(6.0f),val));
+    }
+
+    READY_TARGET("avx2")
+    void ImageRowAVX2(const float* old_a,const float* old_b,float* new_a,float* new_b,
+                      size_t row,size_t row_y_prev,size_t row_y_next,size_t row_z_prev,size_t row_z_next,
+                      size_t x_start,size_t x_end,const GrayScottParameters& p)
+    {
+        size_t x = x_start;
+        for(;x+8<=x_end;x+=8)
+        {
+            const __m256 aval = _mm256_loadu_ps(old_a+row+x);
+            const __m256 bval = _mm256_loadu_ps(old_b+row+x);
+            const __m256 dda = LaplacianAVX2(old_a+row+x,old_a+row_y_prev+x,old_a+row_y_next+x,old_a+row_z_prev+x,old_a+row_z_next+x,aval);
+            const __m256 ddb = LaplacianAVX2(old_b+row+x,old_b+row_y_prev+x,old_b+row_y_next+x,old_b+row_z_prev+x,old_b+row_z_next+x,bval);
+            ReactionAVX2(aval,bval,dda,ddb,p,new_a+row+x,new_b+row+x);
+        }
+        ImageRowScalar(old_a,old_b,new_a,new_b,row,row_y_prev,row_y_next,row_z_prev,row_z_next,x,x_end,p);
+    }
+
+    READY_TARGET("avx2")
+    void MeshCellsAVX2(const float* old_a,const float* old_b,float* new_a,float* new_b,
+                       const int* neighbor_indices,const float* neighbor_weights,int max_neighbors,
+                       size_t first_cell,size_t last_cell,const GrayScottParameters& p)
+    {
+        const size_t M = max_neighbors;
+        const __m256i lane_offsets = _mm256_mullo_epi32(_mm256_setr_epi32(0,1,2,3,4,5,6,7),_mm256_set1_epi32(max_neighbors));
+        size_t iCell = first_cell;
+        for(;iCell+8<=last_cell;iCell+=8)
+        {
+            const __m256 aval = _mm256_loadu_ps(old_a+iCell);
+            const __m256 bval = _mm256_loadu_ps(old_b+iCell);
+            __m256 dda = _mm256_setzero_ps();
+            __m256 ddb = _mm256_setzero_ps();
+            const int* indices = neighbor_indices + iCell*M;
+            const float* weights = neighbor_weights + iCell*M;
+            for(size_t iNeighbor=0;iNeighbor<M;iNeighbor++)
+            {
+                const __m256i index = _mm256_i32gather_epi32(indices+iNeighbor,lane_offsets,4);
+                const __m256 w = _mm256_i32gather_ps(weights+iNeighbor,lane_offsets,4);
+                dda = _mm256_add_ps(dda,_mm256_mul_ps(_mm256_i32gather_ps(old_a,index,4),w));
+                ddb = _mm256_add_ps(ddb,_mm256_mul_ps(_mm256_i32gather_ps(old_b,index,4),w));
+            }
+            dda = _mm256_mul_ps(_mm256_sub_ps(dda,aval),_mm256_set1_ps(4.0f));
+            ddb = _mm256_mul_ps(_mm256_sub_ps(ddb,bval),_mm256_set1_ps(4.0f));
+            ReactionAVX2(aval,bval,dda,ddb,p,new_a+iCell,new_b+iCell);
+        }
+        MeshCellsScalar(old_a,old_b,new_a,new_b,neighbor_indices,neighbor_weights,max_neighbors,iCell,last_cell,p);
+    }
+
+    // ---------------------------------------------------------------------
+    // AVX-512: 16 cells at a time
+
+    READY_TARGET("avx512f")
+    inline void ReactionAVX512(__m512 aval,__m512 bval,__m512 dda,__m512 ddb,const GrayScottParameters& p,float* new_a,float* new_b)
+    {
+        const __m512 abb = _mm512_mul_ps(_mm512_mul_ps(aval,bval),bval);
+        __m512 da = _mm512_add_ps(_mm512_sub_ps(_mm512_mul_ps(_mm512_set1_ps(p.D_a),dda),abb),
+                                  _mm512_mul_ps(_mm512_set1_ps(p.F),_mm512_sub_ps(_mm512_set1_ps(1.0f),aval)));
+        __m512 db = _mm512_sub_ps(_mm512_add_ps(_mm512_mul_ps(_mm512_set1_ps(p.D_b),ddb),abb),
+                                  _mm512_mul_ps(_mm512_set1_ps(p.F+p.k),bval));
+        #if !defined( USE_SSE )
+            da = _mm512_add_ps(da,_mm512_set1_ps(1e-10f));
+            db = _mm512_add_ps(db,_mm512_set1_ps(1e-10f));
+        #endif
+        _mm512_storeu_ps(new_a,_mm512_add_ps(aval,_mm512_mul_ps(_mm512_set1_ps(p.timestep),da)));
+        _mm512_storeu_ps(new_b,_mm512_add_ps(bval,_mm512_mul_ps(_mm512_set1_ps(p.timestep),db)));
+    }
+
+    READY_TARGET("avx512f")
+    inline __m512 LaplacianAVX512(const float* c,const float* y_prev,const float* y_next,const float* z_prev,const float* z_next,__m512 val)
+    {
+        __m512 sum = _mm512_add_ps(_mm512_loadu_ps(y_prev),_mm512_loadu_ps(y_next));
+        sum = _mm512_add_ps(sum,_mm512_loadu_ps(c-1));
+        sum = _mm512_add_ps(sum,_mm512_loadu_ps(c+1));
+        sum = _mm512_add_ps(sum,_mm512_loadu_ps(z_prev));
+        sum = _mm512_add_ps(sum,_mm512_loadu_ps(z_next));
+        return _mm512_sub_ps(sum,_mm512_mul_ps(_mm512_set1_ps(6.0f),val));
+    }
+
+    READY_TARGET("avx512f")
+    void ImageRowAVX512(const float* old_a,const float* old_b,float* new_a,float* new_b,
+                        size_t row,size_t row_y_prev,size_t row_y_next,size_t row_z_prev,size_t row_z_next,
+                        size_t x_start,size_t x_end,const GrayScottParameters& p)
+    {
+        size_t x = x_start;
+        for(;x+16<=x_end;x+=16)
+        {
+            const __m512 aval = _mm512_loadu_ps(old_a+row+x);
+            const __m512 bval = _mm512_loadu_ps(old_b+row+x);
+            const __m512 dda = LaplacianAVX512(old_a+row+x,old_a+row_y_prev+x,old_a+row_y_next+x,old_a+row_z_prev+x,old_a+row_z_next+x,aval);
+            const __m512 ddb = LaplacianAVX512(old_b+row+x,old_b+row_y_prev+x,old_b+row_y_next+x,old_b+row_z_prev+x,old_b+row_z_next+x,bval);
+            ReactionAVX512(aval,bval,dda,ddb,p,new_a+row+x,new_b+row+x);
+        }
+        ImageRowAVX2(old_a,old_b,new_a,new_b,row,row_y_prev,row_y_next,row_z_prev,row_z_next,x,x_end,p);
+    }
+
+    READY_TARGET("avx512f")
+    void MeshCellsAVX512(const float* old_a,const float* old_b,float* new_a,float* new_b,
+                         const int* neighbor_indices,const float* neighbor_weights,int max_neighbors,
+                         size_t first_cell,size_t last_cell,const GrayScottParameters& p)
+    {
+        const size_t M = max_neighbors;
+        const __m512i lane_offsets = _mm512_mullo_epi32(_mm512_setr_epi32(0,1,2,3,4,5,6,7,8,9,10,11,12,13,14,15),
+                                                        _mm512_set1_epi32(max_neighbors));
+        size_t iCell = first_cell;
+        for(;iCell+16<=last_cell;iCell+=16)
+        {
+            const __m512 aval = _mm512_loadu_ps(old_a+iCell);
+            const __m512 bval = _mm512_loadu_ps(old_b+iCell);
+            __m512 dda = _mm512_setzero_ps();
+            __m512 ddb = _mm512_setzero_ps();
+            const int* indices = neighbor_indices + iCell*M;
+            const float* weights = neighbor_weights + iCell*M;
+            for(size_t iNeighbor=0;iNeighbor<M;iNeighbor++)
+            {
+                const __m512i index = _mm512_i32gather_epi32(lane_offsets,indices+iNeighbor,4);
+                const __m512 w = _mm512_i32gather_ps(lane_offsets,weights+iNeighbor,4);
+                dda = _mm512_add_ps(dda,_mm512_mul_ps(_mm512_i32gather_ps(index,old_a,4),w));
+                ddb = _mm512_add_ps(ddb,_mm512_mul_ps(_mm512_i32gather_ps(index,old_b,4),w));
+            }
+            dda = _mm512_mul_ps(_mm512_sub_ps(dda,aval),_mm512_set1_ps(4.0f));
+            ddb = _mm512_mul_ps(_mm512_sub_ps(ddb,bval),_mm512_set1_ps(4.0f));
+            ReactionAVX512(aval,bval,dda,ddb,p,new_a+iCell,new_b+iCell);
+        }
+        MeshCellsAVX2(old_a,old_b,new_a,new_b,neighbor_indices,neighbor_weights,max_neighbors,iCell,last_cell,p);
+    }
+
+#endif // READY_X86_KERNELS
+
+    // ---------------------------------------------------------------------
+
+    typedef void (*ImageRowFunction)(const float*,const float*,float*,float*,size_t,size_t,size_t,size_t,size_t,size_t,size_t,
+                                     const GrayScottParameters&);
+    typedef void (*MeshCellsFunction)(const float*,const float*,float*,float*,const int*,const float*,int,size_t,size_t,
+                                      const GrayScottParameters&);
+
+    struct Kernels
+    {
+        string instruction_set;
+        ImageRowFunction image_row;
+        MeshCellsFunction mesh_cells;
+    };
+
+    // ---------------------------------------------------------------------
+
+    Kernels ChooseKernels()
+    {
+        bool has_sse2 = false, has_avx2 = false, has_avx512 = false;
+        #if defined(READY_X86_KERNELS)
+            #if defined(_MSC_VER)
+                int info[4];
+                __cpuid(info,0);
+                const int max_leaf = info[0];
+                __cpuid(info,1);
+                has_sse2 = ( info[3] & (1<<26) ) != 0;
+                const bool has_osxsave = ( info[2] & (1<<27) ) != 0;
+                if(has_osxsave && max_leaf >= 7)
+                {
+                    // check that the OS saves the wider registers, as well as that the CPU has the instructions
+                    const unsigned long long xcr0 = _xgetbv(0);
+                    __cpuidex(info,7,0);
+                    has_avx2 = ( info[1] & (1<<5) ) != 0 && ( xcr0 & 0x6 ) == 0x6;
+                    has_avx512 = ( info[1] & (1<<16) ) != 0 && ( xcr0 & 0xe6 ) == 0xe6;
+                }
+            #else
+                __builtin_cpu_init();
+                has_sse2 = __builtin_cpu_supports("sse2");
+                has_avx2 = __builtin_cpu_supports("avx2");
+                has_avx512 = __builtin_cpu_supports("avx512f");
+            #endif
+        #endif
+
+        Kernels kernels = { "scalar", ImageRowScalar, MeshCellsScalar };
+        #if defined(READY_X86_KERNELS)
+            if(has_avx512 && has_avx2)
+                kernels = { "AVX-512", ImageRowAVX512, MeshCellsAVX512 };
+            else if(has_avx2)
+                kernels = { "AVX2", ImageRowAVX2, MeshCellsAVX2 };
+            else if(has_sse2)
+                kernels = { "SSE2", ImageRowSSE2, MeshCellsSSE2 };
+        #else
+            (void)has_sse2; (void)has_avx2; (void)has_avx512;
+        #endif
+        return kernels;
+    }
+
+    // ---------------------------------------------------------------------
+
+    const Kernels& GetKernels()
+    {
+        static const Kernels kernels = ChooseKernels();
+        return kernels;
+    }
+}
+
+// ---------------------------------------------------------------------
+
+string GetGrayScottKernelInstructionSet()
+{
+    return GetKernels().instruction_set;
+}
+
+// ---------------------------------------------------------------------
+
+void GrayScottImageCell(const float* old_a,const float* old_b,float* new_a,float* new_b,size_t i,
+                        size_t i_x_prev,size_t i_x_next,size_t i_y_prev,size_t i_y_next,size_t i_z_prev,size_t i_z_next,
+                        const GrayScottParameters& p)
+{
+    const float aval = old_a[i];
+    const float bval = old_b[i];
+
+    // compute the Laplacians of a and b
+    // 7-point stencil:
+    const float dda = old_a[i_y_prev] +
+                      old_a[i_y_next] +
+                      old_a[i_x_prev] +
+                      old_a[i_x_next] +
+                      old_a[i_z_prev] +
+                      old_a[i_z_next] - 6*aval;
+    const float ddb = old_b[i_y_prev] +
+                      old_b[i_y_next] +
+                      old_b[i_x_prev] +
+                      old_b[i_x_next] +
+                      old_b[i_z_prev] +
+                      old_b[i_z_next] - 6*bval;
+
+    Reaction(aval,bval,dda,ddb,p,new_a[i],new_b[i]);
+}
+
+// ---------------------------------------------------------------------
+
+void GrayScottImageRow(const float* old_a,const float* old_b,float* new_a,float* new_b,
+                       size_t row,size_t row_y_prev,size_t row_y_next,size_t row_z_prev,size_t row_z_next,
+                       size_t x_start,size_t x_end,const GrayScottParameters& p)
+{
+    GetKernels().image_row(old_a,old_b,new_a,new_b,row,row_y_prev,row_y_next,row_z_prev,row_z_next,x_start,x_end,p);
+}
+
+// ---------------------------------------------------------------------
+
+void GrayScottMeshCells(const float* old_a,const float* old_b,float* new_a,float* new_b,
+                        const int* neighbor_indices,const float* neighbor_weights,int max_neighbors,
+                        size_t first_cell,size_t last_cell,const GrayScottParameters& p)
+{
+    GetKernels().mesh_cells(old_a,old_b,new_a,new_b,neighbor_indices,neighbor_weights,max_neighbors,first_cell,last_cell,p);
+}
+
+// ---------------------------------------------------------------------
+
+void GrayScottMeshCellsCompressed(const float* old_a,const float* old_b,float* new_a,float* new_b,
+                                  const int* neighbor_offsets,const int* neighbor_indices,const float* neighbor_weights,
+                                  size_t first_cell,size_t last_cell,const GrayScottParameters& p)
+{
+    // (the cells have different numbers of neighbors, so we don't have vector versions of this one)
+    for(size_t iCell=first_cell;iCell<last_cell;iCell++)
+    {
+        // compute the laplacian
+        const float aval = old_a[iCell];
+        const float bval = old_b[iCell];
+        float dda = 0.0f;
+        float ddb = 0.0f;
+        for(int k=neighbor_offsets[iCell];k<neighbor_offsets[iCell+1];k++)
+        {
+            const int neighbor_index = neighbor_indices[k];
+            const float diffusion_coefficient = neighbor_weights[k];
+            dda += old_a[neighbor_index] * diffusion_coefficient;
+            ddb += old_b[neighbor_index] * diffusion_coefficient;
+        }
+        dda -= aval;
+        ddb -= bval;
+        dda *= 4.0f; // scale the Laplacian to be more similar to the 2D square grid version, so the same parameters work
+        ddb *= 4.0f;
+        Reaction(aval,bval,dda,ddb,p,new_a[iCell],new_b[iCell]);
+    }
+}
+
+// ---------------------------------------------------------------------
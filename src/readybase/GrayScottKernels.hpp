@@ -0,0 +1,59 @@
+/*  Copyright 2011-2021 The Ready Bunch
+
+    This file is part of Ready.
+
+    Ready is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Ready is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Ready. If not, see <http://www.gnu.org/licenses/>.         */
+
+#ifndef __GRAYSCOTTKERNELS__
+#define __GRAYSCOTTKERNELS__
+
+// STL:
+#include <cstddef>
+#include <string>
+
+// The Gray-Scott update loops used by the inbuilt CPU implementations. On x86 there are SSE2, AVX2 and AVX-512
+// versions and the widest one that the CPU supports is chosen at run time. All the versions do the same floating-point
+// operations in the same order, so they give the same results.
+
+struct GrayScottParameters
+{
+    float timestep,D_a,D_b,k,F;
+};
+
+/// Returns the name of the instruction set that the kernels are using on this machine, e.g. "AVX2".
+std::string GetGrayScottKernelInstructionSet();
+
+/// Updates one cell of an image, given the indices of its 7-point stencil neighbors.
+void GrayScottImageCell(const float* old_a,const float* old_b,float* new_a,float* new_b,size_t i,
+                        size_t i_x_prev,size_t i_x_next,size_t i_y_prev,size_t i_y_next,size_t i_z_prev,size_t i_z_next,
+                        const GrayScottParameters& p);
+
+/// Updates the cells [x_start,x_end) of a row of an image, where the x-neighbors of each cell are simply the cells either side.
+/** The row offsets are the indices of the first cell of the row and of its neighboring rows in y and z. */
+void GrayScottImageRow(const float* old_a,const float* old_b,float* new_a,float* new_b,
+                       size_t row,size_t row_y_prev,size_t row_y_next,size_t row_z_prev,size_t row_z_next,
+                       size_t x_start,size_t x_end,const GrayScottParameters& p);
+
+/// Updates the cells [first_cell,last_cell) of a mesh, where each cell has max_neighbors weighted neighbors.
+void GrayScottMeshCells(const float* old_a,const float* old_b,float* new_a,float* new_b,
+                        const int* neighbor_indices,const float* neighbor_weights,int max_neighbors,
+                        size_t first_cell,size_t last_cell,const GrayScottParameters& p);
+
+/// Updates the cells [first_cell,last_cell) of a mesh, where the neighbors of cell i are the entries [offsets[i],offsets[i+1]).
+/** Gives the same results as GrayScottMeshCells does with the neighbors padded out with zero weights. */
+void GrayScottMeshCellsCompressed(const float* old_a,const float* old_b,float* new_a,float* new_b,
+                                  const int* neighbor_offsets,const int* neighbor_indices,const float* neighbor_weights,
+                                  size_t first_cell,size_t last_cell,const GrayScottParameters& p);
+
+#endif
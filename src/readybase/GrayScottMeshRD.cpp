@@ -17,8 +17,13 @@
 
 // local:
 #include "GrayScottMeshRD.hpp"
+#include "GrayScottKernels.hpp"
+#include "ThreadPool.hpp"
 #include "utils.hpp"
 
+// STL:
+#include <algorithm>
+
 // VTK:
 #include <vtkFloatArray.h>
 #include <vtkUnstructuredGrid.h>
@@ -27,6 +32,29 @@
 
 // ---------------------------------------------------------------------
 
+namespace
+{
+    float* GetFloatPointer(vtkUnstructuredGrid* grid,const std::string& name)
+    {
+        vtkFloatArray *array = vtkFloatArray::SafeDownCast( grid->GetCellData()->GetArray(name.c_str()) );
+        if(!array)
+            throw std::runtime_error("GrayScottMeshRD::InternalUpdate : float array not found: "+name);
+        return array->GetPointer(0);
+    }
+
+    // Exchanges the named arrays of the two grids, without copying their values.
+    void SwapCellArray(vtkUnstructuredGrid* a,vtkUnstructuredGrid* b,const std::string& name)
+    {
+        vtkSmartPointer<vtkDataArray> array_a = a->GetCellData()->GetArray(name.c_str());
+        vtkSmartPointer<vtkDataArray> array_b = b->GetCellData()->GetArray(name.c_str());
+        // (AddArray replaces the array with the same name, keeping its position)
+        a->GetCellData()->AddArray(array_b);
+        b->GetCellData()->AddArray(array_a);
+    }
+}
+
+// ---------------------------------------------------------------------
+
 GrayScottMeshRD::GrayScottMeshRD()
     : InbuiltMeshRD(VTK_FLOAT)
 {
@@ -44,68 +72,52 @@ GrayScottMeshRD::GrayScottMeshRD()
 
 void GrayScottMeshRD::InternalUpdate(int n_steps)
 {
-    float timestep = this->GetParameterValueByName("timestep");
-    float D_a = this->GetParameterValueByName("D_a");
-    float D_b = this->GetParameterValueByName("D_b");
-    float k = this->GetParameterValueByName("k");
-    float F = this->GetParameterValueByName("F");
-
-    vtkFloatArray *source_a,*source_b;
-    vtkFloatArray *target_a,*target_b;
-    float dda,ddb,aval,bval,da,db;
-    int neighbor_index;
-    float diffusion_coefficient;
+    GrayScottParameters p;
+    p.timestep = this->GetParameterValueByName("timestep");
+    p.D_a = this->GetParameterValueByName("D_a");
+    p.D_b = this->GetParameterValueByName("D_b");
+    p.k = this->GetParameterValueByName("k");
+    p.F = this->GetParameterValueByName("F");
+
+    const vtkIdType N = this->mesh->GetNumberOfCells();
+    if(N == 0) return;
+
+    // work on the raw arrays rather than through vtkFloatArray, so that the kernels can be vectorized
+    float *mesh_a = GetFloatPointer(this->mesh,GetChemicalName(0));
+    float *mesh_b = GetFloatPointer(this->mesh,GetChemicalName(1));
+    float *buffer_a = GetFloatPointer(this->buffer,GetChemicalName(0));
+    float *buffer_b = GetFloatPointer(this->buffer,GetChemicalName(1));
+
+    // share the cells out among the threads, in chunks small enough to stay in cache (and a multiple of the vector width)
+    const vtkIdType CELLS_PER_CHUNK = 16384;
+    const int num_chunks = static_cast<int>((N + CELLS_PER_CHUNK - 1) / CELLS_PER_CHUNK);
+    ThreadPool& thread_pool = ThreadPool::GetInstance();
 
     for(int iStep=0;iStep<n_steps;iStep++)
     {
-        if(iStep%2)
-        {
-            source_a = vtkFloatArray::SafeDownCast( this->buffer->GetCellData()->GetArray(GetChemicalName(0).c_str()) );
-            source_b = vtkFloatArray::SafeDownCast( this->buffer->GetCellData()->GetArray(GetChemicalName(1).c_str()) );
-            target_a = vtkFloatArray::SafeDownCast( this->mesh->GetCellData()->GetArray(GetChemicalName(0).c_str()) );
-            target_b = vtkFloatArray::SafeDownCast( this->mesh->GetCellData()->GetArray(GetChemicalName(1).c_str()) );
-        }
-        else
+        const float *old_a = (iStep%2) ? buffer_a : mesh_a;
+        const float *old_b = (iStep%2) ? buffer_b : mesh_b;
+        float *new_a = (iStep%2) ? mesh_a : buffer_a;
+        float *new_b = (iStep%2) ? mesh_b : buffer_b;
+        thread_pool.ParallelFor(num_chunks, [&](int iChunk)
         {
-            source_a = vtkFloatArray::SafeDownCast( this->mesh->GetCellData()->GetArray(GetChemicalName(0).c_str()) );
-            source_b = vtkFloatArray::SafeDownCast( this->mesh->GetCellData()->GetArray(GetChemicalName(1).c_str()) );
-            target_a = vtkFloatArray::SafeDownCast( this->buffer->GetCellData()->GetArray(GetChemicalName(0).c_str()) );
-            target_b = vtkFloatArray::SafeDownCast( this->buffer->GetCellData()->GetArray(GetChemicalName(1).c_str()) );
-        }
-        for(vtkIdType iCell=0;iCell<this->mesh->GetNumberOfCells();iCell++)
-        {
-            // compute the laplacian
-            aval = source_a->GetValue(iCell);
-            bval = source_b->GetValue(iCell);
-            dda = 0.0f;
-            ddb = 0.0f;
-            for(int iNeighbor=0;iNeighbor<this->max_neighbors;iNeighbor++)
-            {
-                int k = iCell*this->max_neighbors + iNeighbor;
-                neighbor_index = this->cell_neighbor_indices[k];
-                diffusion_coefficient = this->cell_neighbor_weights[k];
-                dda += source_a->GetValue(neighbor_index) * diffusion_coefficient;
-                ddb += source_b->GetValue(neighbor_index) * diffusion_coefficient;
-            }
-            dda -= aval;
-            ddb -= bval;
-            dda *= 4.0f; // scale the Laplacian to be more similar to the 2D square grid version, so the same parameters work
-            ddb *= 4.0f;
-            // Gray-Scott update step:
-            da = D_a * dda - aval*bval*bval + F*(1-aval);
-            db = D_b * ddb + aval*bval*bval - (F+k)*bval;
-            #if !defined( USE_SSE )
-                // avoid denormals manually
-                da += 1e-10f;
-                db += 1e-10f;
-            #endif
-            // apply the step:
-            target_a->SetValue(iCell,aval + timestep*da );
-            target_b->SetValue(iCell,bval + timestep*db );
-        }
+            const size_t first_cell = iChunk * CELLS_PER_CHUNK;
+            const size_t last_cell = std::min<size_t>(N, first_cell + CELLS_PER_CHUNK);
+            if(this->padded_neighbors)
+                GrayScottMeshCells(old_a,old_b,new_a,new_b,this->cell_neighbor_indices.data(),this->cell_neighbor_weights.data(),
+                                   this->max_neighbors,first_cell,last_cell,p);
+            else
+                GrayScottMeshCellsCompressed(old_a,old_b,new_a,new_b,this->cell_neighbor_offsets.data(),
+                                             this->cell_neighbor_indices.data(),this->cell_neighbor_weights.data(),
+                                             first_cell,last_cell,p);
+        });
     }
     if(n_steps%2)
-        this->mesh->DeepCopy(this->buffer);
+    {
+        // output ended up in the buffer, so make it current
+        SwapCellArray(this->mesh,this->buffer,GetChemicalName(0));
+        SwapCellArray(this->mesh,this->buffer,GetChemicalName(1));
+    }
 }
 
 // ---------------------------------------------------------------------
@@ -33,7 +33,7 @@ class InbuiltMeshRD : public MeshRD
         bool HasEditableDataType() const override { return false; }
 };
 
-/// A non-OpenCL mesh implementation, just as an example.
+/// A non-OpenCL mesh implementation, with the cells shared out among the threads of the ThreadPool.
 class GrayScottMeshRD : public InbuiltMeshRD
 {
     public:
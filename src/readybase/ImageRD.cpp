@@ -17,15 +17,18 @@
 
 // local:
 #include "ImageRD.hpp"
+#include "ImplicitDiffusion.hpp"
 #include "IO_XML.hpp"
 #include "overlays.hpp"
 #include "Properties.hpp"
 #include "scene_items.hpp"
+#include "ThreadPool.hpp"
 #include "utils.hpp"
 
 // STL:
 #include <algorithm>
 #include <cassert>
+#include <sstream>
 #include <stdexcept>
 
 // VTK:
@@ -129,9 +132,12 @@ void ImageRD::DeallocateImages()
 int ImageRD::GetArenaDimensionality() const
 {
     assert(this->images.front());
+    // (we use the form of GetDimensions that doesn't write to the image, so that overlays can call this from many threads)
+    int dims[3];
+    this->images.front()->GetDimensions(dims);
     int dimensionality=0;
     for(int iDim=0;iDim<3;iDim++)
-        if(this->images.front()->GetDimensions()[iDim]>1)
+        if(dims[iDim]>1)
             dimensionality++;
     return dimensionality;
 }
@@ -140,21 +146,27 @@ int ImageRD::GetArenaDimensionality() const
 
 float ImageRD::GetX() const
 {
-    return this->images.front()->GetDimensions()[0];
+    int dims[3];
+    this->images.front()->GetDimensions(dims);
+    return dims[0];
 }
 
 // ---------------------------------------------------------------------
 
 float ImageRD::GetY() const
 {
-    return this->images.front()->GetDimensions()[1];
+    int dims[3];
+    this->images.front()->GetDimensions(dims);
+    return dims[1];
 }
 
 // ---------------------------------------------------------------------
 
 float ImageRD::GetZ() const
 {
-    return this->images.front()->GetDimensions()[2];
+    int dims[3];
+    this->images.front()->GetDimensions(dims);
+    return dims[2];
 }
 
 // ---------------------------------------------------------------------
@@ -168,6 +180,7 @@ vtkImageData* ImageRD::GetImage(int iChemical) const
 
 void ImageRD::GetImage(vtkImageData *im) const
 {
+    this->SyncToHost();
     vtkSmartPointer<vtkImageAppendComponents> iac = vtkSmartPointer<vtkImageAppendComponents>::New();
     for(int i=0;i<this->GetNumberOfChemicals();i++)
     {
@@ -181,6 +194,7 @@ void ImageRD::GetImage(vtkImageData *im) const
 
 void ImageRD::CopyFromImage(vtkImageData* im)
 {
+    this->SyncToHost();
     int n_arrays = im->GetPointData()->GetNumberOfArrays();
     int n_components = im->GetNumberOfScalarComponents();
 
@@ -231,6 +245,7 @@ void ImageRD::CopyFromMesh(
     const float value_inside,
     const float value_outside)
 {
+    this->SyncToHost();
     // decide the size of the image
     mesh->ComputeBounds();
     double bounds[6];
@@ -299,44 +314,152 @@ void ImageRD::AllocateImages(int x,int y,int z,int nc,int data_type)
 
 // ---------------------------------------------------------------------
 
-void ImageRD::GenerateInitialPattern()
+/* static */ void ImageRD::SwapImageData(vtkImageData* a,vtkImageData* b)
 {
-    if (this->initial_pattern_generator.ShouldZeroFirst()) {
-        this->BlankImage();
+    vtkSmartPointer<vtkDataArray> scalars_a = a->GetPointData()->GetScalars();
+    vtkSmartPointer<vtkDataArray> scalars_b = b->GetPointData()->GetScalars();
+    // the arrays keep the names of the images they belong to, since the rendering pipeline looks them up by name
+    const string name_a = scalars_a->GetName() ? scalars_a->GetName() : "";
+    const string name_b = scalars_b->GetName() ? scalars_b->GetName() : "";
+    scalars_a->SetName(name_b.empty() ? nullptr : name_b.c_str());
+    scalars_b->SetName(name_a.empty() ? nullptr : name_a.c_str());
+    a->GetPointData()->SetScalars(scalars_b);
+    b->GetPointData()->SetScalars(scalars_a);
+}
+
+// ---------------------------------------------------------------------
+
+vector<double> ImageRD::GetImplicitDiffusionCoefficients() const
+{
+    vector<double> coefficients(this->GetNumberOfChemicals(), 0.0);
+    istringstream iss(ReplaceAllSubstrings(this->implicit_diffusion, ",", " "));
+    string entry;
+    for(int iChem=0;iss >> entry;iChem++)
+    {
+        if(iChem >= this->GetNumberOfChemicals())
+            throw runtime_error("ImageRD::GetImplicitDiffusionCoefficients : more entries than chemicals: "+this->implicit_diffusion);
+        double value;
+        if(this->IsParameter(entry))
+            coefficients[iChem] = this->GetParameterValueByName(entry);
+        else if(from_string(entry, value))
+            coefficients[iChem] = value;
+        else
+            throw runtime_error("ImageRD::GetImplicitDiffusionCoefficients : not a parameter or a number: "+entry);
     }
+    return coefficients;
+}
 
+// ---------------------------------------------------------------------
+
+void ImageRD::DiffuseImplicitly(vtkImageData* image,double coefficient,double timestep) const
+{
+    // the grid spacing, as in the stencils
+    const double dx = this->IsParameter("dx") ? this->GetParameterValueByName("dx") : 1.0;
+    const double rate = coefficient * timestep / (dx * dx);
+    const int* dims = image->GetDimensions();
+    if(image->GetScalarType() == VTK_DOUBLE)
+        ::DiffuseImplicitly(static_cast<double*>(image->GetScalarPointer()), dims[0], dims[1], dims[2], this->wrap, rate);
+    else
+        ::DiffuseImplicitly(static_cast<float*>(image->GetScalarPointer()), dims[0], dims[1], dims[2], this->wrap, rate);
+}
+
+// ---------------------------------------------------------------------
+
+template<typename T>
+void ImageRD::ApplyOverlays()
+{
     const int X = this->images.front()->GetDimensions()[0];
     const int Y = this->images.front()->GetDimensions()[1];
     const int Z = this->images.front()->GetDimensions()[2];
+    const int NC = this->GetNumberOfChemicals();
 
-    for (size_t iOverlay = 0; iOverlay < this->initial_pattern_generator.GetNumberOfOverlays(); iOverlay++)
+    // find the box of cells that each overlay might change, so that we only visit those
+    struct OverlayRegion
+    {
+        const Overlay* overlay;
+        int lower[3],upper[3]; // (inclusive)
+    };
+    const int dims[3] = { X, Y, Z };
+    const int dimensionality = this->GetArenaDimensionality();
+    vector<OverlayRegion> overlays;
+    for(size_t iOverlay=0; iOverlay < this->initial_pattern_generator.GetNumberOfOverlays(); iOverlay++)
     {
-        this->initial_pattern_generator.GetOverlay(iOverlay).Reseed();
+        const Overlay& overlay = this->initial_pattern_generator.GetOverlay(iOverlay);
+        int iC = overlay.GetTargetChemical();
+        if(iC<0 || iC>=NC)
+            continue; // best for now to silently ignore this overlay, because the user has no way of editing the overlays (short of editing the file)
+            //throw runtime_error("Overlay: chemical out of range: "+GetChemicalName(iC));
+        double bounds[6];
+        overlay.GetBounds(X, Y, Z, dimensionality, bounds);
+        OverlayRegion region = { &overlay, { 0, 0, 0 }, { X-1, Y-1, Z-1 } };
+        bool is_empty = false;
+        for(int i=0;i<3;i++)
+        {
+            // (with a cell to spare on each side, since the shapes test the cells with their own arithmetic)
+            if(bounds[i*2+0] > -dims[i])
+                region.lower[i] = static_cast<int>(max(0.0, floor(bounds[i*2+0]) - 1.0));
+            if(bounds[i*2+1] < 2*dims[i])
+                region.upper[i] = static_cast<int>(min(dims[i] - 1.0, ceil(bounds[i*2+1]) + 1.0));
+            is_empty |= region.lower[i] > region.upper[i];
+        }
+        if(!is_empty)
+            overlays.push_back(region);
     }
+    if(overlays.empty())
+        return;
 
-    for(int z=0;z<Z;z++)
+    vector<T*> data(NC);
+    for(int i=0;i<NC;i++)
+        data[i] = static_cast<T*>(this->images[i]->GetScalarPointer());
+
+    // each cell only depends on its own values, so we can share out slabs of rows among the threads, and within a slab
+    // apply one overlay after another
+    const int TARGET_CELLS_PER_SLAB = 16384;
+    const int slab_Y = max(1, min(Y, TARGET_CELLS_PER_SLAB / max(1, X)));
+    const int num_slabs_Y = (Y + slab_Y - 1) / slab_Y;
+    ThreadPool::GetInstance().ParallelFor(num_slabs_Y * Z, [&](int iSlab)
     {
-        for(int y=0;y<Y;y++)
+        const int z = iSlab / num_slabs_Y;
+        const int y_start = (iSlab % num_slabs_Y) * slab_Y;
+        const int y_end = min(Y, y_start + slab_Y);
+        vector<double> vals(NC); // scratchpad for this thread
+        for(const OverlayRegion& region : overlays)
         {
-            for(int x=0;x<X;x++)
+            if(z < region.lower[2] || z > region.upper[2])
+                continue;
+            const Overlay* overlay = region.overlay;
+            T* target = data[overlay->GetTargetChemical()];
+            for(int y=max(y_start,region.lower[1]);y<min(y_end,region.upper[1]+1);y++)
             {
-                for(size_t iOverlay=0; iOverlay < this->initial_pattern_generator.GetNumberOfOverlays(); iOverlay++)
+                const size_t row = size_t(X) * (y + size_t(Y) * z);
+                for(int x=region.lower[0];x<=region.upper[0];x++)
                 {
-                    const Overlay& overlay = this->initial_pattern_generator.GetOverlay(iOverlay);
-
-                    int iC = overlay.GetTargetChemical();
-                    if(iC<0 || iC>=this->GetNumberOfChemicals())
-                        continue; // best for now to silently ignore this overlay, because the user has no way of editing the overlays (short of editing the file)
-                        //throw runtime_error("Overlay: chemical out of range: "+GetChemicalName(iC));
-
-                    vector<double> vals(this->GetNumberOfChemicals());
-                    for(int i=0;i<this->GetNumberOfChemicals();i++)
-                        vals[i] = this->GetImage(i)->GetScalarComponentAsDouble(x,y,z,0);
-                    this->GetImage(iC)->SetScalarComponentFromDouble(x, y, z, 0, overlay.Apply(vals, *this, x, y, z));
+                    const size_t i = row + x;
+                    for(int iC=0;iC<NC;iC++)
+                        vals[iC] = data[iC][i];
+                    target[i] = static_cast<T>(overlay->ApplyInPlace(vals, *this, x, y, z));
                 }
             }
         }
+    });
+}
+
+// ---------------------------------------------------------------------
+
+void ImageRD::GenerateInitialPattern()
+{
+    this->SyncToHost();
+    if (this->initial_pattern_generator.ShouldZeroFirst()) {
+        this->BlankImage();
     }
+
+    this->initial_pattern_generator.Reseed();
+
+    if(this->images.front()->GetScalarType()==VTK_DOUBLE)
+        this->ApplyOverlays<double>();
+    else
+        this->ApplyOverlays<float>();
+
     for(int i=0;i<(int)this->images.size();i++)
         this->images[i]->Modified();
     this->timesteps_taken = 0;
@@ -346,6 +469,7 @@ void ImageRD::GenerateInitialPattern()
 
 void ImageRD::BlankImage(float value)
 {
+    this->SyncToHost();
     for(int iImage=0;iImage<(int)this->images.size();iImage++)
     {
         this->images[iImage]->GetPointData()->GetScalars()->FillComponent(0, value);
@@ -381,6 +505,7 @@ void ImageRD::Update(int n_steps)
 
 void ImageRD::InitializeRenderPipeline(vtkRenderer* pRenderer,const Properties& render_settings)
 {
+    this->SyncToHost();
     this->rearrange_fields_filter = NULL;
     this->assign_attribute_filter = NULL;
 
@@ -1248,6 +1373,7 @@ void ImageRD::AddPhasePlot(vtkRenderer* pRenderer,float scaling,float low,float
 
 void ImageRD::SaveStartingPattern()
 {
+    this->SyncToHost();
     this->GetImage(this->starting_pattern);
 }
 
@@ -1255,6 +1381,7 @@ void ImageRD::SaveStartingPattern()
 
 void ImageRD::RestoreStartingPattern()
 {
+    this->SyncToHost();
     this->CopyFromImage(this->starting_pattern);
     this->timesteps_taken = 0;
 }
@@ -1270,6 +1397,7 @@ void ImageRD::SetDimensions(int x, int y, int z)
 
 void ImageRD::SetNumberOfChemicals(int n, bool reallocate_storage)
 {
+    this->SyncToHost();
     const int X = this->GetX();
     const int Y = this->GetY();
     const int Z = this->GetZ();
@@ -1312,6 +1440,7 @@ int ImageRD::GetNumberOfCells() const
 
 void ImageRD::GetAsMesh(vtkPolyData *out, const Properties &render_settings) const
 {
+    this->SyncToHost();
     bool use_image_interpolation = render_settings.GetProperty("use_image_interpolation").GetBool();
     int iActiveChemical = IndexFromChemicalName(render_settings.GetProperty("active_chemical").GetChemical());
     float contour_level = render_settings.GetProperty("contour_level").GetFloat();
@@ -1402,6 +1531,7 @@ void ImageRD::GetAsMesh(vtkPolyData *out, const Properties &render_settings) con
 
 void ImageRD::SaveFile(const char* filename,const Properties& render_settings,bool generate_initial_pattern_when_loading) const
 {
+    this->SyncToHost();
     // convert the image to named arrays
     vtkSmartPointer<vtkImageData> im = vtkSmartPointer<vtkImageData>::New();
     im->DeepCopy(this->images.front());
@@ -1429,6 +1559,7 @@ void ImageRD::SaveFile(const char* filename,const Properties& render_settings,bo
 
 void ImageRD::GetAs2DImage(vtkImageData *out,const Properties& render_settings) const
 {
+    this->SyncToHost();
     int iActiveChemical = IndexFromChemicalName(render_settings.GetProperty("active_chemical").GetChemical());
 
     // create a lookup table for mapping values to colors
@@ -1498,6 +1629,7 @@ void ImageRD::GetAs2DImage(vtkImageData *out,const Properties& render_settings)
 
 void ImageRD::SetFrom2DImage(int iChemical, vtkImageData *im)
 {
+    this->SyncToHost();
     if (this->images.front()->GetDimensions()[0] != im->GetDimensions()[0] ||
         this->images.front()->GetDimensions()[1] != im->GetDimensions()[1] ||
         this->images.front()->GetDimensions()[2] != im->GetDimensions()[2] ||
@@ -1515,6 +1647,7 @@ void ImageRD::SetFrom2DImage(int iChemical, vtkImageData *im)
 
 float ImageRD::GetValue(float x,float y,float z,const Properties& render_settings)
 {
+    this->SyncToHost();
     const int X = this->GetX();
     const int Y = this->GetY();
     const int Z = this->GetZ();
@@ -1559,6 +1692,7 @@ float ImageRD::GetValue(float x,float y,float z,const Properties& render_setting
 
 void ImageRD::SetValue(float x,float y,float z,float val,const Properties& render_settings)
 {
+    this->SyncToHost();
     const int X = this->GetX();
     const int Y = this->GetY();
     const int Z = this->GetZ();
@@ -1598,17 +1732,19 @@ void ImageRD::SetValue(float x,float y,float z,float val,const Properties& rende
 
     float old_val = this->GetImage(iChemical)->GetScalarComponentAsFloat(ix,iy,iz,0);
     int ijk[3] = { ix, iy, iz };
-    vtkIdType iCell = this->GetImage(iChemical)->ComputeCellId(ijk);
+    vtkIdType iCell = this->GetImage(iChemical)->ComputePointId(ijk); // (our cells are the image's points)
     this->StorePaintAction(iChemical,iCell,old_val);
     this->GetImage(iChemical)->SetScalarComponentFromFloat(ix,iy,iz,0,val);
     this->images[iChemical]->Modified();
     this->is_modified = true;
+    this->RegionWasPainted(iChemical,ijk,ijk);
 }
 
 // --------------------------------------------------------------------------------
 
 void ImageRD::SetValuesInRadius(float x,float y,float z,float r,float val,const Properties& render_settings)
 {
+    this->SyncToHost();
     const int X = this->GetX();
     const int Y = this->GetY();
     const int Z = this->GetZ();
@@ -1649,6 +1785,7 @@ void ImageRD::SetValuesInRadius(float x,float y,float z,float r,float val,const
     iy = min(Y-1,max(0,iy));
     iz = min(Z-1,max(0,iz));
 
+    int lower[3] = { X, Y, Z }, upper[3] = { -1, -1, -1 }; // the box around the cells we change
     for(int tz=max(0,int(iz-r));tz<=min(Z-1,int(iz+r));tz++)
     {
         for(int ty=max(0,int(iy-r));ty<=min(Y-1,int(iy+r));ty++)
@@ -1659,27 +1796,39 @@ void ImageRD::SetValuesInRadius(float x,float y,float z,float r,float val,const
                 {
                     float old_val = this->GetImage(iChemical)->GetScalarComponentAsFloat(tx,ty,tz,0);
                     int ijk[3] = { tx, ty, tz };
-                    vtkIdType iCell = this->GetImage(iChemical)->ComputeCellId(ijk);
+                    vtkIdType iCell = this->GetImage(iChemical)->ComputePointId(ijk); // (our cells are the image's points)
                     this->StorePaintAction(iChemical,iCell,old_val);
                     this->GetImage(iChemical)->SetScalarComponentFromFloat(tx,ty,tz,0,val);
+                    for(int i=0;i<3;i++)
+                    {
+                        lower[i] = min(lower[i],ijk[i]);
+                        upper[i] = max(upper[i],ijk[i]);
+                    }
                 }
             }
         }
     }
     this->images[iChemical]->Modified();
     this->is_modified = true;
+    if(upper[0] >= 0)
+        this->RegionWasPainted(iChemical,lower,upper);
 }
 
 // --------------------------------------------------------------------------------
 
 void ImageRD::FlipPaintAction(PaintAction& cca)
 {
+    this->SyncToHost();
     float *pCell = static_cast<float*>(this->GetImage(cca.iChemical)->GetScalarPointer()) + cca.iCell;
     float old_val = *pCell;
     *pCell = cca.val;
     cca.val = old_val;
     cca.done = !cca.done;
     this->images[cca.iChemical]->Modified();
+    const int X = this->GetX();
+    const int Y = this->GetY();
+    int ijk[3] = { cca.iCell % X, ( cca.iCell / X ) % Y, cca.iCell / ( X * Y ) };
+    this->RegionWasPainted(cca.iChemical,ijk,ijk);
 }
 
 // --------------------------------------------------------------------------------
@@ -1693,6 +1842,7 @@ size_t ImageRD::GetMemorySize() const
 
 vector<float> ImageRD::GetData(int i_chemical) const
 {
+    this->SyncToHost();
     vector<float> values(this->GetX() * this->GetY() * this->GetZ());
     size_t i = 0;
     for(int z = 0; z < this->GetZ(); z++)
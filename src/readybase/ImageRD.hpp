@@ -106,12 +106,30 @@ class ImageRD : public AbstractRD
 
         void DeallocateImages();
 
+        /// Draws the overlays of the initial pattern generator onto the images, whose scalars are of type T.
+        template<typename T> void ApplyOverlays();
+
         static vtkSmartPointer<vtkImageData> AllocateVTKImage(int x,int y,int z,int data_type);
 
+        /// Exchanges the values of two images of the same size and type by swapping their arrays, without copying.
+        /** The image objects themselves stay put, so the rendering pipeline sees the new values. */
+        static void SwapImageData(vtkImageData* a,vtkImageData* b);
+
+        /// The diffusion coefficient of each chemical from the implicit diffusion setting, or 0 for those not listed.
+        /** Throws std::runtime_error if an entry is neither a parameter name nor a number. */
+        std::vector<double> GetImplicitDiffusionCoefficients() const;
+
+        /// Takes an implicit diffusion step of the given size on one chemical, in place (see ImplicitDiffusion.hpp).
+        void DiffuseImplicitly(vtkImageData* image,double coefficient,double timestep) const;
+
         int GetArenaDimensionality() const override;
 
         void FlipPaintAction(PaintAction& cca) override;
 
+        /// Called when painting, undo or redo has changed the values of one chemical inside a box of cells (bounds inclusive).
+        /** Implementations that keep a copy of the data elsewhere (e.g. OpenCLImageRD) can use this to update just that part. */
+        virtual void RegionWasPainted(int /*iChemical*/,const int /*lower*/[3],const int /*upper*/[3]) {}
+
         // some saved handles into the pipeline, for manual updates to workaround a named arrays problem
         vtkAssignAttribute *assign_attribute_filter;
         vtkRearrangeFields *rearrange_fields_filter;
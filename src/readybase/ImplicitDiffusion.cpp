@@ -0,0 +1,166 @@
+/*  Copyright 2011-2021 The Ready Bunch
+
+    This file is part of Ready.
+
+    Ready is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Ready is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Ready. If not, see <http://www.gnu.org/licenses/>.         */
+
+// local:
+#include "ImplicitDiffusion.hpp"
+#include "ThreadPool.hpp"
+
+// STL:
+#include <algorithm>
+#include <vector>
+
+using namespace std;
+
+// ---------------------------------------------------------------------
+
+namespace
+{
+    /// The factored form of (1 - rate * Lxx) for lines of length n, which is the same for every line.
+    /** The matrix has 1 + 2 * rate on the diagonal and -rate either side, except that with zero flux the end cells have
+     *  only one neighbor, and with wrap-around the end cells are neighbors. The wrapped (cyclic) system is solved by
+     *  the Sherman-Morrison method: we solve a tridiagonal system and then subtract a multiple of a fixed vector. */
+    struct TridiagonalSolver
+    {
+        TridiagonalSolver(int n, bool wrap, double rate)
+        {
+            vector<double> lower(n, -rate), diagonal(n, 1.0 + 2.0 * rate), upper(n, -rate);
+            lower[0] = upper[n-1] = 0.0;
+            this->is_cyclic = wrap && n > 2;
+            this->corner_ratio = 0.0;
+            if(!wrap)
+            {
+                diagonal[0] = diagonal[n-1] = 1.0 + rate;
+            }
+            else if(n == 2)
+            {
+                // both neighbors of each cell are the other cell
+                lower[1] = upper[0] = -2.0 * rate;
+            }
+            else
+            {
+                // remove the corners, which are both -rate, from the matrix by adjusting the ends of the diagonal
+                const double gamma = -diagonal[0];
+                this->corner_ratio = -rate / gamma;
+                diagonal[0] -= gamma;
+                diagonal[n-1] -= rate * rate / gamma;
+            }
+
+            this->lower = lower;
+            this->inverse_pivot.resize(n);
+            this->upper_factor.resize(n);
+            double pivot = diagonal[0];
+            for(int i=0;i<n;i++)
+            {
+                if(i > 0)
+                    pivot = diagonal[i] - lower[i] * this->upper_factor[i-1];
+                this->inverse_pivot[i] = 1.0 / pivot;
+                this->upper_factor[i] = upper[i] / pivot;
+            }
+
+            if(this->is_cyclic)
+            {
+                // the correction vector, the solution for u = (gamma, 0, ..., 0, -rate)
+                const double gamma = -(1.0 + 2.0 * rate);
+                this->correction.assign(n, 0.0);
+                this->correction[0] = gamma;
+                this->correction[n-1] = -rate;
+                this->Solve(this->correction.data());
+                this->correction_denominator = 1.0 + this->correction[0] + this->corner_ratio * this->correction[n-1];
+            }
+        }
+
+        /// Solves the tridiagonal part for one line, in place.
+        void Solve(double* d) const
+        {
+            const int n = static_cast<int>(this->inverse_pivot.size());
+            d[0] *= this->inverse_pivot[0];
+            for(int i=1;i<n;i++)
+                d[i] = (d[i] - this->lower[i] * d[i-1]) * this->inverse_pivot[i];
+            for(int i=n-2;i>=0;i--)
+                d[i] -= this->upper_factor[i] * d[i+1];
+        }
+
+        vector<double> lower, inverse_pivot, upper_factor;
+        bool is_cyclic;
+        vector<double> correction;
+        double corner_ratio, correction_denominator;
+    };
+
+    /// Solves along lines of n values, spaced 'stride' apart in memory.
+    /** Lines that start next to each other are solved together, num_inner of them at a time, so that the memory is read
+     *  in contiguous runs even along y and z. There are num_outer such groups, spaced outer_stride apart. */
+    template<typename T>
+    void SolveLines(T* data, const TridiagonalSolver& solver, int n, size_t stride, int num_inner, int num_outer,
+                    size_t outer_stride)
+    {
+        const int TARGET_VALUES_PER_TASK = 16384;
+        const int inner_per_task = max(1, min(num_inner, TARGET_VALUES_PER_TASK / n));
+        const int num_inner_tasks = (num_inner + inner_per_task - 1) / inner_per_task;
+        const int outer_per_task = max(1, TARGET_VALUES_PER_TASK / (n * inner_per_task));
+        const int num_outer_tasks = (num_outer + outer_per_task - 1) / outer_per_task;
+        ThreadPool::GetInstance().ParallelFor(num_inner_tasks * num_outer_tasks, [&](int iTask)
+        {
+            const int inner_start = (iTask % num_inner_tasks) * inner_per_task;
+            const int width = min(inner_per_task, num_inner - inner_start);
+            const int outer_start = (iTask / num_inner_tasks) * outer_per_task;
+            const int outer_end = min(num_outer, outer_start + outer_per_task);
+            // the lines are copied into a buffer in double precision, with each line contiguous
+            vector<double> lines(size_t(width) * n);
+            for(int outer=outer_start;outer<outer_end;outer++)
+            {
+                T* first = data + outer * outer_stride + inner_start;
+                for(int j=0;j<n;j++)
+                    for(int b=0;b<width;b++)
+                        lines[size_t(b) * n + j] = first[j * stride + b];
+                for(int b=0;b<width;b++)
+                {
+                    double* line = lines.data() + size_t(b) * n;
+                    solver.Solve(line);
+                    if(solver.is_cyclic)
+                    {
+                        const double factor = (line[0] + solver.corner_ratio * line[n-1]) / solver.correction_denominator;
+                        for(int j=0;j<n;j++)
+                            line[j] -= factor * solver.correction[j];
+                    }
+                }
+                for(int j=0;j<n;j++)
+                    for(int b=0;b<width;b++)
+                        first[j * stride + b] = static_cast<T>(lines[size_t(b) * n + j]);
+            }
+        });
+    }
+}
+
+// ---------------------------------------------------------------------
+
+template<typename T>
+void DiffuseImplicitly(T* data, int X, int Y, int Z, bool wrap, double rate)
+{
+    if(rate <= 0.0)
+        return;
+    if(X > 1)
+        SolveLines(data, TridiagonalSolver(X, wrap, rate), X, 1, 1, Y * Z, X);
+    if(Y > 1)
+        SolveLines(data, TridiagonalSolver(Y, wrap, rate), Y, X, X, Z, size_t(X) * Y);
+    if(Z > 1)
+        SolveLines(data, TridiagonalSolver(Z, wrap, rate), Z, size_t(X) * Y, X * Y, 1, 0);
+}
+
+template void DiffuseImplicitly<float>(float* data, int X, int Y, int Z, bool wrap, double rate);
+template void DiffuseImplicitly<double>(double* data, int X, int Y, int Z, bool wrap, double rate);
+
+// ---------------------------------------------------------------------
@@ -0,0 +1,31 @@
+/*  Copyright 2011-2021 The Ready Bunch
+
+    This file is part of Ready.
+
+    Ready is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Ready is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Ready. If not, see <http://www.gnu.org/licenses/>.         */
+
+#ifndef __IMPLICITDIFFUSION__
+#define __IMPLICITDIFFUSION__
+
+/// Takes one implicit step of the diffusion equation du/dt = D * laplacian(u), in place, on an X*Y*Z grid.
+/** rate is D * timestep / dx^2. Instead of solving (1 - rate * L) u' = u with the full Laplacian L, each axis is solved
+ *  in turn with the three-point second difference along it, (1 - rate * Lxx) etc. - the locally one-dimensional form of
+ *  the alternating-direction implicit method - so that each solve is a set of tridiagonal systems. The result is
+ *  first-order accurate in time, like forward-Euler, but stable for any timestep. The edges are either wrapped or have
+ *  zero flux, to match the stencils. The lines of the grid are shared out among the threads of the ThreadPool.
+ *  Axes of length 1 are skipped. Defined for float and double. */
+template<typename T>
+void DiffuseImplicitly(T* data, int X, int Y, int Z, bool wrap, double rate);
+
+#endif
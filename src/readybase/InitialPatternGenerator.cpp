@@ -19,12 +19,17 @@ along with Ready. If not, see <http://www.gnu.org/licenses/>.         */
 #include "InitialPatternGenerator.hpp"
 
 // STL:
+#include <random>
+#include <stdexcept>
 #include <string>
 
 using namespace std;
 
 InitialPatternGenerator::InitialPatternGenerator()
     : zero_first(true)
+    , has_seed(false)
+    , seed(0)
+    , key(0)
 {
 }
 
@@ -53,6 +58,20 @@ void InitialPatternGenerator::ReadFromXML(vtkXMLDataElement* node)
         if (zero_first_str && string(zero_first_str) == "false")
             this->zero_first = false;
 
+        this->has_seed = false;
+        const char *seed_str = node->GetAttribute("seed");
+        if (seed_str)
+        {
+            try
+            {
+                this->SetSeed(stoull(seed_str));
+            }
+            catch (const exception&)
+            {
+                throw runtime_error(string("initial_pattern_generator : invalid seed: ") + seed_str);
+            }
+        }
+
         for (int i = 0; i < node->GetNumberOfNestedElements(); i++)
         {
             this->overlays.push_back(make_unique<Overlay>(node->GetNestedElement(i)));
@@ -69,6 +88,8 @@ vtkSmartPointer<vtkXMLDataElement> InitialPatternGenerator::GetAsXML(bool genera
     ipg->SetName("initial_pattern_generator");
     ipg->SetAttribute("apply_when_loading", generate_initial_pattern_when_loading ? "true" : "false");
     ipg->SetAttribute("zero_first", this->zero_first ? "true" : "false");
+    if (this->has_seed)
+        ipg->SetAttribute("seed", to_string(this->seed).c_str());
     for (size_t i = 0; i < this->overlays.size(); i++)
     {
         ipg->AddNestedElement(this->overlays[i]->GetAsXML());
@@ -78,6 +99,22 @@ vtkSmartPointer<vtkXMLDataElement> InitialPatternGenerator::GetAsXML(bool genera
 
 // ---------------------------------------------------------------------
 
+void InitialPatternGenerator::Reseed()
+{
+    this->key = this->seed;
+    if (!this->has_seed)
+    {
+        random_device rd;
+        this->key = (uint64_t(rd()) << 32) | rd();
+    }
+    for (size_t i = 0; i < this->overlays.size(); i++)
+    {
+        this->overlays[i]->Reseed(random_hash(this->key, i));
+    }
+}
+
+// ---------------------------------------------------------------------
+
 void InitialPatternGenerator::CreateDefaultInitialPatternGenerator(size_t num_chemicals)
 {
     RemoveAllOverlays();
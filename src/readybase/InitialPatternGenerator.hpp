@@ -19,6 +19,7 @@ along with Ready. If not, see <http://www.gnu.org/licenses/>.         */
 #include "overlays.hpp"
 
 // STL:
+#include <cstdint>
 #include <vector>
 
 /// Generates image/mesh patterns by drawing a series of overlays.
@@ -40,10 +41,25 @@ class InitialPatternGenerator
         void CreateDefaultInitialPatternGenerator(size_t num_chemicals);
         bool ShouldZeroFirst() const { return this->zero_first; }
 
+        /// Gives each overlay that uses randomness its random key, from the seed if there is one or else at random.
+        /** Call before generating the pattern. With a seed, the same pattern is made every time, on any machine. */
+        void Reseed();
+        /// The key that the last call to Reseed used. Overlay i was given random_hash(key, i).
+        std::uint64_t GetKey() const { return this->key; }
+
+        /// Sets the seed that is saved with the pattern, so that runs are reproducible.
+        void SetSeed(std::uint64_t seed) { this->seed = seed; this->has_seed = true; }
+        void ClearSeed() { this->has_seed = false; }
+        bool HasSeed() const { return this->has_seed; }
+        std::uint64_t GetSeed() const { return this->seed; }
+
     private:
 
         void RemoveAllOverlays();
 
         std::vector<std::unique_ptr<Overlay>> overlays;
         bool zero_first;
+        bool has_seed;
+        std::uint64_t seed;
+        std::uint64_t key;
 };
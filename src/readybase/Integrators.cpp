@@ -0,0 +1,270 @@
+/*  Copyright 2011-2021 The Ready Bunch
+
+    This file is part of Ready.
+
+    Ready is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Ready is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Ready. If not, see <http://www.gnu.org/licenses/>.         */
+
+// local:
+#include "Integrators.hpp"
+#include "utils.hpp"
+
+// STL:
+#include <algorithm>
+#include <cmath>
+#include <limits>
+#include <sstream>
+#include <stdexcept>
+
+// VTK:
+#include <vtkXMLDataElement.h>
+
+using namespace std;
+
+// ---------------------------------------------------------------------
+
+namespace
+{
+    const ButcherTableau EULER = { "euler", { {} }, { 1.0 }, {}, 0 };
+
+    // the midpoint method
+    const ButcherTableau RK2 = { "rk2", { {}, { 0.5 } }, { 0.0, 1.0 }, {}, 0 };
+
+    // the classic fourth-order method
+    const ButcherTableau RK4 = { "rk4",
+        { {}, { 0.5 }, { 0.0, 0.5 }, { 0.0, 0.0, 1.0 } },
+        { 1.0/6.0, 1.0/3.0, 1.0/3.0, 1.0/6.0 }, {}, 0 };
+
+    // Cash-Karp: fifth order, with an embedded fourth-order solution for the error estimate
+    // J. R. Cash, A. H. Karp (1990) "A variable order Runge-Kutta method for initial value problems with rapidly
+    // varying right-hand sides", ACM Transactions on Mathematical Software 16(3)
+    const ButcherTableau RK45 = { "rk45",
+        { {},
+          { 1.0/5.0 },
+          { 3.0/40.0, 9.0/40.0 },
+          { 3.0/10.0, -9.0/10.0, 6.0/5.0 },
+          { -11.0/54.0, 5.0/2.0, -70.0/27.0, 35.0/27.0 },
+          { 1631.0/55296.0, 175.0/512.0, 575.0/13824.0, 44275.0/110592.0, 253.0/4096.0 } },
+        { 37.0/378.0, 0.0, 250.0/621.0, 125.0/594.0, 0.0, 512.0/1771.0 },
+        { 37.0/378.0 - 2825.0/27648.0, 0.0, 250.0/621.0 - 18575.0/48384.0, 125.0/594.0 - 13525.0/55296.0,
+          -277.0/14336.0, 512.0/1771.0 - 1.0/4.0 },
+        4 };
+
+    const ButcherTableau* const TABLEAUS[] = { &EULER, &RK2, &RK4, &RK45 }; // in the order of AbstractRD::Integrator
+
+    /// Returns the timestep to try next, given the error of a step of the current size relative to the tolerance.
+    double GetNextAdaptiveTimestep(double timestep, double relative_error, int error_order)
+    {
+        const double SAFETY = 0.9;     // aim a little below the tolerance, so that fewer steps are rejected
+        const double MIN_FACTOR = 0.2; // don't change the timestep too quickly in either direction
+        const double MAX_FACTOR = 5.0;
+        double factor = MAX_FACTOR;
+        if(!(relative_error < numeric_limits<double>::infinity())) // (includes NaN)
+            factor = MIN_FACTOR;
+        else if(relative_error > 0.0)
+            factor = min(MAX_FACTOR, max(MIN_FACTOR, SAFETY * pow(relative_error, -1.0 / (error_order + 1))));
+        return timestep * factor;
+    }
+
+    /// Returns e.g. "timestep * (0.5f * a_k0[i] + 0.25f * delta_a)", or an empty string if all the weights are zero.
+    string GetWeightedRates(const vector<double>& weights, int current_stage, const string& chem, const string& index,
+                            const string& data_type_suffix)
+    {
+        ostringstream oss;
+        for(size_t j=0;j<weights.size();j++)
+        {
+            if(weights[j] == 0.0)
+                continue;
+            if(oss.tellp() > 0)
+                oss << (weights[j] < 0.0 ? " - " : " + ");
+            else if(weights[j] < 0.0)
+                oss << "-";
+            if(fabs(weights[j]) != 1.0)
+                oss << GetKernelLiteral(fabs(weights[j]), data_type_suffix) << " * ";
+            if(static_cast<int>(j) == current_stage)
+                oss << "delta_" << chem;
+            else
+                oss << chem << "_k" << j << "[" << index << "]";
+        }
+        if(oss.tellp() == 0)
+            return "";
+        return "timestep * (" + oss.str() + ")";
+    }
+}
+
+// ---------------------------------------------------------------------
+
+bool ButcherTableau::IsRateStored(int s) const
+{
+    if(s >= this->GetNumberOfStages() - 1)
+        return false; // the last stage goes straight into the final combination
+    if(this->b[s] != 0.0 || (this->IsAdaptive() && this->error_b[s] != 0.0))
+        return true;
+    for(int i=s+2;i<this->GetNumberOfStages();i++)
+        if(this->a[i][s] != 0.0)
+            return true;
+    return false;
+}
+
+// ---------------------------------------------------------------------
+
+const ButcherTableau& GetButcherTableau(AbstractRD::Integrator integrator)
+{
+    return *TABLEAUS[static_cast<int>(integrator)];
+}
+
+// ---------------------------------------------------------------------
+
+string GetIntegratorName(AbstractRD::Integrator integrator)
+{
+    return GetButcherTableau(integrator).name;
+}
+
+// ---------------------------------------------------------------------
+
+AbstractRD::Integrator GetIntegratorFromName(const string& name)
+{
+    for(size_t i=0;i<sizeof(TABLEAUS)/sizeof(TABLEAUS[0]);i++)
+        if(TABLEAUS[i]->name == name)
+            return static_cast<AbstractRD::Integrator>(i);
+    throw runtime_error("unknown integrator attribute: " + name);
+}
+
+// ---------------------------------------------------------------------
+
+void ReadIntegratorAttributes(vtkXMLDataElement* xml_formula, AbstractRD::Integrator& integrator, float& tolerance)
+{
+    string integrator_string;
+    read_optional_attribute(xml_formula, "integrator", integrator_string);
+    integrator = integrator_string.empty() ? AbstractRD::Integrator::Euler : GetIntegratorFromName(integrator_string);
+    read_optional_attribute(xml_formula, "tolerance", tolerance);
+    if(!(tolerance > 0.0f))
+        throw runtime_error("tolerance attribute must be greater than zero");
+}
+
+// ---------------------------------------------------------------------
+
+void WriteIntegratorAttributes(vtkXMLDataElement* xml_formula, AbstractRD::Integrator integrator, float tolerance)
+{
+    if(integrator == AbstractRD::Integrator::Euler)
+        return;
+    xml_formula->SetAttribute("integrator", GetIntegratorName(integrator).c_str());
+    if(GetButcherTableau(integrator).IsAdaptive())
+        xml_formula->SetFloatAttribute("tolerance", tolerance);
+}
+
+// ---------------------------------------------------------------------
+
+int GetTimestepParameterIndex(const AbstractRD& system)
+{
+    for(int iParam=0;iParam<system.GetNumberOfParameters();iParam++)
+        if(system.GetParameterName(iParam) == "timestep")
+            return iParam;
+    throw runtime_error("GetTimestepParameterIndex : the integrator needs a parameter called timestep");
+}
+
+// ---------------------------------------------------------------------
+
+double RunIntegratorSteps(const ButcherTableau& tableau, int n_steps, double timestep, double tolerance,
+                          const function<double(double)>& take_step, const function<void()>& accept)
+{
+    const int MAX_REJECTIONS = 50; // by then the timestep has shrunk by a factor of 5^50, so something is wrong
+    int n_rejections = 0;
+    for(int iStep=0;iStep<n_steps;)
+    {
+        const double error = take_step(timestep);
+        if(!tableau.IsAdaptive())
+        {
+            accept();
+            iStep++;
+            continue;
+        }
+        const double relative_error = error / tolerance;
+        if(relative_error <= 1.0)
+        {
+            accept();
+            iStep++;
+            n_rejections = 0;
+        }
+        else if(++n_rejections > MAX_REJECTIONS)
+            throw runtime_error("RunIntegratorSteps : the error stayed above the tolerance even with a tiny timestep");
+        timestep = GetNextAdaptiveTimestep(timestep, relative_error, tableau.error_order);
+    }
+    return timestep;
+}
+
+// ---------------------------------------------------------------------
+
+void WriteIntegratorKernelArguments(ostream& kernel_source, const ButcherTableau& tableau,
+                                    const vector<string>& chemicals, const string& data_type_string)
+{
+    for(const string& chem : chemicals)
+        kernel_source << ",global " << data_type_string << " *" << chem << "_base";
+    for(int s=0;s<tableau.GetNumberOfStages();s++)
+        if(tableau.IsRateStored(s))
+            for(const string& chem : chemicals)
+                kernel_source << ",global " << data_type_string << " *" << chem << "_k" << s;
+    if(tableau.IsAdaptive())
+        kernel_source << ",global " << data_type_string << " *rd_error";
+    kernel_source << ",const int rd_stage";
+}
+
+// ---------------------------------------------------------------------
+
+void WriteIntegratorKernelStages(ostream& kernel_source, const ButcherTableau& tableau, const vector<string>& chemicals,
+                                 const string& index, const string& indent, const string& data_type_string,
+                                 const string& data_type_suffix)
+{
+    const int S = tableau.GetNumberOfStages();
+    kernel_source << indent << "// " << tableau.name << " update, one stage at a time:\n";
+    for(int s=0;s<S;s++)
+    {
+        const bool last_stage = (s == S-1);
+        if(s == 0)
+            kernel_source << indent << "if (rd_stage == 0)\n";
+        else if(!last_stage)
+            kernel_source << indent << "else if (rd_stage == " << s << ")\n";
+        else
+            kernel_source << indent << "else\n";
+        kernel_source << indent << "{\n";
+        const string indent2 = indent + indent;
+        if(tableau.IsRateStored(s))
+        {
+            for(const string& chem : chemicals)
+                kernel_source << indent2 << chem << "_k" << s << "[" << index << "] = delta_" << chem << ";\n";
+        }
+        // the input for the next stage, or the final values
+        const vector<double>& weights = last_stage ? tableau.b : tableau.a[s+1];
+        for(const string& chem : chemicals)
+        {
+            const string weighted_rates = GetWeightedRates(weights, s, chem, index, data_type_suffix);
+            kernel_source << indent2 << chem << "_out[" << index << "] = " << chem << "_base[" << index << "]"
+                          << (weighted_rates.empty() ? "" : " + " + weighted_rates) << ";\n";
+        }
+        if(last_stage && tableau.IsAdaptive())
+        {
+            // the error, relative to 1 + the size of the new value, taking the largest over the chemicals
+            kernel_source << indent2 << data_type_string << " rd_cell_error = 0.0" << data_type_suffix << ";\n";
+            for(const string& chem : chemicals)
+            {
+                const string weighted_errors = GetWeightedRates(tableau.error_b, s, chem, index, data_type_suffix);
+                kernel_source << indent2 << "rd_cell_error = max(rd_cell_error, fabs(" << weighted_errors << ") / (1.0"
+                              << data_type_suffix << " + fabs(" << chem << "_out[" << index << "])));\n";
+            }
+            kernel_source << indent2 << "rd_error[" << index << "] = rd_cell_error;\n";
+        }
+        kernel_source << indent << "}\n";
+    }
+}
+
+// ---------------------------------------------------------------------
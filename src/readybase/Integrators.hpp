@@ -0,0 +1,97 @@
+/*  Copyright 2011-2021 The Ready Bunch
+
+    This file is part of Ready.
+
+    Ready is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Ready is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Ready. If not, see <http://www.gnu.org/licenses/>.         */
+
+#ifndef __INTEGRATORS__
+#define __INTEGRATORS__
+
+// local:
+#include "AbstractRD.hpp"
+
+// STL:
+#include <functional>
+#include <ostream>
+#include <string>
+#include <vector>
+
+// The ways that the formula implementations can step forward in time. Each is an explicit Runge-Kutta method, where a
+// step of size h from u evaluates the rates of change (delta_a etc.) at several stages and combines them:
+//     k[s] = rates at (u + h * sum_j a[s][j] * k[j])    for each stage s, with j < s
+//     new u = u + h * sum_j b[j] * k[j]
+// Forward-Euler is the method with a single stage. Since the stages need the rates at the neighboring cells, each stage
+// is a separate pass over the grid.
+
+/// The coefficients of an explicit Runge-Kutta method.
+struct ButcherTableau
+{
+    std::string name;                   ///< as used in the files, e.g. "rk4"
+    std::vector<std::vector<double>> a; ///< a[s] has s entries
+    std::vector<double> b;
+    /// If the method is adaptive, b minus the weights of the lower-order solution that is embedded in it, so that
+    /// h * sum_j error_b[j] * k[j] is an estimate of the error of the step. Empty otherwise.
+    std::vector<double> error_b;
+    int error_order; ///< the order of the lower-order solution, which sets how the timestep is changed
+
+    int GetNumberOfStages() const { return static_cast<int>(this->b.size()); }
+    bool IsAdaptive() const { return !this->error_b.empty(); }
+
+    /// Is k[s] needed by a later stage, or by the final combination, other than the stage right after it?
+    /** (The stage that computes k[s] also computes the input for stage s+1, so only these ones need storing.) */
+    bool IsRateStored(int s) const;
+};
+
+const ButcherTableau& GetButcherTableau(AbstractRD::Integrator integrator);
+
+/// Returns e.g. "euler", "rk4", as in the files.
+std::string GetIntegratorName(AbstractRD::Integrator integrator);
+/// Throws std::runtime_error if the name isn't one of the integrators.
+AbstractRD::Integrator GetIntegratorFromName(const std::string& name);
+
+/// Reads the optional "integrator" and "tolerance" attributes of a formula element.
+void ReadIntegratorAttributes(vtkXMLDataElement* xml_formula, AbstractRD::Integrator& integrator, float& tolerance);
+/// Writes the integrator attributes, leaving them out when they are the defaults, so that older versions can still load the file.
+void WriteIntegratorAttributes(vtkXMLDataElement* xml_formula, AbstractRD::Integrator integrator, float tolerance);
+
+/// Returns the index of the "timestep" parameter, which sets the size of each step. Throws std::runtime_error if there isn't one.
+int GetTimestepParameterIndex(const AbstractRD& system);
+
+/// Takes n_steps steps with an integrator, retrying any step whose error is too large with a smaller timestep.
+/** take_step(timestep) should take one step from the current values, without changing them, and return the largest
+ *  error over all the cells and chemicals, as |error| / (1 + |new value|), or 0 if the integrator isn't adaptive.
+ *  accept() should then make the new values current. For adaptive integrators the timestep grows or shrinks after each
+ *  step to keep the error close to the tolerance. Returns the timestep for the next step. */
+double RunIntegratorSteps(const ButcherTableau& tableau, int n_steps, double timestep, double tolerance,
+                          const std::function<double(double)>& take_step, const std::function<void()>& accept);
+
+// For the OpenCL formula kernels. A multi-stage kernel computes the rates at its input, as usual, and then either writes
+// the input for the next stage or the final values, depending on which stage it is running. Its extra arguments are:
+//     a_base, b_base, ...      - the values at the start of the step
+//     a_k0, b_k0, ...          - the rates of each stage that IsRateStored
+//     rd_error                 - for adaptive methods, the scaled error of each cell (see RunIntegratorSteps)
+//     rd_stage                 - which stage is running, from 0
+// The rates are taken from delta_a etc., so any changes that the formula makes to a, b, ... directly are ignored.
+
+/// Writes the extra kernel arguments, each preceded by a comma.
+void WriteIntegratorKernelArguments(std::ostream& kernel_source, const ButcherTableau& tableau,
+                                    const std::vector<std::string>& chemicals, const std::string& data_type_string);
+
+/// Writes the end of the kernel, in place of the forward-Euler step. The cell being computed is at 'index'.
+void WriteIntegratorKernelStages(std::ostream& kernel_source, const ButcherTableau& tableau,
+                                 const std::vector<std::string>& chemicals, const std::string& index,
+                                 const std::string& indent, const std::string& data_type_string,
+                                 const std::string& data_type_suffix);
+
+#endif
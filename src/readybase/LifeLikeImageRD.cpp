@@ -0,0 +1,369 @@
+/*  Copyright 2011-2021 The Ready Bunch
+
+    This file is part of Ready.
+
+    Ready is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Ready is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Ready. If not, see <http://www.gnu.org/licenses/>.         */
+
+// local:
+#include "LifeLikeImageRD.hpp"
+#include "ThreadPool.hpp"
+
+// STL:
+#include <algorithm>
+#include <cmath>
+#include <stdexcept>
+
+// VTK:
+#include <vtkImageData.h>
+
+using namespace std;
+
+// ---------------------------------------------------------------------
+
+namespace
+{
+    const int MAX_RANGE = 63;  // (so that a row's padding fits in the word either side of it)
+    const int MAX_PLANES = 24; // enough bits to count the neighbors of a cell in 3D with the largest range
+
+    inline bool GetBit(const uint64_t* row,int i)
+    {
+        return (row[i >> 6] >> (i & 63)) & 1;
+    }
+
+    inline void SetBit(uint64_t* row,int i,bool value)
+    {
+        const uint64_t bit = uint64_t(1) << (i & 63);
+        if(value)
+            row[i >> 6] |= bit;
+        else
+            row[i >> 6] &= ~bit;
+    }
+
+    /// Copies the cells at each end of a row into the R cells of padding either side of it.
+    void FillPadding(uint64_t* row,int X,int R,bool wrap)
+    {
+        for(int g=1;g<=R;g++)
+        {
+            const int left = wrap ? ((-g) % X + X) % X : 0;
+            const int right = wrap ? (X - 1 + g) % X : X - 1;
+            SetBit(row, R - g, GetBit(row, R + left));
+            SetBit(row, R + X - 1 + g, GetBit(row, R + right));
+        }
+    }
+
+    /// Returns the 64 bits of a row that start at bit 64*iWord + dx, with zeros for any that are before the row.
+    inline uint64_t GetShiftedWord(const uint64_t* row,int iWord,int dx)
+    {
+        const int start = 64 * iWord + dx;
+        if(start < 0)
+            return row[0] << -start;
+        const int w = start >> 6;
+        const int offset = start & 63;
+        if(offset == 0)
+            return row[w];
+        return (row[w] >> offset) | (row[w+1] << (64 - offset));
+    }
+
+    /// Adds one to the count of each cell whose bit is set. The counts are held as bit planes: planes[j] has bit j of each.
+    inline void AddToCounts(uint64_t* planes,int num_planes,uint64_t bits)
+    {
+        for(int j=0;j<num_planes && bits;j++)
+        {
+            const uint64_t carry = planes[j] & bits;
+            planes[j] ^= bits;
+            bits = carry;
+        }
+    }
+
+    /// Returns a bit for each cell, set if its count is at least n.
+    inline uint64_t CountIsAtLeast(const uint64_t* planes,int num_planes,int n)
+    {
+        if(n <= 0) return ~uint64_t(0);
+        if(n >= (1 << num_planes)) return 0;
+        // compare the bits from the top down, as long as they have been equal so far
+        uint64_t greater = 0, equal = ~uint64_t(0);
+        for(int j=num_planes-1;j>=0;j--)
+        {
+            if((n >> j) & 1)
+                equal &= planes[j];
+            else
+            {
+                greater |= equal & planes[j];
+                equal &= ~planes[j];
+            }
+        }
+        return greater | equal;
+    }
+
+    /// Returns a bit for each cell, set if its count is from low to high inclusive.
+    inline uint64_t CountIsBetween(const uint64_t* planes,int num_planes,int low,int high)
+    {
+        if(low > high) return 0;
+        return CountIsAtLeast(planes, num_planes, low) & ~CountIsAtLeast(planes, num_planes, high + 1);
+    }
+
+    struct LifeLikeRule
+    {
+        int range[3]; ///< in x, y and z (zero for the dimensions that the image doesn't have)
+        int birth_min, birth_max, survival_min, survival_max;
+        int num_planes; ///< enough to hold the largest neighbor count
+    };
+
+    /// Computes the next state of the cells in one row, but not its padding.
+    /** rows holds the padded rows around it, for dz and then dy from -range to +range. */
+    void UpdateRow(const uint64_t* const* rows,uint64_t* out,int X,const LifeLikeRule& rule)
+    {
+        const int R = rule.range[0];
+        const int num_rows = (2 * rule.range[1] + 1) * (2 * rule.range[2] + 1);
+        const int iCenterRow = num_rows / 2;
+        const int last_word = (R + X - 1) >> 6;
+        for(int iWord=0;iWord<=last_word;iWord++)
+        {
+            uint64_t planes[MAX_PLANES] = {};
+            for(int iRow=0;iRow<num_rows;iRow++)
+                for(int dx=-R;dx<=R;dx++)
+                    if(iRow != iCenterRow || dx != 0)
+                        AddToCounts(planes, rule.num_planes, GetShiftedWord(rows[iRow], iWord, dx));
+            const uint64_t alive = rows[iCenterRow][iWord];
+            const uint64_t next = (alive & CountIsBetween(planes, rule.num_planes, rule.survival_min, rule.survival_max))
+                               | (~alive & CountIsBetween(planes, rule.num_planes, rule.birth_min, rule.birth_max));
+            // keep just the bits of the cells themselves
+            const int first_bit = max(0, R - 64 * iWord);
+            const int end_bit = min(64, R + X - 64 * iWord);
+            const uint64_t mask = (end_bit == 64 ? ~uint64_t(0) : (uint64_t(1) << end_bit) - 1) & ~((uint64_t(1) << first_bit) - 1);
+            out[iWord] = next & mask;
+        }
+    }
+
+    template<typename T>
+    void PackRow(const T* values,uint64_t* row,int X,int R,bool wrap)
+    {
+        for(int x=0;x<X;x++)
+            if(values[x] >= T(0.5))
+                row[(R + x) >> 6] |= uint64_t(1) << ((R + x) & 63);
+        FillPadding(row, X, R, wrap);
+    }
+
+    template<typename T>
+    void UnpackRow(const uint64_t* row,T* values,int X,int R)
+    {
+        for(int x=0;x<X;x++)
+            values[x] = GetBit(row, R + x) ? T(1) : T(0);
+    }
+}
+
+// ---------------------------------------------------------------------
+
+LifeLikeImageRD::LifeLikeImageRD()
+    : InbuiltImageRD(VTK_FLOAT)
+    , packed_range(0)
+    , packed_wrap(true)
+    , words_per_row(0)
+    , need_pack(true)
+    , need_unpack(false)
+{
+    this->rule_name = "Life-like";
+    this->n_chemicals = 1;
+    // Conway's Life
+    this->AddParameter("range",1.0f);
+    this->AddParameter("birth_min",3.0f);
+    this->AddParameter("birth_max",3.0f);
+    this->AddParameter("survival_min",2.0f);
+    this->AddParameter("survival_max",3.0f);
+}
+
+// ---------------------------------------------------------------------
+
+void LifeLikeImageRD::AllocateImages(int x,int y,int z,int nc,int data_type)
+{
+    // N.B. the bits are unpacked to floats, so data_type is ignored
+    if(nc!=1) throw runtime_error("LifeLikeImageRD::AllocateImages : this implementation is for 1 chemical only");
+    ImageRD::AllocateImages(x,y,z,1,VTK_FLOAT);
+    this->cells.clear();
+    this->buffer.clear();
+    this->need_pack = true;
+    this->need_unpack = false;
+}
+
+// ---------------------------------------------------------------------
+
+void LifeLikeImageRD::CopyFromImage(vtkImageData* im)
+{
+    ImageRD::CopyFromImage(im);
+    this->need_pack = true;
+}
+
+// ---------------------------------------------------------------------
+
+void LifeLikeImageRD::SetFrom2DImage(int iChemical, vtkImageData *im)
+{
+    ImageRD::SetFrom2DImage(iChemical, im);
+    this->need_pack = true;
+}
+
+// ---------------------------------------------------------------------
+
+void LifeLikeImageRD::GenerateInitialPattern()
+{
+    ImageRD::GenerateInitialPattern();
+    this->need_pack = true;
+}
+
+// ---------------------------------------------------------------------
+
+void LifeLikeImageRD::BlankImage(float value)
+{
+    ImageRD::BlankImage(value);
+    this->need_pack = true;
+}
+
+// ---------------------------------------------------------------------
+
+void LifeLikeImageRD::RegionWasPainted(int /*iChemical*/,const int /*lower*/[3],const int /*upper*/[3])
+{
+    this->need_pack = true;
+}
+
+// ---------------------------------------------------------------------
+
+size_t LifeLikeImageRD::GetMemorySize() const
+{
+    return ImageRD::GetMemorySize() + (this->cells.size() + this->buffer.size()) * sizeof(uint64_t);
+}
+
+// ---------------------------------------------------------------------
+
+void LifeLikeImageRD::PackIfNeeded(int range)
+{
+    if(range != this->packed_range || this->wrap != this->packed_wrap)
+    {
+        // the padding has changed, so start again from the image
+        this->UnpackIfNeeded();
+        this->need_pack = true;
+    }
+    if(!this->need_pack) return;
+
+    const int X = this->GetX();
+    const int num_rows = this->GetY() * this->GetZ();
+    this->packed_range = range;
+    this->packed_wrap = this->wrap;
+    this->words_per_row = (range + X - 1) / 64 + 3; // (a spare word either side, for GetShiftedWord)
+    this->cells.assign(size_t(this->words_per_row) * num_rows, 0);
+    this->buffer.assign(this->cells.size(), 0);
+
+    vtkImageData *image = this->images.front();
+    const int data_type = image->GetScalarType();
+    if(data_type != VTK_FLOAT && data_type != VTK_DOUBLE)
+        throw runtime_error("LifeLikeImageRD::PackIfNeeded : unsupported data type");
+    const bool wrap = this->wrap;
+    ThreadPool::GetInstance().ParallelFor(num_rows, [&](int iRow)
+    {
+        uint64_t *row = this->cells.data() + size_t(iRow) * this->words_per_row;
+        if(data_type == VTK_FLOAT)
+            PackRow(static_cast<const float*>(image->GetScalarPointer()) + size_t(iRow) * X, row, X, range, wrap);
+        else
+            PackRow(static_cast<const double*>(image->GetScalarPointer()) + size_t(iRow) * X, row, X, range, wrap);
+    });
+    this->need_pack = false;
+    this->need_unpack = false;
+}
+
+// ---------------------------------------------------------------------
+
+void LifeLikeImageRD::UnpackIfNeeded() const
+{
+    if(!this->need_unpack) return;
+
+    const int X = this->GetX();
+    const int num_rows = this->GetY() * this->GetZ();
+    vtkImageData *image = this->images.front();
+    const int data_type = image->GetScalarType();
+    if(data_type != VTK_FLOAT && data_type != VTK_DOUBLE)
+        throw runtime_error("LifeLikeImageRD::UnpackIfNeeded : unsupported data type");
+    ThreadPool::GetInstance().ParallelFor(num_rows, [&](int iRow)
+    {
+        const uint64_t *row = this->cells.data() + size_t(iRow) * this->words_per_row;
+        if(data_type == VTK_FLOAT)
+            UnpackRow(row, static_cast<float*>(image->GetScalarPointer()) + size_t(iRow) * X, X, this->packed_range);
+        else
+            UnpackRow(row, static_cast<double*>(image->GetScalarPointer()) + size_t(iRow) * X, X, this->packed_range);
+    });
+    image->Modified();
+    this->need_unpack = false;
+}
+
+// ---------------------------------------------------------------------
+
+void LifeLikeImageRD::InternalUpdate(int n_steps)
+{
+    const int X = this->GetX();
+    const int Y = this->GetY();
+    const int Z = this->GetZ();
+
+    LifeLikeRule rule;
+    const int range = static_cast<int>(lround(this->GetParameterValueByName("range")));
+    if(range < 1 || range > MAX_RANGE)
+        throw runtime_error("LifeLikeImageRD::InternalUpdate : range must be from 1 to "+to_string(MAX_RANGE));
+    rule.range[0] = range;
+    rule.range[1] = Y > 1 ? range : 0;
+    rule.range[2] = Z > 1 ? range : 0;
+    rule.birth_min = static_cast<int>(lround(this->GetParameterValueByName("birth_min")));
+    rule.birth_max = static_cast<int>(lround(this->GetParameterValueByName("birth_max")));
+    rule.survival_min = static_cast<int>(lround(this->GetParameterValueByName("survival_min")));
+    rule.survival_max = static_cast<int>(lround(this->GetParameterValueByName("survival_max")));
+    const int max_count = (2 * rule.range[0] + 1) * (2 * rule.range[1] + 1) * (2 * rule.range[2] + 1) - 1;
+    rule.num_planes = 1;
+    while((max_count >> rule.num_planes) > 0)
+        rule.num_planes++;
+
+    this->PackIfNeeded(range);
+
+    // share the rows out among the threads, a few thousand words at a time
+    const int TARGET_WORDS_PER_TASK = 4096;
+    const int num_rows = Y * Z;
+    const int rows_per_task = max(1, TARGET_WORDS_PER_TASK / this->words_per_row);
+    const int num_tasks = (num_rows + rows_per_task - 1) / rows_per_task;
+    const int num_rows_around = (2 * rule.range[1] + 1) * (2 * rule.range[2] + 1);
+    const bool wrap = this->wrap;
+    auto wrap_or_clamp = [wrap](int i, int n) { return wrap ? ((i % n) + n) % n : min(n - 1, max(0, i)); };
+    ThreadPool& thread_pool = ThreadPool::GetInstance();
+
+    for(int iStep=0;iStep<n_steps;iStep++)
+    {
+        const uint64_t *old_cells = this->cells.data();
+        uint64_t *new_cells = this->buffer.data();
+        thread_pool.ParallelFor(num_tasks, [&](int iTask)
+        {
+            vector<const uint64_t*> rows(num_rows_around);
+            const int first_row = iTask * rows_per_task;
+            const int last_row = min(num_rows, first_row + rows_per_task);
+            for(int iRow=first_row;iRow<last_row;iRow++)
+            {
+                const int y = iRow % Y;
+                const int z = iRow / Y;
+                int i = 0;
+                for(int dz=-rule.range[2];dz<=rule.range[2];dz++)
+                    for(int dy=-rule.range[1];dy<=rule.range[1];dy++)
+                        rows[i++] = old_cells + size_t(this->words_per_row) * (wrap_or_clamp(y + dy, Y) + size_t(Y) * wrap_or_clamp(z + dz, Z));
+                uint64_t *out = new_cells + size_t(this->words_per_row) * iRow;
+                UpdateRow(rows.data(), out, X, rule);
+                FillPadding(out, X, range, wrap);
+            }
+        });
+        this->cells.swap(this->buffer);
+    }
+    this->need_unpack = true;
+}
+
+// ---------------------------------------------------------------------
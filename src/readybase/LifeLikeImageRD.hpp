@@ -0,0 +1,78 @@
+/*  Copyright 2011-2021 The Ready Bunch
+
+    This file is part of Ready.
+
+    Ready is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Ready is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Ready. If not, see <http://www.gnu.org/licenses/>.         */
+
+#ifndef __LIFELIKEIMAGERD__
+#define __LIFELIKEIMAGERD__
+
+// local:
+#include "InbuiltImageRD.hpp"
+
+// STL:
+#include <cstdint>
+#include <vector>
+
+/// An inbuilt implementation of Life-like cellular automata on images, with two states per cell.
+/** Covers Conway's Life, Larger than Life and their analogues in 1D and 3D. Each cell counts the live cells in the box
+ *  within 'range' of it (not counting itself): a dead cell comes alive if the count is from birth_min to birth_max, and a
+ *  live cell stays alive if the count is from survival_min to survival_max. A cell is alive if its value is 0.5 or more.
+ *
+ *  The cells are stored as bits, 64 to a word, and the neighbors are counted with bit-parallel adders, so each step works
+ *  on 64 cells at a time. The images are only written when they are needed (see SyncToHost). */
+class LifeLikeImageRD : public InbuiltImageRD
+{
+    public:
+
+        LifeLikeImageRD();
+
+        void SyncToHost() const override { this->UnpackIfNeeded(); }
+
+        void CopyFromImage(vtkImageData* im) override;
+        void SetFrom2DImage(int iChemical, vtkImageData *im) override;
+        void GenerateInitialPattern() override;
+        void BlankImage(float value = 0.0f) override;
+
+        size_t GetMemorySize() const override;
+
+    protected:
+
+        void AllocateImages(int x,int y,int z,int nc,int data_type) override;
+
+        void InternalUpdate(int n_steps) override;
+
+        void RegionWasPainted(int iChemical,const int lower[3],const int upper[3]) override;
+
+    private:
+
+        /// Fills the bits from the image, if the image has changed since, padding the rows for the given range.
+        void PackIfNeeded(int range);
+
+        /// Writes the bits back to the image, if they have changed since.
+        void UnpackIfNeeded() const;
+
+    private:
+
+        // the cells as bits, for the current step and the next: each row of X cells has packed_range cells either side
+        // that are copies of the cells they stand for (with wrap-around or clamping), so that no row needs bounds checks
+        std::vector<uint64_t> cells, buffer;
+        int packed_range;   ///< how many cells the rows are padded with
+        bool packed_wrap;   ///< whether the padding was filled with wrap-around
+        int words_per_row;
+        bool need_pack;           ///< the image has changed since the bits were filled
+        mutable bool need_unpack; ///< the bits have changed since the image was written
+};
+
+#endif
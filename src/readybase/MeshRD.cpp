@@ -16,11 +16,13 @@
     along with Ready. If not, see <http://www.gnu.org/licenses/>.         */
 
 // local:
+#include "CellOrdering.hpp"
 #include "IO_XML.hpp"
 #include "MeshRD.hpp"
 #include "overlays.hpp"
 #include "Properties.hpp"
 #include "scene_items.hpp"
+#include "ThreadPool.hpp"
 #include "utils.hpp"
 
 // VTK:
@@ -45,6 +47,7 @@
 #include <vtkMergeFilter.h>
 #include <vtkPlane.h>
 #include <vtkPointData.h>
+#include <vtkPoints.h>
 #include <vtkPointSource.h>
 #include <vtkPolyData.h>
 #include <vtkPolyDataMapper.h>
@@ -67,13 +70,85 @@
 // STL:
 #include <stdexcept>
 #include <algorithm>
+#include <array>
+#include <cstdint>
+#include <limits>
 
 using namespace std;
 
 // ---------------------------------------------------------------------
 
+static MeshRD::NeighborStorage neighbor_storage = MeshRD::NeighborStorage::Automatic;
+static MeshRD::CellOrder cell_order = MeshRD::CellOrder::Original;
+
+// ---------------------------------------------------------------------
+
+void MeshRD::SetNeighborStorage(NeighborStorage storage)
+{
+    neighbor_storage = storage;
+}
+
+// ---------------------------------------------------------------------
+
+MeshRD::NeighborStorage MeshRD::GetNeighborStorage()
+{
+    return neighbor_storage;
+}
+
+// ---------------------------------------------------------------------
+
+void MeshRD::SetCellOrder(CellOrder order)
+{
+    cell_order = order;
+}
+
+// ---------------------------------------------------------------------
+
+MeshRD::CellOrder MeshRD::GetCellOrder()
+{
+    return cell_order;
+}
+
+// ---------------------------------------------------------------------
+
+namespace
+{
+    /// Makes target a copy of source, but with the cells (and their data) in the given order.
+    /** The cell at position i of target is the cell at position order[i] of source. The points are shared. */
+    template<typename Index>
+    void CopyCellsInOrder(vtkUnstructuredGrid* source,const vector<Index>& order,vtkUnstructuredGrid* target)
+    {
+        const vtkIdType N = static_cast<vtkIdType>(order.size());
+        vtkSmartPointer<vtkUnstructuredGrid> reordered = vtkSmartPointer<vtkUnstructuredGrid>::New();
+        reordered->SetPoints(source->GetPoints());
+        reordered->GetPointData()->ShallowCopy(source->GetPointData());
+        reordered->GetFieldData()->ShallowCopy(source->GetFieldData());
+        reordered->Allocate(N);
+        vtkSmartPointer<vtkIdList> ids = vtkSmartPointer<vtkIdList>::New();
+        for(vtkIdType i=0;i<N;i++)
+        {
+            const int cell_type = source->GetCellType(order[i]);
+            if(cell_type == VTK_POLYHEDRON)
+                source->GetFaceStream(order[i], ids); // (polyhedra are inserted from their faces)
+            else
+                source->GetCellPoints(order[i], ids);
+            reordered->InsertNextCell(cell_type, ids);
+        }
+        vtkCellData* source_data = source->GetCellData();
+        vtkCellData* target_data = reordered->GetCellData();
+        target_data->CopyAllocate(source_data, N);
+        for(vtkIdType i=0;i<N;i++)
+            target_data->CopyData(source_data, order[i], i);
+        target->ShallowCopy(reordered);
+    }
+}
+
+// ---------------------------------------------------------------------
+
 MeshRD::MeshRD(int data_type)
     : AbstractRD(data_type)
+    , max_neighbors(0)
+    , padded_neighbors(true)
 {
     this->starting_pattern = vtkSmartPointer<vtkUnstructuredGrid>::New();
     this->mesh = vtkSmartPointer<vtkUnstructuredGrid>::New();
@@ -95,6 +170,7 @@ void MeshRD::Update(int n_steps)
 
 void MeshRD::SetNumberOfChemicals(int n, bool reallocate_storage)
 {
+    this->SyncToHost();
     if (reallocate_storage)
     {
         this->mesh->GetCellData()->Initialize();
@@ -129,6 +205,7 @@ void MeshRD::SetNumberOfChemicals(int n, bool reallocate_storage)
 
 void MeshRD::SaveFile(const char* filename,const Properties& render_settings,bool generate_initial_pattern_when_loading) const
 {
+    this->SyncToHost();
     vtkSmartPointer<RD_XMLUnstructuredGridWriter> iw = vtkSmartPointer<RD_XMLUnstructuredGridWriter>::New();
     iw->SetSystem(this);
     iw->SetRenderSettings(&render_settings);
@@ -136,53 +213,153 @@ void MeshRD::SaveFile(const char* filename,const Properties& render_settings,boo
         iw->GenerateInitialPatternWhenLoading();
     iw->SetFileName(filename);
     iw->SetDataModeToBinary(); // workaround for http://www.vtk.org/Bug/view.php?id=13382
-    iw->SetInputData(this->mesh);
+    if(this->cell_original_ids.empty())
+        iw->SetInputData(this->mesh);
+    else
+    {
+        // save the cells in the order they were loaded, in case other programs depend on it
+        vtkSmartPointer<vtkUnstructuredGrid> original = vtkSmartPointer<vtkUnstructuredGrid>::New();
+        this->GetMeshInOriginalOrder(original);
+        iw->SetInputData(original);
+    }
     iw->Write();
 }
 
 // ---------------------------------------------------------------------
 
-void MeshRD::GenerateInitialPattern()
+void MeshRD::ComputeCellCentroidsIfNeeded()
 {
-    if (this->initial_pattern_generator.ShouldZeroFirst()) {
-        this->BlankImage();
+    const vtkIdType n_cells = this->mesh->GetNumberOfCells();
+    if((vtkIdType)this->cell_centroids.size() == 3 * n_cells) return;
+
+    // the centre of a cell is the mean of its points (need a location to sample the overlays)
+    this->cell_centroids.resize(3 * n_cells);
+    const double *bounds = this->mesh->GetBounds();
+    vtkPoints *points = this->mesh->GetPoints();
+    const vtkIdType CELLS_PER_CHUNK = 4096;
+    const int num_chunks = static_cast<int>((n_cells + CELLS_PER_CHUNK - 1) / CELLS_PER_CHUNK);
+    ThreadPool::GetInstance().ParallelFor(num_chunks, [&](int iChunk)
+    {
+        vtkSmartPointer<vtkIdList> ids = vtkSmartPointer<vtkIdList>::New(); // (each thread needs its own)
+        const vtkIdType start = iChunk * CELLS_PER_CHUNK;
+        const vtkIdType end = min(n_cells, start + CELLS_PER_CHUNK);
+        double p[3];
+        for(vtkIdType iCell=start;iCell<end;iCell++)
+        {
+            this->mesh->GetCellPoints(iCell, ids);
+            float *cp = &this->cell_centroids[3 * iCell];
+            cp[0]=cp[1]=cp[2]=0.0f;
+            for(vtkIdType iPt=0;iPt<ids->GetNumberOfIds();iPt++)
+            {
+                points->GetPoint(ids->GetId(iPt), p); // (unlike the form that returns a pointer, this is thread-safe)
+                for(int xyz=0;xyz<3;xyz++)
+                    cp[xyz] += p[xyz]-bounds[xyz*2+0];
+            }
+            for(int xyz=0;xyz<3;xyz++)
+                cp[xyz] /= ids->GetNumberOfIds();
+        }
+    });
+}
+
+// ---------------------------------------------------------------------
+
+template<typename T>
+void MeshRD::ApplyOverlays()
+{
+    const int NC = this->GetNumberOfChemicals();
+
+    // find the box that each overlay might change, so that we can skip the cells outside it
+    struct OverlayRegion
+    {
+        const Overlay* overlay;
+        array<double, 6> bounds;
+    };
+    const float X = this->GetX(), Y = this->GetY(), Z = this->GetZ();
+    const int dimensionality = this->GetArenaDimensionality();
+    const double margin = 1e-4 * max(X, max(Y, Z)); // (the shapes test the cells with their own arithmetic)
+    vector<OverlayRegion> overlays;
+    for(size_t iOverlay=0; iOverlay < this->initial_pattern_generator.GetNumberOfOverlays(); iOverlay++)
+    {
+        const Overlay& overlay = this->initial_pattern_generator.GetOverlay(iOverlay);
+        int iC = overlay.GetTargetChemical();
+        if(iC<0 || iC>=NC)
+            continue; // best for now to silently ignore this overlay, because the user has no way of editing the overlays (short of editing the file)
+            //throw runtime_error("Overlay: chemical out of range: "+GetChemicalName(iC));
+        OverlayRegion region = { &overlay, {} };
+        overlay.GetBounds(X, Y, Z, dimensionality, region.bounds.data());
+        for(int i=0;i<3;i++)
+        {
+            region.bounds[i*2+0] -= margin;
+            region.bounds[i*2+1] += margin;
+        }
+        overlays.push_back(region);
     }
+    if(overlays.empty())
+        return;
 
-    for (size_t iOverlay = 0; iOverlay < this->initial_pattern_generator.GetNumberOfOverlays(); iOverlay++)
+    vector<vtkDataArray*> arrays(NC);
+    vector<T*> data(NC);
+    for(int i=0;i<NC;i++)
     {
-        this->initial_pattern_generator.GetOverlay(iOverlay).Reseed();
+        arrays[i] = this->mesh->GetCellData()->GetArray(GetChemicalName(i).c_str());
+        if(!arrays[i] || arrays[i]->GetDataType() != this->data_type)
+            throw runtime_error("MeshRD::GenerateInitialPattern : missing or mistyped array: "+GetChemicalName(i));
+        data[i] = static_cast<T*>(arrays[i]->GetVoidPointer(0));
     }
 
-    float cp[3];
-    double *bounds = this->mesh->GetBounds();
-    for(vtkIdType iCell=0;iCell<this->mesh->GetNumberOfCells();iCell++)
+    // each cell only depends on its own values, so we can share out chunks of cells among the threads
+    // (the mesh bounds were computed above, so the overlays can read them from several threads)
+    const vtkIdType n_cells = this->mesh->GetNumberOfCells();
+    const vtkIdType CELLS_PER_CHUNK = 4096;
+    const int num_chunks = static_cast<int>((n_cells + CELLS_PER_CHUNK - 1) / CELLS_PER_CHUNK);
+    ThreadPool::GetInstance().ParallelFor(num_chunks, [&](int iChunk)
     {
-        vtkSmartPointer<vtkIdList> ids = vtkSmartPointer<vtkIdList>::New();
-        this->mesh->GetCellPoints(iCell, ids);
-        // get a point at the centre of the cell (need a location to sample the overlays)
-        cp[0]=cp[1]=cp[2]=0.0f;
-        for(vtkIdType iPt=0;iPt<ids->GetNumberOfIds();iPt++)
-            for(int xyz=0;xyz<3;xyz++)
-                cp[xyz] += this->mesh->GetPoint(ids->GetId(iPt))[xyz]-bounds[xyz*2+0];
-        for(int xyz=0;xyz<3;xyz++)
-            cp[xyz] /= ids->GetNumberOfIds();
-        for(size_t iOverlay=0; iOverlay < this->initial_pattern_generator.GetNumberOfOverlays(); iOverlay++)
+        vector<double> vals(NC); // scratchpad for this thread
+        const vtkIdType start = iChunk * CELLS_PER_CHUNK;
+        const vtkIdType end = min(n_cells, start + CELLS_PER_CHUNK);
+        for(vtkIdType iCell=start;iCell<end;iCell++)
         {
-            const Overlay& overlay = this->initial_pattern_generator.GetOverlay(iOverlay);
-
-            int iC = overlay.GetTargetChemical();
-            if(iC<0 || iC>=this->GetNumberOfChemicals())
-                continue; // best for now to silently ignore this overlay, because the user has no way of editing the overlays (short of editing the file)
-                //throw runtime_error("Overlay: chemical out of range: "+GetChemicalName(iC));
-
-            vector<double> vals(this->GetNumberOfChemicals());
-            for(int i=0;i<this->GetNumberOfChemicals();i++)
+            const float *cp = &this->cell_centroids[3 * iCell];
+            bool have_vals = false;
+            for(const OverlayRegion& region : overlays)
             {
-                vals[i] = this->mesh->GetCellData()->GetArray(GetChemicalName(i).c_str())->GetComponent( iCell, 0 );
+                const array<double, 6>& ob = region.bounds;
+                if(cp[0]<ob[0] || cp[0]>ob[1] || cp[1]<ob[2] || cp[1]>ob[3] || cp[2]<ob[4] || cp[2]>ob[5])
+                    continue;
+                if(!have_vals)
+                {
+                    // (the overlays only change their target chemical, and do so in vals too, so we only read once)
+                    for(int iC=0;iC<NC;iC++)
+                        vals[iC] = data[iC][iCell];
+                    have_vals = true;
+                }
+                const Overlay* overlay = region.overlay;
+                data[overlay->GetTargetChemical()][iCell] = static_cast<T>(overlay->ApplyInPlace(vals, *this, cp[0], cp[1], cp[2]));
             }
-            this->mesh->GetCellData()->GetArray(GetChemicalName(iC).c_str())->SetComponent(iCell, 0, overlay.Apply(vals, *this, cp[0], cp[1], cp[2]));
         }
+    });
+
+    for(vtkDataArray* a : arrays)
+        a->Modified();
+}
+
+// ---------------------------------------------------------------------
+
+void MeshRD::GenerateInitialPattern()
+{
+    this->SyncToHost();
+    if (this->initial_pattern_generator.ShouldZeroFirst()) {
+        this->BlankImage();
     }
+
+    this->initial_pattern_generator.Reseed();
+
+    this->ComputeCellCentroidsIfNeeded();
+    if(this->data_type == VTK_DOUBLE)
+        this->ApplyOverlays<double>();
+    else
+        this->ApplyOverlays<float>();
+
     this->mesh->Modified();
     this->is_modified = true;
     this->timesteps_taken = 0;
@@ -192,6 +369,7 @@ void MeshRD::GenerateInitialPattern()
 
 void MeshRD::BlankImage(float value)
 {
+    this->SyncToHost();
     for(int iChem=0;iChem<this->n_chemicals;iChem++)
     {
         this->mesh->GetCellData()->GetArray(GetChemicalName(iChem).c_str())->FillComponent(0, value);
@@ -226,20 +404,96 @@ float MeshRD::GetZ() const
 
 void MeshRD::CopyFromMesh(vtkUnstructuredGrid* mesh2)
 {
+    this->SyncToHost();
     this->undo_stack.clear();
     this->mesh->DeepCopy(mesh2);
     this->is_modified = true;
     this->n_chemicals = this->mesh->GetCellData()->GetNumberOfArrays();
 
     this->cell_locator = NULL;
+    this->cell_centroids.clear();
+    this->cell_original_ids.clear();
 
     this->ComputeCellNeighbors(this->neighborhood_type);
+    this->ReorderCells();
+}
+
+// ---------------------------------------------------------------------
+
+void MeshRD::ReorderCells()
+{
+    const int N = static_cast<int>(this->mesh->GetNumberOfCells());
+    vector<int> order;
+    switch(cell_order)
+    {
+        default:
+        case CellOrder::Original:
+            return;
+        case CellOrder::Hilbert:
+            this->ComputeCellCentroidsIfNeeded();
+            order = GetHilbertOrder(this->cell_centroids);
+            break;
+        case CellOrder::ReverseCuthillMcKee:
+            order = GetReverseCuthillMcKeeOrder(this->cell_neighbor_offsets, this->cell_neighbor_indices);
+            break;
+    }
+    if((int)order.size() != N)
+        throw runtime_error("MeshRD::ReorderCells : unexpected number of cells");
+
+    CopyCellsInOrder(this->mesh, order, this->mesh);
+
+    // renumber the neighbor lists to match, keeping the neighbors of each cell in the same order so that the results
+    // are the same as without reordering
+    vector<int> new_position(N);
+    for(int i=0;i<N;i++)
+        new_position[order[i]] = i;
+    vector<int> offsets(N + 1);
+    vector<int> indices(this->cell_neighbor_indices.size());
+    vector<float> weights(this->cell_neighbor_weights.size());
+    offsets[0] = 0;
+    for(int i=0;i<N;i++)
+    {
+        int k = offsets[i];
+        for(int old_k=this->cell_neighbor_offsets[order[i]];old_k<this->cell_neighbor_offsets[order[i]+1];old_k++,k++)
+        {
+            indices[k] = new_position[this->cell_neighbor_indices[old_k]];
+            weights[k] = this->cell_neighbor_weights[old_k];
+        }
+        offsets[i+1] = k;
+    }
+    this->cell_neighbor_offsets.swap(offsets);
+    this->cell_neighbor_indices.swap(indices);
+    this->cell_neighbor_weights.swap(weights);
+
+    this->cell_original_ids.assign(order.begin(), order.end());
+    this->cell_centroids.clear();
+    this->cell_locator = NULL;
+}
+
+// ---------------------------------------------------------------------
+
+void MeshRD::GetMeshInOriginalOrder(vtkUnstructuredGrid* out) const
+{
+    if(this->cell_original_ids.empty())
+    {
+        out->DeepCopy(this->mesh);
+        return;
+    }
+    vector<vtkIdType> order(this->cell_original_ids.size());
+    for(size_t i=0;i<order.size();i++)
+        order[this->cell_original_ids[i]] = i;
+    CopyCellsInOrder(this->mesh, order, out);
+    // (CopyCellsInOrder shares the points, so make them our own in case the caller changes them)
+    vtkSmartPointer<vtkPoints> points = vtkSmartPointer<vtkPoints>::New();
+    points->DeepCopy(this->mesh->GetPoints());
+    out->SetPoints(points);
 }
 
 // ---------------------------------------------------------------------
 
 void MeshRD::InitializeRenderPipeline(vtkRenderer* pRenderer,const Properties& render_settings)
 {
+    this->SyncToHost();
     float low = render_settings.GetProperty("low").GetFloat();
     float high = render_settings.GetProperty("high").GetFloat();
     bool use_image_interpolation = render_settings.GetProperty("use_image_interpolation").GetBool();
@@ -634,13 +888,16 @@ void MeshRD::AddPhasePlot(vtkRenderer* pRenderer,float scaling,float low,float h
 
 void MeshRD::SaveStartingPattern()
 {
-    this->starting_pattern->DeepCopy(this->mesh);
+    this->SyncToHost();
+    // (in the original order, since RestoreStartingPattern passes it to CopyFromMesh, which reorders it again)
+    this->GetMeshInOriginalOrder(this->starting_pattern);
 }
 
 // ---------------------------------------------------------------------
 
 void MeshRD::RestoreStartingPattern()
 {
+    this->SyncToHost();
     this->CopyFromMesh(this->starting_pattern);
     this->is_modified = true;
     this->timesteps_taken = 0;
@@ -648,28 +905,193 @@ void MeshRD::RestoreStartingPattern()
 
 // ---------------------------------------------------------------------
 
-struct TNeighbor { vtkIdType iNeighbor; float weight; };
-
-void add_if_new(vector<TNeighbor>& neighbors,TNeighbor neighbor)
+namespace
 {
-    for(vector<TNeighbor>::const_iterator it=neighbors.begin();it!=neighbors.end();it++)
-        if(it->iNeighbor==neighbor.iNeighbor)
-            return;
-    neighbors.push_back(neighbor);
-}
+    /// The connectivity of a mesh as plain arrays, so that the neighbors of the cells can be found in parallel.
+    struct CellConnectivity
+    {
+        // the points of each cell, as compressed rows
+        vector<vtkIdType> cell_point_offsets;
+        vector<vtkIdType> cell_points;
+        // the cells that use each point, in increasing order (the order that vtkUnstructuredGrid::GetCellNeighbors uses)
+        vector<vtkIdType> point_cell_offsets;
+        vector<int> point_cells;
+        // the edges (or faces) of each cell, each stored as its number of points and then their positions in the cell
+        vector<vtkIdType> cell_part_offsets;
+        vector<uint16_t> cell_parts;
+
+        const int* CellsBegin(vtkIdType iPt) const { return this->point_cells.data() + this->point_cell_offsets[iPt]; }
+        const int* CellsEnd(vtkIdType iPt) const { return this->point_cells.data() + this->point_cell_offsets[iPt+1]; }
+
+        bool CellUsesPoint(int iCell,vtkIdType iPt) const
+        {
+            return binary_search(this->CellsBegin(iPt), this->CellsEnd(iPt), iCell);
+        }
 
-bool IsEdgeNeighbor(vtkUnstructuredGrid *grid,vtkIdType iCell1,vtkIdType iCell2)
-{
-    vtkSmartPointer<vtkIdList> cellIds = vtkSmartPointer<vtkIdList>::New();
-    vtkCell* pCell = grid->GetCell(iCell1);
-    for(int iEdge=0;iEdge<pCell->GetNumberOfEdges();iEdge++)
+        /// Appends the cells other than iCell that use all of the given points, in increasing order.
+        void AppendCellsUsingPoints(int iCell,const vector<vtkIdType>& pts,vector<int>& cells) const
+        {
+            if(pts.empty()) return;
+            // run through the cells of the point that has fewest, checking the others
+            size_t iShortest = 0;
+            for(size_t i=1;i<pts.size();i++)
+                if(this->CellsEnd(pts[i]) - this->CellsBegin(pts[i]) < this->CellsEnd(pts[iShortest]) - this->CellsBegin(pts[iShortest]))
+                    iShortest = i;
+            for(const int *c = this->CellsBegin(pts[iShortest]); c != this->CellsEnd(pts[iShortest]); c++)
+            {
+                if(*c == iCell) continue;
+                bool uses_all = true;
+                for(size_t i=0;i<pts.size() && uses_all;i++)
+                    uses_all = i == iShortest || this->CellUsesPoint(*c, pts[i]);
+                if(uses_all)
+                    cells.push_back(*c);
+            }
+        }
+
+        /// Gets the points of the part of iCell that starts at cell_parts[iPart], and returns the start of the next one.
+        vtkIdType GetPartPoints(int iCell,vtkIdType iPart,vector<vtkIdType>& pts) const
+        {
+            const vtkIdType *cell_pts = this->cell_points.data() + this->cell_point_offsets[iCell];
+            const int npts = this->cell_parts[iPart++];
+            pts.resize(npts);
+            for(int i=0;i<npts;i++)
+                pts[i] = cell_pts[this->cell_parts[iPart++]];
+            return iPart;
+        }
+
+        /// Returns true if iCell2, with the given points, uses all the points of one of the edges of iCell1.
+        bool IsEdgeNeighbor(int iCell1,int iCell2,const vtkIdType *pts2,vtkIdType npts2,vector<vtkIdType>& pts) const
+        {
+            if(iCell1 == iCell2) return false;
+            const vtkIdType *pts1 = this->cell_points.data() + this->cell_point_offsets[iCell1];
+            const vtkIdType npts1 = this->cell_point_offsets[iCell1+1] - this->cell_point_offsets[iCell1];
+            if(npts1 <= 64)
+            {
+                // mark which points of iCell1 are shared, then look for an edge made of them
+                uint64_t shared = 0;
+                for(vtkIdType i=0;i<npts1;i++)
+                    for(vtkIdType j=0;j<npts2;j++)
+                        if(pts1[i] == pts2[j])
+                            shared |= uint64_t(1) << i;
+                if((shared & (shared - 1)) == 0) return false; // (fewer than two points shared)
+                for(vtkIdType iPart=this->cell_part_offsets[iCell1];iPart<this->cell_part_offsets[iCell1+1];)
+                {
+                    const int n = this->cell_parts[iPart++];
+                    bool uses_all = true;
+                    for(int i=0;i<n;i++)
+                        uses_all &= ((shared >> this->cell_parts[iPart++]) & 1) != 0;
+                    if(uses_all)
+                        return true;
+                }
+                return false;
+            }
+            for(vtkIdType iPart=this->cell_part_offsets[iCell1];iPart<this->cell_part_offsets[iCell1+1];)
+            {
+                iPart = this->GetPartPoints(iCell1, iPart, pts);
+                bool uses_all = true;
+                for(size_t i=0;i<pts.size() && uses_all;i++)
+                    uses_all = this->CellUsesPoint(iCell2, pts[i]);
+                if(uses_all)
+                    return true;
+            }
+            return false;
+        }
+    };
+
+    /// Working space for finding the neighbors of a cell, reused from one cell to the next.
+    struct NeighborSearch
     {
-        vtkIdList *vertIds = pCell->GetEdge(iEdge)->GetPointIds();
-        grid->GetCellNeighbors(iCell1,vertIds,cellIds);
-        if(cellIds->IsId(iCell2)>=0)
-            return true;
+        vector<int> candidates;     ///< the cells found, in the order found, with repeats
+        vector<int> distinct;       ///< the same cells, sorted, without repeats
+        vector<int> position;       ///< for each candidate, its index in distinct
+        vector<char> added;         ///< for each distinct cell, whether it is in the list of neighbors yet
+        vector<signed char> is_edge_neighbor; ///< for each pair of distinct cells, -1 if not yet known
+        vector<vtkIdType> distinct_point_offsets, distinct_points; ///< the points of each distinct cell, kept close by
+        vector<vtkIdType> pts;
+
+        /// Sets up distinct, position and added from the candidates.
+        void Index()
+        {
+            this->distinct = this->candidates;
+            sort(this->distinct.begin(), this->distinct.end());
+            this->distinct.erase(unique(this->distinct.begin(), this->distinct.end()), this->distinct.end());
+            this->position.resize(this->candidates.size());
+            for(size_t k=0;k<this->candidates.size();k++)
+                this->position[k] = static_cast<int>(lower_bound(this->distinct.begin(), this->distinct.end(), this->candidates[k]) - this->distinct.begin());
+            this->added.assign(this->distinct.size(), 0);
+        }
+    };
+
+    /// Finds the cells that share an edge (or a face, depending on what the parts are) with iCell.
+    /** The neighbors are in the order that they are first found, going through the parts of the cell in turn. */
+    void FindPartNeighbors(const CellConnectivity& cc,int iCell,NeighborSearch& s,vector<int>& neighbors)
+    {
+        s.candidates.clear();
+        for(vtkIdType iPart=cc.cell_part_offsets[iCell];iPart<cc.cell_part_offsets[iCell+1];)
+        {
+            iPart = cc.GetPartPoints(iCell, iPart, s.pts);
+            cc.AppendCellsUsingPoints(iCell, s.pts, s.candidates);
+        }
+        s.Index();
+        for(size_t k=0;k<s.candidates.size();k++)
+        {
+            if(s.added[s.position[k]]) continue;
+            s.added[s.position[k]] = 1;
+            neighbors.push_back(s.candidates[k]);
+        }
+    }
+
+    /// Finds the cells that share a vertex with iCell.
+    /** Where possible each neighbor shares an edge with the one before it, so that the neighbors go around the cell. */
+    void FindVertexNeighbors(const CellConnectivity& cc,int iCell,NeighborSearch& s,vector<int>& neighbors)
+    {
+        s.candidates.clear();
+        for(vtkIdType iPt=cc.cell_point_offsets[iCell];iPt<cc.cell_point_offsets[iCell+1];iPt++)
+            for(const int *c = cc.CellsBegin(cc.cell_points[iPt]); c != cc.CellsEnd(cc.cell_points[iPt]); c++)
+                if(*c != iCell)
+                    s.candidates.push_back(*c);
+        s.Index();
+        const size_t n_distinct = s.distinct.size();
+        s.is_edge_neighbor.assign(n_distinct * n_distinct, -1);
+        s.distinct_point_offsets.resize(n_distinct + 1);
+        s.distinct_point_offsets[0] = 0;
+        s.distinct_points.clear();
+        for(size_t i=0;i<n_distinct;i++)
+        {
+            s.distinct_points.insert(s.distinct_points.end(), cc.cell_points.begin() + cc.cell_point_offsets[s.distinct[i]],
+                                     cc.cell_points.begin() + cc.cell_point_offsets[s.distinct[i]+1]);
+            s.distinct_point_offsets[i+1] = s.distinct_points.size();
+        }
+        // first try to add neighbors that are also edge-neighbors of the previously added cell
+        int iLast = -1; // (index in distinct of the cell added last)
+        size_t n_previously;
+        do {
+            n_previously = neighbors.size();
+            for(size_t k=0;k<s.candidates.size();k++)
+            {
+                const int iDistinct = s.position[k];
+                if(s.added[iDistinct]) continue;
+                if(iLast >= 0)
+                {
+                    signed char& known = s.is_edge_neighbor[iLast * n_distinct + iDistinct];
+                    if(known < 0)
+                        known = cc.IsEdgeNeighbor(s.distinct[iLast], s.distinct[iDistinct], s.distinct_points.data() + s.distinct_point_offsets[iDistinct],
+                                                  s.distinct_point_offsets[iDistinct+1] - s.distinct_point_offsets[iDistinct], s.pts) ? 1 : 0;
+                    if(!known) continue;
+                }
+                s.added[iDistinct] = 1;
+                neighbors.push_back(s.candidates[k]);
+                iLast = iDistinct;
+            }
+        } while(neighbors.size() > n_previously);
+        // add any remaining neighbors (in case mesh is non-manifold)
+        for(size_t k=0;k<s.candidates.size();k++)
+        {
+            if(s.added[s.position[k]]) continue;
+            s.added[s.position[k]] = 1;
+            neighbors.push_back(s.candidates[k]);
+        }
     }
-    return false;
 }
 
 // ---------------------------------------------------------------------
@@ -678,122 +1100,179 @@ void MeshRD::ComputeCellNeighbors(TNeighborhood neighborhood_type)
 {
     if(!this->mesh->IsHomogeneous())
         throw runtime_error("MeshRD::ComputeCellNeighbors : mixed cell types not supported");
+    if(neighborhood_type != TNeighborhood::VERTEX_NEIGHBORS && neighborhood_type != TNeighborhood::EDGE_NEIGHBORS
+       && neighborhood_type != TNeighborhood::FACE_NEIGHBORS)
+        throw runtime_error("MeshRD::ComputeCellNeighbors : unsupported neighborhood type");
 
-    vtkSmartPointer<vtkIdList> ptIds = vtkSmartPointer<vtkIdList>::New();
-    vtkSmartPointer<vtkIdList> cellIds = vtkSmartPointer<vtkIdList>::New();
-    TNeighbor nbor;
+    const int N = static_cast<int>(this->mesh->GetNumberOfCells());
+    const int CELLS_PER_CHUNK = 4096;
+    const int num_chunks = (N + CELLS_PER_CHUNK - 1) / CELLS_PER_CHUNK;
+    const bool use_faces = neighborhood_type == TNeighborhood::FACE_NEIGHBORS; // (else we need the edges)
 
-    vector<vector<TNeighbor> > cell_neighbors; // the connectivity between cells; for each cell, what cells are its neighbors?
-    this->max_neighbors = 0;
-    for(vtkIdType iCell=0;iCell<this->mesh->GetNumberOfCells();iCell++)
+    // copy the points, and the edges or faces, of each cell into plain arrays, a chunk of cells per task
+    struct CellChunk
+    {
+        vector<vtkIdType> num_points, points;
+        vector<vtkIdType> num_parts, parts; // (the lengths of each cell's run of cell_parts)
+        vector<uint16_t> part_data;
+    };
+    vector<CellChunk> chunks(num_chunks);
+    if(N > 0)
+    {
+        // the first call to GetCell builds some internal structures, so must be made from a single thread
+        vtkSmartPointer<vtkGenericCell> cell = vtkSmartPointer<vtkGenericCell>::New();
+        this->mesh->GetCell(0, cell);
+    }
+    ThreadPool::GetInstance().ParallelFor(num_chunks, [&](int iChunk)
     {
-        vector<TNeighbor> neighbors;
-        this->mesh->GetCellPoints(iCell,ptIds);
-        vtkIdType npts = ptIds->GetNumberOfIds();
-        switch(neighborhood_type)
+        vtkSmartPointer<vtkIdList> ptIds = vtkSmartPointer<vtkIdList>::New(); // (each thread needs its own)
+        vtkSmartPointer<vtkGenericCell> cell = vtkSmartPointer<vtkGenericCell>::New();
+        CellChunk& chunk = chunks[iChunk];
+        const int start = iChunk * CELLS_PER_CHUNK;
+        const int end = min(N, start + CELLS_PER_CHUNK);
+        for(int iCell=start;iCell<end;iCell++)
         {
-            case TNeighborhood::VERTEX_NEIGHBORS: // neighbors share a vertex
+            this->mesh->GetCellPoints(iCell, ptIds);
+            const vtkIdType npts = ptIds->GetNumberOfIds();
+            if(npts > numeric_limits<uint16_t>::max())
+                throw runtime_error("MeshRD::ComputeCellNeighbors : too many points in a cell");
+            chunk.num_points.push_back(npts);
+            for(vtkIdType iPt=0;iPt<npts;iPt++)
+                chunk.points.push_back(ptIds->GetId(iPt));
+            this->mesh->GetCell(iCell, cell);
+            const size_t parts_start = chunk.part_data.size();
+            const int n_parts = use_faces ? cell->GetNumberOfFaces() : cell->GetNumberOfEdges();
+            for(int iPart=0;iPart<n_parts;iPart++)
             {
-                vtkSmartPointer<vtkIdList> vertIds = vtkSmartPointer<vtkIdList>::New();
-                vertIds->SetNumberOfIds(1);
-                // first try to add neighbors that are also edge-neighbors of the previously added cell
-                size_t n_previously;
-                do {
-                    n_previously = neighbors.size();
-                    for(vtkIdType iPt=0;iPt<npts;iPt++)
-                    {
-                        vertIds->SetId(0,ptIds->GetId(iPt));
-                        this->mesh->GetCellNeighbors(iCell,vertIds,cellIds);
-                        for(vtkIdType iNeighbor=0;iNeighbor<cellIds->GetNumberOfIds();iNeighbor++)
-                        {
-                            nbor.iNeighbor = cellIds->GetId(iNeighbor);
-                            nbor.weight = 1.0f;
-                            if(neighbors.empty() || IsEdgeNeighbor(this->mesh,neighbors.back().iNeighbor,nbor.iNeighbor))
-                                add_if_new(neighbors,nbor);
-                        }
-                    }
-                } while(neighbors.size() > n_previously);
-                // add any remaining neighbors (in case mesh is non-manifold)
-                for(vtkIdType iPt=0;iPt<npts;iPt++)
+                vtkIdList *partIds = (use_faces ? cell->GetFace(iPart) : cell->GetEdge(iPart))->GetPointIds();
+                chunk.part_data.push_back(static_cast<uint16_t>(partIds->GetNumberOfIds()));
+                for(vtkIdType i=0;i<partIds->GetNumberOfIds();i++)
                 {
-                    vertIds->SetId(0,ptIds->GetId(iPt));
-                    this->mesh->GetCellNeighbors(iCell,vertIds,cellIds);
-                    for(vtkIdType iNeighbor=0;iNeighbor<cellIds->GetNumberOfIds();iNeighbor++)
-                    {
-                        nbor.iNeighbor = cellIds->GetId(iNeighbor);
-                        nbor.weight = 1.0f;
-                        add_if_new(neighbors,nbor);
-                    }
+                    const vtkIdType iPos = ptIds->IsId(partIds->GetId(i));
+                    if(iPos < 0)
+                        throw runtime_error("MeshRD::ComputeCellNeighbors : cell has a face or edge point that it doesn't use");
+                    chunk.part_data.push_back(static_cast<uint16_t>(iPos));
                 }
             }
-            break;
-            case TNeighborhood::EDGE_NEIGHBORS: // neighbors share an edge
-            {
-                vtkCell* pCell = this->mesh->GetCell(iCell);
-                for(int iEdge=0;iEdge<pCell->GetNumberOfEdges();iEdge++)
-                {
-                    vtkIdList *vertIds = pCell->GetEdge(iEdge)->GetPointIds();
-                    this->mesh->GetCellNeighbors(iCell,vertIds,cellIds);
-                    for(vtkIdType iNeighbor=0;iNeighbor<cellIds->GetNumberOfIds();iNeighbor++)
-                    {
-                        nbor.iNeighbor = cellIds->GetId(iNeighbor);
-                        nbor.weight = 1.0f;
-                        add_if_new(neighbors,nbor);
-                    }
-                }
-            }
-            break;
-            case TNeighborhood::FACE_NEIGHBORS:
-            {
-                vtkCell* pCell = this->mesh->GetCell(iCell);
-                for(int iEdge=0;iEdge<pCell->GetNumberOfFaces();iEdge++)
-                {
-                    vtkIdList *vertIds = pCell->GetFace(iEdge)->GetPointIds();
-                    this->mesh->GetCellNeighbors(iCell,vertIds,cellIds);
-                    for(vtkIdType iNeighbor=0;iNeighbor<cellIds->GetNumberOfIds();iNeighbor++)
-                    {
-                        nbor.iNeighbor = cellIds->GetId(iNeighbor);
-                        nbor.weight = 1.0f;
-                        add_if_new(neighbors,nbor);
-                    }
-                }
-            }
-            break;
-            default: throw runtime_error("MeshRD::ComputeCellNeighbors : unsupported neighborhood type");
+            chunk.num_parts.push_back(chunk.part_data.size() - parts_start);
         }
-        // normalize the weights for this cell
-        float weight_sum=0.0f;
-        for(int iN=0;iN<(int)neighbors.size();iN++)
-            weight_sum += neighbors[iN].weight;
-        weight_sum = max(weight_sum,1e-5f); // avoid div0
-        for(int iN=0;iN<(int)neighbors.size();iN++)
-            neighbors[iN].weight /= weight_sum;
-        // store this list of neighbors
-        cell_neighbors.push_back(neighbors);
-        if((int)neighbors.size()>this->max_neighbors)
-            this->max_neighbors = (int)neighbors.size();
-        this->max_neighbors = max(1,this->max_neighbors); // avoid error in case of unconnected cells or single cell
+    });
+    CellConnectivity cc;
+    cc.cell_point_offsets.resize(N + 1);
+    cc.cell_part_offsets.resize(N + 1);
+    cc.cell_point_offsets[0] = cc.cell_part_offsets[0] = 0;
+    for(int iChunk=0;iChunk<num_chunks;iChunk++)
+    {
+        const CellChunk& chunk = chunks[iChunk];
+        const int start = iChunk * CELLS_PER_CHUNK;
+        for(size_t i=0;i<chunk.num_points.size();i++)
+        {
+            cc.cell_point_offsets[start+i+1] = cc.cell_point_offsets[start+i] + chunk.num_points[i];
+            cc.cell_part_offsets[start+i+1] = cc.cell_part_offsets[start+i] + chunk.num_parts[i];
+        }
+        cc.cell_points.insert(cc.cell_points.end(), chunk.points.begin(), chunk.points.end());
+        cc.cell_parts.insert(cc.cell_parts.end(), chunk.part_data.begin(), chunk.part_data.end());
+    }
+    chunks.clear();
+
+    // make the table of which cells use each point, with the cells in increasing order
+    const vtkIdType n_points = this->mesh->GetNumberOfPoints();
+    cc.point_cell_offsets.assign(n_points + 1, 0);
+    for(const vtkIdType iPt : cc.cell_points)
+        cc.point_cell_offsets[iPt + 1]++;
+    for(vtkIdType iPt=0;iPt<n_points;iPt++)
+        cc.point_cell_offsets[iPt + 1] += cc.point_cell_offsets[iPt];
+    cc.point_cells.resize(cc.cell_points.size());
+    {
+        vector<vtkIdType> next(cc.point_cell_offsets.begin(), cc.point_cell_offsets.end() - 1);
+        for(int iCell=0;iCell<N;iCell++)
+            for(vtkIdType i=cc.cell_point_offsets[iCell];i<cc.cell_point_offsets[iCell+1];i++)
+                cc.point_cells[next[cc.cell_points[i]]++] = iCell;
     }
 
-    // copy data to plain arrays
-    this->cell_neighbor_indices.resize(this->mesh->GetNumberOfCells() * this->max_neighbors);
-    this->cell_neighbor_weights.resize(this->mesh->GetNumberOfCells() * this->max_neighbors);
-    for(int i=0;i<this->mesh->GetNumberOfCells();i++)
+    // find the neighbors of each cell, a chunk of cells per task
+    struct NeighborChunk
+    {
+        vector<int> num_neighbors, neighbors;
+    };
+    vector<NeighborChunk> neighbor_chunks(num_chunks);
+    ThreadPool::GetInstance().ParallelFor(num_chunks, [&](int iChunk)
     {
-        for(int j=0;j<(int)cell_neighbors[i].size();j++)
+        NeighborSearch search;
+        NeighborChunk& chunk = neighbor_chunks[iChunk];
+        const int start = iChunk * CELLS_PER_CHUNK;
+        const int end = min(N, start + CELLS_PER_CHUNK);
+        for(int iCell=start;iCell<end;iCell++)
         {
-            int k = i*this->max_neighbors + j;
-            this->cell_neighbor_indices[k] = cell_neighbors[i][j].iNeighbor;
-            this->cell_neighbor_weights[k] = cell_neighbors[i][j].weight;
+            const size_t n_before = chunk.neighbors.size();
+            if(neighborhood_type == TNeighborhood::VERTEX_NEIGHBORS)
+                FindVertexNeighbors(cc, iCell, search, chunk.neighbors);
+            else
+                FindPartNeighbors(cc, iCell, search, chunk.neighbors);
+            chunk.num_neighbors.push_back(static_cast<int>(chunk.neighbors.size() - n_before));
         }
-        // fill any remaining slots with iCell,0.0
-        for(int j=(int)cell_neighbors[i].size();j<max_neighbors;j++)
+    });
+    cc = CellConnectivity();
+
+    this->max_neighbors = 0;
+    size_t num_entries = 0;
+    for(const NeighborChunk& chunk : neighbor_chunks)
+    {
+        for(const int n : chunk.num_neighbors)
+            this->max_neighbors = max(this->max_neighbors, n);
+        num_entries += chunk.neighbors.size();
+    }
+    if(N > 0)
+        this->max_neighbors = max(1,this->max_neighbors); // avoid error in case of unconnected cells or single cell
+
+    // copy data to plain arrays, either as compressed rows or padded out to max_neighbors for each cell
+    switch(this->NeedsPaddedNeighbors() ? NeighborStorage::Padded : neighbor_storage)
+    {
+        default:
+        case NeighborStorage::Automatic:
+            // padding is worth having when it adds little, since the uniform loops vectorize better
+            this->padded_neighbors = size_t(N) * this->max_neighbors <= num_entries + num_entries / 8;
+            break;
+        case NeighborStorage::Compressed: this->padded_neighbors = false; break;
+        case NeighborStorage::Padded: this->padded_neighbors = true; break;
+    }
+    this->cell_neighbor_offsets.resize(N + 1);
+    this->cell_neighbor_offsets[0] = 0;
+    for(int iChunk=0;iChunk<num_chunks;iChunk++)
+    {
+        const int start = iChunk * CELLS_PER_CHUNK;
+        for(size_t j=0;j<neighbor_chunks[iChunk].num_neighbors.size();j++)
         {
-            int k = i*this->max_neighbors + j;
-            this->cell_neighbor_indices[k] = i;
-            this->cell_neighbor_weights[k] = 0.0f;
+            const int i = start + static_cast<int>(j);
+            this->cell_neighbor_offsets[i+1] = this->cell_neighbor_offsets[i] + (this->padded_neighbors ? this->max_neighbors : neighbor_chunks[iChunk].num_neighbors[j]);
         }
     }
+    this->cell_neighbor_indices.resize(this->cell_neighbor_offsets[N]);
+    this->cell_neighbor_weights.resize(this->cell_neighbor_offsets[N]);
+    ThreadPool::GetInstance().ParallelFor(num_chunks, [&](int iChunk)
+    {
+        const NeighborChunk& chunk = neighbor_chunks[iChunk];
+        const int start = iChunk * CELLS_PER_CHUNK;
+        const int *neighbor = chunk.neighbors.data();
+        for(size_t j=0;j<chunk.num_neighbors.size();j++)
+        {
+            const int i = start + static_cast<int>(j);
+            const int n = chunk.num_neighbors[j];
+            const float weight = 1.0f / max(float(n), 1e-5f); // the weights for each cell sum to 1
+            int k = this->cell_neighbor_offsets[i];
+            for(int iN=0;iN<n;iN++,k++)
+            {
+                this->cell_neighbor_indices[k] = *neighbor++;
+                this->cell_neighbor_weights[k] = weight;
+            }
+            // fill any remaining slots with iCell,0.0
+            for(;k<this->cell_neighbor_offsets[i+1];k++)
+            {
+                this->cell_neighbor_indices[k] = i;
+                this->cell_neighbor_weights[k] = 0.0f;
+            }
+        }
+    });
 }
 
 // ---------------------------------------------------------------------
@@ -807,6 +1286,7 @@ int MeshRD::GetNumberOfCells() const
 
 void MeshRD::GetAsMesh(vtkPolyData *out, const Properties &render_settings) const
 {
+    this->SyncToHost();
     bool use_image_interpolation = render_settings.GetProperty("use_image_interpolation").GetBool();
     string activeChemical = render_settings.GetProperty("active_chemical").GetChemical();
     float contour_level = render_settings.GetProperty("contour_level").GetFloat();
@@ -865,6 +1345,7 @@ int MeshRD::GetArenaDimensionality() const
 
 void MeshRD::GetAs2DImage(vtkImageData *out,const Properties& render_settings) const
 {
+    this->SyncToHost();
     throw runtime_error("MeshRD::GetAs2DImage() : no 2D image available");
 }
 
@@ -872,6 +1353,7 @@ void MeshRD::GetAs2DImage(vtkImageData *out,const Properties& render_settings) c
 
 void MeshRD::SetFrom2DImage(int iChemical, vtkImageData *im)
 {
+    this->SyncToHost();
     throw runtime_error("MeshRD::SetFrom2DImage() : no 2D image available");
 }
 
@@ -879,6 +1361,7 @@ void MeshRD::SetFrom2DImage(int iChemical, vtkImageData *im)
 
 float MeshRD::GetValue(float x, float y, float z, const Properties& render_settings)
 {
+    this->SyncToHost();
     const double X = this->GetX();
 
     this->CreateCellLocatorIfNeeded();
@@ -916,6 +1399,7 @@ float MeshRD::GetValue(float x, float y, float z, const Properties& render_setti
 
 void MeshRD::SetValue(float x,float y,float z,float val,const Properties& render_settings)
 {
+    this->SyncToHost();
     const double X = this->GetX();
 
     this->CreateCellLocatorIfNeeded();
@@ -957,6 +1441,7 @@ void MeshRD::SetValue(float x,float y,float z,float val,const Properties& render
 
 void MeshRD::SetValuesInRadius(float x,float y,float z,float r,float val,const Properties& render_settings)
 {
+    this->SyncToHost();
     const double X = this->GetX();
     const double Y = this->GetY();
     const double Z = this->GetZ();
@@ -1026,6 +1511,7 @@ void MeshRD::CreateCellLocatorIfNeeded()
 
 void MeshRD::FlipPaintAction(PaintAction& cca)
 {
+    this->SyncToHost();
     float old_val = this->mesh->GetCellData()->GetArray(GetChemicalName(cca.iChemical).c_str())->GetComponent( cca.iCell, 0 );
     this->mesh->GetCellData()->GetArray(GetChemicalName(cca.iChemical).c_str())->SetComponent( cca.iCell, 0, cca.val );
     cca.val = old_val;
@@ -1038,7 +1524,8 @@ void MeshRD::FlipPaintAction(PaintAction& cca)
 
 void MeshRD::GetMesh(vtkUnstructuredGrid* mesh) const
 {
-    mesh->DeepCopy(this->mesh);
+    this->SyncToHost();
+    this->GetMeshInOriginalOrder(mesh);
 }
 
 // --------------------------------------------------------------------------------
@@ -1046,20 +1533,24 @@ void MeshRD::GetMesh(vtkUnstructuredGrid* mesh) const
 size_t MeshRD::GetMemorySize() const
 {
     const size_t DATA_SIZE = this->n_chemicals * this->data_type_size * this->mesh->GetNumberOfCells();
-    const size_t NBORS_INDICES_SIZE = sizeof(int) * this->mesh->GetNumberOfCells() * this->max_neighbors;
-    const size_t NBORS_WEIGHTS_SIZE = sizeof(float) * this->mesh->GetNumberOfCells() * this->max_neighbors;
-    return DATA_SIZE + NBORS_INDICES_SIZE + NBORS_WEIGHTS_SIZE;
+    const size_t NBORS_OFFSETS_SIZE = sizeof(int) * this->cell_neighbor_offsets.size();
+    const size_t NBORS_INDICES_SIZE = sizeof(int) * this->cell_neighbor_indices.size();
+    const size_t NBORS_WEIGHTS_SIZE = sizeof(float) * this->cell_neighbor_weights.size();
+    return DATA_SIZE + NBORS_OFFSETS_SIZE + NBORS_INDICES_SIZE + NBORS_WEIGHTS_SIZE;
 }
 
 // --------------------------------------------------------------------------------
 
 vector<float> MeshRD::GetData(int i_chemical) const
 {
+    this->SyncToHost();
     vtkDataArray* data = this->mesh->GetCellData()->GetArray(GetChemicalName(i_chemical).c_str());
     vector<float> values(this->mesh->GetNumberOfCells());
     for (int i = 0; i < this->mesh->GetNumberOfCells(); i++)
     {
-        values[i] = data->GetComponent(i, 0);
+        // (in the order the cells were loaded)
+        const vtkIdType iOriginal = this->cell_original_ids.empty() ? i : this->cell_original_ids[i];
+        values[iOriginal] = data->GetComponent(i, 0);
     }
     return values;
 }
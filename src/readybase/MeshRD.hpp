@@ -33,6 +33,32 @@ class MeshRD : public AbstractRD
 
         MeshRD(int data_type);
 
+        /// How the neighbors of each cell are stored for the kernels.
+        enum class NeighborStorage
+        {
+            Automatic,  ///< padded if that adds few entries, else compressed
+            Compressed, ///< just the neighbors of each cell, one after another (compressed sparse rows)
+            Padded      ///< max_neighbors entries for every cell, which suits devices where uniform loops are faster
+        };
+
+        /// Chooses how the neighbors are stored, from the next time that they are worked out. The default is Automatic.
+        static void SetNeighborStorage(NeighborStorage storage);
+        static NeighborStorage GetNeighborStorage();
+
+        /// How the cells are numbered when a mesh is loaded (see CellOrdering.hpp).
+        enum class CellOrder
+        {
+            Original,           ///< as they come
+            Hilbert,            ///< along a Hilbert curve through their centres
+            ReverseCuthillMcKee ///< by the reverse Cuthill-McKee method, from the neighbor lists
+        };
+
+        /// Chooses how the cells are numbered, from the next mesh that is loaded. The default is Original.
+        /** A better order keeps neighboring cells near each other in memory, which makes the updates faster. The mesh
+         *  is saved in its original order. */
+        static void SetCellOrder(CellOrder order);
+        static CellOrder GetCellOrder();
+
         void SaveFile(const char* filename,
             const Properties& render_settings,
             bool generate_initial_pattern_when_loading) const override;
@@ -85,8 +111,23 @@ class MeshRD : public AbstractRD
         /// work out which cells are neighbors of each other
         void ComputeCellNeighbors(TNeighborhood neighborhood_type);
 
+        /// whether the kernels need the padded neighbor storage, whatever was chosen (e.g. because the user wrote them)
+        virtual bool NeedsPaddedNeighbors() const { return false; }
+
+        /// renumber the cells (and their neighbor lists) in the order chosen with SetCellOrder
+        void ReorderCells();
+
+        /// get a copy of the mesh with the cells in the order they were loaded
+        void GetMeshInOriginalOrder(vtkUnstructuredGrid* out) const;
+
         void CreateCellLocatorIfNeeded();
 
+        /// work out the centre of each cell, unless we already have them
+        void ComputeCellCentroidsIfNeeded();
+
+        /// draws the overlays of the initial pattern generator onto the cells, whose arrays are of type T
+        template<typename T> void ApplyOverlays();
+
         void FlipPaintAction(PaintAction& cca) override;
 
     protected: // variables
@@ -95,11 +136,17 @@ class MeshRD : public AbstractRD
         vtkSmartPointer<vtkUnstructuredGrid> starting_pattern; ///< we save the starting pattern, to allow the user to reset
 
         int max_neighbors;
+        bool padded_neighbors;                    ///< if true, every cell has max_neighbors entries (spares are the cell itself, with weight 0)
+        std::vector<int> cell_neighbor_offsets;   ///< the entries for cell i are [offsets[i],offsets[i+1])
         std::vector<int> cell_neighbor_indices;   ///< index of each neighbor of a cell
         std::vector<float> cell_neighbor_weights; ///< diffusion coefficient between each cell and a neighbor
 
         vtkSmartPointer<vtkCellLocator> cell_locator; ///< Returns a cell ID when given a 3D location
 
+        std::vector<float> cell_centroids; ///< x,y,z of the centre of each cell, relative to the lower corner of the bounds
+
+        std::vector<vtkIdType> cell_original_ids; ///< the position that each cell had when loaded, or empty if not reordered
+
     private: // deliberately not implemented, to prevent use
 
         MeshRD(MeshRD&);
@@ -0,0 +1,391 @@
+/*  Copyright 2011-2021 The Ready Bunch
+
+    This file is part of Ready.
+
+    Ready is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Ready is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Ready. If not, see <http://www.gnu.org/licenses/>.         */
+
+// local:
+#include "NativeKernel.hpp"
+#include "OpenCL_KernelCache.hpp"
+#include "utils.hpp"
+
+// STL:
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <filesystem>
+#include <fstream>
+#include <sstream>
+#include <stdexcept>
+
+// POSIX:
+#ifndef _WIN32
+    #include <dlfcn.h>
+    #include <unistd.h>
+#endif
+
+using namespace std;
+namespace fs = std::filesystem;
+
+// ---------------------------------------------------------------------------------------------------------
+
+#ifdef _WIN32
+static bool native_enabled = false;
+#else
+static bool native_enabled = true;
+#endif
+
+static const char NATIVE_COMPILER_OPTIONS[] = "-std=c++11 -O3 -shared -fPIC -w";
+
+// ---------------------------------------------------------------------------------------------------------
+
+void NativeKernel::SetEnabled(bool enabled)
+{
+#ifndef _WIN32
+    native_enabled = enabled;
+#endif
+}
+
+// ---------------------------------------------------------------------------------------------------------
+
+bool NativeKernel::IsEnabled()
+{
+    return native_enabled;
+}
+
+// ---------------------------------------------------------------------------------------------------------
+
+namespace
+{
+    /// Definitions of the OpenCL built-ins that C++ doesn't have, for the sources that use the formulas.
+    /** The helpers get a prefix (and a macro for the OpenCL name) so that they can't clash with the C library. */
+    const char FORMULA_PRELUDE[] = R"(
+#include <cmath>
+#include <type_traits>
+using namespace std;
+
+typedef unsigned int uint;
+typedef unsigned long ulong;
+typedef float half;
+
+template<typename A, typename B> inline typename common_type<A, B>::type ready_min(A a, B b) { return b < a ? b : a; }
+template<typename A, typename B> inline typename common_type<A, B>::type ready_max(A a, B b) { return a < b ? b : a; }
+inline real ready_clamp(real x, real lo, real hi) { return ready_min(ready_max(x, lo), hi); }
+inline real ready_mix(real a, real b, real t) { return a + (b - a) * t; }
+inline real ready_step(real edge, real x) { return x < edge ? real(0) : real(1); }
+inline real ready_smoothstep(real edge0, real edge1, real x)
+{
+    const real t = ready_clamp((x - edge0) / (edge1 - edge0), real(0), real(1));
+    return t * t * (real(3) - real(2) * t);
+}
+inline real ready_sign(real x) { return x > 0 ? real(1) : (x < 0 ? real(-1) : real(0)); }
+inline real ready_degrees(real x) { return x * real(57.295779513082321); }
+inline real ready_radians(real x) { return x * real(0.017453292519943296); }
+inline real ready_rsqrt(real x) { return real(1) / sqrt(x); }
+inline real ready_exp10(real x) { return pow(real(10), x); }
+inline real ready_pow(real x, real y) { return pow(x, y); }
+inline real ready_divide(real a, real b) { return a / b; }
+inline real ready_mad(real a, real b, real c) { return a * b + c; }
+template<typename A, typename B, typename C> inline typename common_type<A, B>::type ready_select(A a, B b, C c) { return c ? b : a; }
+inline int ready_isequal(real a, real b) { return a == b; }
+inline int ready_isnotequal(real a, real b) { return a != b; }
+
+#define min ready_min
+#define max ready_max
+#define clamp ready_clamp
+#define mix ready_mix
+#define step ready_step
+#define smoothstep ready_smoothstep
+#define sign ready_sign
+#define degrees ready_degrees
+#define radians ready_radians
+#define rsqrt ready_rsqrt
+#define exp10 ready_exp10
+#define powr ready_pow
+#define pown ready_pow
+#define divide ready_divide
+#define mad ready_mad
+#define select ready_select
+#define isequal ready_isequal
+#define isnotequal ready_isnotequal
+
+// the fast versions, e.g. "native_exp", are computed in the same way as the others
+#define native_sin sin
+#define native_cos cos
+#define native_tan tan
+#define native_exp exp
+#define native_exp2 exp2
+#define native_exp10 ready_exp10
+#define native_log log
+#define native_log2 log2
+#define native_log10 log10
+#define native_sqrt sqrt
+#define native_rsqrt ready_rsqrt
+#define native_powr ready_pow
+#define native_divide ready_divide
+#define half_sin sin
+#define half_cos cos
+#define half_tan tan
+#define half_exp exp
+#define half_exp2 exp2
+#define half_exp10 ready_exp10
+#define half_log log
+#define half_log2 log2
+#define half_log10 log10
+#define half_sqrt sqrt
+#define half_rsqrt ready_rsqrt
+#define half_powr ready_pow
+#define half_divide ready_divide
+
+inline int ready_wrap(int i, int n) { return i < 0 ? (i % n + n) % n : (i >= n ? i % n : i); }
+inline int ready_clamp_index(int i, int n) { return i < 0 ? 0 : (i >= n ? n - 1 : i); }
+)";
+}
+
+// ---------------------------------------------------------------------------------------------------------
+
+string NativeKernel::GetFormulaPrelude()
+{
+    return FORMULA_PRELUDE;
+}
+
+// ---------------------------------------------------------------------------------------------------------
+
+string NativeKernel::AdaptFormula(const string& formula, bool use_double)
+{
+    // each cell is computed on its own, so the vector types hold a single value, as in FormulaEvaluator
+    const string real_type = use_double ? "double" : "float";
+    string adapted_formula = ReplaceAllSubstrings(formula, "float4", real_type);
+    adapted_formula = ReplaceAllSubstrings(adapted_formula, "double4", real_type);
+    if (!use_double)
+        adapted_formula = ReplaceAllSubstrings(adapted_formula, "double", real_type);
+    return adapted_formula;
+}
+
+// ---------------------------------------------------------------------------------------------------------
+
+#ifndef _WIN32
+
+namespace
+{
+    string GetCompiler()
+    {
+        for (const char* name : { "READY_CXX", "CXX" })
+        {
+            const char* value = getenv(name);
+            if (value && value[0] != '\0')
+            {
+                return value;
+            }
+        }
+        return "c++";
+    }
+
+    string QuoteForShell(const string& s)
+    {
+        string quoted = "'";
+        for (const char c : s)
+        {
+            if (c == '\'')
+            {
+                quoted += "'\\''";
+            }
+            else
+            {
+                quoted += c;
+            }
+        }
+        return quoted + "'";
+    }
+
+    string ReadFile(const fs::path& filename)
+    {
+        ifstream in(filename, ios::binary);
+        ostringstream oss;
+        oss << in.rdbuf();
+        return oss.str();
+    }
+
+    /// Returns the options that -march=native stands for on this CPU, as the compiler reports them, or "" if it doesn't.
+    /** They go into the cache key, so that a library built for one CPU is never loaded on another one that shares the
+     *  cache folder (e.g. a home folder mounted on several machines), where it could crash with an illegal instruction. */
+    string GetNativeTargetOptions(const string& compiler)
+    {
+        static string cached_compiler, cached_options;
+        static bool have_cached = false;
+        if (have_cached && cached_compiler == compiler)
+        {
+            return cached_options;
+        }
+
+        string output;
+        const string command = QuoteForShell(compiler) + " -march=native -### -x c++ -E /dev/null 2>&1";
+        FILE* pipe = popen(command.c_str(), "r");
+        if (pipe)
+        {
+            char buffer[4096];
+            size_t n;
+            while ((n = fread(buffer, 1, sizeof(buffer), pipe)) > 0)
+            {
+                output.append(buffer, n);
+            }
+            if (pclose(pipe) != 0)
+            {
+                output.clear();
+            }
+        }
+        // gcc passes e.g. -march=skylake -mavx2 -mno-avx512f to the compiler proper, clang "-target-cpu" "skylake"
+        // "-target-feature" "+avx2" (the other options can depend on e.g. the current folder, so we leave them out)
+        istringstream iss(output);
+        string token, options;
+        bool keep_next = false;
+        while (iss >> token)
+        {
+            token.erase(remove(token.begin(), token.end(), '"'), token.end());
+            if (keep_next || token.compare(0, 2, "-m") == 0)
+            {
+                options += " " + token;
+            }
+            keep_next = (token == "-target-cpu" || token == "-target-feature");
+        }
+
+        cached_compiler = compiler;
+        cached_options = options;
+        have_cached = true;
+        return options;
+    }
+}
+
+#endif
+
+// ---------------------------------------------------------------------------------------------------------
+
+NativeKernel::NativeKernel(const string& source, const string& caller)
+    : library(nullptr)
+    , caller(caller)
+{
+#ifdef _WIN32
+    throw runtime_error(caller + " : native kernels are not supported on this platform");
+#else
+    if (!native_enabled)
+    {
+        throw runtime_error(caller + " : native kernels are turned off");
+    }
+    const string compiler = GetCompiler();
+    // build for this CPU if we can tell which one it is, else for the compiler's default target
+    const string target_options = GetNativeTargetOptions(compiler);
+    const string options = string(NATIVE_COMPILER_OPTIONS) + (target_options.empty() ? "" : " -march=native");
+    // the stored source includes the compiler, the options and the CPU, to guard against hash collisions
+    const string key = "// " + compiler + " " + options + "\n//" + target_options + "\n" + source;
+    const string hash = OpenCL_KernelCache::Hash(key);
+
+    const bool use_cache = OpenCL_KernelCache::IsEnabled();
+    error_code ec;
+    const fs::path folder = use_cache ? fs::path(OpenCL_KernelCache::GetFolder()) / "native"
+                                      : fs::temp_directory_path(ec) / ("ready_native_" + to_string(getpid()));
+    fs::create_directories(folder, ec);
+    const fs::path source_filename = folder / (hash + ".cpp");
+    const fs::path library_filename = folder / (hash + ".so");
+
+    if (use_cache && fs::exists(library_filename, ec) && ReadFile(source_filename) == key)
+    {
+        this->library = dlopen(library_filename.c_str(), RTLD_NOW | RTLD_LOCAL);
+        if (this->library)
+        {
+            return;
+        }
+        // else the library is damaged, so we build it again
+    }
+
+    // write and build into files of our own and then rename them, in case another process is building the same kernel
+    const string suffix = "." + to_string(getpid());
+    const fs::path temp_source_filename = folder / (hash + suffix + ".cpp");
+    const fs::path temp_library_filename = library_filename.string() + suffix;
+    const fs::path log_filename = folder / (hash + ".log" + suffix);
+    {
+        ofstream out(temp_source_filename, ios::binary);
+        out << key;
+        if (!out)
+        {
+            out.close();
+            fs::remove(temp_source_filename, ec);
+            throw runtime_error(caller + " : failed to write " + temp_source_filename.string());
+        }
+    }
+    const string command = QuoteForShell(compiler) + " " + options
+        + " -o " + QuoteForShell(temp_library_filename.string()) + " " + QuoteForShell(temp_source_filename.string())
+        + " > " + QuoteForShell(log_filename.string()) + " 2>&1";
+    const int ret = system(command.c_str());
+    const string log = ReadFile(log_filename);
+    fs::remove(log_filename, ec);
+    if (ret != 0)
+    {
+        fs::remove(temp_library_filename, ec);
+        fs::remove(temp_source_filename, ec);
+        throw runtime_error(caller + " : native compilation with '" + compiler + "' failed:\n" + log);
+    }
+    fs::rename(temp_library_filename, library_filename, ec);
+    const fs::path& loaded_filename = ec ? temp_library_filename : library_filename;
+    fs::rename(temp_source_filename, source_filename, ec);
+    if (ec)
+    {
+        fs::remove(temp_source_filename, ec);
+    }
+    if (use_cache)
+    {
+        OpenCL_KernelCache::LimitSize();
+    }
+
+    this->library = dlopen(loaded_filename.c_str(), RTLD_NOW | RTLD_LOCAL);
+    const char* error = this->library ? nullptr : dlerror();
+    if (!use_cache)
+    {
+        // the library stays loaded after its file is removed
+        fs::remove_all(folder, ec);
+    }
+    if (!this->library)
+    {
+        throw runtime_error(caller + " : failed to load native kernel: " + (error ? error : "unknown error"));
+    }
+#endif
+}
+
+// ---------------------------------------------------------------------------------------------------------
+
+NativeKernel::~NativeKernel()
+{
+#ifndef _WIN32
+    if (this->library)
+    {
+        dlclose(this->library);
+    }
+#endif
+}
+
+// ---------------------------------------------------------------------------------------------------------
+
+void* NativeKernel::GetFunction(const string& name) const
+{
+    void* function = nullptr;
+#ifndef _WIN32
+    function = dlsym(this->library, name.c_str());
+#endif
+    if (!function)
+    {
+        throw runtime_error(this->caller + " : native kernel has no function " + name);
+    }
+    return function;
+}
+
+// ---------------------------------------------------------------------------------------------------------
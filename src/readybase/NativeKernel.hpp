@@ -0,0 +1,60 @@
+/*  Copyright 2011-2021 The Ready Bunch
+
+    This file is part of Ready.
+
+    Ready is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Ready is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Ready. If not, see <http://www.gnu.org/licenses/>.         */
+
+#ifndef __NATIVEKERNEL__
+#define __NATIVEKERNEL__
+
+// STL:
+#include <string>
+
+/// C++ source compiled at run time with the system compiler and loaded as a shared library.
+/** The libraries are kept in the kernel cache folder (see OpenCL_KernelCache) under a hash of the source, the compiler,
+ *  its options and the CPU, so each formula only has to be compiled once. They are built with -march=native when the
+ *  compiler reports what that means for this CPU, else for the compiler's default target. The compiler is taken from the
+ *  READY_CXX environment variable, then CXX, then "c++". Not available on Windows. */
+class NativeKernel
+{
+    public:
+
+        /// Turns native compilation on or off. It is on by default where it is supported.
+        static void SetEnabled(bool enabled);
+        static bool IsEnabled();
+
+        /// Compiles the source, or loads the library that was compiled from it before.
+        /** Throws std::runtime_error (with the compiler output) if the compilation fails. The caller string is used as
+         *  the prefix for error messages. */
+        NativeKernel(const std::string& source,const std::string& caller);
+        ~NativeKernel();
+
+        NativeKernel(const NativeKernel&) = delete;
+        NativeKernel& operator=(const NativeKernel&) = delete;
+
+        /// Returns the address of an extern "C" function in the library. Throws std::runtime_error if it isn't there.
+        void* GetFunction(const std::string& name) const;
+
+        /// Returns C++ definitions of the OpenCL built-ins that the formulas use, for a source that has typedef'd real.
+        static std::string GetFormulaPrelude();
+        /// Returns the formula with the OpenCL vector types replaced by the scalar type, since each cell is computed on its own.
+        static std::string AdaptFormula(const std::string& formula, bool use_double);
+
+    private:
+
+        void* library;
+        std::string caller;
+};
+
+#endif
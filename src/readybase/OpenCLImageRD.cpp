@@ -18,13 +18,17 @@
 #include "OpenCLImageRD.hpp"
 
 // local:
+#include "Integrators.hpp"
+#include "OpenCL_KernelCache.hpp"
 #include "OpenCL_utils.hpp"
 #include "utils.hpp"
 using namespace OpenCL_utils;
 
 // STL:
 #include <algorithm>
+#include <array>
 #include <cassert>
+#include <limits>
 #include <stdexcept>
 #include <sstream>
 #include <utility>
@@ -41,37 +45,33 @@ using namespace std;
 OpenCLImageRD::OpenCLImageRD(int opencl_platform,int opencl_device,int data_type)
     : ImageRD(data_type)
     , OpenCL_MixIn(opencl_platform,opencl_device)
+    , ensemble_size(1)
+    , ensemble_member_shown(0)
+    , initial_pattern_program(NULL)
+    , initial_pattern_kernel(NULL)
+    , initial_pattern_context(NULL)
 {
 }
 
 // ----------------------------------------------------------------------------------------------------------------
 
+OpenCLImageRD::~OpenCLImageRD()
+{
+    this->WaitForPendingReads(); // (they write into our images)
+    clReleaseKernel(this->initial_pattern_kernel);
+    clReleaseProgram(this->initial_pattern_program);
+}
+
+// ----------------------------------------------------------------------------------------------------------------
+
 void OpenCLImageRD::BuildProgram()
 {
-    // create the program
-    this->kernel_source = this->AssembleKernelSourceFromFormula(this->formula);
-    const char* source = this->kernel_source.c_str();
-    size_t source_size = this->kernel_source.length();
+    // create and build the program (or retrieve it from the cache)
+    this->kernel_source = this->AssembleKernelSourceForRunning(this->formula);
     clReleaseProgram(this->program);
-    cl_int ret;
-    this->program = clCreateProgramWithSource(this->context, 1, &source, &source_size, &ret);
-    throwOnError(ret, "OpenCLImageRD::ReloadKernelIfNeeded : Failed to create program with source: ");
-
-    // build the program
-    ret = clBuildProgram(this->program, 1, &this->device_id, "-cl-denorms-are-zero", NULL, NULL);
-    if (ret != CL_SUCCESS)
-    {
-        size_t build_log_length = 0;
-        cl_int ret2 = clGetProgramBuildInfo(this->program, this->device_id, CL_PROGRAM_BUILD_LOG, 0, 0, &build_log_length);
-        throwOnError(ret2, "OpenCLImageRD::ReloadKernelIfNeeded : retrieving length of program build log failed: ");
-        vector<char> build_log(build_log_length);
-        cl_int ret3 = clGetProgramBuildInfo(this->program, this->device_id, CL_PROGRAM_BUILD_LOG, build_log_length, build_log.data(), 0);
-        throwOnError(ret3, "OpenCLImageRD::ReloadKernelIfNeeded : retrieving program build log failed: ");
-        { ofstream out("kernel.txt"); out << kernel_source; }
-        ostringstream oss;
-        oss << "OpenCLImageRD::ReloadKernelIfNeeded : build failed (kernel saved as kernel.txt):\n\n" << string(build_log.begin(), build_log.end());
-        throwOnError(ret, oss.str().c_str());
-    }
+    this->program = NULL;
+    this->program = OpenCL_KernelCache::BuildProgram(this->context, this->device_id, this->kernel_source,
+        "-cl-denorms-are-zero", "OpenCLImageRD::ReloadKernelIfNeeded");
 }
 
 // ----------------------------------------------------------------------------------------------------------------
@@ -83,48 +83,22 @@ void OpenCLImageRD::ReloadKernelIfNeeded()
     this->global_range[0] = max(1, vtkMath::Round(this->GetX()) / this->GetBlockSizeX());
     this->global_range[1] = max(1, vtkMath::Round(this->GetY()) / this->GetBlockSizeY());
     this->global_range[2] = max(1, vtkMath::Round(this->GetZ()) / this->GetBlockSizeZ());
+    this->global_range[2] *= this->ensemble_size; // (the members of an ensemble are stacked along z)
 
     if (this->use_local_memory)
     {
-        cl_ulong local_memory_size;
-        clGetDeviceInfo(this->device_id, CL_DEVICE_LOCAL_MEM_SIZE, sizeof(local_memory_size), &local_memory_size, NULL);
-        cl_ulong max_work_group_size;
-        clGetDeviceInfo(this->device_id, CL_DEVICE_MAX_WORK_GROUP_SIZE, sizeof(max_work_group_size), &max_work_group_size, NULL);
-
-        int n = 1;
-        while (n <= 1024)
+        // use the work group size that was fastest last time we saw this kernel on this device, else find it now
+        // (the kernel source depends on the work group size so we use a placeholder size for the key)
+        this->local_work_size[0] = this->local_work_size[1] = this->local_work_size[2] = 1;
+        ostringstream tuning_key;
+        tuning_key << OpenCL_KernelCache::GetDeviceKey(this->device_id)
+            << this->global_range[0] << " " << this->global_range[1] << " " << this->global_range[2] << "\n"
+            << this->AssembleKernelSourceForRunning(this->formula);
+        if (!OpenCL_KernelCache::LookupWorkGroupSize(tuning_key.str(), this->local_work_size))
         {
-            this->local_work_size[0] = min(this->global_range[0], (size_t)4 * n / this->GetBlockSizeX());
-            this->local_work_size[1] = min(this->global_range[1], (size_t)4 * n / this->GetBlockSizeY());
-            this->local_work_size[2] = min(this->global_range[2], (size_t)4 * n / this->GetBlockSizeZ());
-            try
-            {
-                // ensure that we don't hit CL_DEVICE_MAX_WORK_GROUP_SIZE
-                size_t work_group_size = this->local_work_size[0] * this->local_work_size[1] * this->local_work_size[2];
-                if (work_group_size >= max_work_group_size)  // if allow to be equal, can get errors later
-                {
-                    break;
-                }
-                // ensure that we don't hit CL_DEVICE_LOCAL_MEM_SIZE
-                int extra = 2;
-                size_t expected_mem = 4 * sizeof(float) * (this->local_work_size[0] + extra) * (this->local_work_size[1] + extra) * (this->local_work_size[2] + extra);
-                // TODO: allow for number of chemicals etc, as we allocate in the kernel
-                if (expected_mem > local_memory_size)
-                {
-                    break;
-                }
-                BuildProgram();
-            }
-            catch (...)
-            {
-                break;
-            }
-            n *= 2;
+            this->TuneLocalWorkSize();
+            OpenCL_KernelCache::StoreWorkGroupSize(tuning_key.str(), this->local_work_size);
         }
-        n /= 2; // return to last known good
-        this->local_work_size[0] = min(this->global_range[0], (size_t)4 * n / this->GetBlockSizeX());
-        this->local_work_size[1] = min(this->global_range[1], (size_t)4 * n / this->GetBlockSizeY());
-        this->local_work_size[2] = min(this->global_range[2], (size_t)4 * n / this->GetBlockSizeZ());
     }
 
     BuildProgram();
@@ -140,11 +114,170 @@ void OpenCLImageRD::ReloadKernelIfNeeded()
 
 // ----------------------------------------------------------------------------------------------------------------
 
+void OpenCLImageRD::TuneLocalWorkSize()
+{
+    size_t max_work_group_size;
+    clGetDeviceInfo(this->device_id, CL_DEVICE_MAX_WORK_GROUP_SIZE, sizeof(max_work_group_size), &max_work_group_size, NULL);
+    cl_ulong local_memory_size;
+    clGetDeviceInfo(this->device_id, CL_DEVICE_LOCAL_MEM_SIZE, sizeof(local_memory_size), &local_memory_size, NULL);
+
+    // the candidates are the same series of sizes as we used to try, smallest first
+    vector<array<size_t, 3>> candidates;
+    for (int n = 1; n <= 1024; n *= 2)
+    {
+        array<size_t, 3> candidate;
+        candidate[0] = max((size_t)1, min(this->global_range[0], (size_t)4 * n / this->GetBlockSizeX()));
+        candidate[1] = max((size_t)1, min(this->global_range[1], (size_t)4 * n / this->GetBlockSizeY()));
+        candidate[2] = max((size_t)1, min(this->global_range[2], (size_t)4 * n / this->GetBlockSizeZ()));
+        if (candidate[0] * candidate[1] * candidate[2] >= max_work_group_size) // if allow to be equal, can get errors later
+        {
+            break;
+        }
+        // (a work group mustn't straddle two members of an ensemble, since they share local memory)
+        if (this->global_range[0] % candidate[0] != 0 || this->global_range[1] % candidate[1] != 0
+            || (this->global_range[2] / this->ensemble_size) % candidate[2] != 0)
+        {
+            continue;
+        }
+        if (find(candidates.begin(), candidates.end(), candidate) == candidates.end())
+        {
+            candidates.push_back(candidate);
+        }
+    }
+    if (candidates.empty())
+    {
+        candidates.push_back({ 1, 1, 1 });
+    }
+
+    // number of cells in the local memory arrays, including an estimate of the neighborhood around the work group
+    auto local_cells = [&](const array<size_t, 3>& size) {
+        size_t cells = 1;
+        for (int i = 0; i < 3; i++)
+        {
+            cells *= size[i] + (this->global_range[i] > 1 ? 2 : 0);
+        }
+        return cells;
+    };
+
+    // make some scratch buffers to time the kernels on
+    const size_t MEM_SIZE = this->data_type_size * this->GetX() * this->GetY() * this->GetZ() * this->ensemble_size;
+    const int NC = this->GetNumberOfChemicals();
+    const vector<char> zeros(MEM_SIZE, 0);
+    vector<cl_mem> scratch_buffers(2 * NC, NULL);
+    for (cl_mem& buffer : scratch_buffers)
+    {
+        cl_int ret;
+        buffer = clCreateBuffer(this->context, CL_MEM_READ_WRITE, MEM_SIZE, NULL, &ret);
+        throwOnError(ret, "OpenCLImageRD::TuneLocalWorkSize : buffer creation failed: ");
+        ret = clEnqueueWriteBuffer(this->command_queue, buffer, CL_TRUE, 0, MEM_SIZE, zeros.data(), 0, NULL, NULL);
+        throwOnError(ret, "OpenCLImageRD::TuneLocalWorkSize : buffer writing failed: ");
+    }
+
+    array<size_t, 3> best_size = candidates.front();
+    double best_time = numeric_limits<double>::max();
+    size_t kernel_work_group_size = max_work_group_size;
+    double local_memory_per_cell = 0.0;
+    for (const array<size_t, 3>& candidate : candidates)
+    {
+        // use what the first build told us to skip candidates that can't work
+        if (candidate[0] * candidate[1] * candidate[2] > kernel_work_group_size
+            || local_memory_per_cell * local_cells(candidate) > local_memory_size)
+        {
+            continue;
+        }
+        copy(candidate.begin(), candidate.end(), this->local_work_size);
+        try
+        {
+            // the work group size is compiled into the kernel, so each candidate needs its own build
+            BuildProgram();
+            clReleaseKernel(this->kernel);
+            cl_int ret;
+            this->kernel = clCreateKernel(this->program, this->kernel_function_name.c_str(), &ret);
+            throwOnError(ret, "OpenCLImageRD::TuneLocalWorkSize : kernel creation failed: ");
+
+            size_t work_group_size;
+            ret = clGetKernelWorkGroupInfo(this->kernel, this->device_id, CL_KERNEL_WORK_GROUP_SIZE, sizeof(work_group_size), &work_group_size, NULL);
+            throwOnError(ret, "OpenCLImageRD::TuneLocalWorkSize : clGetKernelWorkGroupInfo failed: ");
+            cl_ulong kernel_local_memory_size;
+            ret = clGetKernelWorkGroupInfo(this->kernel, this->device_id, CL_KERNEL_LOCAL_MEM_SIZE, sizeof(kernel_local_memory_size), &kernel_local_memory_size, NULL);
+            throwOnError(ret, "OpenCLImageRD::TuneLocalWorkSize : clGetKernelWorkGroupInfo failed: ");
+            kernel_work_group_size = min(kernel_work_group_size, work_group_size);
+            local_memory_per_cell = max(local_memory_per_cell, kernel_local_memory_size / (double)local_cells(candidate));
+            if (candidate[0] * candidate[1] * candidate[2] > work_group_size || kernel_local_memory_size > local_memory_size)
+            {
+                continue;
+            }
+
+            // time a short run
+            for (int i = 0; i < 2 * NC; i++)
+            {
+                ret = clSetKernelArg(this->kernel, i, sizeof(cl_mem), &scratch_buffers[i]);
+                throwOnError(ret, "OpenCLImageRD::TuneLocalWorkSize : clSetKernelArg failed: ");
+            }
+            this->PassParametersToKernel();
+            const ButcherTableau& tableau = GetButcherTableau(this->integrator);
+            if (tableau.GetNumberOfStages() > 1 && this->HasParameterKernelArguments())
+            {
+                // time the last stage, which does the most work
+                this->CreateIntegratorBuffersIfNeeded(tableau, NC, MEM_SIZE);
+                this->SetIntegratorKernelArguments(tableau, 2 * NC + this->GetNumberOfParameters(),
+                    vector<cl_mem>(scratch_buffers.begin(), scratch_buffers.begin() + NC), tableau.GetNumberOfStages() - 1);
+            }
+            const int TIMING_RUNS = 10;
+            double start_time = 0.0;
+            for (int it = -1; it < TIMING_RUNS; it++) // (the first run is a warm-up)
+            {
+                ret = clEnqueueNDRangeKernel(this->command_queue, this->kernel, 3, NULL, this->global_range, this->local_work_size, 0, NULL, NULL);
+                throwOnError(ret, "OpenCLImageRD::TuneLocalWorkSize : clEnqueueNDRangeKernel failed: ");
+                if (it == -1)
+                {
+                    ret = clFinish(this->command_queue);
+                    throwOnError(ret, "OpenCLImageRD::TuneLocalWorkSize : clFinish failed: ");
+                    start_time = get_time_in_seconds();
+                }
+            }
+            ret = clFinish(this->command_queue);
+            throwOnError(ret, "OpenCLImageRD::TuneLocalWorkSize : clFinish failed: ");
+            const double time_taken = get_time_in_seconds() - start_time;
+            if (time_taken < best_time)
+            {
+                best_time = time_taken;
+                best_size = candidate;
+            }
+        }
+        catch (...)
+        {
+            // this candidate doesn't work on this device, try the others
+        }
+    }
+
+    for (cl_mem buffer : scratch_buffers)
+    {
+        clReleaseMemObject(buffer);
+    }
+    copy(best_size.begin(), best_size.end(), this->local_work_size);
+}
+
+// ----------------------------------------------------------------------------------------------------------------
+
+void OpenCLImageRD::PassParametersToKernel()
+{
+    if(!this->HasParameterKernelArguments()) return;
+
+    // the parameter values come after a_in, b_in, ... a_out, b_out ...
+    vector<float> values;
+    for(const Parameter& parameter : this->parameters)
+        values.push_back(parameter.value);
+    this->SetParameterKernelArguments(2*this->GetNumberOfChemicals(), values, this->data_type == VTK_DOUBLE);
+}
+
+// ----------------------------------------------------------------------------------------------------------------
+
 void OpenCLImageRD::CreateOpenCLBuffers()
 {
     this->ReloadContextIfNeeded();
 
-    const size_t MEM_SIZE = this->data_type_size * this->GetX() * this->GetY() * this->GetZ();
+    const size_t MEM_SIZE = this->data_type_size * this->GetX() * this->GetY() * this->GetZ() * this->ensemble_size;
     const int NC = this->GetNumberOfChemicals();
 
     this->ReleaseOpenCLBuffers();
@@ -162,13 +295,20 @@ void OpenCLImageRD::CreateOpenCLBuffers()
     }
 
     this->need_write_to_opencl_buffers = true;
+    this->need_read_from_opencl_buffers = false;
+    this->painted_regions.clear();
 }
 
 // ----------------------------------------------------------------------------------------------------------------
 
 void OpenCLImageRD::WriteToOpenCLBuffersIfNeeded()
 {
-    if(!this->need_write_to_opencl_buffers) return;
+    if(!this->need_write_to_opencl_buffers)
+    {
+        // at most a few regions have been painted, so we only need to upload those
+        this->WritePaintedRegionsToOpenCLBuffers();
+        return;
+    }
 
     const size_t MEM_SIZE = this->data_type_size * this->GetX() * this->GetY() * this->GetZ();
 
@@ -176,11 +316,82 @@ void OpenCLImageRD::WriteToOpenCLBuffersIfNeeded()
     for(int ic=0;ic<this->GetNumberOfChemicals();ic++)
     {
         void* data = this->images[ic]->GetScalarPointer();
-        cl_int ret = clEnqueueWriteBuffer(this->command_queue,this->buffers[this->iCurrentBuffer][ic], CL_TRUE, 0, MEM_SIZE, data, 0, NULL, NULL);
-        throwOnError(ret,"OpenCLImageRD::WriteToOpenCLBuffers : buffer writing failed: ");
+        // every member of an ensemble starts from the host images
+        for(int im=0;im<this->ensemble_size;im++)
+        {
+            cl_int ret = clEnqueueWriteBuffer(this->command_queue,this->buffers[this->iCurrentBuffer][ic], CL_TRUE, im * MEM_SIZE, MEM_SIZE, data, 0, NULL, NULL);
+            throwOnError(ret,"OpenCLImageRD::WriteToOpenCLBuffers : buffer writing failed: ");
+        }
     }
 
     this->need_write_to_opencl_buffers = false;
+    this->painted_regions.clear();
+}
+
+// ----------------------------------------------------------------------------------------------------------------
+
+void OpenCLImageRD::RegionWasPainted(int iChemical,const int lower[3],const int upper[3])
+{
+    if(this->need_write_to_opencl_buffers) return; // everything will be uploaded anyway
+
+    if(iChemical >= (int)this->painted_regions.size())
+        this->painted_regions.resize(iChemical+1, { true, { 0, 0, 0 }, { 0, 0, 0 } });
+    PaintedRegion& region = this->painted_regions[iChemical];
+    for(int i=0;i<3;i++)
+    {
+        region.lower[i] = region.empty ? lower[i] : min(region.lower[i],lower[i]);
+        region.upper[i] = region.empty ? upper[i] : max(region.upper[i],upper[i]);
+    }
+    region.empty = false;
+}
+
+// ----------------------------------------------------------------------------------------------------------------
+
+void OpenCLImageRD::WritePaintedRegionsToOpenCLBuffers()
+{
+    if(this->painted_regions.empty()) return;
+
+    // OpenCL 1.0 has no clEnqueueWriteBufferRect so we upload each region as a list of contiguous spans of cells:
+    // rows, or whole slices if the region spans the image in x, or a single span if it also spans it in y
+    struct Span { int iChemical; size_t offset,count; };
+    vector<Span> spans;
+    const int X = this->GetX();
+    const int Y = this->GetY();
+    for(int ic=0;ic<(int)this->painted_regions.size() && ic<this->GetNumberOfChemicals();ic++)
+    {
+        const PaintedRegion& region = this->painted_regions[ic];
+        if(region.empty) continue;
+        const size_t nx = region.upper[0] - region.lower[0] + 1;
+        const size_t ny = region.upper[1] - region.lower[1] + 1;
+        const size_t nz = region.upper[2] - region.lower[2] + 1;
+        if(nx == (size_t)X && ny == (size_t)Y)
+            spans.push_back({ ic, size_t(region.lower[2]) * X * Y, nx * ny * nz });
+        else if(nx == (size_t)X)
+            for(int z=region.lower[2];z<=region.upper[2];z++)
+                spans.push_back({ ic, (size_t(z) * Y + region.lower[1]) * X, nx * ny });
+        else
+            for(int z=region.lower[2];z<=region.upper[2];z++)
+                for(int y=region.lower[1];y<=region.upper[1];y++)
+                    spans.push_back({ ic, (size_t(z) * Y + y) * X + region.lower[0], nx });
+    }
+    this->painted_regions.clear();
+
+    // the painting goes into every member of an ensemble, each of which has its own slab of the buffers
+    const size_t MEM_SIZE = this->data_type_size * X * Y * this->GetZ();
+    for(size_t i=0;i<spans.size();i++)
+    {
+        const Span& span = spans[i];
+        const char* data = static_cast<const char*>(this->images[span.iChemical]->GetScalarPointer());
+        for(int im=0;im<this->ensemble_size;im++)
+        {
+            // the queue is in-order, so making the last write blocking means the host data is free to change when we return
+            const cl_bool blocking = ( i+1 == spans.size() && im+1 == this->ensemble_size ) ? CL_TRUE : CL_FALSE;
+            cl_int ret = clEnqueueWriteBuffer(this->command_queue, this->buffers[this->iCurrentBuffer][span.iChemical], blocking,
+                im * MEM_SIZE + span.offset * this->data_type_size, span.count * this->data_type_size,
+                data + span.offset * this->data_type_size, 0, NULL, NULL);
+            throwOnError(ret,"OpenCLImageRD::WritePaintedRegionsToOpenCLBuffers : buffer writing failed: ");
+        }
+    }
 }
 
 // ----------------------------------------------------------------------------------------------------------------
@@ -203,12 +414,147 @@ void OpenCLImageRD::SetFrom2DImage(int iChemical, vtkImageData *im)
 
 void OpenCLImageRD::GenerateInitialPattern()
 {
+    if(this->GenerateInitialPatternOnDevice()) return;
+
     ImageRD::GenerateInitialPattern();
     this->need_write_to_opencl_buffers = true;
 }
 
 // ----------------------------------------------------------------------------------------------------------------
 
+string OpenCLImageRD::AssembleInitialPatternKernelSource() const
+{
+    const int NC = this->GetNumberOfChemicals();
+    const bool zero_first = this->initial_pattern_generator.ShouldZeroFirst();
+
+    ostringstream kernel_source;
+    if(this->data_type == VTK_DOUBLE)
+    {
+        kernel_source << "\
+#ifdef cl_khr_fp64\n\
+    #pragma OPENCL EXTENSION cl_khr_fp64 : enable\n\
+#elif defined(cl_amd_fp64)\n\
+    #pragma OPENCL EXTENSION cl_amd_fp64 : enable\n\
+#else\n\
+    #error \"Double precision floating point not supported on this OpenCL device. Choose another or contact the Ready team.\"\n\
+#endif\n\n";
+    }
+    kernel_source << "typedef " << this->data_type_string << " real;\n\n";
+    kernel_source << Overlay::GetOpenCLFunctions() << "\n";
+
+    // (the chemicals are passed as chem_0, chem_1, ... in case a chemical is called x, y or z)
+    kernel_source << "__kernel void initial_pattern(";
+    for(int ic=0;ic<NC;ic++)
+        kernel_source << "global real* chem_" << ic << ", ";
+    kernel_source << "const ulong key)\n{\n";
+    kernel_source << "    const int ix = get_global_id(0);\n";
+    kernel_source << "    const int iy = get_global_id(1);\n";
+    kernel_source << "    const int iz = get_global_id(2);\n";
+    kernel_source << "    const int index_here = " << this->GetX() << " * (" << this->GetY() << " * iz + iy) + ix;\n";
+    kernel_source << "    const real x = ix;\n";
+    kernel_source << "    const real y = iy;\n";
+    kernel_source << "    const real z = iz;\n";
+    kernel_source << "    real vals[" << NC << "];\n";
+    for(int ic=0;ic<NC;ic++)
+        kernel_source << "    vals[" << ic << "] = " << (zero_first ? string("0") : "chem_" + to_string(ic) + "[index_here]") << ";\n";
+
+    vector<bool> changed(NC, zero_first);
+    for(size_t iOverlay=0;iOverlay<this->initial_pattern_generator.GetNumberOfOverlays();iOverlay++)
+    {
+        const Overlay& overlay = this->initial_pattern_generator.GetOverlay(iOverlay);
+        const string code = overlay.GetOpenCLCode(*this, "overlay_key");
+        if(code.empty())
+            return "";
+        changed[overlay.GetTargetChemical()] = true;
+        kernel_source << "    {\n";
+        kernel_source << "        const ulong overlay_key = random_hash(key, " << iOverlay << "UL);\n";
+        istringstream lines(code);
+        string line;
+        while(getline(lines, line))
+            kernel_source << "        " << line << "\n";
+        kernel_source << "    }\n";
+    }
+
+    for(int ic=0;ic<NC;ic++)
+        if(changed[ic])
+            kernel_source << "    chem_" << ic << "[index_here] = vals[" << ic << "];\n";
+    kernel_source << "}\n";
+    return kernel_source.str();
+}
+
+// ----------------------------------------------------------------------------------------------------------------
+
+bool OpenCLImageRD::GenerateInitialPatternOnDevice()
+{
+    const int NC = this->GetNumberOfChemicals();
+    if(NC == 0 || (int)this->buffers[0].size() != NC || (int)this->buffers[1].size() != NC)
+        return false;
+    if(this->ensemble_size > 1)
+        return false; // the kernel only writes one copy of the grid, so we make the pattern on the host and upload it to every member
+
+    // the overlays are reseeded before the source is made, since the kernel is given the key that they were given
+    this->initial_pattern_generator.Reseed();
+    const string source = this->AssembleInitialPatternKernelSource();
+    if(source.empty())
+        return false; // some overlay can only be run on the host
+
+    this->ReloadContextIfNeeded();
+
+    if(source != this->initial_pattern_kernel_source || this->context != this->initial_pattern_context)
+    {
+        clReleaseKernel(this->initial_pattern_kernel);
+        this->initial_pattern_kernel = NULL;
+        clReleaseProgram(this->initial_pattern_program);
+        this->initial_pattern_program = NULL;
+        this->initial_pattern_kernel_source.clear();
+
+        this->initial_pattern_program = OpenCL_KernelCache::BuildProgram(this->context, this->device_id, source,
+            "-cl-denorms-are-zero", "OpenCLImageRD::GenerateInitialPatternOnDevice");
+        cl_int ret;
+        this->initial_pattern_kernel = clCreateKernel(this->initial_pattern_program, "initial_pattern", &ret);
+        throwOnError(ret,"OpenCLImageRD::GenerateInitialPatternOnDevice : kernel creation failed: ");
+        this->initial_pattern_kernel_source = source;
+        this->initial_pattern_context = this->context;
+    }
+
+    if(this->initial_pattern_generator.ShouldZeroFirst())
+    {
+        // every cell is written by the kernel, so there is nothing to upload
+        this->need_write_to_opencl_buffers = false;
+        this->painted_regions.clear();
+        this->undo_stack.clear();
+    }
+    else
+    {
+        // the kernel reads the current values, so any changes made on the host must be uploaded first
+        this->WriteToOpenCLBuffersIfNeeded();
+    }
+
+    cl_int ret;
+    for(int ic=0;ic<NC;ic++)
+    {
+        ret = clSetKernelArg(this->initial_pattern_kernel, ic, sizeof(cl_mem), &this->buffers[this->iCurrentBuffer][ic]);
+        throwOnError(ret,"OpenCLImageRD::GenerateInitialPatternOnDevice : clSetKernelArg failed: ");
+    }
+    const cl_ulong key = this->initial_pattern_generator.GetKey();
+    ret = clSetKernelArg(this->initial_pattern_kernel, NC, sizeof(cl_ulong), &key);
+    throwOnError(ret,"OpenCLImageRD::GenerateInitialPatternOnDevice : clSetKernelArg failed: ");
+
+    // one work item for each cell
+    const size_t global_size[3] = { (size_t)this->GetX(), (size_t)this->GetY(), (size_t)this->GetZ() };
+    ret = clEnqueueNDRangeKernel(this->command_queue, this->initial_pattern_kernel, 3, NULL, global_size, NULL, 0, NULL, NULL);
+    throwOnError(ret,"OpenCLImageRD::GenerateInitialPatternOnDevice : clEnqueueNDRangeKernel failed: ");
+    ret = clFlush(this->command_queue);
+    throwOnError(ret,"OpenCLImageRD::GenerateInitialPatternOnDevice : clFlush failed: ");
+
+    // the host images are read back from the device when they are next needed
+    this->need_read_from_opencl_buffers = true;
+    this->timesteps_taken = 0;
+    return true;
+}
+
+// ----------------------------------------------------------------------------------------------------------------
+
 void OpenCLImageRD::BlankImage(float value)
 {
     ImageRD::BlankImage(value);
@@ -249,18 +595,10 @@ void OpenCLImageRD::InternalUpdate(int n_steps)
     int iBuffer;
     const int NC = this->GetNumberOfChemicals();
 
-    for(int it=0;it<n_steps;it++)
+    this->PassParametersToKernel();
+
+    auto enqueue_kernel = [&]()
     {
-        for(int io=0;io<2;io++) // first input buffers (io=0) then output buffers (io=1)
-        {
-            iBuffer = (this->iCurrentBuffer+io)%2;
-            for(int ic=0;ic<NC;ic++)
-            {
-                // a_in, b_in, ... a_out, b_out ...
-                ret = clSetKernelArg(this->kernel, io*NC+ic, sizeof(cl_mem), (void *)&this->buffers[iBuffer][ic]);
-                throwOnError(ret,"OpenCLImageRD::InternalUpdate : clSetKernelArg failed: ");
-            }
-        }
         ret = clEnqueueNDRangeKernel(this->command_queue, this->kernel, 3, // dimensions
             NULL, this->global_range, this->use_local_memory ? this->local_work_size : NULL,
             0, NULL, NULL);
@@ -271,63 +609,121 @@ void OpenCLImageRD::InternalUpdate(int n_steps)
             oss << "Local work size: " << this->local_work_size[0] << " x " << this->local_work_size[1] << " x " << this->local_work_size[2] << "\n";
             throwOnError(ret, oss.str().c_str());
         }
-        this->iCurrentBuffer = 1 - this->iCurrentBuffer;
-    }
+    };
 
-    this->ReadFromOpenCLBuffers();
-}
-
-// ----------------------------------------------------------------------------------------------------------------
+    const ButcherTableau& tableau = GetButcherTableau(this->integrator);
+    if(tableau.GetNumberOfStages() > 1 && this->HasParameterKernelArguments())
+    {
+        // the integrator's arguments come after the parameters, and the kernel runs once for each stage
+        const size_t MEM_SIZE = this->data_type_size * this->GetX() * this->GetY() * this->GetZ() * this->ensemble_size;
+        const int first_arg = 2*NC + this->GetNumberOfParameters();
+        const int iTimestep = GetTimestepParameterIndex(*this);
+        const bool use_double = this->data_type == VTK_DOUBLE;
+        auto take_step = [&](double timestep)
+        {
+            this->SetParameterKernelArguments(2*NC + iTimestep, { static_cast<float>(timestep) }, use_double);
+            return this->EnqueueIntegratorStep(tableau, first_arg, MEM_SIZE, use_double, enqueue_kernel);
+        };
+        auto accept = [&]() { this->iCurrentBuffer = 1 - this->iCurrentBuffer; };
+        const double next_timestep = RunIntegratorSteps(tableau, n_steps, this->parameters[iTimestep].value,
+            this->integrator_tolerance, take_step, accept);
+        if(tableau.IsAdaptive())
+            this->SetParameterValue(iTimestep, static_cast<float>(next_timestep));
+    }
+    else
+    {
+        for(int it=0;it<n_steps;it++)
+        {
+            for(int io=0;io<2;io++) // first input buffers (io=0) then output buffers (io=1)
+            {
+                iBuffer = (this->iCurrentBuffer+io)%2;
+                for(int ic=0;ic<NC;ic++)
+                {
+                    // a_in, b_in, ... a_out, b_out ...
+                    ret = clSetKernelArg(this->kernel, io*NC+ic, sizeof(cl_mem), (void *)&this->buffers[iBuffer][ic]);
+                    throwOnError(ret,"OpenCLImageRD::InternalUpdate : clSetKernelArg failed: ");
+                }
+            }
+            enqueue_kernel();
+            this->iCurrentBuffer = 1 - this->iCurrentBuffer;
+        }
+    }
 
-void OpenCLImageRD::ReadFromOpenCLBuffers()
-{
-    // read from opencl buffers into our image
-    const size_t MEM_SIZE = this->data_type_size * this->GetX() * this->GetY() * this->GetZ();
-    for(int ic=0;ic<this->GetNumberOfChemicals();ic++)
+    if(n_steps > 0)
     {
-        void* data = this->images[ic]->GetScalarPointer();
-        cl_int ret = clEnqueueReadBuffer(this->command_queue,this->buffers[this->iCurrentBuffer][ic], CL_TRUE, 0, MEM_SIZE, data, 0, NULL, NULL);
-        throwOnError(ret,"OpenCLImageRD::ReadFromOpenCLBuffers : buffer reading failed: ");
+        // start the device working but don't wait for it: the results are read back when someone needs them
+        ret = clFlush(this->command_queue);
+        throwOnError(ret,"OpenCLImageRD::InternalUpdate : clFlush failed: ");
+        this->need_read_from_opencl_buffers = true;
     }
 }
 
 // ----------------------------------------------------------------------------------------------------------------
 
-void OpenCLImageRD::TestFormula(std::string program_string)
+void OpenCLImageRD::SaveChangeReference()
 {
-    this->TestKernel(this->AssembleKernelSourceFromFormula(program_string));
+    this->SaveChangeReferenceOnDevice(this->data_type_size * this->GetX() * this->GetY() * this->GetZ() * this->ensemble_size);
 }
 
 // ----------------------------------------------------------------------------------------------------------------
 
-void OpenCLImageRD::SetValue(float x,float y,float z,float val,const Properties& render_settings)
+void OpenCLImageRD::GetChangeFromReference(double& max_change, double& sum_squares)
 {
-    ImageRD::SetValue(x,y,z,val,render_settings);
-    this->need_write_to_opencl_buffers = true;
+    this->GetChangeFromReferenceOnDevice(this->data_type_size * this->GetX() * this->GetY() * this->GetZ() * this->ensemble_size,
+        this->data_type == VTK_DOUBLE, max_change, sum_squares);
+    sum_squares /= this->ensemble_size; // (so that the root-mean-square change is over all the members)
 }
 
 // ----------------------------------------------------------------------------------------------------------------
 
-void OpenCLImageRD::SetValuesInRadius(float x,float y,float z,float r,float val,const Properties& render_settings)
+void OpenCLImageRD::EnqueueReadFromOpenCLBuffers() const
 {
-    ImageRD::SetValuesInRadius(x,y,z,r,val,render_settings);
-    this->need_write_to_opencl_buffers = true;
+    if(!this->need_read_from_opencl_buffers) return;
+
+    // queue non-blocking reads from opencl buffers into our image, behind the kernels that compute them
+    const size_t MEM_SIZE = this->data_type_size * this->GetX() * this->GetY() * this->GetZ();
+    const int NC = this->GetNumberOfChemicals();
+    cl_int ret = CL_SUCCESS;
+    for(int ic=0;ic<NC && ret==CL_SUCCESS;ic++)
+    {
+        void* data = this->images[ic]->GetScalarPointer();
+        cl_event event;
+        ret = clEnqueueReadBuffer(this->command_queue,this->buffers[this->iCurrentBuffer][ic], CL_FALSE,
+            this->ensemble_member_shown * MEM_SIZE, MEM_SIZE, data, 0, NULL, &event);
+        if(ret == CL_SUCCESS)
+            this->pending_read_events.push_back(event);
+    }
+    if(ret == CL_SUCCESS)
+        ret = clFlush(this->command_queue);
+    if(ret != CL_SUCCESS)
+    {
+        this->WaitForPendingReads(); // (the reads that were queued still write into our image)
+        throwOnError(ret,"OpenCLImageRD::EnqueueReadFromOpenCLBuffers : buffer reading failed: ");
+    }
+
+    this->need_read_from_opencl_buffers = false;
 }
 
 // ----------------------------------------------------------------------------------------------------------------
 
-void OpenCLImageRD::Undo()
+void OpenCLImageRD::ReadFromOpenCLBuffers() const
 {
-    ImageRD::Undo();
-    this->need_write_to_opencl_buffers = true;
+    this->EnqueueReadFromOpenCLBuffers();
+    if(this->pending_read_events.empty()) return;
+
+    cl_int ret = this->WaitForPendingReads();
+    throwOnError(ret,"OpenCLImageRD::ReadFromOpenCLBuffers : buffer reading failed: ");
+
+    for(int ic=0;ic<this->GetNumberOfChemicals();ic++)
+        this->images[ic]->Modified();
 }
 
 // ----------------------------------------------------------------------------------------------------------------
 
-void OpenCLImageRD::Redo()
+void OpenCLImageRD::TestFormula(std::string program_string)
 {
-    ImageRD::Redo();
-    this->need_write_to_opencl_buffers = true;
+    this->TestKernel(this->AssembleKernelSourceForRunning(program_string));
 }
 
 // ----------------------------------------------------------------------------------------------------------------
+
@@ -28,9 +28,14 @@ class OpenCLImageRD : public ImageRD, public OpenCL_MixIn
     public:
 
         OpenCLImageRD(int opencl_platform,int opencl_device,int data_type);
+        ~OpenCLImageRD();
 
         bool HasEditableFormula() const override { return true; }
 
+        void BeginSyncToHost() const override { this->EnqueueReadFromOpenCLBuffers(); }
+        void SyncToHost() const override { this->ReadFromOpenCLBuffers(); }
+        void WaitForUpdate() const override { this->WaitForDevice(); }
+
         void GenerateInitialPattern() override;
         void BlankImage(float value = 0.0f) override;
 
@@ -40,12 +45,6 @@ class OpenCLImageRD : public ImageRD, public OpenCL_MixIn
 
         void SetFrom2DImage(int iChemical, vtkImageData *im) override;
 
-        void SetValue(float x,float y,float z,float val,const Properties& render_settings) override;
-        void SetValuesInRadius(float x,float y,float z,float r,float val,const Properties& render_settings) override;
-
-        void Undo() override;
-        void Redo() override;
-
     protected:
 
         void CopyFromImage(vtkImageData* im) override;
@@ -55,15 +54,59 @@ class OpenCLImageRD : public ImageRD, public OpenCL_MixIn
 
         void InternalUpdate(int n_steps) override;
 
+        // the values are compared on the device, instead of reading them back
+        void SaveChangeReference() override;
+        void GetChangeFromReference(double& max_change, double& sum_squares) override;
+
         void ReloadKernelIfNeeded() override;
 
         void CreateOpenCLBuffers() override;
         void WriteToOpenCLBuffersIfNeeded() override;
-        void ReadFromOpenCLBuffers() override;
+        void EnqueueReadFromOpenCLBuffers() const override;
+        void ReadFromOpenCLBuffers() const override;
+
+        void RegionWasPainted(int iChemical,const int lower[3],const int upper[3]) override;
+
+        /// The number of copies of the grid that are stacked along z in the OpenCL buffers, each one a member of an ensemble.
+        /** Only FormulaOpenCLImageRD runs ensembles (see FormulaOpenCLImageRD::SetEnsemble), else this is 1. The host
+         *  images hold just one member, ensemble_member_shown; when they change, every member is reset to them, except
+         *  that a painted region (the box around the brush strokes) is copied into each member, leaving the rest alone. */
+        int ensemble_size;
+        int ensemble_member_shown;
 
     private:
 
+        /// Uploads just the painted regions, for when the rest of the OpenCL buffers are up to date.
+        void WritePaintedRegionsToOpenCLBuffers();
+
+        /// A box of cells (bounds inclusive) that has changed since the OpenCL buffers were written.
+        struct PaintedRegion {
+            bool empty;
+            int lower[3],upper[3];
+        };
+        std::vector<PaintedRegion> painted_regions; ///< one for each chemical
+
+        /// Runs the initial pattern generator as a kernel that writes straight into the OpenCL buffers.
+        /** Returns false, having changed nothing, if some overlay can't be run on the device. The host images are only
+         *  updated when someone needs them (see SyncToHost). */
+        bool GenerateInitialPatternOnDevice();
+
+        /// Returns the source of the initial pattern kernel, or an empty string if some overlay can't be run on the device.
+        std::string AssembleInitialPatternKernelSource() const;
+
+        // the initial pattern kernel, kept for as long as the source and the context stay the same
+        cl_program initial_pattern_program;
+        cl_kernel initial_pattern_kernel;
+        cl_context initial_pattern_context;
+        std::string initial_pattern_kernel_source;
+
         void BuildProgram();
+
+        /// Times the kernel with a few different work group sizes and leaves the fastest in local_work_size.
+        void TuneLocalWorkSize();
+
+        /// Sets the kernel arguments that hold the parameter values, if the kernel has them.
+        void PassParametersToKernel();
 };
 
 #endif
@@ -17,6 +17,8 @@
 
 // local:
 #include "OpenCLMeshRD.hpp"
+#include "Integrators.hpp"
+#include "OpenCL_KernelCache.hpp"
 #include "OpenCL_utils.hpp"
 using namespace OpenCL_utils;
 #include "utils.hpp"
@@ -24,6 +26,7 @@ using namespace OpenCL_utils;
 // STL:
 #include <string>
 #include <sstream>
+#include <vector>
 
 // VTK:
 #include <vtkMath.h>
@@ -38,6 +41,7 @@ OpenCLMeshRD::OpenCLMeshRD(int opencl_platform,int opencl_device,int data_type)
     : MeshRD(data_type)
     , OpenCL_MixIn(opencl_platform,opencl_device)
 {
+    this->clBuffer_cell_neighbor_offsets = NULL;
     this->clBuffer_cell_neighbor_indices = NULL;
     this->clBuffer_cell_neighbor_weights = NULL;
 }
@@ -46,6 +50,8 @@ OpenCLMeshRD::OpenCLMeshRD(int opencl_platform,int opencl_device,int data_type)
 
 OpenCLMeshRD::~OpenCLMeshRD()
 {
+    this->WaitForPendingReads(); // (they write into our mesh data)
+    clReleaseMemObject(this->clBuffer_cell_neighbor_offsets);
     clReleaseMemObject(this->clBuffer_cell_neighbor_indices);
     clReleaseMemObject(this->clBuffer_cell_neighbor_weights);
 }
@@ -63,14 +69,6 @@ void OpenCLMeshRD::SetNumberOfChemicals(int n, bool reallocate_storage)
 
 // -------------------------------------------------------------------------
 
-void OpenCLMeshRD::SetParameterValue(int iParam,float val)
-{
-    AbstractRD::SetParameterValue(iParam,val);
-    this->need_reload_formula = true;
-}
-
-// -------------------------------------------------------------------------
-
 void OpenCLMeshRD::SetParameterName(int iParam,const string& s)
 {
     AbstractRD::SetParameterName(iParam,s);
@@ -118,27 +116,77 @@ void OpenCLMeshRD::InternalUpdate(int n_steps)
     throwOnError(ret,"OpenCLMeshRD::InternalUpdate : clSetKernelArg failed on indices array: ");
     ret = clSetKernelArg(this->kernel, 2*NC + 1, sizeof(cl_mem), (void *)&this->clBuffer_cell_neighbor_weights);
     throwOnError(ret,"OpenCLMeshRD::InternalUpdate : clSetKernelArg failed on weights array: ");
-    ret = clSetKernelArg(this->kernel, 2*NC + 2, sizeof(int), &this->max_neighbors);
-    throwOnError(ret,"OpenCLMeshRD::InternalUpdate : clSetKernelArg failed on max_neighbors parameter: ");
+    if(this->padded_neighbors)
+    {
+        ret = clSetKernelArg(this->kernel, 2*NC + 2, sizeof(int), &this->max_neighbors);
+        throwOnError(ret,"OpenCLMeshRD::InternalUpdate : clSetKernelArg failed on max_neighbors parameter: ");
+    }
+    else
+    {
+        ret = clSetKernelArg(this->kernel, 2*NC + 2, sizeof(cl_mem), (void *)&this->clBuffer_cell_neighbor_offsets);
+        throwOnError(ret,"OpenCLMeshRD::InternalUpdate : clSetKernelArg failed on offsets array: ");
+    }
+
+    if(this->HasParameterKernelArguments())
+    {
+        // the parameter values come after max_neighbors (or neighbor_offsets)
+        vector<float> values;
+        for(const Parameter& parameter : this->parameters)
+            values.push_back(parameter.value);
+        this->SetParameterKernelArguments(2*NC + 3, values, this->data_type == VTK_DOUBLE);
+    }
+
+    auto enqueue_kernel = [&]()
+    {
+        ret = clEnqueueNDRangeKernel(this->command_queue,this->kernel, 3, NULL, this->global_range, NULL, 0, NULL, NULL);
+        throwOnError(ret,"OpenCLMeshRD::InternalUpdate : clEnqueueNDRangeKernel failed: ");
+    };
 
-    for(int it=0;it<n_steps;it++)
+    const ButcherTableau& tableau = GetButcherTableau(this->integrator);
+    if(tableau.GetNumberOfStages() > 1 && this->HasParameterKernelArguments())
     {
-        for(int io=0;io<2;io++) // first input buffers (io=0) then output buffers (io=1)
+        // the integrator's arguments come after the parameters, and the kernel runs once for each stage
+        const size_t MEM_SIZE = this->data_type_size * this->mesh->GetNumberOfCells();
+        const int first_arg = 2*NC + 3 + this->GetNumberOfParameters();
+        const int iTimestep = GetTimestepParameterIndex(*this);
+        const bool use_double = this->data_type == VTK_DOUBLE;
+        auto take_step = [&](double timestep)
         {
-            iBuffer = (this->iCurrentBuffer+io)%2;
-            for(int ic=0;ic<NC;ic++)
+            this->SetParameterKernelArguments(2*NC + 3 + iTimestep, { static_cast<float>(timestep) }, use_double);
+            return this->EnqueueIntegratorStep(tableau, first_arg, MEM_SIZE, use_double, enqueue_kernel);
+        };
+        auto accept = [&]() { this->iCurrentBuffer = 1 - this->iCurrentBuffer; };
+        const double next_timestep = RunIntegratorSteps(tableau, n_steps, this->parameters[iTimestep].value,
+            this->integrator_tolerance, take_step, accept);
+        if(tableau.IsAdaptive())
+            this->SetParameterValue(iTimestep, static_cast<float>(next_timestep));
+    }
+    else
+    {
+        for(int it=0;it<n_steps;it++)
+        {
+            for(int io=0;io<2;io++) // first input buffers (io=0) then output buffers (io=1)
             {
-                // a_in, b_in, ... a_out, b_out ...
-                ret = clSetKernelArg(this->kernel, io*NC+ic, sizeof(cl_mem), &this->buffers[iBuffer][ic]);
-                throwOnError(ret,"OpenCLMeshRD::InternalUpdate : clSetKernelArg failed on buffer: ");
+                iBuffer = (this->iCurrentBuffer+io)%2;
+                for(int ic=0;ic<NC;ic++)
+                {
+                    // a_in, b_in, ... a_out, b_out ...
+                    ret = clSetKernelArg(this->kernel, io*NC+ic, sizeof(cl_mem), &this->buffers[iBuffer][ic]);
+                    throwOnError(ret,"OpenCLMeshRD::InternalUpdate : clSetKernelArg failed on buffer: ");
+                }
             }
+            enqueue_kernel();
+            this->iCurrentBuffer = 1 - this->iCurrentBuffer;
         }
-        ret = clEnqueueNDRangeKernel(this->command_queue,this->kernel, 3, NULL, this->global_range, NULL, 0, NULL, NULL);
-        throwOnError(ret,"OpenCLMeshRD::InternalUpdate : clEnqueueNDRangeKernel failed: ");
-        this->iCurrentBuffer = 1 - this->iCurrentBuffer;
     }
 
-    this->ReadFromOpenCLBuffers();
+    if(n_steps > 0)
+    {
+        // start the device working but don't wait for it: the results are read back when someone needs them
+        ret = clFlush(this->command_queue);
+        throwOnError(ret,"OpenCLMeshRD::InternalUpdate : clFlush failed: ");
+        this->need_read_from_opencl_buffers = true;
+    }
 }
 
 // ----------------------------------------------------------------------------------------------------------------
@@ -152,29 +200,12 @@ void OpenCLMeshRD::ReloadKernelIfNeeded()
 
     cl_int ret;
 
-    // create the program
-    this->kernel_source = this->AssembleKernelSourceFromFormula(this->formula);
-    const char *source = this->kernel_source.c_str();
-    size_t source_size = this->kernel_source.length();
+    // create and build the program (or retrieve it from the cache)
+    this->kernel_source = this->AssembleKernelSourceForRunning(this->formula);
     clReleaseProgram(this->program);
-    this->program = clCreateProgramWithSource(this->context,1,&source,&source_size,&ret);
-    throwOnError(ret,"OpenCLMeshRD::ReloadKernelIfNeeded : Failed to create program with source: ");
-
-    // build the program
-    ret = clBuildProgram(this->program,1,&this->device_id,"-cl-denorms-are-zero",NULL,NULL);
-    if(ret != CL_SUCCESS)
-    {
-        size_t build_log_length = 0;
-        cl_int ret2 = clGetProgramBuildInfo(this->program,this->device_id,CL_PROGRAM_BUILD_LOG,0,0,&build_log_length);
-        throwOnError(ret2,"OpenCLMeshRD::ReloadKernelIfNeeded : retrieving length of program build log failed: ");
-        vector<char> build_log(build_log_length);
-        cl_int ret3 = clGetProgramBuildInfo(this->program,this->device_id,CL_PROGRAM_BUILD_LOG,build_log_length,build_log.data(),0);
-        throwOnError(ret3,"OpenCLMeshRD::ReloadKernelIfNeeded : retrieving program build log failed: ");
-        { ofstream out("kernel.txt"); out << kernel_source; }
-        ostringstream oss;
-        oss << "OpenCLMeshRD::ReloadKernelIfNeeded : build failed (kernel saved as kernel.txt):\n\n" << string( build_log.begin(), build_log.end() );
-        throwOnError(ret,oss.str().c_str());
-    }
+    this->program = NULL;
+    this->program = OpenCL_KernelCache::BuildProgram(this->context, this->device_id, this->kernel_source,
+        "-cl-denorms-are-zero", "OpenCLMeshRD::ReloadKernelIfNeeded");
 
     // create the kernel
     clReleaseKernel(this->kernel);
@@ -213,17 +244,27 @@ void OpenCLMeshRD::CreateOpenCLBuffers()
         }
     }
 
+    // create a buffer for where the neighbors of each cell start, if we are using the compressed storage
+    if(!this->padded_neighbors)
+    {
+        const size_t NBORS_OFFSETS_SIZE = sizeof(int) * this->cell_neighbor_offsets.size();
+        this->clBuffer_cell_neighbor_offsets = clCreateBuffer(this->context, CL_MEM_READ_ONLY, NBORS_OFFSETS_SIZE, NULL, &ret);
+        throwOnError(ret,"OpenCLMeshRD::CreateOpenCLBuffers : neighbor_offsets buffer creation failed: ");
+    }
+
     // create a buffer for the indices of the neighbors of each cell
-    const size_t NBORS_INDICES_SIZE = sizeof(int) * this->mesh->GetNumberOfCells() * this->max_neighbors;
+    // (at least one entry each, since OpenCL doesn't allow empty buffers)
+    const size_t NBORS_INDICES_SIZE = sizeof(int) * max<size_t>(1, this->cell_neighbor_indices.size());
     this->clBuffer_cell_neighbor_indices = clCreateBuffer(this->context, CL_MEM_READ_ONLY, NBORS_INDICES_SIZE, NULL, &ret);
     throwOnError(ret,"OpenCLMeshRD::CreateOpenCLBuffers : neighbor_indices buffer creation failed: ");
 
     // create a buffer for the diffusion coefficients of the neighbors of each cell
-    const size_t NBORS_WEIGHTS_SIZE = sizeof(float) * this->mesh->GetNumberOfCells() * this->max_neighbors;
+    const size_t NBORS_WEIGHTS_SIZE = sizeof(float) * max<size_t>(1, this->cell_neighbor_weights.size());
     this->clBuffer_cell_neighbor_weights = clCreateBuffer(this->context, CL_MEM_READ_ONLY, NBORS_WEIGHTS_SIZE, NULL, &ret);
     throwOnError(ret,"OpenCLMeshRD::CreateOpenCLBuffers : neighbor_weights buffer creation failed: ");
 
     this->need_write_to_opencl_buffers = true;
+    this->need_read_from_opencl_buffers = false;
 }
 
 // ----------------------------------------------------------------------------------------------------------------
@@ -245,49 +286,107 @@ void OpenCLMeshRD::WriteToOpenCLBuffersIfNeeded()
         throwOnError(ret,"OpenCLMeshRD::WriteToOpenCLBuffers : data buffer writing failed: ");
     }
 
-    // fill indices buffer
-    const size_t NBORS_INDICES_SIZE = sizeof(int) * this->mesh->GetNumberOfCells() * this->max_neighbors;
-    ret = clEnqueueWriteBuffer(
-        this->command_queue,
-        this->clBuffer_cell_neighbor_indices,
-        CL_TRUE,
-        0,
-        NBORS_INDICES_SIZE,
-        &this->cell_neighbor_indices[0],
-        0,
-        NULL,
-        NULL);
-    throwOnError(ret,"OpenCLMeshRD::WriteToOpenCLBuffers : indices buffer writing failed: ");
-
-    // fill weights buffer
-    const size_t NBORS_WEIGHTS_SIZE = sizeof(float) * this->mesh->GetNumberOfCells() * this->max_neighbors;
-    ret = clEnqueueWriteBuffer(
-        this->command_queue,
-        this->clBuffer_cell_neighbor_weights,
-        CL_TRUE, 0, NBORS_WEIGHTS_SIZE,
-        &this->cell_neighbor_weights[0],
-        0,
-        NULL,
-        NULL);
-    throwOnError(ret,"OpenCLMeshRD::WriteToOpenCLBuffers : weights buffer writing failed: ");
+    // fill offsets buffer
+    if(!this->padded_neighbors)
+    {
+        const size_t NBORS_OFFSETS_SIZE = sizeof(int) * this->cell_neighbor_offsets.size();
+        ret = clEnqueueWriteBuffer(this->command_queue, this->clBuffer_cell_neighbor_offsets, CL_TRUE, 0, NBORS_OFFSETS_SIZE,
+            this->cell_neighbor_offsets.data(), 0, NULL, NULL);
+        throwOnError(ret,"OpenCLMeshRD::WriteToOpenCLBuffers : offsets buffer writing failed: ");
+    }
+
+    // fill indices and weights buffers (which may be empty if no cell has any neighbors)
+    if(!this->cell_neighbor_indices.empty())
+    {
+        const size_t NBORS_INDICES_SIZE = sizeof(int) * this->cell_neighbor_indices.size();
+        ret = clEnqueueWriteBuffer(
+            this->command_queue,
+            this->clBuffer_cell_neighbor_indices,
+            CL_TRUE,
+            0,
+            NBORS_INDICES_SIZE,
+            &this->cell_neighbor_indices[0],
+            0,
+            NULL,
+            NULL);
+        throwOnError(ret,"OpenCLMeshRD::WriteToOpenCLBuffers : indices buffer writing failed: ");
+
+        const size_t NBORS_WEIGHTS_SIZE = sizeof(float) * this->cell_neighbor_weights.size();
+        ret = clEnqueueWriteBuffer(
+            this->command_queue,
+            this->clBuffer_cell_neighbor_weights,
+            CL_TRUE, 0, NBORS_WEIGHTS_SIZE,
+            &this->cell_neighbor_weights[0],
+            0,
+            NULL,
+            NULL);
+        throwOnError(ret,"OpenCLMeshRD::WriteToOpenCLBuffers : weights buffer writing failed: ");
+    }
 
     this->need_write_to_opencl_buffers = false;
 }
 
 // ----------------------------------------------------------------------------------------------------------------
 
-void OpenCLMeshRD::ReadFromOpenCLBuffers()
+void OpenCLMeshRD::SaveChangeReference()
 {
-    // read from opencl buffers into our mesh data
+    this->SaveChangeReferenceOnDevice(this->data_type_size * this->mesh->GetNumberOfCells());
+}
+
+// ----------------------------------------------------------------------------------------------------------------
+
+void OpenCLMeshRD::GetChangeFromReference(double& max_change, double& sum_squares)
+{
+    this->GetChangeFromReferenceOnDevice(this->data_type_size * this->mesh->GetNumberOfCells(), this->data_type == VTK_DOUBLE, max_change, sum_squares);
+}
+
+// ----------------------------------------------------------------------------------------------------------------
+
+void OpenCLMeshRD::EnqueueReadFromOpenCLBuffers() const
+{
+    if(!this->need_read_from_opencl_buffers) return;
+
+    // queue non-blocking reads from opencl buffers into our mesh data, behind the kernels that compute them
     const size_t MEM_SIZE = this->data_type_size * this->mesh->GetNumberOfCells();
-    for(int ic=0;ic<this->GetNumberOfChemicals();ic++)
+    const int NC = this->GetNumberOfChemicals();
+    vector<void*> destinations(NC);
+    for(int ic=0;ic<NC;ic++)
     {
         vtkDataArray *array = this->mesh->GetCellData()->GetArray(GetChemicalName(ic).c_str());
         if( !array ) throw runtime_error( "OpenCLMeshRD::ReadFromOpenCLBuffers : named array not found" );
-        void* data = array->WriteVoidPointer(0,0);
-        cl_int ret = clEnqueueReadBuffer(this->command_queue,this->buffers[this->iCurrentBuffer][ic], CL_TRUE, 0, MEM_SIZE, data, 0, NULL, NULL);
-        throwOnError(ret,"OpenCLMeshRD::ReadFromOpenCLBuffers : data buffer reading failed: ");
+        destinations[ic] = array->WriteVoidPointer(0,0);
     }
+    cl_int ret = CL_SUCCESS;
+    for(int ic=0;ic<NC && ret==CL_SUCCESS;ic++)
+    {
+        void* data = destinations[ic];
+        cl_event event;
+        ret = clEnqueueReadBuffer(this->command_queue,this->buffers[this->iCurrentBuffer][ic], CL_FALSE, 0, MEM_SIZE, data, 0, NULL, &event);
+        if(ret == CL_SUCCESS)
+            this->pending_read_events.push_back(event);
+    }
+    if(ret == CL_SUCCESS)
+        ret = clFlush(this->command_queue);
+    if(ret != CL_SUCCESS)
+    {
+        this->WaitForPendingReads(); // (the reads that were queued still write into our mesh data)
+        throwOnError(ret,"OpenCLMeshRD::EnqueueReadFromOpenCLBuffers : data buffer reading failed: ");
+    }
+
+    this->need_read_from_opencl_buffers = false;
+}
+
+// ----------------------------------------------------------------------------------------------------------------
+
+void OpenCLMeshRD::ReadFromOpenCLBuffers() const
+{
+    this->EnqueueReadFromOpenCLBuffers();
+    if(this->pending_read_events.empty()) return;
+
+    cl_int ret = this->WaitForPendingReads();
+    throwOnError(ret,"OpenCLMeshRD::ReadFromOpenCLBuffers : data buffer reading failed: ");
+
+    this->mesh->Modified();
 }
 
 // ----------------------------------------------------------------------------------------------------------------
@@ -295,6 +394,9 @@ void OpenCLMeshRD::ReadFromOpenCLBuffers()
 void OpenCLMeshRD::CopyFromMesh(vtkUnstructuredGrid* mesh2)
 {
     MeshRD::CopyFromMesh(mesh2);
+    // the neighbor storage may have changed, and with it the kernel and the size of the buffers
+    this->need_reload_formula = true;
+    this->ReleaseOpenCLBuffers();
     this->need_write_to_opencl_buffers = true;
 }
 
@@ -302,7 +404,7 @@ void OpenCLMeshRD::CopyFromMesh(vtkUnstructuredGrid* mesh2)
 
 void OpenCLMeshRD::TestFormula(std::string program_string)
 {
-    this->TestKernel(this->AssembleKernelSourceFromFormula(program_string));
+    this->TestKernel(this->AssembleKernelSourceForRunning(program_string));
 }
 
 // ----------------------------------------------------------------------------------------------------------------
@@ -326,8 +428,14 @@ void OpenCLMeshRD::BlankImage(float value)
 void OpenCLMeshRD::ReleaseOpenCLBuffers()
 {
     OpenCL_MixIn::ReleaseOpenCLBuffers();
+    for(int i=0;i<2;i++)
+        this->buffers[i].clear();
+    clReleaseMemObject(this->clBuffer_cell_neighbor_offsets);
     clReleaseMemObject(this->clBuffer_cell_neighbor_indices);
     clReleaseMemObject(this->clBuffer_cell_neighbor_weights);
+    this->clBuffer_cell_neighbor_offsets = NULL;
+    this->clBuffer_cell_neighbor_indices = NULL;
+    this->clBuffer_cell_neighbor_weights = NULL;
 }
 
 // ----------------------------------------------------------------------------------------------------------------
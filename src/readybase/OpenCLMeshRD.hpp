@@ -34,14 +34,18 @@ class OpenCLMeshRD : public MeshRD, public OpenCL_MixIn
 
         bool HasEditableFormula() const override { return true; }
 
+        void BeginSyncToHost() const override { this->EnqueueReadFromOpenCLBuffers(); }
+        void SyncToHost() const override { this->ReadFromOpenCLBuffers(); }
+        void WaitForUpdate() const override { this->WaitForDevice(); }
+
         void CopyFromMesh(vtkUnstructuredGrid* mesh2) override;
 
         // we override the parameter access functions because changing the parameters requires rewriting the kernel
+        // (changing a parameter value does not, since the values are passed as kernel arguments)
         void AddParameter(const std::string& name,float val) override;
         void DeleteParameter(int iParam) override;
         void DeleteAllParameters() override;
         void SetParameterName(int iParam,const std::string& s) override;
-        void SetParameterValue(int iParam,float val) override;
 
         void GenerateInitialPattern() override;
         void BlankImage(float value = 0.0f) override;
@@ -59,15 +63,21 @@ class OpenCLMeshRD : public MeshRD, public OpenCL_MixIn
 
         void InternalUpdate(int n_steps) override;
 
+        // the values are compared on the device, instead of reading them back
+        void SaveChangeReference() override;
+        void GetChangeFromReference(double& max_change, double& sum_squares) override;
+
         void ReloadKernelIfNeeded() override;
 
         void CreateOpenCLBuffers() override;
         void WriteToOpenCLBuffersIfNeeded() override;
-        void ReadFromOpenCLBuffers() override;
+        void EnqueueReadFromOpenCLBuffers() const override;
+        void ReadFromOpenCLBuffers() const override;
         void ReleaseOpenCLBuffers() override;
 
     private:
 
+        cl_mem clBuffer_cell_neighbor_offsets; ///< only used with the compressed neighbor storage
         cl_mem clBuffer_cell_neighbor_indices;
         cl_mem clBuffer_cell_neighbor_weights;
 };
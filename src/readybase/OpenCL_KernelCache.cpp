@@ -0,0 +1,490 @@
+/*  Copyright 2011-2021 The Ready Bunch
+
+    This file is part of Ready.
+
+    Ready is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Ready is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Ready. If not, see <http://www.gnu.org/licenses/>.         */
+
+// local:
+#include "OpenCL_KernelCache.hpp"
+#include "OpenCL_utils.hpp"
+using namespace OpenCL_utils;
+
+// STL:
+#include <algorithm>
+#include <array>
+#include <chrono>
+#include <cstdlib>
+#include <filesystem>
+#include <fstream>
+#include <iomanip>
+#include <map>
+#include <sstream>
+#include <stdexcept>
+#include <vector>
+
+using namespace std;
+namespace fs = std::filesystem;
+
+// ---------------------------------------------------------------------------------------------------------
+
+static bool cache_enabled = true;
+static string cache_folder;
+static uintmax_t cache_max_bytes = 64 * 1024 * 1024;
+
+static const char CACHE_FILE_MAGIC[] = "READY_CL_BINARY_1";
+static const char WORK_GROUP_SIZES_FILENAME[] = "work_group_sizes.txt";
+
+static map<string, array<size_t, 3>> work_group_sizes;
+static bool have_read_work_group_sizes = false;
+
+// ---------------------------------------------------------------------------------------------------------
+
+namespace
+{
+    string GetPlatformInfoString(cl_platform_id platform_id, cl_platform_info param)
+    {
+        size_t length = 0;
+        if (clGetPlatformInfo(platform_id, param, 0, NULL, &length) != CL_SUCCESS)
+        {
+            return "";
+        }
+        vector<char> info(length);
+        if (clGetPlatformInfo(platform_id, param, length, info.data(), NULL) != CL_SUCCESS)
+        {
+            return "";
+        }
+        return string(info.data());
+    }
+
+    // ---------------------------------------------------------------------------------------------------------
+
+    string GetDeviceInfoString(cl_device_id device_id, cl_device_info param)
+    {
+        size_t length = 0;
+        if (clGetDeviceInfo(device_id, param, 0, NULL, &length) != CL_SUCCESS)
+        {
+            return "";
+        }
+        vector<char> info(length);
+        if (clGetDeviceInfo(device_id, param, length, info.data(), NULL) != CL_SUCCESS)
+        {
+            return "";
+        }
+        return string(info.data());
+    }
+
+    // ---------------------------------------------------------------------------------------------------------
+
+    bool ReadCachedBinary(const fs::path& filename, const string& key, vector<unsigned char>& binary)
+    {
+        ifstream in(filename, ios::binary);
+        if (!in)
+        {
+            return false;
+        }
+        // the file starts with the full key, to guard against hash collisions
+        string magic(sizeof(CACHE_FILE_MAGIC), '\0');
+        uint64_t key_length, binary_length;
+        in.read(&magic[0], magic.size());
+        in.read(reinterpret_cast<char*>(&key_length), sizeof(key_length));
+        if (!in || magic != string(CACHE_FILE_MAGIC, sizeof(CACHE_FILE_MAGIC)) || key_length != key.size())
+        {
+            return false;
+        }
+        string stored_key(key_length, '\0');
+        in.read(&stored_key[0], key_length);
+        in.read(reinterpret_cast<char*>(&binary_length), sizeof(binary_length));
+        if (!in || stored_key != key || binary_length == 0)
+        {
+            return false;
+        }
+        binary.resize(binary_length);
+        in.read(reinterpret_cast<char*>(binary.data()), binary_length);
+        return static_cast<bool>(in);
+    }
+
+    // ---------------------------------------------------------------------------------------------------------
+
+    void RemoveOldestFilesIfOverSize(const fs::path& folder)
+    {
+        error_code ec;
+        vector<pair<fs::file_time_type, fs::path>> files;
+        uintmax_t total_size = 0;
+        for (const fs::directory_entry& entry : fs::recursive_directory_iterator(folder, ec))
+        {
+            if (!entry.is_regular_file(ec) || entry.path().filename() == WORK_GROUP_SIZES_FILENAME)
+            {
+                continue; // (the tuned work-group sizes are tiny and never evicted)
+            }
+            total_size += entry.file_size(ec);
+            files.push_back(make_pair(entry.last_write_time(ec), entry.path()));
+        }
+        if (total_size <= cache_max_bytes)
+        {
+            return;
+        }
+        sort(files.begin(), files.end());
+        for (const pair<fs::file_time_type, fs::path>& file : files)
+        {
+            if (total_size <= cache_max_bytes)
+            {
+                break;
+            }
+            const uintmax_t size = fs::file_size(file.second, ec);
+            if (fs::remove(file.second, ec))
+            {
+                total_size -= min(size, total_size);
+            }
+        }
+    }
+
+    // ---------------------------------------------------------------------------------------------------------
+
+    void WriteCachedBinary(const fs::path& filename, const string& key, const vector<unsigned char>& binary)
+    {
+        // write to a temporary file and then rename, so that other processes never see a partial file
+        error_code ec;
+        fs::create_directories(filename.parent_path(), ec);
+        fs::path temp_filename = filename;
+        temp_filename += ".tmp" + to_string(chrono::steady_clock::now().time_since_epoch().count());
+        {
+            ofstream out(temp_filename, ios::binary);
+            if (!out)
+            {
+                return;
+            }
+            const uint64_t key_length = key.size();
+            const uint64_t binary_length = binary.size();
+            out.write(CACHE_FILE_MAGIC, sizeof(CACHE_FILE_MAGIC));
+            out.write(reinterpret_cast<const char*>(&key_length), sizeof(key_length));
+            out.write(key.data(), key.size());
+            out.write(reinterpret_cast<const char*>(&binary_length), sizeof(binary_length));
+            out.write(reinterpret_cast<const char*>(binary.data()), binary.size());
+            if (!out)
+            {
+                out.close();
+                fs::remove(temp_filename, ec);
+                return;
+            }
+        }
+        fs::rename(temp_filename, filename, ec);
+        if (ec)
+        {
+            fs::remove(temp_filename, ec);
+            return;
+        }
+        RemoveOldestFilesIfOverSize(OpenCL_KernelCache::GetFolder());
+    }
+
+    // ---------------------------------------------------------------------------------------------------------
+
+    void ReadWorkGroupSizes(const fs::path& filename, map<string, array<size_t, 3>>& sizes)
+    {
+        // each line is: hash x y z (later lines take precedence)
+        ifstream in(filename);
+        string hash;
+        array<size_t, 3> size;
+        while (in >> hash >> size[0] >> size[1] >> size[2])
+        {
+            sizes[hash] = size;
+        }
+    }
+
+    // ---------------------------------------------------------------------------------------------------------
+
+    bool GetProgramBinary(cl_program program, cl_device_id device_id, vector<unsigned char>& binary)
+    {
+        cl_uint num_devices = 0;
+        if (clGetProgramInfo(program, CL_PROGRAM_NUM_DEVICES, sizeof(num_devices), &num_devices, NULL) != CL_SUCCESS || num_devices == 0)
+        {
+            return false;
+        }
+        vector<cl_device_id> devices(num_devices);
+        vector<size_t> sizes(num_devices);
+        if (clGetProgramInfo(program, CL_PROGRAM_DEVICES, sizeof(cl_device_id) * num_devices, devices.data(), NULL) != CL_SUCCESS
+            || clGetProgramInfo(program, CL_PROGRAM_BINARY_SIZES, sizeof(size_t) * num_devices, sizes.data(), NULL) != CL_SUCCESS)
+        {
+            return false;
+        }
+        const size_t iDevice = find(devices.begin(), devices.end(), device_id) - devices.begin();
+        if (iDevice == num_devices || sizes[iDevice] == 0)
+        {
+            return false;
+        }
+        vector<vector<unsigned char>> binaries(num_devices);
+        vector<unsigned char*> binary_pointers(num_devices);
+        for (cl_uint i = 0; i < num_devices; i++)
+        {
+            binaries[i].resize(sizes[i]);
+            binary_pointers[i] = binaries[i].data();
+        }
+        if (clGetProgramInfo(program, CL_PROGRAM_BINARIES, sizeof(unsigned char*) * num_devices, binary_pointers.data(), NULL) != CL_SUCCESS)
+        {
+            return false;
+        }
+        binary.swap(binaries[iDevice]);
+        return true;
+    }
+
+    // ---------------------------------------------------------------------------------------------------------
+
+    cl_program BuildProgramFromBinary(cl_context context, cl_device_id device_id, const vector<unsigned char>& binary,
+                                      const string& build_options)
+    {
+        const size_t binary_length = binary.size();
+        const unsigned char* binary_pointer = binary.data();
+        cl_int binary_status, ret;
+        cl_program program = clCreateProgramWithBinary(context, 1, &device_id, &binary_length, &binary_pointer, &binary_status, &ret);
+        if (ret != CL_SUCCESS || binary_status != CL_SUCCESS)
+        {
+            clReleaseProgram(program);
+            return NULL;
+        }
+        ret = clBuildProgram(program, 1, &device_id, build_options.c_str(), NULL, NULL);
+        if (ret != CL_SUCCESS)
+        {
+            clReleaseProgram(program);
+            return NULL;
+        }
+        return program;
+    }
+}
+
+// ---------------------------------------------------------------------------------------------------------
+
+void OpenCL_KernelCache::SetEnabled(bool enabled)
+{
+    cache_enabled = enabled;
+}
+
+// ---------------------------------------------------------------------------------------------------------
+
+bool OpenCL_KernelCache::IsEnabled()
+{
+    return cache_enabled;
+}
+
+// ---------------------------------------------------------------------------------------------------------
+
+void OpenCL_KernelCache::SetFolder(const string& folder)
+{
+    cache_folder = folder;
+}
+
+// ---------------------------------------------------------------------------------------------------------
+
+string OpenCL_KernelCache::GetFolder()
+{
+    if (!cache_folder.empty())
+    {
+        return cache_folder;
+    }
+    fs::path base;
+#if defined(_WIN32)
+    if (const char* local_app_data = getenv("LOCALAPPDATA"))
+    {
+        base = fs::path(local_app_data) / "Ready";
+    }
+#elif defined(__APPLE__)
+    if (const char* home = getenv("HOME"))
+    {
+        base = fs::path(home) / "Library" / "Caches" / "Ready";
+    }
+#else
+    if (const char* xdg_cache_home = getenv("XDG_CACHE_HOME"))
+    {
+        base = fs::path(xdg_cache_home) / "ready";
+    }
+    else if (const char* home = getenv("HOME"))
+    {
+        base = fs::path(home) / ".cache" / "ready";
+    }
+#endif
+    if (base.empty())
+    {
+        error_code ec;
+        base = fs::temp_directory_path(ec) / "ready";
+    }
+    return (base / "kernel_cache").string();
+}
+
+// ---------------------------------------------------------------------------------------------------------
+
+void OpenCL_KernelCache::SetMaximumSize(uintmax_t max_bytes)
+{
+    cache_max_bytes = max_bytes;
+}
+
+// ---------------------------------------------------------------------------------------------------------
+
+void OpenCL_KernelCache::LimitSize()
+{
+    RemoveOldestFilesIfOverSize(GetFolder());
+}
+
+// ---------------------------------------------------------------------------------------------------------
+
+string OpenCL_KernelCache::GetDeviceKey(cl_device_id device_id)
+{
+    ostringstream oss;
+    cl_platform_id platform_id;
+    if (clGetDeviceInfo(device_id, CL_DEVICE_PLATFORM, sizeof(platform_id), &platform_id, NULL) == CL_SUCCESS)
+    {
+        oss << GetPlatformInfoString(platform_id, CL_PLATFORM_NAME) << "\n";
+        oss << GetPlatformInfoString(platform_id, CL_PLATFORM_VERSION) << "\n";
+    }
+    oss << GetDeviceInfoString(device_id, CL_DEVICE_NAME) << "\n";
+    oss << GetDeviceInfoString(device_id, CL_DEVICE_VERSION) << "\n";
+    oss << GetDeviceInfoString(device_id, CL_DRIVER_VERSION) << "\n";
+    return oss.str();
+}
+
+// ---------------------------------------------------------------------------------------------------------
+
+string OpenCL_KernelCache::Hash(const string& s)
+{
+    uint64_t hash = 14695981039346656037ULL;
+    for (const unsigned char c : s)
+    {
+        hash ^= c;
+        hash *= 1099511628211ULL;
+    }
+    ostringstream oss;
+    oss << hex << setw(16) << setfill('0') << hash;
+    return oss.str();
+}
+
+// ---------------------------------------------------------------------------------------------------------
+
+cl_program OpenCL_KernelCache::BuildProgram(cl_context context, cl_device_id device_id, const string& kernel_source,
+                                            const string& build_options, const string& caller)
+{
+    cl_int ret;
+
+    // look for a binary we built earlier
+    string key;
+    fs::path filename;
+    if (cache_enabled)
+    {
+        key = GetDeviceKey(device_id) + build_options + "\n" + kernel_source;
+        filename = fs::path(GetFolder()) / (Hash(key) + ".bin");
+        vector<unsigned char> binary;
+        if (ReadCachedBinary(filename, key, binary))
+        {
+            cl_program program = BuildProgramFromBinary(context, device_id, binary, build_options);
+            error_code ec;
+            if (program)
+            {
+                fs::last_write_time(filename, fs::file_time_type::clock::now(), ec); // mark as recently used
+                return program;
+            }
+            fs::remove(filename, ec); // the driver didn't accept it, so build from source instead
+        }
+    }
+
+    // create the program
+    const char* source = kernel_source.c_str();
+    size_t source_size = kernel_source.length();
+    cl_program program = clCreateProgramWithSource(context, 1, &source, &source_size, &ret);
+    throwOnError(ret, (caller + " : Failed to create program with source: ").c_str());
+
+    // build the program
+    ret = clBuildProgram(program, 1, &device_id, build_options.c_str(), NULL, NULL);
+    if (ret != CL_SUCCESS)
+    {
+        size_t build_log_length = 0;
+        cl_int ret2 = clGetProgramBuildInfo(program, device_id, CL_PROGRAM_BUILD_LOG, 0, 0, &build_log_length);
+        vector<char> build_log(build_log_length);
+        cl_int ret3 = clGetProgramBuildInfo(program, device_id, CL_PROGRAM_BUILD_LOG, build_log_length, build_log.data(), 0);
+        clReleaseProgram(program);
+        throwOnError(ret2, (caller + " : retrieving length of program build log failed: ").c_str());
+        throwOnError(ret3, (caller + " : retrieving program build log failed: ").c_str());
+        { ofstream out("kernel.txt"); out << kernel_source; }
+        ostringstream oss;
+        oss << caller << " : build failed (kernel saved as kernel.txt):\n\n" << string(build_log.begin(), build_log.end());
+        throwOnError(ret, oss.str().c_str());
+    }
+
+    // store the binary for next time
+    if (cache_enabled)
+    {
+        vector<unsigned char> binary;
+        if (GetProgramBinary(program, device_id, binary))
+        {
+            WriteCachedBinary(filename, key, binary);
+        }
+    }
+
+    return program;
+}
+
+// ---------------------------------------------------------------------------------------------------------
+
+bool OpenCL_KernelCache::LookupWorkGroupSize(const string& key, size_t local_work_size[3])
+{
+    if (cache_enabled && !have_read_work_group_sizes)
+    {
+        ReadWorkGroupSizes(fs::path(GetFolder()) / WORK_GROUP_SIZES_FILENAME, work_group_sizes);
+        have_read_work_group_sizes = true;
+    }
+    const auto found = work_group_sizes.find(Hash(key));
+    if (found == work_group_sizes.end())
+    {
+        return false;
+    }
+    copy(found->second.begin(), found->second.end(), local_work_size);
+    return true;
+}
+
+// ---------------------------------------------------------------------------------------------------------
+
+void OpenCL_KernelCache::StoreWorkGroupSize(const string& key, const size_t local_work_size[3])
+{
+    const string hash = Hash(key);
+    work_group_sizes[hash] = { local_work_size[0], local_work_size[1], local_work_size[2] };
+    if (cache_enabled)
+    {
+        // merge with what other processes may have stored since we read the file, then rewrite it with one line
+        // per key (via a temporary file and a rename, so that readers never see a partial file)
+        const fs::path filename = fs::path(GetFolder()) / WORK_GROUP_SIZES_FILENAME;
+        map<string, array<size_t, 3>> sizes;
+        ReadWorkGroupSizes(filename, sizes);
+        sizes[hash] = work_group_sizes[hash];
+        work_group_sizes.insert(sizes.begin(), sizes.end());
+        error_code ec;
+        fs::create_directories(filename.parent_path(), ec);
+        fs::path temp_filename = filename;
+        temp_filename += ".tmp" + to_string(chrono::steady_clock::now().time_since_epoch().count());
+        {
+            ofstream out(temp_filename);
+            for (const auto& entry : sizes)
+            {
+                out << entry.first << " " << entry.second[0] << " " << entry.second[1] << " " << entry.second[2] << "\n";
+            }
+            if (!out)
+            {
+                out.close();
+                fs::remove(temp_filename, ec);
+                return;
+            }
+        }
+        fs::rename(temp_filename, filename, ec);
+        if (ec)
+        {
+            fs::remove(temp_filename, ec);
+        }
+    }
+}
+
+// ---------------------------------------------------------------------------------------------------------
@@ -0,0 +1,74 @@
+/*  Copyright 2011-2021 The Ready Bunch
+
+    This file is part of Ready.
+
+    Ready is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Ready is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Ready. If not, see <http://www.gnu.org/licenses/>.         */
+
+#ifndef __OPENCL_KERNELCACHE__
+#define __OPENCL_KERNELCACHE__
+
+// OpenCL:
+#ifdef __APPLE__
+    // OpenCL is linked at start up time on Mac OS 10.6+
+    #include <OpenCL/opencl.h>
+#else
+    // OpenCL is loaded dynamically on Windows and Linux
+    #include "OpenCL_Dyn_Load.h"
+#endif
+
+// STL:
+#include <cstdint>
+#include <string>
+
+/// An on-disk cache of built OpenCL programs, so that we don't have to run the OpenCL compiler every time we load a pattern.
+/** Binaries are stored under a hash of the kernel source, the build options, and the platform, device and driver
+ *  that built them. When the total size of the cache exceeds the limit the least recently used files are removed. */
+namespace OpenCL_KernelCache
+{
+    /// Turns the cache on or off. It is on by default.
+    void SetEnabled(bool enabled);
+    bool IsEnabled();
+
+    /// Sets the folder where the binaries are stored. The default is in the user's cache folder.
+    void SetFolder(const std::string& folder);
+    std::string GetFolder();
+
+    /// Sets the maximum total size of the files in the cache folder and its subfolders, in bytes.
+    void SetMaximumSize(std::uintmax_t max_bytes);
+
+    /// Removes the least recently written files from the cache folder and its subfolders (e.g. the native kernels, see
+    /// NativeKernel) until their total size is within the limit.
+    void LimitSize();
+
+    /// Returns a string identifying the platform, device and driver, for use in cache keys.
+    std::string GetDeviceKey(cl_device_id device_id);
+
+    /// Returns a 64-bit FNV-1a hash of the string, as 16 hex digits.
+    std::string Hash(const std::string& s);
+
+    /// Creates and builds a program from the kernel source, reusing a cached binary when we have one.
+    /** Throws (with the build log, after saving the kernel as kernel.txt) if the build fails. The caller string is
+     *  used as the prefix for error messages. */
+    cl_program BuildProgram(cl_context context, cl_device_id device_id, const std::string& kernel_source,
+                            const std::string& build_options, const std::string& caller);
+
+    /// Retrieves the work group size that was stored for this key, returning false if there isn't one.
+    bool LookupWorkGroupSize(const std::string& key, size_t local_work_size[3]);
+
+    /// Remembers the work group size that was found to be fastest for this key (e.g. the device and kernel source).
+    /** The sizes are kept for the rest of the session, and also in the cache folder if the cache is enabled. */
+    void StoreWorkGroupSize(const std::string& key, const size_t local_work_size[3]);
+}
+
+#endif
@@ -17,18 +17,68 @@
 
 // local:
 #include "OpenCL_MixIn.hpp"
+#include "Integrators.hpp"
+#include "OpenCL_KernelCache.hpp"
 #include "OpenCL_utils.hpp"
 using namespace OpenCL_utils;
 
 // STL:
+#include <algorithm>
 #include <stdexcept>
 #include <fstream>
+#include <numeric>
 #include <sstream>
 
 using namespace std;
 
 // ---------------------------------------------------------------------------
 
+namespace
+{
+    /// The change kernel uses this many work items, each of which reads every so many values.
+    const size_t CHANGE_WORK_ITEMS = 4096;
+
+    /// A kernel that compares the values with the reference, leaving the largest change and the sum of the squares of
+    /// the changes of each work item in partial. If reference is null then the values are compared with zero.
+    string GetChangeKernelSource(bool use_double)
+    {
+        ostringstream kernel_source;
+        if(use_double)
+        {
+            kernel_source << "\
+#ifdef cl_khr_fp64\n\
+    #pragma OPENCL EXTENSION cl_khr_fp64 : enable\n\
+#elif defined(cl_amd_fp64)\n\
+    #pragma OPENCL EXTENSION cl_amd_fp64 : enable\n\
+#else\n\
+    #error \"Double precision floating point not supported on this OpenCL device. Choose another or contact the Ready team.\"\n\
+#endif\n\n";
+        }
+        kernel_source << "typedef " << (use_double ? "double" : "float") << " real;\n\n";
+        kernel_source << "\
+__kernel void rd_change(global const real* values, global const real* reference, const int num_values, global real* partial)\n\
+{\n\
+    const int i = get_global_id(0);\n\
+    const int num_work_items = get_global_size(0);\n\
+    real max_change = 0;\n\
+    real sum_squares = 0;\n\
+    for(int j = i; j < num_values; j += num_work_items)\n\
+    {\n\
+        real change = fabs(reference ? values[j] - reference[j] : values[j]);\n\
+        if(isnan(change))\n\
+            change = INFINITY;\n\
+        max_change = fmax(max_change, change);\n\
+        sum_squares += change * change;\n\
+    }\n\
+    partial[i] = max_change;\n\
+    partial[num_work_items + i] = sum_squares;\n\
+}\n";
+        return kernel_source.str();
+    }
+}
+
+// ---------------------------------------------------------------------------
+
 OpenCL_MixIn::OpenCL_MixIn(int opencl_platform, int opencl_device)
     : context(NULL)
     , device_id(NULL)
@@ -40,9 +90,18 @@ OpenCL_MixIn::OpenCL_MixIn(int opencl_platform, int opencl_device)
     , command_queue(NULL)
     , need_reload_context(true)
     , need_write_to_opencl_buffers(true)
+    , need_read_from_opencl_buffers(false)
     , iCurrentBuffer(0)
     , iPlatform(opencl_platform)
     , iDevice(opencl_device)
+    , error_buffer(NULL)
+    , integrator_buffer_size(0)
+    , change_reference_size(0)
+    , change_partial_buffer(NULL)
+    , change_program(NULL)
+    , change_kernel(NULL)
+    , change_kernel_uses_double(false)
+    , change_context(NULL)
 {
     if(LinkOpenCL()!= CL_SUCCESS)
         throw runtime_error("Failed to load dynamic library for OpenCL");
@@ -59,6 +118,10 @@ OpenCL_MixIn::~OpenCL_MixIn()
     for(int i=0;i<2;i++)
         for(vector<cl_mem>::const_iterator it = this->buffers[i].begin();it!=this->buffers[i].end();it++)
             clReleaseMemObject(*it);
+    this->ReleaseIntegratorBuffers();
+    this->ReleaseChangeBuffers();
+    clReleaseKernel(this->change_kernel);
+    clReleaseProgram(this->change_program);
     clReleaseCommandQueue(this->command_queue);
     clReleaseContext(this->context);
 }
@@ -101,6 +164,9 @@ void OpenCL_MixIn::ReloadContextIfNeeded()
 {
     if(!this->need_reload_context) return;
 
+    // collect any results still on the device before we release the command queue
+    this->ReadFromOpenCLBuffers();
+
     cl_int ret;
 
     // retrieve our chosen platform
@@ -159,39 +225,309 @@ void OpenCL_MixIn::TestKernel(std::string kernel_source)
     this->need_reload_context = true;
     this->ReloadContextIfNeeded();
 
-    cl_int ret;
+    // build the program (and store it in the cache, ready for when we run it)
+    cl_program temp_program = OpenCL_KernelCache::BuildProgram(this->context, this->device_id, kernel_source,
+        "-cl-denorms-are-zero", "OpenCL_MixIn::TestKernel");
+    clReleaseProgram(temp_program);
+}
 
-    // create the program
-    const char *source = kernel_source.c_str();
-    size_t source_size = kernel_source.length();
-    cl_program temp_program = clCreateProgramWithSource(this->context,1,&source,&source_size,&ret);
-    throwOnError(ret,"OpenCL_MixIn::TestKernel : Failed to create program with source: ");
-
-    // build the program
-    ret = clBuildProgram(temp_program,1,&this->device_id,"-cl-denorms-are-zero",NULL,NULL);
-    if(ret != CL_SUCCESS)
-    {
-        size_t build_log_length = 0;
-        cl_int ret2 = clGetProgramBuildInfo(temp_program,this->device_id,CL_PROGRAM_BUILD_LOG,0,0,&build_log_length);
-        throwOnError(ret2,"OpenCL_MixIn::TestKernel : retrieving length of program build log failed: ");
-        vector<char> build_log(build_log_length);
-        cl_int ret3 = clGetProgramBuildInfo(temp_program,this->device_id,CL_PROGRAM_BUILD_LOG,build_log_length,build_log.data(),0);
-        throwOnError(ret3,"OpenCL_MixIn::TestKernel : retrieving program build log failed: ");
-        { ofstream out("kernel.txt"); out << kernel_source; }
-        ostringstream oss;
-        oss << "OpenCL_MixIn::TestKernel : build failed (kernel saved as kernel.txt):\n\n" << string( build_log.begin(), build_log.end() );
-        throwOnError(ret,oss.str().c_str());
+// -----------------------------------------------------------------------
+
+void OpenCL_MixIn::SetParameterKernelArguments(int first_arg, const vector<float>& values, bool use_double)
+{
+    for(size_t i=0;i<values.size();i++)
+    {
+        cl_int ret;
+        if(use_double)
+        {
+            const double value = values[i];
+            ret = clSetKernelArg(this->kernel, first_arg + (cl_uint)i, sizeof(double), &value);
+        }
+        else
+        {
+            ret = clSetKernelArg(this->kernel, first_arg + (cl_uint)i, sizeof(float), &values[i]);
+        }
+        throwOnError(ret,"OpenCL_MixIn::SetParameterKernelArguments : clSetKernelArg failed: ");
     }
-    clReleaseProgram(temp_program);
+}
+
+// -----------------------------------------------------------------------
+
+cl_int OpenCL_MixIn::WaitForPendingReads() const
+{
+    if(this->pending_read_events.empty()) return CL_SUCCESS;
+    cl_int ret = clWaitForEvents(static_cast<cl_uint>(this->pending_read_events.size()), this->pending_read_events.data());
+    for(cl_event event : this->pending_read_events)
+        clReleaseEvent(event);
+    this->pending_read_events.clear();
+    return ret;
+}
+
+// -----------------------------------------------------------------------
+
+void OpenCL_MixIn::WaitForDevice() const
+{
+    if(!this->command_queue) return;
+    cl_int ret = clFinish(this->command_queue);
+    throwOnError(ret,"OpenCL_MixIn::WaitForDevice : clFinish failed: ");
 }
 
 // -----------------------------------------------------------------------
 
 void OpenCL_MixIn::ReleaseOpenCLBuffers()
 {
+    this->WaitForPendingReads(); // (the buffers are still being read from)
     for(int i=0;i<2;i++)
         for(vector<cl_mem>::const_iterator it = this->buffers[i].begin();it!=this->buffers[i].end();it++)
             clReleaseMemObject(*it);
+    this->ReleaseIntegratorBuffers();
+    this->ReleaseChangeBuffers();
+}
+
+// -----------------------------------------------------------------------
+
+void OpenCL_MixIn::ReleaseIntegratorBuffers()
+{
+    for(cl_mem buffer : this->stage_buffers)
+        clReleaseMemObject(buffer);
+    for(cl_mem buffer : this->rate_buffers)
+        clReleaseMemObject(buffer);
+    if(this->error_buffer)
+        clReleaseMemObject(this->error_buffer);
+    this->stage_buffers.clear();
+    this->rate_buffers.clear();
+    this->error_buffer = NULL;
+    this->integrator_buffer_size = 0;
+}
+
+// -----------------------------------------------------------------------
+
+void OpenCL_MixIn::CreateIntegratorBuffersIfNeeded(const ButcherTableau& tableau, int NC, size_t mem_size)
+{
+    int num_rates_stored = 0;
+    for(int s=0;s<tableau.GetNumberOfStages();s++)
+        if(tableau.IsRateStored(s))
+            num_rates_stored++;
+    if(this->integrator_buffer_size == mem_size && static_cast<int>(this->stage_buffers.size()) == NC
+       && static_cast<int>(this->rate_buffers.size()) == num_rates_stored * NC
+       && (this->error_buffer != NULL) == tableau.IsAdaptive())
+        return;
+
+    this->ReleaseIntegratorBuffers();
+    cl_int ret;
+    auto create_buffer = [&]()
+    {
+        cl_mem buffer = clCreateBuffer(this->context, CL_MEM_READ_WRITE, mem_size, NULL, &ret);
+        throwOnError(ret,"OpenCL_MixIn::CreateIntegratorBuffersIfNeeded : buffer creation failed: ");
+        return buffer;
+    };
+    for(int ic=0;ic<NC;ic++)
+        this->stage_buffers.push_back(create_buffer());
+    for(int i=0;i<num_rates_stored*NC;i++)
+        this->rate_buffers.push_back(create_buffer());
+    if(tableau.IsAdaptive())
+        this->error_buffer = create_buffer();
+    this->integrator_buffer_size = mem_size;
+}
+
+// -----------------------------------------------------------------------
+
+void OpenCL_MixIn::SetIntegratorKernelArguments(const ButcherTableau& tableau, int first_arg, const vector<cl_mem>& base, int stage)
+{
+    // a_base, b_base, ... a_k0, b_k0, ... rd_error, rd_stage
+    cl_uint arg = first_arg;
+    cl_int ret;
+    for(size_t ic=0;ic<base.size();ic++)
+    {
+        ret = clSetKernelArg(this->kernel, arg++, sizeof(cl_mem), &base[ic]);
+        throwOnError(ret,"OpenCL_MixIn::SetIntegratorKernelArguments : clSetKernelArg failed: ");
+    }
+    for(const cl_mem& buffer : this->rate_buffers)
+    {
+        ret = clSetKernelArg(this->kernel, arg++, sizeof(cl_mem), &buffer);
+        throwOnError(ret,"OpenCL_MixIn::SetIntegratorKernelArguments : clSetKernelArg failed: ");
+    }
+    if(tableau.IsAdaptive())
+    {
+        ret = clSetKernelArg(this->kernel, arg++, sizeof(cl_mem), &this->error_buffer);
+        throwOnError(ret,"OpenCL_MixIn::SetIntegratorKernelArguments : clSetKernelArg failed: ");
+    }
+    ret = clSetKernelArg(this->kernel, arg++, sizeof(int), &stage);
+    throwOnError(ret,"OpenCL_MixIn::SetIntegratorKernelArguments : clSetKernelArg failed: ");
+}
+
+// -----------------------------------------------------------------------
+
+double OpenCL_MixIn::EnqueueIntegratorStep(const ButcherTableau& tableau, int first_arg, size_t mem_size, bool use_double,
+                                           const function<void()>& enqueue_kernel)
+{
+    const vector<cl_mem>& base = this->buffers[this->iCurrentBuffer];
+    const int NC = static_cast<int>(base.size());
+    const int S = tableau.GetNumberOfStages();
+    this->CreateIntegratorBuffersIfNeeded(tableau, NC, mem_size);
+
+    // each stage reads the output of the one before, and the stages alternate between writing to the stage buffers
+    // and to the other buffers, arranged so that the last stage writes to the other buffers
+    const vector<cl_mem>* stage_in = &base;
+    for(int s=0;s<S;s++)
+    {
+        const vector<cl_mem>* stage_out = ((S - 1 - s) % 2 == 0) ? &this->buffers[1 - this->iCurrentBuffer] : &this->stage_buffers;
+        for(int io=0;io<2;io++) // first input buffers (io=0) then output buffers (io=1)
+        {
+            const vector<cl_mem>& io_buffers = io ? *stage_out : *stage_in;
+            for(int ic=0;ic<NC;ic++)
+            {
+                cl_int ret = clSetKernelArg(this->kernel, io*NC+ic, sizeof(cl_mem), &io_buffers[ic]);
+                throwOnError(ret,"OpenCL_MixIn::EnqueueIntegratorStep : clSetKernelArg failed: ");
+            }
+        }
+        this->SetIntegratorKernelArguments(tableau, first_arg, base, s);
+        enqueue_kernel();
+        stage_in = stage_out;
+    }
+    if(!tableau.IsAdaptive())
+        return 0.0;
+
+    // find the largest error of any cell on the device, so that only the maxima of the work items are read back
+    // (the change kernel turns NaN into infinity, so a failed step is rejected)
+    double error = 0.0;
+    this->ReduceChangeOnDevice(this->error_buffer, NULL, mem_size, use_double, error, NULL);
+    return error;
+}
+
+// -----------------------------------------------------------------------
+
+void OpenCL_MixIn::ReleaseChangeBuffers()
+{
+    for(cl_mem buffer : this->change_reference_buffers)
+        clReleaseMemObject(buffer);
+    if(this->change_partial_buffer)
+        clReleaseMemObject(this->change_partial_buffer);
+    this->change_reference_buffers.clear();
+    this->change_reference_size = 0;
+    this->change_partial_buffer = NULL;
+}
+
+// -----------------------------------------------------------------------
+
+void OpenCL_MixIn::ReleaseChangeBuffersFromOldContext()
+{
+    if(this->change_context != this->context)
+    {
+        // the buffers and the kernel belong to an old context
+        this->ReleaseChangeBuffers();
+        clReleaseKernel(this->change_kernel);
+        this->change_kernel = NULL;
+        clReleaseProgram(this->change_program);
+        this->change_program = NULL;
+        this->change_context = this->context;
+    }
+}
+
+// -----------------------------------------------------------------------
+
+void OpenCL_MixIn::SaveChangeReferenceOnDevice(size_t mem_size)
+{
+    this->ReleaseChangeBuffersFromOldContext();
+
+    const vector<cl_mem>& current = this->buffers[this->iCurrentBuffer];
+    if(this->change_reference_size != mem_size || this->change_reference_buffers.size() != current.size())
+    {
+        this->ReleaseChangeBuffers();
+        cl_int ret;
+        for(size_t ic=0;ic<current.size();ic++)
+        {
+            this->change_reference_buffers.push_back(clCreateBuffer(this->context, CL_MEM_READ_WRITE, mem_size, NULL, &ret));
+            throwOnError(ret,"OpenCL_MixIn::SaveChangeReferenceOnDevice : buffer creation failed: ");
+        }
+        this->change_reference_size = mem_size;
+    }
+    for(size_t ic=0;ic<current.size();ic++)
+    {
+        cl_int ret = clEnqueueCopyBuffer(this->command_queue, current[ic], this->change_reference_buffers[ic], 0, 0, mem_size, 0, NULL, NULL);
+        throwOnError(ret,"OpenCL_MixIn::SaveChangeReferenceOnDevice : buffer copying failed: ");
+    }
+}
+
+// -----------------------------------------------------------------------
+
+void OpenCL_MixIn::GetChangeFromReferenceOnDevice(size_t mem_size, bool use_double, double& max_change, double& sum_squares)
+{
+    const vector<cl_mem>& current = this->buffers[this->iCurrentBuffer];
+    if(this->change_context != this->context || this->change_reference_size != mem_size
+       || this->change_reference_buffers.size() != current.size())
+        throw runtime_error("OpenCL_MixIn::GetChangeFromReferenceOnDevice : no reference was saved");
+
+    max_change = 0.0;
+    sum_squares = 0.0;
+    for(size_t ic=0;ic<current.size();ic++)
+    {
+        double chemical_max_change, chemical_sum_squares;
+        this->ReduceChangeOnDevice(current[ic], this->change_reference_buffers[ic], mem_size, use_double,
+            chemical_max_change, &chemical_sum_squares);
+        max_change = max(max_change, chemical_max_change);
+        sum_squares += chemical_sum_squares;
+    }
+}
+
+// -----------------------------------------------------------------------
+
+void OpenCL_MixIn::ReduceChangeOnDevice(cl_mem values, cl_mem reference, size_t mem_size, bool use_double,
+                                        double& max_change, double* sum_squares)
+{
+    this->ReleaseChangeBuffersFromOldContext();
+
+    cl_int ret;
+    if(!this->change_kernel || this->change_kernel_uses_double != use_double)
+    {
+        clReleaseKernel(this->change_kernel);
+        this->change_kernel = NULL;
+        clReleaseProgram(this->change_program);
+        this->change_program = OpenCL_KernelCache::BuildProgram(this->context, this->device_id, GetChangeKernelSource(use_double),
+            "-cl-denorms-are-zero", "OpenCL_MixIn::ReduceChangeOnDevice");
+        this->change_kernel = clCreateKernel(this->change_program, "rd_change", &ret);
+        throwOnError(ret,"OpenCL_MixIn::ReduceChangeOnDevice : kernel creation failed: ");
+        this->change_kernel_uses_double = use_double;
+    }
+    if(!this->change_partial_buffer)
+    {
+        this->change_partial_buffer = clCreateBuffer(this->context, CL_MEM_READ_WRITE, 2 * CHANGE_WORK_ITEMS * sizeof(double), NULL, &ret);
+        throwOnError(ret,"OpenCL_MixIn::ReduceChangeOnDevice : buffer creation failed: ");
+    }
+
+    const size_t value_size = use_double ? sizeof(double) : sizeof(float);
+    const cl_int num_values = static_cast<cl_int>(mem_size / value_size);
+    const size_t num_work_items = max<size_t>(1, min<size_t>(CHANGE_WORK_ITEMS, num_values));
+    ret = clSetKernelArg(this->change_kernel, 0, sizeof(cl_mem), &values);
+    throwOnError(ret,"OpenCL_MixIn::ReduceChangeOnDevice : clSetKernelArg failed: ");
+    ret = clSetKernelArg(this->change_kernel, 1, sizeof(cl_mem), reference ? &reference : NULL); // (NULL gives a null pointer)
+    throwOnError(ret,"OpenCL_MixIn::ReduceChangeOnDevice : clSetKernelArg failed: ");
+    ret = clSetKernelArg(this->change_kernel, 2, sizeof(cl_int), &num_values);
+    throwOnError(ret,"OpenCL_MixIn::ReduceChangeOnDevice : clSetKernelArg failed: ");
+    ret = clSetKernelArg(this->change_kernel, 3, sizeof(cl_mem), &this->change_partial_buffer);
+    throwOnError(ret,"OpenCL_MixIn::ReduceChangeOnDevice : clSetKernelArg failed: ");
+    ret = clEnqueueNDRangeKernel(this->command_queue, this->change_kernel, 1, NULL, &num_work_items, NULL, 0, NULL, NULL);
+    throwOnError(ret,"OpenCL_MixIn::ReduceChangeOnDevice : clEnqueueNDRangeKernel failed: ");
+
+    // read back just the results of each work item (only their maxima if the sum of squares isn't wanted), and combine them
+    const size_t num_partials = (sum_squares ? 2 : 1) * num_work_items;
+    vector<double> partial_doubles(num_partials);
+    if(use_double)
+    {
+        ret = clEnqueueReadBuffer(this->command_queue, this->change_partial_buffer, CL_TRUE, 0,
+            num_partials * sizeof(double), partial_doubles.data(), 0, NULL, NULL);
+    }
+    else
+    {
+        vector<float> partial_floats(num_partials);
+        ret = clEnqueueReadBuffer(this->command_queue, this->change_partial_buffer, CL_TRUE, 0,
+            num_partials * sizeof(float), partial_floats.data(), 0, NULL, NULL);
+        copy(partial_floats.begin(), partial_floats.end(), partial_doubles.begin());
+    }
+    throwOnError(ret,"OpenCL_MixIn::ReduceChangeOnDevice : buffer reading failed: ");
+    max_change = *max_element(partial_doubles.begin(), partial_doubles.begin() + num_work_items);
+    if(sum_squares)
+        *sum_squares = accumulate(partial_doubles.begin() + num_work_items, partial_doubles.end(), 0.0);
 }
 
 // -----------------------------------------------------------------------
@@ -28,9 +28,12 @@
 #endif
 
 // STL:
+#include <functional>
 #include <vector>
 #include <string>
 
+struct ButcherTableau;
+
 /// OpenCL functionality, for adding to those implementations that use it.
 class OpenCL_MixIn
 {
@@ -48,12 +51,47 @@ class OpenCL_MixIn
 
         virtual std::string AssembleKernelSourceFromFormula(const std::string& formula) const =0;
 
+        /// The kernel source that is built for running. Defaults to AssembleKernelSourceFromFormula.
+        virtual std::string AssembleKernelSourceForRunning(const std::string& formula) const { return this->AssembleKernelSourceFromFormula(formula); }
+        /// Does the kernel built for running take the parameter values as its last arguments?
+        virtual bool HasParameterKernelArguments() const { return false; }
+        /// Pass the parameter values to the kernel, as the arguments starting at first_arg.
+        void SetParameterKernelArguments(int first_arg, const std::vector<float>& values, bool use_double);
+
+        // For multi-stage integrators, whose kernels take extra arguments after the parameters (see Integrators.hpp).
+        /// Makes sure the scratch buffers that the integrator needs exist, for NC chemicals of mem_size bytes each.
+        void CreateIntegratorBuffersIfNeeded(const ButcherTableau& tableau, int NC, size_t mem_size);
+        /// Pass the integrator's buffers and the stage to the kernel, as the arguments starting at first_arg.
+        void SetIntegratorKernelArguments(const ButcherTableau& tableau, int first_arg, const std::vector<cl_mem>& base, int stage);
+        /// Queues one step from the current buffers to the other ones, running the kernel once for each stage.
+        /** enqueue_kernel should queue the kernel, whose arguments have all been set. For adaptive integrators this
+         *  waits for the device, and returns the largest error over the cells (see RunIntegratorSteps), else returns 0.
+         *  The largest error is found on the device, so only a few numbers are read back. Doesn't change iCurrentBuffer. */
+        double EnqueueIntegratorStep(const ButcherTableau& tableau, int first_arg, size_t mem_size, bool use_double,
+                                     const std::function<void()>& enqueue_kernel);
+
+        // For the convergence monitor (see AbstractRD::UpdateAndGetChange), which compares the values on the device so
+        // that only a few numbers need to be read back.
+        /// Copies the current buffers, of mem_size bytes each, into reference buffers on the device.
+        void SaveChangeReferenceOnDevice(size_t mem_size);
+        /// Finds the largest change of any value since SaveChangeReferenceOnDevice, and the sum of the squares of the changes.
+        void GetChangeFromReferenceOnDevice(size_t mem_size, bool use_double, double& max_change, double& sum_squares);
+
         void ReloadContextIfNeeded();
         virtual void ReloadKernelIfNeeded() =0;
 
         virtual void CreateOpenCLBuffers() =0;
         virtual void WriteToOpenCLBuffersIfNeeded() =0;
-        virtual void ReadFromOpenCLBuffers() =0;
+        /// Queues non-blocking reads of the results of the last update from the OpenCL buffers, if they haven't been read already.
+        /** The reads are kept in pending_read_events until ReadFromOpenCLBuffers waits for them. */
+        virtual void EnqueueReadFromOpenCLBuffers() const =0;
+        /// Copies the results of the last update from the OpenCL buffers, if they haven't been copied already.
+        /** Update only queues the work on the device, so this waits for it (and for the reads) to finish. */
+        virtual void ReadFromOpenCLBuffers() const =0;
+        /// Waits for the reads in pending_read_events to finish and releases them. Returns the first error, if any.
+        cl_int WaitForPendingReads() const;
+        /// Waits for all the work queued on the device to finish.
+        void WaitForDevice() const;
         virtual void ReleaseOpenCLBuffers();
 
         /// Test a kernel string for errors on the current device.
@@ -72,15 +110,41 @@ class OpenCL_MixIn
         cl_command_queue command_queue;
 
         bool need_reload_context,need_write_to_opencl_buffers;
+        mutable bool need_read_from_opencl_buffers; ///< true if the device has results that the host doesn't have yet
+        mutable std::vector<cl_event> pending_read_events; ///< reads into the host data that may not have finished yet
 
         std::vector<cl_mem> buffers[2];
         int iCurrentBuffer;
 
         std::string kernel_source;
 
+    private:
+
+        void ReleaseIntegratorBuffers();
+        void ReleaseChangeBuffers();
+        void ReleaseChangeBuffersFromOldContext();
+
+        /// Runs the change kernel over a buffer of mem_size bytes, comparing it with reference (or with zero if reference
+        /// is NULL), and reads back the results of its work items. The sum of squares is only read if sum_squares isn't NULL.
+        void ReduceChangeOnDevice(cl_mem values, cl_mem reference, size_t mem_size, bool use_double, double& max_change,
+                                  double* sum_squares);
+
     private:
 
         int iPlatform,iDevice;
+
+        std::vector<cl_mem> stage_buffers; ///< the input to every other stage, one for each chemical
+        std::vector<cl_mem> rate_buffers;  ///< for each stage that IsRateStored, one for each chemical
+        cl_mem error_buffer;               ///< for adaptive integrators
+        size_t integrator_buffer_size;
+
+        std::vector<cl_mem> change_reference_buffers; ///< a copy of the buffers, one for each chemical
+        size_t change_reference_size;
+        cl_mem change_partial_buffer;                 ///< the results of each work item of the change kernel
+        cl_program change_program;
+        cl_kernel change_kernel;
+        bool change_kernel_uses_double;
+        cl_context change_context;                    ///< the context that the change buffers and kernel belong to
 };
 
 #endif
@@ -0,0 +1,231 @@
+/*  Copyright 2011-2021 The Ready Bunch
+
+    This file is part of Ready.
+
+    Ready is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Ready is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Ready. If not, see <http://www.gnu.org/licenses/>.         */
+
+// local:
+#include "SpectralGrayScottImageRD.hpp"
+#include "ThreadPool.hpp"
+
+// STL:
+#include <algorithm>
+#include <cmath>
+#include <stdexcept>
+
+// VTK:
+#include <vtkImageData.h>
+
+using namespace std;
+
+// ---------------------------------------------------------------------
+
+namespace
+{
+    const double PI = 3.14159265358979323846;
+
+    /// Returns the eigenvalues of the 1D discrete Laplacian (u[x-1] - 2u[x] + u[x+1]) on a loop of n cells.
+    vector<double> GetLaplacianEigenvalues(int n)
+    {
+        vector<double> eigenvalues(n);
+        for(int k=0;k<n;k++)
+            eigenvalues[k] = 2.0 * cos(2.0 * PI * k / n) - 2.0;
+        return eigenvalues;
+    }
+
+    /// Returns exp(x), phi1(x) = (exp(x)-1)/x and phi2(x) = (exp(x)-1-x)/x^2, taking care near x=0.
+    inline void GetExponentialFactors(double x,double& e,double& phi1,double& phi2)
+    {
+        const double e_minus_1 = expm1(x);
+        e = e_minus_1 + 1.0;
+        if(fabs(x) < 1e-4)
+        {
+            // the formulas lose precision here, so we use the start of their series instead
+            phi1 = 1.0 + x * (1.0/2.0 + x * (1.0/6.0 + x / 24.0));
+            phi2 = 1.0/2.0 + x * (1.0/6.0 + x * (1.0/24.0 + x / 120.0));
+        }
+        else
+        {
+            phi1 = e_minus_1 / x;
+            phi2 = (e_minus_1 - x) / (x * x);
+        }
+    }
+
+    /// Returns the transform of (fa * a + i * fb * b) at a mode, given the transform v of a + ib at that mode and at its mirror.
+    /** Since a and b are real, the transform of a at mode m is (v(m) + conj(v(-m)))/2 and that of b is
+     *  (v(m) - conj(v(-m)))/2i, so the transforms of the two chemicals can be separated and recombined like this. */
+    inline complex<double> ScaleChemicals(double fa,double fb,const complex<double>& v,const complex<double>& v_mirror)
+    {
+        return 0.5 * (fa + fb) * v + 0.5 * (fa - fb) * conj(v_mirror);
+    }
+}
+
+// ---------------------------------------------------------------------
+
+SpectralGrayScottImageRD::SpectralGrayScottImageRD()
+    : InbuiltImageRD(VTK_FLOAT)
+{
+    this->rule_name = "Gray-Scott spectral";
+    this->n_chemicals = 2;
+    this->AddParameter("timestep",1.0f);
+    this->AddParameter("D_a",0.082f);
+    this->AddParameter("D_b",0.041f);
+    this->AddParameter("k",0.06f);
+    this->AddParameter("F",0.035f);
+}
+
+// ---------------------------------------------------------------------
+
+void SpectralGrayScottImageRD::AllocateImages(int x,int y,int z,int nc,int data_type)
+{
+    // N.B. this class is hardwired for Gray-Scott using floats, so data_type is ignored
+    if(nc!=2) throw runtime_error("SpectralGrayScottImageRD::AllocateImages : this implementation is for 2 chemicals only");
+    ImageRD::AllocateImages(x,y,z,2,VTK_FLOAT);
+    this->fft = make_unique<FFT3D>(x,y,z);
+    const size_t n_cells = size_t(x) * y * z;
+    this->chemicals.assign(n_cells, 0.0);
+    this->reactions.assign(n_cells, 0.0);
+    this->stage.assign(n_cells, 0.0);
+    this->laplacian_x = GetLaplacianEigenvalues(x);
+    this->laplacian_y = GetLaplacianEigenvalues(y);
+    this->laplacian_z = GetLaplacianEigenvalues(z);
+}
+
+// ---------------------------------------------------------------------
+
+size_t SpectralGrayScottImageRD::GetMemorySize() const
+{
+    return ImageRD::GetMemorySize() + (this->chemicals.size() + this->reactions.size() + this->stage.size()) * sizeof(complex<double>);
+}
+
+// ---------------------------------------------------------------------
+
+void SpectralGrayScottImageRD::InternalUpdate(int n_steps)
+{
+    if(!this->wrap)
+        throw runtime_error("SpectralGrayScottImageRD::InternalUpdate : this implementation needs wrap-around");
+
+    const int X = this->GetX();
+    const int Y = this->GetY();
+    const int Z = this->GetZ();
+    const size_t n_cells = size_t(X) * Y * Z;
+
+    const double timestep = this->GetParameterValueByName("timestep");
+    const double D_a = this->GetParameterValueByName("D_a");
+    const double D_b = this->GetParameterValueByName("D_b");
+    const double k = this->GetParameterValueByName("k");
+    const double F = this->GetParameterValueByName("F");
+
+    ThreadPool& thread_pool = ThreadPool::GetInstance();
+    const int CELLS_PER_TASK = 16384;
+    const int num_tasks = static_cast<int>((n_cells + CELLS_PER_TASK - 1) / CELLS_PER_TASK);
+    auto ForEachCell = [&](const auto& f)
+    {
+        thread_pool.ParallelFor(num_tasks, [&](int iTask)
+        {
+            const size_t end = min(n_cells, size_t(iTask + 1) * CELLS_PER_TASK);
+            for(size_t i=size_t(iTask) * CELLS_PER_TASK;i<end;i++)
+                f(i);
+        });
+    };
+
+    // we work in double precision throughout the steps, holding a and b together as a + ib
+    float* a = static_cast<float*>(this->images[0]->GetScalarPointer());
+    float* b = static_cast<float*>(this->images[1]->GetScalarPointer());
+    complex<double>* chemicals = this->chemicals.data();
+    complex<double>* reactions = this->reactions.data();
+    complex<double>* stage = this->stage.data();
+    ForEachCell([&](size_t i) { chemicals[i] = complex<double>(a[i], b[i]); });
+
+    auto GetReactionRates = [=](const complex<double>& c)
+    {
+        const double aval = c.real();
+        const double bval = c.imag();
+        const double abb = aval*bval*bval;
+        return complex<double>(F*(1.0-aval) - abb, abb - (F+k)*bval);
+    };
+
+    // The transform of a + ib at mode m mixes those of a and b at modes m and -m, so we work on each pair of modes
+    // together, calling f(i,j,laplacian) for each pair of indices. Since a mode and its mirror share their eigenvalue of
+    // the Laplacian they also share their factors. The rows of modes are shared out among the threads, with each pair
+    // of rows done by the lower of the two.
+    auto ForEachPairOfModes = [&](const auto& f)
+    {
+        thread_pool.ParallelFor(Y * Z, [&](int iRow)
+        {
+            const int ky = iRow % Y;
+            const int kz = iRow / Y;
+            const int iMirrorRow = (Y - ky) % Y + Y * ((Z - kz) % Z);
+            if(iMirrorRow < iRow)
+                return;
+            const double laplacian_yz = this->laplacian_y[ky] + this->laplacian_z[kz];
+            for(int kx=0;kx<X;kx++)
+            {
+                const int mirror_kx = (X - kx) % X;
+                if(iMirrorRow == iRow && mirror_kx < kx)
+                    continue;
+                f(kx + size_t(X) * iRow, mirror_kx + size_t(X) * iMirrorRow, this->laplacian_x[kx] + laplacian_yz);
+            }
+        });
+    };
+
+    // Each step is the second-order exponential Runge-Kutta method of Cox and Matthews (ETDRK2). With L the diffusion
+    // of a mode, h the timestep and N the reaction rates:
+    //     s = exp(hL) u + h phi1(hL) N(u)
+    //     u' = s + h phi2(hL) (N(s) - N(u))
+    const double scale = 1.0 / n_cells; // the inverse transform doesn't divide by the number of cells, so we do it here
+    for(int iStep=0;iStep<n_steps;iStep++)
+    {
+        ForEachCell([&](size_t i) { reactions[i] = GetReactionRates(chemicals[i]); });
+        this->fft->Transform(chemicals, false);
+        this->fft->Transform(reactions, false);
+
+        // the first stage, into stage (in real space) and chemicals (in Fourier space)
+        ForEachPairOfModes([&](size_t i,size_t j,double laplacian)
+        {
+            double Ea,Eb,P1a,P1b,P2a,P2b;
+            GetExponentialFactors(timestep * D_a * laplacian, Ea, P1a, P2a);
+            GetExponentialFactors(timestep * D_b * laplacian, Eb, P1b, P2b);
+            const complex<double> c_i = chemicals[i], c_j = chemicals[j];
+            const complex<double> r_i = reactions[i], r_j = reactions[j];
+            chemicals[i] = ScaleChemicals(Ea, Eb, c_i, c_j) + timestep * ScaleChemicals(P1a, P1b, r_i, r_j);
+            chemicals[j] = ScaleChemicals(Ea, Eb, c_j, c_i) + timestep * ScaleChemicals(P1a, P1b, r_j, r_i);
+        });
+        ForEachCell([&](size_t i) { stage[i] = chemicals[i]; });
+        this->fft->Transform(stage, true);
+        ForEachCell([&](size_t i) { stage[i] = GetReactionRates(stage[i] * scale); });
+        this->fft->Transform(stage, false);
+
+        // the second stage
+        ForEachPairOfModes([&](size_t i,size_t j,double laplacian)
+        {
+            double Ea,Eb,P1a,P1b,P2a,P2b;
+            GetExponentialFactors(timestep * D_a * laplacian, Ea, P1a, P2a);
+            GetExponentialFactors(timestep * D_b * laplacian, Eb, P1b, P2b);
+            const complex<double> c_i = chemicals[i], c_j = chemicals[j];
+            const complex<double> d_i = stage[i] - reactions[i], d_j = stage[j] - reactions[j];
+            chemicals[i] = scale * (c_i + timestep * ScaleChemicals(P2a, P2b, d_i, d_j));
+            chemicals[j] = scale * (c_j + timestep * ScaleChemicals(P2a, P2b, d_j, d_i));
+        });
+        this->fft->Transform(chemicals, true);
+    }
+
+    ForEachCell([&](size_t i)
+    {
+        a[i] = static_cast<float>(chemicals[i].real());
+        b[i] = static_cast<float>(chemicals[i].imag());
+    });
+}
+
+// ---------------------------------------------------------------------
@@ -0,0 +1,61 @@
+/*  Copyright 2011-2021 The Ready Bunch
+
+    This file is part of Ready.
+
+    Ready is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Ready is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Ready. If not, see <http://www.gnu.org/licenses/>.         */
+
+#ifndef __SPECTRALGRAYSCOTTIMAGERD__
+#define __SPECTRALGRAYSCOTTIMAGERD__
+
+// local:
+#include "FFT.hpp"
+#include "InbuiltImageRD.hpp"
+
+// STL:
+#include <complex>
+#include <memory>
+#include <vector>
+
+/// An inbuilt implementation of Gray-Scott on wrap-around images that does the diffusion exactly, in Fourier space.
+/** Each step uses exponential time differencing (ETDRK2): the chemicals and their reaction rates are transformed with
+ *  FFT3D, each mode is decayed by its exact diffusion over the timestep while the reaction is integrated along with it
+ *  to second order, and the result is transformed back. The diffusion uses the same discrete Laplacian as GrayScottImageRD, so the two
+ *  approach the same patterns, but this one is stable for any D_a and D_b and so the timestep is limited only by the
+ *  reaction. The transform treats the image as periodic, so wrap-around is always on. */
+class SpectralGrayScottImageRD : public InbuiltImageRD
+{
+    public:
+
+        SpectralGrayScottImageRD();
+
+        bool HasEditableWrapOption() const override { return false; }
+
+        size_t GetMemorySize() const override;
+
+    protected:
+
+        void AllocateImages(int x,int y,int z,int nc,int data_type) override;
+
+        void InternalUpdate(int n_steps) override;
+
+    private:
+
+        std::unique_ptr<FFT3D> fft;
+        std::vector<std::complex<double>> chemicals; ///< a + ib, for each cell or for each mode
+        std::vector<std::complex<double>> reactions; ///< the rates of change of a and b from the reaction, likewise
+        std::vector<std::complex<double>> stage;     ///< the first stage of each step, and then its reaction rates
+        std::vector<double> laplacian_x,laplacian_y,laplacian_z; ///< the eigenvalues of the Laplacian along each axis
+};
+
+#endif
@@ -20,9 +20,13 @@
 #include <SystemFactory.hpp>
 #include <IO_XML.hpp>
 #include <GrayScottImageRD.hpp>
+#include <LifeLikeImageRD.hpp>
+#include <SpectralGrayScottImageRD.hpp>
+#include <FormulaImageRD.hpp>
 #include <FormulaOpenCLImageRD.hpp>
 #include <FullKernelOpenCLImageRD.hpp>
 #include <GrayScottMeshRD.hpp>
+#include <FormulaMeshRD.hpp>
 #include <FormulaOpenCLMeshRD.hpp>
 #include <FullKernelOpenCLMeshRD.hpp>
 #include <Properties.hpp>
@@ -33,6 +37,7 @@
 #include <vtkImageData.h>
 #include <vtkPointData.h>
 #include <vtkUnstructuredGrid.h>
+#include <vtkXMLDataElement.h>
 #include <vtkXMLGenericDataObjectReader.h>
 
 // STL:
@@ -42,6 +47,20 @@ using namespace std;
 
 // -------------------------------------------------------------------------------------------------------------
 
+namespace
+{
+    /// Does the formula ask for implicit diffusion? That is only done on the CPU, by FormulaImageRD.
+    bool UsesImplicitDiffusion(vtkXMLDataElement* rd)
+    {
+        vtkXMLDataElement* rule = rd ? rd->FindNestedElementWithName("rule") : nullptr;
+        vtkXMLDataElement* formula = rule ? rule->FindNestedElementWithName("formula") : nullptr;
+        const char* implicit_diffusion = formula ? formula->GetAttribute("implicit_diffusion") : nullptr;
+        return implicit_diffusion && string(implicit_diffusion).find_first_not_of(" ,") != string::npos;
+    }
+}
+
+// -------------------------------------------------------------------------------------------------------------
+
 unique_ptr<AbstractRD> CreateFromImageDataFile(
     const char *filename,
     bool is_opencl_available,
@@ -128,14 +147,19 @@ unique_ptr<AbstractRD> CreateFromImageDataFile(
     {
         if(name=="Gray-Scott")
             image_system = make_unique<GrayScottImageRD>();
+        else if(name=="Life-like")
+            image_system = make_unique<LifeLikeImageRD>();
+        else if(name=="Gray-Scott spectral")
+            image_system = make_unique<SpectralGrayScottImageRD>();
         else
             throw runtime_error("Unsupported inbuilt implementation: "+name);
     }
     else if(type=="formula")
     {
-        if(!is_opencl_available)
-            throw runtime_error(OpenCL_utils::GetOpenCLInstallationHints());
-        image_system = make_unique<FormulaOpenCLImageRD>(opencl_platform,opencl_device,data_type);
+        if(is_opencl_available && !UsesImplicitDiffusion(reader->GetRDElement()))
+            image_system = make_unique<FormulaOpenCLImageRD>(opencl_platform,opencl_device,data_type);
+        else
+            image_system = make_unique<FormulaImageRD>(data_type); // slower, but works without OpenCL
     }
     else if(type=="kernel")
     {
@@ -202,9 +226,10 @@ unique_ptr<AbstractRD> CreateFromUnstructuredGridFile(
     }
     else if(type=="formula")
     {
-        if(!is_opencl_available)
-            throw runtime_error(OpenCL_utils::GetOpenCLInstallationHints());
-        mesh_system = make_unique<FormulaOpenCLMeshRD>(opencl_platform,opencl_device,data_type);
+        if(is_opencl_available)
+            mesh_system = make_unique<FormulaOpenCLMeshRD>(opencl_platform,opencl_device,data_type);
+        else
+            mesh_system = make_unique<FormulaMeshRD>(data_type); // slower, but works without OpenCL
     }
     else if(type=="kernel")
     {
@@ -0,0 +1,184 @@
+/*  Copyright 2011-2021 The Ready Bunch
+
+    This file is part of Ready.
+
+    Ready is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Ready is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Ready. If not, see <http://www.gnu.org/licenses/>.         */
+
+// local:
+#include "ThreadPool.hpp"
+
+// STL:
+#include <algorithm>
+
+#if (defined(__i386__) || defined(__x86_64__) || defined(__amd64__) || defined(_M_X64) || defined(_M_IX86))
+    #define READY_HAS_MXCSR
+    // SSE:
+    #include <xmmintrin.h>
+#endif
+
+using namespace std;
+
+// ---------------------------------------------------------------------------
+
+namespace
+{
+    thread_local bool inside_task = false; // used to run nested calls serially, rather than deadlock
+    thread_local int current_thread_index = 0;
+}
+
+// ---------------------------------------------------------------------------
+
+ThreadPool& ThreadPool::GetInstance()
+{
+    static ThreadPool pool(max(1u, thread::hardware_concurrency()));
+    return pool;
+}
+
+// ---------------------------------------------------------------------------
+
+ThreadPool::ThreadPool(int num_threads)
+    : quitting(false)
+    , task(NULL)
+    , num_tasks(0)
+    , next_task(0)
+    , num_tasks_finished(0)
+    , job_id(0)
+    , floating_point_mode(0)
+{
+    // the calling thread also works on each job, so we need one fewer worker
+    for(int i=1;i<num_threads;i++)
+        this->workers.emplace_back(&ThreadPool::WorkerLoop, this, i);
+}
+
+// ---------------------------------------------------------------------------
+
+ThreadPool::~ThreadPool()
+{
+    {
+        lock_guard<std::mutex> lock(this->mutex);
+        this->quitting = true;
+    }
+    this->work_available.notify_all();
+    for(thread& worker : this->workers)
+        worker.join();
+}
+
+// ---------------------------------------------------------------------------
+
+void ThreadPool::ParallelFor(int n, const function<void(int)>& task)
+{
+    if(n <= 0) return;
+
+    if(n == 1 || this->workers.empty() || inside_task)
+    {
+        for(int i=0;i<n;i++)
+            task(i);
+        return;
+    }
+
+    lock_guard<std::mutex> job_lock(this->job_mutex);
+    {
+        lock_guard<std::mutex> lock(this->mutex);
+        this->task = &task;
+        this->num_tasks = n;
+        this->next_task = 0;
+        this->num_tasks_finished = 0;
+        this->first_exception = nullptr;
+        #ifdef READY_HAS_MXCSR
+            this->floating_point_mode = _mm_getcsr();
+        #endif
+        this->job_id++;
+    }
+    this->work_available.notify_all();
+
+    this->RunTasks();
+
+    exception_ptr e;
+    {
+        unique_lock<std::mutex> lock(this->mutex);
+        this->work_finished.wait(lock, [this] { return this->num_tasks_finished == this->num_tasks; });
+        this->task = NULL;
+        e = this->first_exception;
+        this->first_exception = nullptr;
+    }
+    if(e)
+        rethrow_exception(e);
+}
+
+// ---------------------------------------------------------------------------
+
+int ThreadPool::GetThreadIndex()
+{
+    return current_thread_index;
+}
+
+// ---------------------------------------------------------------------------
+
+void ThreadPool::WorkerLoop(int thread_index)
+{
+    current_thread_index = thread_index;
+    unsigned int last_job_id = 0;
+    while(true)
+    {
+        {
+            unique_lock<std::mutex> lock(this->mutex);
+            this->work_available.wait(lock, [&] { return this->quitting || this->job_id != last_job_id; });
+            if(this->quitting) return;
+            last_job_id = this->job_id;
+            #ifdef READY_HAS_MXCSR
+                _mm_setcsr(this->floating_point_mode);
+            #endif
+        }
+        this->RunTasks();
+    }
+}
+
+// ---------------------------------------------------------------------------
+
+void ThreadPool::RunTasks()
+{
+    inside_task = true;
+    while(true)
+    {
+        int i;
+        const function<void(int)>* current_task;
+        {
+            lock_guard<std::mutex> lock(this->mutex);
+            if(!this->task || this->next_task >= this->num_tasks)
+                break;
+            i = this->next_task++;
+            current_task = this->task;
+        }
+        try
+        {
+            (*current_task)(i);
+        }
+        catch(...)
+        {
+            lock_guard<std::mutex> lock(this->mutex);
+            if(!this->first_exception)
+                this->first_exception = current_exception();
+        }
+        bool all_finished;
+        {
+            lock_guard<std::mutex> lock(this->mutex);
+            all_finished = ++this->num_tasks_finished == this->num_tasks;
+        }
+        if(all_finished)
+            this->work_finished.notify_all();
+    }
+    inside_task = false;
+}
+
+// ---------------------------------------------------------------------------
@@ -0,0 +1,79 @@
+/*  Copyright 2011-2021 The Ready Bunch
+
+    This file is part of Ready.
+
+    Ready is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Ready is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Ready. If not, see <http://www.gnu.org/licenses/>.         */
+
+#ifndef __THREADPOOL__
+#define __THREADPOOL__
+
+// STL:
+#include <condition_variable>
+#include <exception>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+/// A set of worker threads that the CPU implementations share, to spread their work across all the cores.
+class ThreadPool
+{
+    public:
+
+        /// The pool used by all the systems, created on first use with one thread per core.
+        static ThreadPool& GetInstance();
+
+        explicit ThreadPool(int num_threads);
+        ~ThreadPool();
+
+        /// The number of threads that work on each job, including the calling thread.
+        int GetNumberOfThreads() const { return static_cast<int>(this->workers.size()) + 1; }
+
+        /// The index of the thread running the current task, in [0,GetNumberOfThreads()). The calling thread is 0.
+        /** Tasks can use this to keep scratch space per thread rather than per task. */
+        static int GetThreadIndex();
+
+        /// Calls task(i) for each i in [0,n), spread across the threads, and returns when they have all finished.
+        /** The calling thread works on the tasks too. If any task throws then the first exception is rethrown here.
+         *  Calls made from inside a task run serially on that thread. */
+        void ParallelFor(int n, const std::function<void(int)>& task);
+
+    private:
+
+        void WorkerLoop(int thread_index);
+        void RunTasks();
+
+    private:
+
+        std::vector<std::thread> workers;
+
+        std::mutex mutex;
+        std::condition_variable work_available, work_finished;
+        bool quitting;
+
+        // the current job, guarded by mutex
+        const std::function<void(int)>* task;
+        int num_tasks, next_task, num_tasks_finished;
+        unsigned int job_id;
+        unsigned int floating_point_mode; ///< the caller's MXCSR, so the workers treat denormals the same way
+        std::exception_ptr first_exception;
+
+        std::mutex job_mutex; ///< only one job at a time
+
+    private: // deliberately not implemented, to prevent use
+        ThreadPool(ThreadPool&);
+        ThreadPool& operator=(ThreadPool&);
+};
+
+#endif
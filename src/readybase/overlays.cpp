@@ -29,11 +29,40 @@
 // STL:
 #include <stdexcept>
 #include <algorithm>
+#include <cstring>
+#include <iomanip>
+#include <limits>
+#include <sstream>
 
 using namespace std;
 
 // ------------------------------------------------------------------------------------------------
 
+namespace
+{
+    /// write a number for OpenCL code, in the system's data type so that the arithmetic stays in that type
+    string OpenCLNumber(double value, const AbstractRD& system)
+    {
+        ostringstream oss;
+        oss << scientific << setprecision(numeric_limits<double>::max_digits10) << value;
+        if(system.GetDataType() != VTK_DOUBLE)
+            oss << "f";
+        return value < 0.0 ? "(" + oss.str() + ")" : oss.str();
+    }
+
+    /// the number of axes that the shapes look at, as in their IsInside methods
+    int NumberOfAxes(const AbstractRD& system)
+    {
+        const int dimensionality = system.GetArenaDimensionality();
+        return (dimensionality == 2 || dimensionality == 3) ? dimensionality : 1;
+    }
+
+    const char* const AXIS_NAMES[3] = { "x", "y", "z" };
+    const char* const AXIS_INDEX_NAMES[3] = { "ix", "iy", "iz" };
+}
+
+// ------------------------------------------------------------------------------------------------
+
 Overlay::Overlay(vtkXMLDataElement* node) : XML_Object(node)
 {
     string s;
@@ -85,13 +114,19 @@ double Overlay::Apply(const vector<double>& vals, const AbstractRD& system, floa
     // copy the values into a scratchpad to allow the overlays to affect each other
     // e.g. one might write a constant value, the next double it
     vector<double> vals_scratchpad(vals);
+    return this->ApplyInPlace(vals_scratchpad, system, x, y, z);
+}
 
-    double& val = vals_scratchpad[this->iTargetChemical];
+// --------------------------------------------------------------------------------------------------
+
+double Overlay::ApplyInPlace(vector<double>& vals, const AbstractRD& system, float x, float y, float z) const
+{
+    double& val = vals[this->iTargetChemical];
     for(int iShape=0;iShape<(int)this->shapes.size();iShape++)
     {
         if( this->shapes[iShape]->IsInside( x, y, z, system.GetX(), system.GetY(), system.GetZ(), system.GetArenaDimensionality() ) )
         {
-            this->op->Apply( val, this->fill->GetValue(system, vals_scratchpad, x, y, z) );
+            this->op->Apply( val, this->fill->GetValue(system, vals, x, y, z) );
         }
     }
     return val;
@@ -99,6 +134,82 @@ double Overlay::Apply(const vector<double>& vals, const AbstractRD& system, floa
 
 // --------------------------------------------------------------------------------------------------
 
+string Overlay::GetOpenCLCode(const AbstractRD& system, const string& key) const
+{
+    if(this->iTargetChemical < 0 || this->iTargetChemical >= system.GetNumberOfChemicals())
+        return "";
+    const string fill_code = this->fill->GetOpenCLCode(system, key);
+    if(fill_code.empty())
+        return "";
+    const string target = "vals[" + to_string(this->iTargetChemical) + "]";
+    ostringstream oss;
+    for(const unique_ptr<BaseShape>& shape : this->shapes)
+    {
+        const string shape_code = shape->GetOpenCLCode(system);
+        if(shape_code.empty())
+            return "";
+        // (the fill is evaluated for each shape, since an earlier shape may have changed the value it reads)
+        oss << "if(" << shape_code << ")\n";
+        oss << "    " << this->op->GetOpenCLCode(target, "(" + fill_code + ")") << "\n";
+    }
+    return oss.str();
+}
+
+// --------------------------------------------------------------------------------------------------
+
+/* static */ string Overlay::GetOpenCLFunctions()
+{
+    // the same as random_hash and random_unit_float in utils.hpp, so the device makes the same noise as the host
+    return "\
+ulong random_hash(ulong key, ulong counter)\n\
+{\n\
+    ulong z = key + (counter + 1) * 0x9E3779B97F4A7C15UL;\n\
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9UL;\n\
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBUL;\n\
+    return z ^ (z >> 31);\n\
+}\n\
+\n\
+float random_unit_float(ulong hash)\n\
+{\n\
+    return (float)(hash >> 40) * (1.0f / 16777216.0f);\n\
+}\n";
+}
+
+// --------------------------------------------------------------------------------------------------
+
+void Overlay::GetBounds(float X, float Y, float Z, int dimensionality, double bounds[6]) const
+{
+    // the union of the bounds of the shapes
+    for(int i=0;i<3;i++)
+    {
+        bounds[i*2+0] = numeric_limits<double>::infinity();
+        bounds[i*2+1] = -numeric_limits<double>::infinity();
+    }
+    for(const unique_ptr<BaseShape>& shape : this->shapes)
+    {
+        double shape_bounds[6];
+        shape->GetBounds(X, Y, Z, dimensionality, shape_bounds);
+        for(int i=0;i<3;i++)
+        {
+            bounds[i*2+0] = min(bounds[i*2+0], shape_bounds[i*2+0]);
+            bounds[i*2+1] = max(bounds[i*2+1], shape_bounds[i*2+1]);
+        }
+    }
+}
+
+// --------------------------------------------------------------------------------------------------
+
+void BaseShape::GetBounds(float X, float Y, float Z, int dimensionality, double bounds[6]) const
+{
+    for(int i=0;i<3;i++)
+    {
+        bounds[i*2+0] = -numeric_limits<double>::infinity();
+        bounds[i*2+1] = numeric_limits<double>::infinity();
+    }
+}
+
+// --------------------------------------------------------------------------------------------------
+
 class Point3D : public XML_Object
 {
     public:
@@ -150,6 +261,11 @@ class Add : public BaseOperation
         }
 
         void Apply(double& target,double value) const override { target += value; }
+
+        string GetOpenCLCode(const string& target, const string& value) const override
+        {
+            return target + " += " + value + ";";
+        }
 };
 
 class Subtract : public BaseOperation
@@ -168,6 +284,11 @@ class Subtract : public BaseOperation
         }
 
         void Apply(double& target,double value) const override { target -= value; }
+
+        string GetOpenCLCode(const string& target, const string& value) const override
+        {
+            return target + " -= " + value + ";";
+        }
 };
 
 class Overwrite : public BaseOperation
@@ -186,6 +307,11 @@ class Overwrite : public BaseOperation
         }
 
         void Apply(double& target,double value) const override { target = value; }
+
+        string GetOpenCLCode(const string& target, const string& value) const override
+        {
+            return target + " = " + value + ";";
+        }
 };
 
 class Multiply : public BaseOperation
@@ -204,6 +330,11 @@ class Multiply : public BaseOperation
         }
 
         void Apply(double& target,double value) const override { target *= value; }
+
+        string GetOpenCLCode(const string& target, const string& value) const override
+        {
+            return target + " *= " + value + ";";
+        }
 };
 
 class Divide : public BaseOperation
@@ -222,6 +353,11 @@ class Divide : public BaseOperation
         }
 
         void Apply(double& target,double value) const override { target /= value; }
+
+        string GetOpenCLCode(const string& target, const string& value) const override
+        {
+            return target + " /= " + value + ";";
+        }
 };
 
 // -------- fill methods: -----------
@@ -250,6 +386,11 @@ class Constant : public BaseFill
             return this->value;
         }
 
+        string GetOpenCLCode(const AbstractRD& system, const string& key) const override
+        {
+            return OpenCLNumber(this->value, system);
+        }
+
     protected:
 
         double value;
@@ -283,6 +424,13 @@ class OtherChemical : public BaseFill
             return vals[this->iOtherChemical];
         }
 
+        string GetOpenCLCode(const AbstractRD& system, const string& key) const override
+        {
+            if(this->iOtherChemical < 0 || this->iOtherChemical >= system.GetNumberOfChemicals())
+                return ""; // (leave it to GetValue to report the error)
+            return "vals[" + to_string(this->iOtherChemical) + "]";
+        }
+
     protected:
 
         int iOtherChemical;
@@ -312,6 +460,12 @@ class Parameter : public BaseFill
             return system.GetParameterValueByName(this->parameter_name.c_str());
         }
 
+        string GetOpenCLCode(const AbstractRD& system, const string& key) const override
+        {
+            // (the kernel is built each time the pattern is generated, so the value can be written into it)
+            return OpenCLNumber(system.GetParameterValueByName(this->parameter_name.c_str()), system);
+        }
+
     protected:
 
         string parameter_name;
@@ -321,7 +475,7 @@ class WhiteNoise : public BaseFill
 {
     public:
 
-        WhiteNoise(vtkXMLDataElement* node) : BaseFill(node)
+        WhiteNoise(vtkXMLDataElement* node) : BaseFill(node), key(0)
         {
             read_required_attribute(node,"low",this->low);
             read_required_attribute(node,"high",this->high);
@@ -338,14 +492,37 @@ class WhiteNoise : public BaseFill
             return xml;
         }
 
+        void Reseed(uint64_t key) override
+        {
+            this->key = key;
+        }
+
         double GetValue(const AbstractRD& system, const vector<double>& vals, float x, float y, float z) const override
         {
-            return frand(this->low,this->high);
+            // the value depends only on the key and the location, so cells can be filled in any order
+            const uint64_t hash = random_hash(random_hash(random_hash(this->key, FloatBits(x)), FloatBits(y)), FloatBits(z));
+            return this->low + (this->high - this->low) * random_unit_float(hash);
+        }
+
+        string GetOpenCLCode(const AbstractRD& system, const string& key) const override
+        {
+            const string hash = "random_hash(random_hash(random_hash(" + key
+                + ", as_uint((float)x)), as_uint((float)y)), as_uint((float)z))";
+            return OpenCLNumber(this->low, system) + " + " + OpenCLNumber(this->high - this->low, system)
+                + " * random_unit_float(" + hash + ")";
         }
 
     protected:
 
+        static uint32_t FloatBits(float f)
+        {
+            uint32_t bits;
+            memcpy(&bits, &f, sizeof(bits));
+            return bits;
+        }
+
         double low,high;
+        uint64_t key;
 };
 
 class PerlinNoise: public BaseFill
@@ -358,9 +535,9 @@ class PerlinNoise: public BaseFill
             read_optional_attribute(node, "num_octaves", this->num_octaves);
         }
 
-        void Reseed()
+        void Reseed(uint64_t key) override
         {
-            this->perlin.reseed(static_cast<unsigned int>(time(NULL)));
+            this->perlin.reseed(static_cast<siv::PerlinNoise::seed_type>(key));
         }
 
         static const char* GetTypeName() { return "perlin_noise"; }
@@ -429,6 +606,21 @@ class LinearGradient : public BaseFill
             return this->val1 + (this->val2-this->val1) * u;
         }
 
+        string GetOpenCLCode(const AbstractRD& system, const string& key) const override
+        {
+            // the same projection as GetValue, with the constant parts worked out here
+            const double blen = hypot3(this->p2->x-this->p1->x,this->p2->y-this->p1->y,this->p2->z-this->p1->z);
+            const double b[3] = { (this->p2->x-this->p1->x) / blen, (this->p2->y-this->p1->y) / blen, (this->p2->z-this->p1->z) / blen };
+            const double p1[3] = { this->p1->x, this->p1->y, this->p1->z };
+            const double size[3] = { system.GetX(), system.GetY(), system.GetZ() };
+            ostringstream dp;
+            for(int i=0;i<3;i++)
+                dp << (i>0 ? " + " : "") << "(" << AXIS_NAMES[i] << "/" << OpenCLNumber(size[i], system) << " - "
+                   << OpenCLNumber(p1[i], system) << ") * " << OpenCLNumber(b[i], system);
+            return OpenCLNumber(this->val1, system) + " + " + OpenCLNumber(this->val2-this->val1, system)
+                + " * (" + dp.str() + ") / " + OpenCLNumber(blen, system);
+        }
+
     protected:
 
         double val1,val2;
@@ -475,6 +667,20 @@ class RadialGradient : public BaseFill
             return val1 + (val2-val1) * hypot3(x-rp1x,y-rp1y,z-rp1z) / hypot3(rp2x-rp1x,rp2y-rp1y,rp2z-rp1z);
         }
 
+        string GetOpenCLCode(const AbstractRD& system, const string& key) const override
+        {
+            const double rp1[3] = { p1->x * system.GetX(), p1->y * system.GetY(), p1->z * system.GetZ() };
+            const double rp2[3] = { p2->x * system.GetX(), p2->y * system.GetY(), p2->z * system.GetZ() };
+            ostringstream dist2;
+            for(int i=0;i<3;i++)
+            {
+                const string d = string("(") + AXIS_NAMES[i] + " - " + OpenCLNumber(rp1[i], system) + ")";
+                dist2 << (i>0 ? " + " : "") << d << "*" << d;
+            }
+            return OpenCLNumber(val1, system) + " + " + OpenCLNumber(val2-val1, system) + " * sqrt(" + dist2.str()
+                + ") / " + OpenCLNumber(hypot3(rp2[0]-rp1[0],rp2[1]-rp1[1],rp2[2]-rp1[2]), system);
+        }
+
     protected:
 
         double val1,val2;
@@ -518,6 +724,20 @@ class Gaussian : public BaseFill
             return this->height * exp( -dist*dist/(2.0f*asigma*asigma) );
         }
 
+        string GetOpenCLCode(const AbstractRD& system, const string& key) const override
+        {
+            const double a[3] = { center->x * system.GetX(), center->y * system.GetY(), center->z * system.GetZ() };
+            const double asigma = this->sigma * max(system.GetX(),max(system.GetY(),system.GetZ()));
+            ostringstream dist2;
+            for(int i=0;i<3;i++)
+            {
+                const string d = string("(") + AXIS_NAMES[i] + " - " + OpenCLNumber(a[i], system) + ")";
+                dist2 << (i>0 ? " + " : "") << d << "*" << d;
+            }
+            return OpenCLNumber(this->height, system) + " * exp( -(" + dist2.str() + ") / "
+                + OpenCLNumber(2.0*asigma*asigma, system) + " )";
+        }
+
     protected:
 
         double height,sigma;
@@ -566,6 +786,21 @@ class Sine : public BaseFill
             return this->amplitude * sin( u * 2.0 * vtkMath::Pi() - this->phase );
         }
 
+        string GetOpenCLCode(const AbstractRD& system, const string& key) const override
+        {
+            // the same projection as GetValue, with the constant parts worked out here
+            const double blen = hypot3(this->p2->x-this->p1->x,this->p2->y-this->p1->y,this->p2->z-this->p1->z);
+            const double b[3] = { (this->p2->x-this->p1->x) / blen, (this->p2->y-this->p1->y) / blen, (this->p2->z-this->p1->z) / blen };
+            const double p1[3] = { this->p1->x, this->p1->y, this->p1->z };
+            const double size[3] = { system.GetX(), system.GetY(), system.GetZ() };
+            ostringstream dp;
+            for(int i=0;i<3;i++)
+                dp << (i>0 ? " + " : "") << "(" << AXIS_NAMES[i] << "/" << OpenCLNumber(size[i], system) << " - "
+                   << OpenCLNumber(p1[i], system) << ") * " << OpenCLNumber(b[i], system);
+            return OpenCLNumber(this->amplitude, system) + " * sin( (" + dp.str() + ") * "
+                + OpenCLNumber(2.0 * vtkMath::Pi() / blen, system) + " - " + OpenCLNumber(this->phase, system) + " )";
+        }
+
     protected:
 
         double phase,amplitude;
@@ -594,6 +829,11 @@ class Everywhere : public BaseShape
         {
             return true;
         }
+
+        string GetOpenCLCode(const AbstractRD& system) const override
+        {
+            return "true";
+        }
 };
 
 class Rectangle : public BaseShape
@@ -636,6 +876,33 @@ class Rectangle : public BaseShape
             }
         }
 
+        void GetBounds(float X,float Y,float Z,int dimensionality,double bounds[6]) const override
+        {
+            BaseShape::GetBounds(X, Y, Z, dimensionality, bounds);
+            const double a[3] = { this->a->x * X, this->a->y * Y, this->a->z * Z };
+            const double b[3] = { this->b->x * X, this->b->y * Y, this->b->z * Z };
+            for(int i=0;i<min(dimensionality,3);i++)
+            {
+                bounds[i*2+0] = a[i];
+                bounds[i*2+1] = b[i];
+            }
+        }
+
+        string GetOpenCLCode(const AbstractRD& system) const override
+        {
+            const double a[3] = { this->a->x, this->a->y, this->a->z };
+            const double b[3] = { this->b->x, this->b->y, this->b->z };
+            const double size[3] = { system.GetX(), system.GetY(), system.GetZ() };
+            ostringstream oss;
+            for(int i=0;i<NumberOfAxes(system);i++)
+            {
+                const string rel = string(AXIS_NAMES[i]) + "/" + OpenCLNumber(size[i], system);
+                oss << (i>0 ? " && " : "") << rel << ">=" << OpenCLNumber(a[i], system)
+                    << " && " << rel << "<=" << OpenCLNumber(b[i], system);
+            }
+            return oss.str();
+        }
+
     protected:
 
         unique_ptr<Point3D> a;
@@ -672,15 +939,43 @@ class Circle : public BaseShape
             double cy = this->c->y * Y;
             double cz = this->c->z * Z;
             double abs_radius = this->radius * max(X,max(Y,Z)); // (radius is proportional to the largest dimension)
+            double dx = x-cx, dy = y-cy, dz = z-cz;
+            // (compare the squared distance, to avoid the square root)
             switch(dimensionality)
             {
                 default:
-                case 1: return sqrt(pow(x-cx, 2)) < abs_radius;
-                case 2: return sqrt(pow(x-cx, 2)+pow(y-cy, 2)) < abs_radius;
-                case 3: return sqrt(pow(x-cx, 2)+pow(y-cy, 2)+pow(z-cz, 2)) < abs_radius;
+                case 1: return dx*dx < abs_radius*abs_radius;
+                case 2: return dx*dx+dy*dy < abs_radius*abs_radius;
+                case 3: return dx*dx+dy*dy+dz*dz < abs_radius*abs_radius;
             }
         }
 
+        void GetBounds(float X,float Y,float Z,int dimensionality,double bounds[6]) const override
+        {
+            BaseShape::GetBounds(X, Y, Z, dimensionality, bounds);
+            const double center[3] = { this->c->x * X, this->c->y * Y, this->c->z * Z };
+            const double abs_radius = this->radius * max(X,max(Y,Z));
+            for(int i=0;i<min(dimensionality,3);i++)
+            {
+                bounds[i*2+0] = center[i] - abs_radius;
+                bounds[i*2+1] = center[i] + abs_radius;
+            }
+        }
+
+        string GetOpenCLCode(const AbstractRD& system) const override
+        {
+            const double center[3] = { this->c->x * system.GetX(), this->c->y * system.GetY(), this->c->z * system.GetZ() };
+            const double abs_radius = this->radius * max(system.GetX(),max(system.GetY(),system.GetZ()));
+            ostringstream oss;
+            for(int i=0;i<NumberOfAxes(system);i++)
+            {
+                const string d = string("(") + AXIS_NAMES[i] + " - " + OpenCLNumber(center[i], system) + ")";
+                oss << (i>0 ? " + " : "") << d << "*" << d;
+            }
+            oss << " < " << OpenCLNumber(abs_radius*abs_radius, system);
+            return oss.str();
+        }
+
     protected:
 
         unique_ptr<Point3D> c;
@@ -721,6 +1016,26 @@ class Pixel : public BaseShape
             }
         }
 
+        void GetBounds(float X,float Y,float Z,int dimensionality,double bounds[6]) const override
+        {
+            BaseShape::GetBounds(X, Y, Z, dimensionality, bounds);
+            const int p[3] = { this->px, this->py, this->pz };
+            for(int i=0;i<min(dimensionality,3);i++)
+            {
+                bounds[i*2+0] = p[i] - 0.5;
+                bounds[i*2+1] = p[i] + 0.5;
+            }
+        }
+
+        string GetOpenCLCode(const AbstractRD& system) const override
+        {
+            const int p[3] = { this->px, this->py, this->pz };
+            ostringstream oss;
+            for(int i=0;i<NumberOfAxes(system);i++)
+                oss << (i>0 ? " && " : "") << AXIS_INDEX_NAMES[i] << "==" << p[i];
+            return oss.str();
+        }
+
     protected:
 
         int px,py,pz;
@@ -19,6 +19,7 @@
 #define __OVERLAYS__
 
 // STL:
+#include <cstdint>
 #include <memory>
 #include <string>
 #include <vector>
@@ -46,6 +47,9 @@ public:
     /// apply the operation to target, with parameter value
     virtual void Apply(double& target, double value) const = 0;
 
+    /// get an OpenCL statement that applies the operation to target, as Apply does
+    virtual std::string GetOpenCLCode(const std::string& target, const std::string& value) const = 0;
+
 protected:
 
     /// can construct from an XML node
@@ -67,8 +71,13 @@ public:
     /// what value would this fill type be at the given location, given the existing data
     virtual double GetValue(const AbstractRD& system, const std::vector<double>& vals, float x, float y, float z) const = 0;
 
-    /// cause the fill to give different results next time, for those fills that use randomness
-    virtual void Reseed() {}
+    /// set the random key for those fills that use randomness, so that the same key gives the same results
+    virtual void Reseed(std::uint64_t /*key*/) {}
+
+    /// get an OpenCL expression for the value, as GetValue returns, or an empty string if this fill can't be run there
+    /** See Overlay::GetOpenCLCode for the variables that the expression can use. The key is the name of the variable
+     *  that holds the random key. */
+    virtual std::string GetOpenCLCode(const AbstractRD& /*system*/, const std::string& /*key*/) const { return ""; }
 
 protected:
 
@@ -91,6 +100,13 @@ public:
     /// returns whether the x, y, z location is inside this shape
     virtual bool IsInside(float x, float y, float z, float X, float Y, float Z, int dimensionality) const = 0;
 
+    /// get a box {xmin,xmax,ymin,ymax,zmin,zmax} that holds every location where IsInside might return true
+    /** The default is unbounded. Axes beyond the dimensionality are always unbounded, since IsInside ignores them. */
+    virtual void GetBounds(float X, float Y, float Z, int dimensionality, double bounds[6]) const;
+
+    /// get an OpenCL condition that is true where IsInside would be, or an empty string if this shape can't be run there
+    virtual std::string GetOpenCLCode(const AbstractRD& /*system*/) const { return ""; }
+
 protected:
 
     /// can construct from an XML node
@@ -118,8 +134,24 @@ class Overlay : public XML_Object
         /// apply all the operations and return the new value
         double Apply(const std::vector<double>& vals, const AbstractRD& system,float x,float y,float z) const;
 
-        /// cause the overlay to give different results next time, for those overlays that use randomness
-        void Reseed() { this->fill->Reseed(); }
+        /// as Apply() but changes the value of the target chemical in vals, instead of working on a copy
+        double ApplyInPlace(std::vector<double>& vals, const AbstractRD& system,float x,float y,float z) const;
+
+        /// get a box that holds every location this overlay might change, in the same form as BaseShape::GetBounds
+        void GetBounds(float X, float Y, float Z, int dimensionality, double bounds[6]) const;
+
+        /// set the random key for those overlays that use randomness, so that the same key gives the same results
+        void Reseed(std::uint64_t key) { this->fill->Reseed(key); }
+
+        /// get OpenCL statements that do what ApplyInPlace does, or an empty string if some part can't be run there
+        /** The statements are for a kernel that works on one cell, where vals is an array of the values of the chemicals
+         *  (of type real, the system's data type), x, y and z are the location of the cell (real) and ix, iy and iz its
+         *  indices (int). The key is the name of a ulong variable holding the key that Reseed would be given, for use
+         *  with the random_hash and random_unit_float functions from GetOpenCLFunctions. */
+        std::string GetOpenCLCode(const AbstractRD& system, const std::string& key) const;
+
+        /// get the OpenCL functions that the code from GetOpenCLCode might call
+        static std::string GetOpenCLFunctions();
 
     protected:
 
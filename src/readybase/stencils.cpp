@@ -16,8 +16,10 @@
     along with Ready. If not, see <http://www.gnu.org/licenses/>.         */
 
 #include "stencils.hpp"
+#include "utils.hpp"
 
 // Stdlib:
+#include <algorithm>
 #include <array>
 #include <cmath>
 #include <exception>
@@ -641,3 +643,101 @@ vector<Stencil> GetKnownStencils(int dimensionality, const AbstractRD::Accuracy&
 }
 
 // ---------------------------------------------------------------------
+
+InputsNeeded DetectInputsNeeded(const string& formula, int num_chemicals, int dimensionality, const int block_size[3],
+                                const AbstractRD::Accuracy& accuracy)
+{
+    InputsNeeded inputs_needed;
+
+    const vector<string> formula_tokens = tokenize_for_keywords(formula);
+    const vector<Stencil> known_stencils = GetKnownStencils(dimensionality, accuracy);
+    for (int i = 0; i < num_chemicals; i++)
+    {
+        const string chem = GetChemicalName(i);
+        inputs_needed.chemicals_needed.push_back(chem);
+        // assume we will need the central cell
+        inputs_needed.cells_needed.insert({ { { 0, 0, 0 } }, chem });
+        // assume we need delta_<chem> for the forward Euler step
+        inputs_needed.deltas_needed.push_back(chem);
+        // assume we need local memory for every chemical
+        inputs_needed.local_memory_needed.push_back(chem);
+        // search for keywords that make use of stencils
+        set<string> dependent_stencils;
+        if (UsingKeyword(formula_tokens, "gradient_mag_squared_" + chem))
+        {
+            inputs_needed.gradient_mag_squared[chem] = dimensionality;
+            switch (dimensionality)
+            {
+            default:
+            case 3:
+                dependent_stencils.insert("z_gradient_" + chem);
+            case 2:
+                dependent_stencils.insert("y_gradient_" + chem);
+            case 1:
+                dependent_stencils.insert("x_gradient_" + chem); // (N.B. no breaks)
+            }
+        }
+        // search for keywords that are stencils
+        for (const Stencil& stencil : known_stencils)
+        {
+            const string keyword = stencil.label + "_" + chem;
+            if (UsingKeyword(formula_tokens, keyword) || dependent_stencils.find(keyword) != dependent_stencils.end())
+            {
+                const AppliedStencil applied_stencil{ stencil, chem };
+                inputs_needed.stencils_needed.push_back(applied_stencil);
+                // add the cell inputs needed for this stencil
+                const set<InputPoint> input_points = applied_stencil.GetInputPoints();
+                inputs_needed.cells_needed.insert(input_points.begin(), input_points.end());
+            }
+        }
+        // search for direct access to neighbors, e.g. "a_nw"
+        const int MAX_RADIUS = 10; // surely if the user wants something this big they should use a kernel?
+        for (int x = -MAX_RADIUS; x <= MAX_RADIUS; x++)
+        {
+            for (int y = -MAX_RADIUS; y <= MAX_RADIUS; y++)
+            {
+                for (int z = -MAX_RADIUS; z <= MAX_RADIUS; z++)
+                {
+                    const InputPoint input_point{ { {x, y, z} }, chem };
+                    if (UsingKeyword(formula_tokens, input_point.GetName()))
+                    {
+                        inputs_needed.cells_needed.insert(input_point);
+                    }
+                }
+            }
+        }
+    }
+    if (block_size[0] == 4)
+    {
+        // non-block-aligned inputs need other inputs: the two blocks that supply them
+        vector<InputPoint> blocks_needed;
+        for (const InputPoint& input_point : inputs_needed.cells_needed)
+        {
+            if (input_point.point.x % 4 != 0)
+            {
+                const pair<InputPoint, InputPoint> blocks = input_point.GetAlignedBlocks_Block411();
+                blocks_needed.push_back(blocks.first);
+                blocks_needed.push_back(blocks.second);
+            }
+        }
+        inputs_needed.cells_needed.insert(blocks_needed.begin(), blocks_needed.end());
+    }
+    // detect if using x_pos, y_pos or z_pos
+    inputs_needed.using_x_pos = UsingKeyword(formula_tokens, "x_pos");
+    inputs_needed.using_y_pos = UsingKeyword(formula_tokens, "y_pos");
+    inputs_needed.using_z_pos = UsingKeyword(formula_tokens, "z_pos");
+    // compute the overall stencil radius in each direction
+    inputs_needed.stencil_radii[0] = 0;
+    inputs_needed.stencil_radii[1] = 0;
+    inputs_needed.stencil_radii[2] = 0;
+    for (const InputPoint& input_point : inputs_needed.cells_needed)
+    {
+        inputs_needed.stencil_radii[0] = max(inputs_needed.stencil_radii[0], abs(input_point.point.x) / block_size[0]);
+        inputs_needed.stencil_radii[1] = max(inputs_needed.stencil_radii[1], abs(input_point.point.y) / block_size[1]);
+        inputs_needed.stencil_radii[2] = max(inputs_needed.stencil_radii[2], abs(input_point.point.z) / block_size[2]);
+    }
+
+    return inputs_needed;
+}
+
+// ---------------------------------------------------------------------
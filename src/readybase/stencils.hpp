@@ -19,6 +19,7 @@
 #include "AbstractRD.hpp"
 
 // Stdlib:
+#include <map>
 #include <set>
 #include <string>
 #include <vector>
@@ -98,6 +99,27 @@ struct AppliedStencil
 
 // ---------------------------------------------------------------------
 
+/// The cells, stencils and keywords that a formula uses.
+struct InputsNeeded
+{
+    std::vector<std::string> chemicals_needed;
+    std::vector<AppliedStencil> stencils_needed;
+    std::set<InputPoint> cells_needed;
+    std::map<std::string, int> gradient_mag_squared;
+    bool using_x_pos;
+    bool using_y_pos;
+    bool using_z_pos;
+    std::vector<std::string> deltas_needed;
+    std::vector<std::string> local_memory_needed;
+    int stencil_radii[3];
+};
+
+/// Searches the formula for the keywords it uses, e.g. "laplacian_a", "a_nw", "x_pos".
+InputsNeeded DetectInputsNeeded(const std::string& formula, int num_chemicals, int dimensionality, const int block_size[3],
+                                const AbstractRD::Accuracy& accuracy);
+
+// ---------------------------------------------------------------------
+
 std::vector<Stencil> GetKnownStencils(int dimensionality, const AbstractRD::Accuracy& accuracy);
 std::string GetIndexString(int x, int y, int z, bool wrap);
 std::string GetIndexString(const std::string& x, const std::string& y, const std::string& z, bool wrap);
@@ -23,8 +23,9 @@
 
 // STL:
 #include <algorithm>
+#include <iomanip>
 #include <limits>
-#include <random>
+#include <sstream>
 #include <vector>
 
 // ---------------------------------------------------------------------------------------------------------
@@ -65,16 +66,6 @@ double get_time_in_seconds()
 
 // ---------------------------------------------------------------------------------------------------------
 
-float frand(float lower,float upper)
-{
-    random_device rd;
-    default_random_engine re(rd());
-    uniform_real_distribution<float> unif(lower, upper);
-    return unif(re);
-}
-
-// ---------------------------------------------------------------------------------------------------------
-
 double hypot2(double x,double y)
 {
     return sqrt(x*x+y*y);
@@ -173,6 +164,29 @@ string ReplaceAllSubstrings(string subject, const string& search, const string&
 
 // ---------------------------------------------------------------------------------------------------------
 
+string GetKernelLiteral(double value, const string& data_type_suffix)
+{
+    // (the kernel source is often written to a fixed-point stream, which would lose small values, so we format it here)
+    const bool is_float = (data_type_suffix == "f");
+    string s;
+    for (int precision = 1; precision <= numeric_limits<double>::max_digits10; precision++)
+    {
+        ostringstream oss;
+        oss << setprecision(precision) << value;
+        s = oss.str();
+        istringstream iss(s);
+        double read_back = 0.0;
+        iss >> read_back;
+        if (is_float ? static_cast<float>(read_back) == static_cast<float>(value) : read_back == value)
+            break;
+    }
+    if (s.find_first_of(".e") == string::npos)
+        s += ".0";
+    return s + data_type_suffix;
+}
+
+// ---------------------------------------------------------------------------------------------------------
+
 vector<string> tokenize_for_keywords(const string& formula)
 {
     // customized tokenize for when searching for keywords in formula rules: whole words only
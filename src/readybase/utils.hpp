@@ -19,6 +19,7 @@
 #define __UTILS__
 
 // STL:
+#include <cstdint>
 #include <string>
 #include <sstream>
 #include <stdexcept>
@@ -32,7 +33,20 @@
 
 double get_time_in_seconds();
 
-float frand(float lower,float upper);
+/// A counter-based random number generator: hashes the key and the counter into 64 random bits.
+/** Values can be computed in any order (e.g. in parallel) and the function is simple to write in OpenCL. To combine
+ *  several counters, chain the calls, e.g. random_hash(random_hash(key,x),y). */
+inline std::uint64_t random_hash(std::uint64_t key,std::uint64_t counter)
+{
+    // the SplitMix64 output function, applied to the key stepped on by the counter
+    std::uint64_t z = key + (counter + 1) * 0x9E3779B97F4A7C15ULL;
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+    return z ^ (z >> 31);
+}
+
+/// Returns a float in [0,1) made from the top 24 bits of a random hash.
+inline float random_unit_float(std::uint64_t hash) { return static_cast<float>(hash >> 40) * (1.0f / 16777216.0f); }
 
 double hypot2(double x,double y);
 
@@ -94,6 +108,9 @@ class XML_Object
 };
 
 std::string ReplaceAllSubstrings(std::string subject, const std::string& search, const std::string& replace);
+/// Returns a literal for a kernel, e.g. "0.035f", "1.0f" or "1e-07f", with the fewest digits that give back the same value
+/// in the kernel's type (float if data_type_suffix is "f", else double).
+std::string GetKernelLiteral(double value, const std::string& data_type_suffix);
 std::vector<std::string> tokenize_for_keywords(const std::string& formula);
 bool UsingKeyword(const std::vector<std::string>& formula_tokens, const std::string& keyword);
 